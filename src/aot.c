@@ -0,0 +1,582 @@
+/**
+ * Ahead-of-time translation of bytecode images to C.
+ *
+ * Every function of the image becomes a C function and its jumps become gotos.
+ * A tail call returns the function to continue in to the loop in call(), so
+ * the C stack doesn't grow with it whatever the C compiler optimizes.
+ * The image has to have the same stack depth at an instruction along every path
+ * into it, so each operand lives in a stack slot at a fixed offset from the
+ * frame and the C compiler sees plain loads and stores where the interpreter
+ * moves a stack pointer. Arithmetic, comparisons, locals and unchecked array
+ * accesses are written out in C; everything that needs the runtime (calls,
+ * objects, strings, globals and builtins) writes the stack pointer back and
+ * goes through vm_decode. The image itself is embedded for its constants and
+ * function table, which vm_load sets up like for the interpreter.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "aot.h"
+#include "runtime/vm.h"
+#include "util/logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Aot {
+    struct Bytecode *bc;
+    size_t code_size;
+    FILE *out;
+
+    // Scratch for one function, indexed by instruction
+    int *depth; // operands on the stack before it runs, -1 when not reached
+    bool *label;
+    size_t *order; // reached instructions, in the order they were found
+    size_t count;
+    int max_depth;
+
+    // Locals of the function being written, and which of them it stores to
+    int nlocals;
+    bool *stored;
+} Aot;
+
+static const char *g_prologue =
+    "#include \"runtime/bytecode.h\"\n"
+    "#include \"runtime/vm.h\"\n"
+    "\n"
+    "#include <stdio.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "#define I(_v) (_v).data.int_value\n"
+    "#define F(_v) (_v).data.float_value\n"
+    "\n"
+    "/* Run an instruction in the runtime, with `_sp` values in the frame */\n"
+    "#define RUN(_ip, _sp)                                                  \\\n"
+    "    do {                                                               \\\n"
+    "        vm->mem.sp = (size_t)(v - vm->mem.stack) + (_sp);              \\\n"
+    "        vm->ip     = (_ip) + 1;                                        \\\n"
+    "        vm_decode(arena, vm, &vm->code[_ip]);                          \\\n"
+    "        if (vm->status != VM_RUNNING)                                  \\\n"
+    "            return -1;                                                 \\\n"
+    "    } while (0)\n"
+    "\n"
+    "static inline float f32(uint32_t bits) {\n"
+    "    float f;\n"
+    "    memcpy(&f, &bits, sizeof(f));\n"
+    "    return f;\n"
+    "}\n";
+
+/**
+ * Functions return the function a tail call continues in, or -1. Running that
+ * one here instead of calling it from the function that made the tail call
+ * keeps the C stack flat however long a chain of tail calls gets.
+ */
+static const char *g_call =
+    "static void call(Arena *arena, VM *vm, int index) {\n"
+    "    while (index >= 0 && vm->status == VM_RUNNING) {\n"
+    "        index = fns[index](arena, vm);\n"
+    "    }\n"
+    "}\n";
+
+static const char *g_epilogue =
+    "int main(void) {\n"
+    "    struct Bytecode bc;\n"
+    "    if (read_bytecode_image(image, sizeof(image), &bc) != 0) {\n"
+    "        return 1;\n"
+    "    }\n"
+    "\n"
+    "    VM vm;\n"
+    "    Arena *arena = arena_create(1024);\n"
+    "    vm_init(&vm, VM_DEFAULT_GC_THRESHOLD);\n"
+    "    vm_load(arena, &vm, &bc);\n"
+    "    if (vm.status == VM_RUNNING) {\n"
+    "        call(arena, &vm, 0);\n"
+    "    }\n"
+    "\n"
+    "    Value *result = vm_result(&vm);\n"
+    "    if (vm.status == VM_HALTED && result != NULL) {\n"
+    "        value_print(result);\n"
+    "        printf(\"\\n\");\n"
+    "    }\n"
+    "\n"
+    "    int status = vm.status == VM_HALTED ? 0 : 1;\n"
+    "    vm_cleanup(arena, &vm);\n"
+    "    return status;\n"
+    "}\n";
+
+/* Condition under which each jump is taken, from vm_decode */
+static const char *jump_condition(enum VMOpcode op) {
+    switch (op) {
+    case J:
+        return "1";
+    case JEQ:
+        return "eq == 1";
+    case JNE:
+        return "eq == 0";
+    case JLT:
+        return "dif == -1";
+    case JGR:
+        return "dif == 1";
+    case JLE:
+        return "dif != 1";
+    default:
+        return "dif != -1";
+    }
+}
+
+static bool is_cond_jump(enum VMOpcode op) {
+    return op >= JEQ && op <= JGE;
+}
+
+static bool in_code(Aot *a, long ip) {
+    return ip >= 0 && (size_t)ip < a->code_size;
+}
+
+/* Reach `ip` with `depth` operands, which has to match any earlier arrival */
+static bool reach(Aot *a, long ip, int depth) {
+    if (!in_code(a, ip)) {
+        return true; // leaves the code, which halts
+    }
+
+    if (a->depth[ip] >= 0) {
+        return a->depth[ip] == depth;
+    }
+
+    a->depth[ip]          = depth;
+    a->order[a->count++] = ip;
+    if (depth > a->max_depth) {
+        a->max_depth = depth;
+    }
+    return true;
+}
+
+/* Find the instructions of function `index` and the stack depth at each */
+static bool scan_function(Aot *a, int index) {
+    VMFunction *fn = &a->bc->funcs[index];
+    if (!in_code(a, fn->entry) || fn->nlocals < fn->nparams) {
+        log_error("aot: function %d has a bad entry\n", index);
+        return false;
+    }
+
+    reach(a, fn->entry, 0);
+    for (size_t next = 0; next < a->count; next++) {
+        size_t ip          = a->order[next];
+        VMInstruction *ins = &a->bc->code[ip];
+        int depth          = a->depth[ip];
+        long operand       = ins->operands_count > 0 ? ins->operands[0].int_value : -1;
+        int pops = 0, pushes = 0;
+        bool ok = true;
+
+        switch (ins->opcode) {
+        case RET:
+            ok = depth >= 1;
+            break;
+        case HALT:
+            break;
+        case TAILCALL:
+            ok = operand >= 0 && operand < a->bc->header.func_count &&
+                 depth >= a->bc->funcs[operand].nparams;
+            break;
+        case J:
+            ok = reach(a, operand, depth);
+            if (in_code(a, operand)) {
+                a->label[operand] = true;
+            }
+            break;
+        case CORO:
+        case RESUME:
+        case YIELD:
+            // Switching stacks would leave the C function running on the old one
+            log_error("aot: coroutines can't be translated to C (ip: %zu)\n", ip);
+            return false;
+        default:
+            if (!instruction_stack_use(ins, a->bc->funcs, a->bc->header.func_count, &pops,
+                                       &pushes) ||
+                depth < pops) {
+                ok = false;
+                break;
+            }
+            if ((ins->opcode == GETL || ins->opcode == SETL) &&
+                (operand < 0 || operand >= fn->nlocals)) {
+                ok = false;
+                break;
+            }
+
+            depth += pushes - pops;
+            if (is_cond_jump(ins->opcode) || ins->opcode == CHKA) {
+                ok = reach(a, operand, depth);
+                if (in_code(a, operand)) {
+                    a->label[operand] = true;
+                }
+            }
+            ok = ok && reach(a, ip + 1, depth);
+            break;
+        }
+
+        if (!ok) {
+            log_error("aot: can't work out the stack at %s (ip: %zu)\n",
+                      opcode_name(ins->opcode), ip);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int compare_ip(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Write the locals the function stores to and the top `depth` operands back to
+ * the VM's stack, for the runtime to see them.
+ */
+static void spill(Aot *a, int depth) {
+    for (int i = 0; i < a->nlocals; i++) {
+        if (a->stored[i]) {
+            fprintf(a->out, "    v[%d] = l%d;\n", i, i);
+        }
+    }
+    for (int i = 0; i < depth; i++) {
+        fprintf(a->out, "    v[%d] = s%d;\n", a->nlocals + i, i);
+    }
+}
+
+/* Run instruction `ip` in the runtime, reloading the operands it leaves */
+static void emit_run(Aot *a, size_t ip) {
+    VMInstruction *ins = &a->bc->code[ip];
+    int d              = a->depth[ip];
+    int pops = 0, pushes = 0;
+    instruction_stack_use(ins, a->bc->funcs, a->bc->header.func_count, &pops, &pushes);
+
+    spill(a, d);
+    fprintf(a->out, "    RUN(%zu, %d);\n", ip, a->nlocals + d);
+    for (int i = d - pops; i < d - pops + pushes; i++) {
+        fprintf(a->out, "    s%d = v[%d];\n", i, a->nlocals + i);
+    }
+}
+
+static void emit_halt(Aot *a, int depth) {
+    spill(a, depth);
+    fprintf(a->out, "    vm->mem.sp = (size_t)(v - vm->mem.stack) + %d;\n",
+            a->nlocals + depth);
+    fprintf(a->out, "    vm->status = VM_HALTED;\n    return -1;\n");
+}
+
+/* Go to instruction `target` if `cond` holds, or halt if it's past the code */
+static void emit_goto(Aot *a, const char *cond, long target, int depth) {
+    fprintf(a->out, "    if (%s) {\n", cond);
+    if (in_code(a, target)) {
+        fprintf(a->out, "        goto L%ld;\n", target);
+    } else {
+        emit_halt(a, depth);
+    }
+    fprintf(a->out, "    }\n");
+}
+
+static void emit_binary(Aot *a, size_t ip, int d) {
+    static const char ops[] = {'+', '-', '*', '/'};
+    VMInstruction *ins      = &a->bc->code[ip];
+    FILE *out               = a->out;
+
+    if (ins->opcode >= ADD_F) {
+        fprintf(out, "    s%d = new_float(F(s%d) %c F(s%d));\n", d - 2, d - 2,
+                ops[ins->opcode - ADD_F], d - 1);
+    } else if (ins->opcode == DIV_I) {
+        fprintf(out, "    if (I(s%d) == 0) {\n", d - 1);
+        fprintf(out, "        vm->ip = %zu;\n", ip + 1);
+        fprintf(out, "        vm_error(vm, \"integer division by zero\");\n");
+        fprintf(out, "        return -1;\n    }\n");
+        fprintf(out, "    if (I(s%d) == -1 && I(s%d) == INT32_MIN) {\n", d - 1, d - 2);
+        fprintf(out, "        vm->ip = %zu;\n", ip + 1);
+        fprintf(out, "        vm_error(vm, \"integer division overflow\");\n");
+        fprintf(out, "        return -1;\n    }\n");
+        fprintf(out, "    s%d = new_int(I(s%d) / I(s%d));\n", d - 2, d - 2, d - 1);
+    } else {
+        // Unsigned so overflow wraps like it does in the interpreter, instead
+        // of being something the C compiler may assume never happens
+        fprintf(out, "    s%d = new_int((int)((unsigned)I(s%d) %c (unsigned)I(s%d)));\n",
+                d - 2, d - 2, ops[ins->opcode - ADD_I], d - 1);
+    }
+}
+
+static void emit_instruction(Aot *a, size_t ip) {
+    VMInstruction *ins = &a->bc->code[ip];
+    FILE *out          = a->out;
+    int d              = a->depth[ip];
+    int operand        = ins->operands[0].int_value;
+
+    switch (ins->opcode) {
+    case NOP:
+    case POP:
+        break;
+    case GETL:
+        fprintf(out, "    s%d = l%d;\n", d, operand);
+        break;
+    case SETL:
+        fprintf(out, "    l%d = s%d;\n", operand, d - 1);
+        break;
+    case PUSH_I:
+        fprintf(out, "    s%d = new_int(%d);\n", d, operand);
+        break;
+    case PUSH_F: {
+        uint32_t bits;
+        memcpy(&bits, &ins->operands[0].float_value, sizeof(bits));
+        fprintf(out, "    s%d = new_float(f32(0x%08xu));\n", d, bits);
+        break;
+    }
+    case CMP_I:
+    case CMP_F: {
+        char t = ins->opcode == CMP_I ? 'I' : 'F';
+        fprintf(out, "    eq  = %c(s%d) == %c(s%d);\n", t, d - 2, t, d - 1);
+        fprintf(out, "    dif = (%c(s%d) > %c(s%d)) - (%c(s%d) < %c(s%d));\n", t,
+                d - 2, t, d - 1, t, d - 2, t, d - 1);
+        break;
+    }
+    case J:
+    case JEQ:
+    case JNE:
+    case JLT:
+    case JGR:
+    case JLE:
+    case JGE:
+        emit_goto(a, jump_condition(ins->opcode), operand, d);
+        break;
+    case ADD_I:
+    case SUB_I:
+    case MUL_I:
+    case DIV_I:
+    case ADD_F:
+    case SUB_F:
+    case MUL_F:
+    case DIV_F:
+        emit_binary(a, ip, d);
+        break;
+    case GETAU:
+        fprintf(out, "    s%d = array_get((ArrayObj *)s%d.data.object, I(s%d));\n", d - 2,
+                d - 2, d - 1);
+        break;
+    case SETAU:
+        fprintf(out, "    array_set((ArrayObj *)s%d.data.object, I(s%d), &s%d);\n", d - 3,
+                d - 2, d - 1);
+        break;
+    case CHKA: {
+        char cond[32];
+        snprintf(cond, sizeof(cond), "vm->ip != %zu", ip + 1);
+        emit_run(a, ip);
+        emit_goto(a, cond, operand, d);
+        break;
+    }
+    case CALL:
+        emit_run(a, ip);
+        fprintf(out, "    call(arena, vm, %d);\n", operand);
+        fprintf(out, "    if (vm->status != VM_RUNNING)\n        return -1;\n");
+        fprintf(out, "    s%d = v[%d];\n", d - a->bc->funcs[operand].nparams,
+                a->nlocals + d - a->bc->funcs[operand].nparams);
+        break;
+    case TAILCALL:
+        // The runtime already replaced the frame, call() runs the function next
+        emit_run(a, ip);
+        fprintf(out, "    return %d;\n", operand);
+        break;
+    case RET:
+    case HALT:
+        emit_run(a, ip);
+        fprintf(out, "    return -1;\n");
+        break;
+    case CMP_S:
+    case CMP:
+        emit_run(a, ip);
+        fprintf(out, "    eq  = vm->eq;\n    dif = vm->dif;\n");
+        break;
+    default:
+        emit_run(a, ip);
+        break;
+    }
+}
+
+static bool falls_through(enum VMOpcode op) {
+    return op != J && op != RET && op != HALT && op != TAILCALL;
+}
+
+/* Declare the locals and operands the function uses as C variables */
+static void emit_variables(Aot *a, int index) {
+    VMFunction *fn = &a->bc->funcs[index];
+    FILE *out      = a->out;
+    bool *used     = (bool *)calloc(fn->nlocals + 1, sizeof(bool));
+    bool flags     = false;
+
+    for (size_t i = 0; i < a->count; i++) {
+        VMInstruction *ins = &a->bc->code[a->order[i]];
+        if (ins->opcode == GETL || ins->opcode == SETL) {
+            used[ins->operands[0].int_value] = true;
+        }
+        flags = flags || ins->opcode == CMP_I || ins->opcode == CMP_F ||
+                ins->opcode == CMP_S || ins->opcode == CMP || is_cond_jump(ins->opcode);
+    }
+
+    fprintf(out, "    Value *v = &vm->mem.stack[vm->mem.frames[vm->mem.frame_count - 1]"
+                 ".fp];\n");
+    fprintf(out,
+            "    if (!stack_reserve(&vm->mem, (size_t)(v - vm->mem.stack) + %d)) {\n",
+            fn->nlocals + a->max_depth);
+    fprintf(out, "        vm_error(vm, \"stack overflow in call\");\n");
+    fprintf(out, "        return -1;\n    }\n");
+    for (int i = 0; i < fn->nlocals; i++) {
+        if (used == NULL || used[i]) {
+            fprintf(out, "    Value l%d = v[%d];\n", i, i);
+        }
+    }
+    for (int i = 0; i < a->max_depth; i++) {
+        fprintf(out, "    Value s%d = {0};\n", i);
+    }
+    if (flags) {
+        // Each jump reads only one of them
+        fprintf(out, "    int eq = 0, dif = 0;\n    (void)eq, (void)dif;\n");
+    }
+    free(used);
+}
+
+static bool emit_function(Aot *a, int index) {
+    VMFunction *fn = &a->bc->funcs[index];
+    a->count       = 0;
+    a->max_depth   = 0;
+    bool ok        = scan_function(a, index);
+
+    a->nlocals = fn->nlocals;
+    a->stored  = (bool *)calloc(fn->nlocals + 1, sizeof(bool));
+    if (a->stored == NULL) {
+        log_error("aot: out of memory\n");
+        ok = false;
+    }
+
+    if (ok) {
+        FILE *out = a->out;
+        for (size_t i = 0; i < a->count; i++) {
+            VMInstruction *ins = &a->bc->code[a->order[i]];
+            if (ins->opcode == SETL) {
+                a->stored[ins->operands[0].int_value] = true;
+            }
+        }
+
+        fprintf(out, "\nstatic int fn_%d(Arena *arena, VM *vm) {\n", index);
+        emit_variables(a, index);
+
+        qsort(a->order, a->count, sizeof(size_t), compare_ip);
+        if (a->order[0] != (size_t)fn->entry) {
+            fprintf(out, "    goto L%d;\n", fn->entry);
+            a->label[fn->entry] = true;
+        }
+
+        for (size_t i = 0; i < a->count; i++) {
+            size_t ip = a->order[i];
+            if (a->label[ip]) {
+                fprintf(out, "L%zu:;\n", ip);
+            }
+            emit_instruction(a, ip);
+
+            // The next instruction is the next one emitted unless it's past the end
+            VMInstruction *ins = &a->bc->code[ip];
+            int pops = 0, pushes = 0;
+            if (falls_through(ins->opcode) && ip + 1 >= a->code_size) {
+                instruction_stack_use(ins, a->bc->funcs, a->bc->header.func_count, &pops,
+                                      &pushes);
+                emit_halt(a, a->depth[ip] + pushes - pops);
+            }
+        }
+        fprintf(out, "}\n");
+    }
+
+    // Clear the scratch for the next function
+    for (size_t i = 0; i < a->count; i++) {
+        a->depth[a->order[i]] = -1;
+        a->label[a->order[i]] = false;
+    }
+    free(a->stored);
+    a->stored = NULL;
+    return ok;
+}
+
+static bool emit_program(Aot *a, uint8_t *image, size_t len) {
+    FILE *out = a->out;
+    int funcs = a->bc->header.func_count;
+
+    fprintf(out, "/* Generated by taro aot, do not edit */\n\n%s", g_prologue);
+    fprintf(out, "\nstatic uint8_t image[%zu] = {", len);
+    for (size_t i = 0; i < len; i++) {
+        fprintf(out, "%s0x%02x,", i % 12 == 0 ? "\n    " : " ", image[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    for (int i = 0; i < funcs; i++) {
+        fprintf(out, "static int fn_%d(Arena *arena, VM *vm);\n", i);
+    }
+
+    fprintf(out, "\nstatic int (*const fns[%d])(Arena *arena, VM *vm) = {", funcs);
+    for (int i = 0; i < funcs; i++) {
+        fprintf(out, "%sfn_%d,", i % 8 == 0 ? "\n    " : " ", i);
+    }
+    fprintf(out, "\n};\n\n%s", g_call);
+
+    for (int i = 0; i < funcs; i++) {
+        if (!emit_function(a, i)) {
+            return false;
+        }
+    }
+
+    fprintf(out, "\n%s", g_epilogue);
+    return true;
+}
+
+int aot_write_file(const char *filename, struct Bytecode *bc) {
+    if (bc->header.func_count < 1) {
+        log_error("aot: image has no top-level function\n");
+        return -1;
+    }
+
+    uint8_t *image;
+    size_t len;
+    if (write_bytecode_image(bc, &image, &len) != 0) {
+        return -1;
+    }
+
+    size_t size = bc->header.code_size > 0 ? bc->header.code_size : 1;
+    Aot a       = {.bc = bc, .code_size = bc->header.code_size};
+    a.depth     = (int *)malloc(size * sizeof(int));
+    a.label     = (bool *)calloc(size, sizeof(bool));
+    a.order     = (size_t *)malloc(size * sizeof(size_t));
+
+    int status = -1;
+    if (a.depth == NULL || a.label == NULL || a.order == NULL) {
+        log_error("aot: out of memory\n");
+        goto done;
+    }
+    for (size_t i = 0; i < size; i++) {
+        a.depth[i] = -1;
+    }
+
+    a.out = fopen(filename, "w");
+    if (a.out == NULL) {
+        log_error("failed to open file: %s\n", filename);
+        goto done;
+    }
+
+    status = emit_program(&a, image, len) ? 0 : -1;
+    if (fclose(a.out) != 0) {
+        log_error("failed to write file: %s\n", filename);
+        status = -1;
+    }
+    if (status != 0) {
+        remove(filename);
+    }
+
+done:
+    free(a.depth);
+    free(a.label);
+    free(a.order);
+    free(image);
+    return status;
+}
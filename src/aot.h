@@ -0,0 +1,20 @@
+/**
+ * Ahead-of-time translation of bytecode images to C.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_AOT_H
+#define TARO_AOT_H
+
+#include "runtime/bytecode.h"
+
+/**
+ * Write a C program that runs `bc` like `taro run` does, to be compiled with
+ * `-I src` and linked against the runtime library. Fails on images whose stack
+ * depth can't be worked out statically.
+ */
+int aot_write_file(const char *filename, struct Bytecode *bc);
+
+#endif
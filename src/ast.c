@@ -0,0 +1,266 @@
+/**
+ * Flat, arena-backed AST storage.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "ast.h"
+#include "lexer.h"
+#include "util/logger.h"
+
+#include <stdio.h>
+
+/*
+ * The pools can't be realloc'd in place inside an arena, so growing one copies
+ * it into a fresh region twice the size. The old copy stays behind until the
+ * arena is cleared, which bounds the waste to the final size of the pool.
+ */
+static void *pool_grow(Arena *arena, void *old, size_t count, size_t new_count,
+                       size_t elem) {
+    void *fresh = arena_alloc(arena, new_count * elem);
+    if (fresh == NULL) {
+        log_error("AST: out of memory\n");
+        return NULL;
+    }
+
+    if (old != NULL) {
+        memcpy(fresh, old, count * elem);
+    }
+
+    return fresh;
+}
+
+static bool ast_grow_nodes(Ast *ast) {
+    uint32_t cap = ast->capacity ? ast->capacity * 2 : 256;
+
+    uint8_t *kind = pool_grow(ast->arena, ast->kind, ast->count, cap, sizeof(uint8_t));
+    uint8_t *op   = pool_grow(ast->arena, ast->op, ast->count, cap, sizeof(uint8_t));
+    uint32_t *a   = pool_grow(ast->arena, ast->a, ast->count, cap, sizeof(uint32_t));
+    uint32_t *b   = pool_grow(ast->arena, ast->b, ast->count, cap, sizeof(uint32_t));
+    uint32_t *c   = pool_grow(ast->arena, ast->c, ast->count, cap, sizeof(uint32_t));
+    int *line     = pool_grow(ast->arena, ast->line, ast->count, cap, sizeof(int));
+    if (!kind || !op || !a || !b || !c || !line) {
+        return false;
+    }
+
+    ast->kind     = kind;
+    ast->op       = op;
+    ast->a        = a;
+    ast->b        = b;
+    ast->c        = c;
+    ast->line     = line;
+    ast->capacity = cap;
+    return true;
+}
+
+static void ast_reset(Ast *ast) {
+    ast->kind = ast->op = NULL;
+    ast->a = ast->b = ast->c = NULL;
+    ast->line                = NULL;
+    ast->count = ast->capacity = 0;
+
+    ast->lists       = NULL;
+    ast->lists_count = ast->lists_capacity = 0;
+
+    ast->strings       = NULL;
+    ast->strings_count = ast->strings_capacity = 0;
+
+    // Claim index 0 so that AST_NONE never names a real node
+    ast_add(ast, NODE_NONE, 0, 0, 0, 0, 0);
+}
+
+Ast *ast_create(void) {
+    Ast *ast = (Ast *)malloc(sizeof(Ast));
+    if (ast == NULL) {
+        return NULL;
+    }
+
+    ast->arena = arena_create(AST_ARENA_SIZE);
+    if (ast->arena == NULL) {
+        free(ast);
+        return NULL;
+    }
+
+    ast_reset(ast);
+    return ast;
+}
+
+void ast_clear(Ast *ast) {
+    // Every pool lives in the arena, so this drops the whole tree at once
+    arena_clear(ast->arena);
+    ast_reset(ast);
+}
+
+void ast_destroy(Ast *ast) {
+    if (ast == NULL) {
+        return;
+    }
+
+    arena_destroy(ast->arena);
+    free(ast);
+}
+
+NodeRef ast_add(Ast *ast, enum NodeKind kind, int op, uint32_t a, uint32_t b, uint32_t c,
+                int line) {
+    if (ast->count == ast->capacity && !ast_grow_nodes(ast)) {
+        return AST_NONE;
+    }
+
+    NodeRef n     = ast->count++;
+    ast->kind[n]  = kind;
+    ast->op[n]    = op;
+    ast->a[n]     = a;
+    ast->b[n]     = b;
+    ast->c[n]     = c;
+    ast->line[n]  = line;
+    return n;
+}
+
+uint32_t ast_add_list(Ast *ast, const NodeRef *items, uint32_t count) {
+    if (ast->lists_count + count + 1 > ast->lists_capacity) {
+        uint32_t cap = ast->lists_capacity ? ast->lists_capacity * 2 : 256;
+        while (cap < ast->lists_count + count + 1) {
+            cap *= 2;
+        }
+
+        uint32_t *lists =
+            pool_grow(ast->arena, ast->lists, ast->lists_count, cap, sizeof(uint32_t));
+        if (lists == NULL) {
+            return 0;
+        }
+
+        ast->lists          = lists;
+        ast->lists_capacity = cap;
+    }
+
+    uint32_t list    = ast->lists_count;
+    ast->lists[list] = count;
+    if (count > 0) {
+        memcpy(&ast->lists[list + 1], items, count * sizeof(NodeRef));
+    }
+    ast->lists_count += count + 1;
+    return list;
+}
+
+uint32_t ast_add_string(Ast *ast, const char *str) {
+    if (ast->strings_count == ast->strings_capacity) {
+        uint32_t cap = ast->strings_capacity ? ast->strings_capacity * 2 : 64;
+
+        const char **strings = pool_grow(ast->arena, ast->strings, ast->strings_count,
+                                         cap, sizeof(const char *));
+        if (strings == NULL) {
+            return 0;
+        }
+
+        ast->strings          = strings;
+        ast->strings_capacity = cap;
+    }
+
+    ast->strings[ast->strings_count] = str;
+    return ast->strings_count++;
+}
+
+static const char *g_node_names[] = {
+    [NODE_NONE] = "none",     [NODE_INT] = "int",       [NODE_FLOAT] = "float",
+    [NODE_STRING] = "string", [NODE_IDENT] = "ident",   [NODE_UNARY] = "unary",
+    [NODE_BINARY] = "binary", [NODE_CALL] = "call",     [NODE_BLOCK] = "block",
+    [NODE_IF] = "if",         [NODE_WHILE] = "while",   [NODE_FOR] = "for",
+    [NODE_LOCAL] = "local",   [NODE_ASSIGN] = "assign", [NODE_FUNC] = "func",
+    [NODE_PARAM] = "param",   [NODE_RETURN] = "return", [NODE_GLOBAL] = "global",
+    [NODE_STRUCT] = "struct", [NODE_FIELD] = "field",   [NODE_SETFIELD] = "setfield",
+    [NODE_INDEX] = "index",   [NODE_SETINDEX] = "setindex",
+};
+
+static void ast_dump_list(Ast *ast, uint32_t list, int depth) {
+    for (uint32_t i = 0; i < ast_list_count(ast, list); i++) {
+        ast_dump(ast, ast_list_items(ast, list)[i], depth);
+    }
+}
+
+void ast_dump(Ast *ast, NodeRef n, int depth) {
+    if (n == AST_NONE) {
+        return;
+    }
+
+    char op[64];
+    printf("%*s%s", depth * 2, "", g_node_names[ast->kind[n]]);
+
+    switch (ast->kind[n]) {
+    case NODE_INT:
+        printf(" %d\n", (int)ast->a[n]);
+        break;
+    case NODE_FLOAT:
+        printf(" %f\n", ast_float(ast, n));
+        break;
+    case NODE_STRING:
+        printf(" \"%s\"\n", ast->strings[ast->a[n]]);
+        break;
+    case NODE_IDENT:
+    case NODE_PARAM:
+        printf(" %s\n", ast->strings[ast->a[n]]);
+        break;
+    case NODE_UNARY:
+    case NODE_BINARY:
+        format_token((struct Token){.type = ast->op[n]}, op);
+        printf(" %s\n", op);
+        ast_dump(ast, ast->a[n], depth + 1);
+        ast_dump(ast, ast->b[n], depth + 1);
+        break;
+    case NODE_CALL:
+        printf(" %s\n", ast->strings[ast->a[n]]);
+        ast_dump_list(ast, ast->b[n], depth + 1);
+        break;
+    case NODE_BLOCK:
+        printf("\n");
+        ast_dump_list(ast, ast->a[n], depth + 1);
+        break;
+    case NODE_IF:
+    case NODE_WHILE:
+        printf("\n");
+        ast_dump(ast, ast->a[n], depth + 1);
+        ast_dump(ast, ast->b[n], depth + 1);
+        ast_dump(ast, ast->c[n], depth + 1);
+        break;
+    case NODE_FOR:
+        printf(" %s\n", ast->strings[ast->a[n]]);
+        ast_dump_list(ast, ast->b[n], depth + 1);
+        ast_dump(ast, ast->c[n], depth + 1);
+        break;
+    case NODE_STRUCT:
+        printf("\n");
+        ast_dump_list(ast, ast->a[n], depth + 1);
+        break;
+    case NODE_FIELD:
+    case NODE_SETFIELD:
+        printf(" %s\n", ast->strings[ast->b[n]]);
+        ast_dump(ast, ast->a[n], depth + 1);
+        ast_dump(ast, ast->c[n], depth + 1);
+        break;
+    case NODE_INDEX:
+    case NODE_SETINDEX:
+        printf("\n");
+        ast_dump(ast, ast->a[n], depth + 1);
+        ast_dump(ast, ast->b[n], depth + 1);
+        ast_dump(ast, ast->c[n], depth + 1);
+        break;
+    case NODE_LOCAL:
+    case NODE_GLOBAL:
+    case NODE_ASSIGN:
+        printf(" %s\n", ast->strings[ast->a[n]]);
+        ast_dump(ast, ast->b[n], depth + 1);
+        break;
+    case NODE_FUNC:
+        printf(" %s\n", ast->strings[ast->a[n]]);
+        ast_dump_list(ast, ast->b[n], depth + 1);
+        ast_dump(ast, ast->c[n], depth + 1);
+        break;
+    case NODE_RETURN:
+        printf("\n");
+        ast_dump(ast, ast->a[n], depth + 1);
+        break;
+    default:
+        printf("\n");
+        break;
+    }
+}
@@ -0,0 +1,108 @@
+/**
+ * Flat abstract syntax tree produced by the parser.
+ *
+ * Nodes live in struct-of-arrays pools inside an arena and refer to each other
+ * by 32-bit index. What `a`, `b` and `c` hold depends on the node kind, see
+ * enum NodeKind. Variable-length children (block statements, call arguments,
+ * parameters) are stored in the `lists` pool as a count followed by the items.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_AST_H
+#define TARO_AST_H
+
+#include "util/arena.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/** Size of the first arena region backing an AST */
+#define AST_ARENA_SIZE (64 * 1024)
+
+/** Node index 0 is reserved to mean "no node" */
+#define AST_NONE 0
+
+typedef uint32_t NodeRef;
+
+enum NodeKind {
+    NODE_NONE,
+    NODE_INT,      // a = value
+    NODE_FLOAT,    // a = value bits
+    NODE_STRING,   // a = string index
+    NODE_IDENT,    // a = string index
+    NODE_UNARY,    // op = operator token, a = operand
+    NODE_BINARY,   // op = operator token, a = lhs, b = rhs
+    NODE_CALL,     // a = callee string index, b = argument list
+    NODE_BLOCK,    // a = statement list
+    NODE_IF,       // a = condition, b = then block, c = else block or AST_NONE
+    NODE_WHILE,    // a = condition, b = body
+    NODE_FOR,      // a = counter string index, b = range list (from, to), c = body
+    NODE_LOCAL,    // op = declared type, a = name string index, b = initializer
+    NODE_ASSIGN,   // a = name string index, b = value
+    NODE_FUNC,     // op = return type, a = name string index, b = param list, c = body
+    NODE_PARAM,    // op = declared type, a = name string index
+    NODE_RETURN,   // a = value or AST_NONE
+    NODE_GLOBAL,   // op = declared type, a = name string index, b = initializer
+    NODE_STRUCT,   // a = list of NODE_ASSIGN field initializers
+    NODE_FIELD,    // a = object, b = field name string index
+    NODE_SETFIELD, // a = object, b = field name string index, c = value
+    NODE_INDEX,    // a = array, b = index
+    NODE_SETINDEX, // a = array, b = index, c = value
+};
+
+/** Declared types, from `: int` style annotations */
+enum AstType {
+    TYPE_ANY,
+    TYPE_INT,
+    TYPE_FLOAT,
+    TYPE_STRING,
+    TYPE_STRUCT,
+    TYPE_INTS,   // [int]
+    TYPE_FLOATS, // [float]
+    TYPE_CORO,   // coroutine
+};
+
+typedef struct Ast {
+    Arena *arena;
+
+    // Node pool, one column per field
+    uint8_t *kind;
+    uint8_t *op;
+    uint32_t *a, *b, *c;
+    int *line;
+    uint32_t count, capacity;
+
+    // Child lists, each one is [count, items...]
+    uint32_t *lists;
+    uint32_t lists_count, lists_capacity;
+
+    // Interned names and string literals referenced by nodes
+    const char **strings;
+    uint32_t strings_count, strings_capacity;
+} Ast;
+
+Ast *ast_create(void);
+void ast_clear(Ast *ast);
+void ast_destroy(Ast *ast);
+
+NodeRef ast_add(Ast *ast, enum NodeKind kind, int op, uint32_t a, uint32_t b, uint32_t c,
+                int line);
+uint32_t ast_add_list(Ast *ast, const NodeRef *items, uint32_t count);
+uint32_t ast_add_string(Ast *ast, const char *str);
+
+/* List accessors */
+#define ast_list_count(_ast, _list) ((_ast)->lists[(_list)])
+#define ast_list_items(_ast, _list) (&(_ast)->lists[(_list) + 1])
+
+static inline float ast_float(Ast *ast, NodeRef n) {
+    float f;
+    memcpy(&f, &ast->a[n], sizeof(f));
+    return f;
+}
+
+void ast_dump(Ast *ast, NodeRef n, int depth);
+
+#endif
@@ -0,0 +1,297 @@
+/**
+ * Persistent bytecode cache.
+ *
+ * Compiled images are stored as <hash>.tbc in the cache directory, where the
+ * hash covers the source bytes, the compiler and bytecode versions and the
+ * compile flags, so an entry can never be stale, only unused.
+ *
+ * Hashing means reading the whole source, so each source path also gets a small
+ * stamp file recording the file's identity (device, inode, size, mtime) and the
+ * content hash it had. When stat() still matches the stamp the hash is reused
+ * and the source isn't read at all. Stamps aren't written for files modified in
+ * the last couple of seconds, since a write landing in the same mtime tick
+ * would go unnoticed.
+ *
+ * Everything is written to a temporary file and renamed into place, so readers
+ * only ever see complete files. A cache that can't be read or written is never
+ * an error, the caller just compiles.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "cache.h"
+#include "compiler.h"
+#include "util/logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_STAMP_MAGIC "TSTP"
+
+/* Seconds a source must have been left alone before its stat stamp is trusted */
+#define CACHE_RACY_SECONDS 2
+
+#define FNV64_OFFSET_BASIS 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+
+struct packed_t CacheStamp {
+    char magic[4];
+    uint32_t flags;
+    uint64_t dev, ino, size;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t hash;
+};
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= p[i];
+        hash *= FNV64_PRIME;
+    }
+
+    return hash;
+}
+
+/* Hash of everything besides the source that decides the compiled output */
+static uint64_t hash_seed(CacheKey *key) {
+    int versions[2] = {COMPILER_VERSION, BYTECODE_VERSION};
+    uint64_t hash   = hash_bytes(FNV64_OFFSET_BASIS, versions, sizeof(versions));
+    return hash_bytes(hash, &key->flags, sizeof(key->flags));
+}
+
+/* Pick the cache directory and create it if needed */
+static bool cache_dir(char *out, size_t size) {
+    const char *dir = getenv(CACHE_DIR_ENV);
+    if (dir != NULL && dir[0] != '\0') {
+        snprintf(out, size, "%s", dir);
+    } else if ((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] != '\0') {
+        snprintf(out, size, "%s/taro", dir);
+    } else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0') {
+        // ~/.cache may not exist yet either
+        snprintf(out, size, "%s/.cache", dir);
+        if (mkdir(out, 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        snprintf(out, size, "%s/.cache/taro", dir);
+    } else {
+        return false;
+    }
+
+    return mkdir(out, 0755) == 0 || errno == EEXIST;
+}
+
+static void stamp_path(CacheKey *key, const char *source_path) {
+    char resolved[PATH_MAX];
+    const char *path = realpath(source_path, resolved) != NULL ? resolved : source_path;
+
+    // Seeded so that a new compiler doesn't trust hashes recorded by an old one
+    uint64_t hash = hash_bytes(hash_seed(key), path, strlen(path));
+    snprintf(key->stamp, sizeof(key->stamp), "%s/%016llx.stamp", key->dir,
+             (unsigned long long)hash);
+}
+
+static void fill_stamp(CacheKey *key, struct CacheStamp *stamp) {
+    memset(stamp, 0, sizeof(*stamp));
+    memcpy(stamp->magic, CACHE_STAMP_MAGIC, 4);
+    stamp->flags      = key->flags;
+    stamp->dev        = key->st.st_dev;
+    stamp->ino        = key->st.st_ino;
+    stamp->size       = key->st.st_size;
+    stamp->mtime_sec  = key->st.st_mtim.tv_sec;
+    stamp->mtime_nsec = key->st.st_mtim.tv_nsec;
+    stamp->hash       = key->hash;
+}
+
+/* Content hash from the stamp, or 0 if the source changed since it was written */
+static uint64_t read_stamp(CacheKey *key) {
+    struct CacheStamp stamp, expected;
+    FILE *file = fopen(key->stamp, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+
+    size_t n = fread(&stamp, 1, sizeof(stamp), file);
+    fclose(file);
+
+    fill_stamp(key, &expected);
+    expected.hash = stamp.hash;
+
+    if (n != sizeof(stamp) || memcmp(&stamp, &expected, sizeof(stamp)) != 0) {
+        return 0;
+    }
+
+    return stamp.hash;
+}
+
+/* Hash the source, together with everything else that decides the output */
+static uint64_t hash_source(CacheKey *key, const char *source_path) {
+    int fd = open(source_path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    uint64_t hash = hash_seed(key);
+
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        hash = hash_bytes(hash, buf, n);
+    }
+
+    close(fd);
+
+    // 0 means "unknown", nudge the one unlucky hash out of the way
+    return n < 0 ? 0 : (hash != 0 ? hash : 1);
+}
+
+static void image_path(CacheKey *key, char *out, size_t size) {
+    snprintf(out, size, "%s/%016llx.tbc", key->dir, (unsigned long long)key->hash);
+}
+
+/* Write a file so that readers see either nothing or all of it */
+static int write_atomic(const char *path, const void *data, size_t length) {
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    const char *p = (const char *)data;
+    size_t left   = length;
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n <= 0) {
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        p += n;
+        left -= n;
+    }
+
+    if (close(fd) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Map a cached image and decode it, 0 on success */
+static int map_image(const char *path, struct Bytecode *out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return -1;
+    }
+
+    int status = read_bytecode_image((uint8_t *)image, st.st_size, out);
+    munmap(image, st.st_size);
+    return status;
+}
+
+/**
+ * Look up the compiled image of a source file. Returns 0 on a hit with `out`
+ * filled in, or 1 on a miss, in which case the caller compiles and hands the
+ * result to cache_store with the same key.
+ */
+int cache_load(const char *source_path, uint32_t flags, CacheKey *key, struct Bytecode *out) {
+    memset(key, 0, sizeof(*key));
+    key->flags = flags;
+    snprintf(key->source, sizeof(key->source), "%s", source_path);
+
+    if (!cache_dir(key->dir, sizeof(key->dir)) || stat(source_path, &key->st) != 0) {
+        key->dir[0] = '\0';
+        return 1;
+    }
+
+    stamp_path(key, source_path);
+
+    key->hash = read_stamp(key);
+    if (key->hash == 0) {
+        key->stamp_stale = true;
+        key->hash        = hash_source(key, source_path);
+        if (key->hash == 0) {
+            return 1;
+        }
+    }
+
+    char path[PATH_MAX];
+    image_path(key, path, sizeof(path));
+    if (map_image(path, out) != 0) {
+        return 1;
+    }
+
+    // The image is good, remember the hash so the next lookup skips reading the source
+    if (key->stamp_stale && cache_store(key, NULL) != 0) {
+        log_warn("cache: failed to update %s\n", key->stamp);
+    }
+
+    return 0;
+}
+
+/**
+ * Store a compiled image under a key from cache_load, and refresh the stamp of
+ * its source. `bc` may be NULL to only write the stamp.
+ */
+int cache_store(CacheKey *key, struct Bytecode *bc) {
+    if (key->dir[0] == '\0' || key->hash == 0) {
+        return -1;
+    }
+
+    // If the source changed while it was being compiled, the image may not match the hash
+    struct stat st;
+    if (stat(key->source, &st) != 0 || st.st_ino != key->st.st_ino ||
+        st.st_size != key->st.st_size || st.st_mtim.tv_sec != key->st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != key->st.st_mtim.tv_nsec) {
+        return -1;
+    }
+
+    if (bc != NULL) {
+        uint8_t *image;
+        size_t length;
+        if (write_bytecode_image(bc, &image, &length) != 0) {
+            return -1;
+        }
+
+        char path[PATH_MAX];
+        image_path(key, path, sizeof(path));
+        int status = write_atomic(path, image, length);
+        free(image);
+        if (status != 0) {
+            return -1;
+        }
+    }
+
+    if (key->stamp_stale && time(NULL) - key->st.st_mtim.tv_sec >= CACHE_RACY_SECONDS) {
+        struct CacheStamp stamp;
+        fill_stamp(key, &stamp);
+        if (write_atomic(key->stamp, &stamp, sizeof(stamp)) != 0) {
+            return -1;
+        }
+        key->stamp_stale = false;
+    }
+
+    return 0;
+}
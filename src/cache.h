@@ -0,0 +1,38 @@
+/**
+ * Persistent cache of compiled bytecode images.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_CACHE_H
+#define TARO_CACHE_H
+
+#include "runtime/bytecode.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/** Environment variable overriding the cache directory */
+#define CACHE_DIR_ENV "TARO_CACHE_DIR"
+
+/** Compile flags that change the emitted code, and so are part of the key */
+#define CACHE_FLAG_OPTIMIZE (1u << 0)
+
+typedef struct CacheKey {
+    char dir[PATH_MAX / 2]; // leaves room for the file names inside it
+    char source[PATH_MAX];
+    char stamp[PATH_MAX]; // stat stamp of the source path, see cache.c
+    uint32_t flags;
+    uint64_t hash; // content hash, 0 until known
+
+    struct stat st; // source file at lookup time
+    bool stamp_stale;
+} CacheKey;
+
+int cache_load(const char *source_path, uint32_t flags, CacheKey *key, struct Bytecode *out);
+int cache_store(CacheKey *key, struct Bytecode *bc);
+
+#endif
@@ -0,0 +1,1412 @@
+/**
+ * Single pass compiler from the AST to VM bytecode.
+ *
+ * The tree is walked exactly once. Locals are resolved to frame slots as they
+ * are declared, forward jumps are emitted with a placeholder target and patched
+ * once the target is known, and string constants are deduplicated through a
+ * pointer-keyed map (names are interned, so equal strings share a pointer).
+ * Calls to functions that haven't been defined yet reserve a function table
+ * entry that the definition fills in later, and the first such call's argument
+ * types are what the definition's parameters are checked against.
+ *
+ * Types are static: int and float arithmetic select the _I and _F opcodes, and
+ * unannotated parameters and return values are ints. Globals keep the type they
+ * were declared with, and a field name has one type across the whole program,
+ * fixed by the first constructor or assignment that mentions it. Like calls to
+ * functions defined later, a field read before any store is assumed to be an
+ * int and checked once the first store shows up. Builtins are typed from their
+ * table entry, an array argument fixes the element type the others must use.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "compiler.h"
+#include "parser.h"
+#include "runtime/builtins.h"
+#include "util/logger.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Open addressing map from interned pointers to indices */
+struct PtrMap {
+    const void **keys;
+    int *values;
+    size_t count, capacity;
+};
+
+struct Local {
+    const char *name; // NULL for hidden locals such as loop limits
+    enum AstType type;
+    int slot;
+    int depth;
+};
+
+/* Arrays and accesses a loop can have unchecked before versioning gives up on it */
+#define LOOP_MAX_ARRAYS 4
+#define LOOP_MAX_ACCESSES 32
+
+/**
+ * Innermost `for` loop being compiled. Accesses `a[i]` where `a` is a local
+ * declared outside the loop and `i` is its counter are recorded, so the loop
+ * can be versioned to index them without bounds checks (see version_loop).
+ */
+struct LoopState {
+    int counter;     // slot of the counter, the limit is in the next slot
+    int outer_count; // locals declared before the loop
+
+    int arrays[LOOP_MAX_ARRAYS]; // slots of the indexed arrays
+    int array_count;
+    int accesses[LOOP_MAX_ACCESSES]; // GETA/SETA instructions
+    int access_count;
+    bool give_up;
+
+    struct LoopState *outer;
+};
+
+/* Per-function compile state */
+struct FuncState {
+    int index; // function table index
+    enum AstType ret;
+
+    struct Local locals[COMPILER_MAX_LOCALS];
+    int local_count;
+    int depth;
+    int next_slot, max_slots;
+};
+
+/* What we know about a function at compile time */
+struct FuncInfo {
+    const char *name;
+    enum AstType ret;
+    enum AstType params[COMPILER_MAX_LOCALS];
+    bool defined;
+    bool assumed; // called before its definition, return type was assumed
+    int line;
+};
+
+typedef struct Compiler {
+    Ast *ast;
+    bool had_error;
+    bool panic; // an error in the current statement was already reported
+
+    VMInstruction *code;
+    size_t code_count, code_capacity;
+
+    const char **consts;
+    size_t const_count, const_capacity;
+    struct PtrMap const_map;
+
+    VMFunction *funcs;
+    struct FuncInfo *infos;
+    size_t func_count, func_capacity;
+    struct PtrMap func_map;
+
+    // Types of globals and of structure fields, by name
+    struct PtrMap global_map;
+    struct PtrMap field_map;
+
+    // Names of the program's own functions, which hide builtins of the same name
+    struct PtrMap user_funcs;
+
+    struct FuncState *fn;
+    struct LoopState *loop;
+} Compiler;
+
+static enum AstType compile_expr(Compiler *c, NodeRef n);
+static void compile_statement(Compiler *c, NodeRef n);
+static void compile_block(Compiler *c, NodeRef n);
+
+static void error_at(Compiler *c, NodeRef n, const char *message) {
+    // Once part of a statement failed to compile, checks further up it would only
+    // report the same mistake again
+    if (c->panic) {
+        return;
+    }
+
+    c->panic = true;
+    log_error("line %d: %s\n", c->ast->line[n], message);
+    c->had_error = true;
+}
+
+/* Pointer map */
+
+static size_t ptrmap_slot(struct PtrMap *m, const void *key) {
+    size_t slot = ((uintptr_t)key >> 3) * 0x9E3779B97F4A7C15ULL & (m->capacity - 1);
+    while (m->keys[slot] != NULL && m->keys[slot] != key) {
+        slot = (slot + 1) & (m->capacity - 1);
+    }
+
+    return slot;
+}
+
+static int ptrmap_get(struct PtrMap *m, const void *key) {
+    if (m->capacity == 0) {
+        return -1;
+    }
+
+    size_t slot = ptrmap_slot(m, key);
+    return m->keys[slot] != NULL ? m->values[slot] : -1;
+}
+
+static bool ptrmap_put(struct PtrMap *m, const void *key, int value) {
+    if ((m->count + 1) * 4 > m->capacity * 3) {
+        struct PtrMap grown = {.count = m->count, .capacity = m->capacity ? m->capacity * 2 : 64};
+        grown.keys          = (const void **)calloc(grown.capacity, sizeof(void *));
+        grown.values        = (int *)malloc(grown.capacity * sizeof(int));
+        if (grown.keys == NULL || grown.values == NULL) {
+            free(grown.keys);
+            free(grown.values);
+            return false;
+        }
+
+        for (size_t i = 0; i < m->capacity; i++) {
+            if (m->keys[i] != NULL) {
+                size_t slot         = ptrmap_slot(&grown, m->keys[i]);
+                grown.keys[slot]   = m->keys[i];
+                grown.values[slot] = m->values[i];
+            }
+        }
+
+        free(m->keys);
+        free(m->values);
+        *m = grown;
+    }
+
+    size_t slot = ptrmap_slot(m, key);
+    if (m->keys[slot] == NULL) {
+        m->count++;
+    }
+
+    m->keys[slot]   = key;
+    m->values[slot] = value;
+    return true;
+}
+
+static void ptrmap_free(struct PtrMap *m) {
+    free(m->keys);
+    free(m->values);
+}
+
+/* Growable arrays */
+
+static bool grow(void **array, size_t *capacity, size_t count, size_t elem) {
+    if (count < *capacity) {
+        return true;
+    }
+
+    size_t cap  = *capacity ? *capacity * 2 : 64;
+    void *fresh = realloc(*array, cap * elem);
+    if (fresh == NULL) {
+        log_error("compiler: out of memory\n");
+        return false;
+    }
+
+    *array    = fresh;
+    *capacity = cap;
+    return true;
+}
+
+/* Code emission */
+
+static int emit(Compiler *c, enum VMOpcode op) {
+    if (!grow((void **)&c->code, &c->code_capacity, c->code_count, sizeof(VMInstruction))) {
+        c->had_error = true;
+        return 0;
+    }
+
+    VMInstruction *ins  = &c->code[c->code_count];
+    ins->opcode         = op;
+    ins->operands_count = 0;
+    return c->code_count++;
+}
+
+static int emit_i(Compiler *c, enum VMOpcode op, int value) {
+    int at = emit(c, op);
+    if (!c->had_error) {
+        c->code[at].operands_count          = 1;
+        c->code[at].operands[0].type        = TY_INT;
+        c->code[at].operands[0].int_value   = value;
+    }
+    return at;
+}
+
+static int emit_f(Compiler *c, enum VMOpcode op, float value) {
+    int at = emit(c, op);
+    if (!c->had_error) {
+        c->code[at].operands_count          = 1;
+        c->code[at].operands[0].type        = TY_FLOAT;
+        c->code[at].operands[0].float_value = value;
+    }
+    return at;
+}
+
+/* Set int operand `i`, growing operands_count to cover it */
+static void set_operand(VMInstruction *ins, int i, int value) {
+    ins->operands[i] = (VMOperand){.type = TY_INT, .int_value = value};
+    if (ins->operands_count <= i) {
+        ins->operands_count = i + 1;
+    }
+}
+
+/* Emit a jump whose target isn't known yet, see patch_here */
+static int emit_jump(Compiler *c, enum VMOpcode op) { return emit_i(c, op, -1); }
+
+static void patch_here(Compiler *c, int at) {
+    if (!c->had_error) {
+        c->code[at].operands[0].int_value = c->code_count;
+    }
+}
+
+static int make_const(Compiler *c, const char *str) {
+    int index = ptrmap_get(&c->const_map, str);
+    if (index >= 0) {
+        return index;
+    }
+
+    if (!grow((void **)&c->consts, &c->const_capacity, c->const_count, sizeof(char *)) ||
+        !ptrmap_put(&c->const_map, str, c->const_count)) {
+        c->had_error = true;
+        return 0;
+    }
+
+    c->consts[c->const_count] = str;
+    return c->const_count++;
+}
+
+/* Functions */
+
+static int declare_func(Compiler *c, const char *name) {
+    int index = ptrmap_get(&c->func_map, name);
+    if (index >= 0) {
+        return index;
+    }
+
+    // The function table and compile-time info grow in lockstep
+    size_t old_capacity = c->func_capacity;
+    if (!grow((void **)&c->funcs, &c->func_capacity, c->func_count, sizeof(VMFunction))) {
+        c->had_error = true;
+        return 0;
+    }
+
+    if (c->func_capacity != old_capacity) {
+        struct FuncInfo *infos = (struct FuncInfo *)realloc(
+            c->infos, c->func_capacity * sizeof(struct FuncInfo));
+        if (infos == NULL) {
+            log_error("compiler: out of memory\n");
+            c->had_error = true;
+            return 0;
+        }
+        c->infos = infos;
+    }
+
+    if (name != NULL && !ptrmap_put(&c->func_map, name, c->func_count)) {
+        c->had_error = true;
+        return 0;
+    }
+
+    index = c->func_count++;
+
+    c->funcs[index] = (VMFunction){.entry = 0, .nparams = 0, .nlocals = 0};
+    c->funcs[index].name = make_const(c, name ? name : "main");
+    c->infos[index]      = (struct FuncInfo){.name = name, .ret = TYPE_INT};
+    return index;
+}
+
+/* Scopes and locals */
+
+static void begin_scope(Compiler *c) { c->fn->depth++; }
+
+static void end_scope(Compiler *c) {
+    struct FuncState *fn = c->fn;
+    fn->depth--;
+
+    // Slots of locals going out of scope are reused by later declarations
+    while (fn->local_count > 0 && fn->locals[fn->local_count - 1].depth > fn->depth) {
+        fn->next_slot = fn->locals[--fn->local_count].slot;
+    }
+}
+
+static int declare_local(Compiler *c, NodeRef n, const char *name, enum AstType type) {
+    struct FuncState *fn = c->fn;
+    if (fn->local_count == COMPILER_MAX_LOCALS) {
+        error_at(c, n, "too many locals in function");
+        return 0;
+    }
+
+    struct Local *local = &fn->locals[fn->local_count++];
+    local->name         = name;
+    local->type         = type;
+    local->depth        = fn->depth;
+    local->slot         = fn->next_slot++;
+
+    if (fn->next_slot > fn->max_slots) {
+        fn->max_slots = fn->next_slot;
+    }
+
+    return local->slot;
+}
+
+static struct Local *resolve_local(Compiler *c, const char *name) {
+    // Innermost declaration wins, so shadowing works
+    for (int i = c->fn->local_count - 1; i >= 0; i--) {
+        if (c->fn->locals[i].name == name) {
+            return &c->fn->locals[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Globals and fields */
+
+static int global_type(Compiler *c, const char *name) {
+    return ptrmap_get(&c->global_map, name);
+}
+
+/* Set in field_map entries whose type was assumed by a read, not seen in a store */
+#define FIELD_ASSUMED 0x100
+
+/* Check a value stored to field `name` against the type the field already has */
+static void store_field_type(Compiler *c, NodeRef n, const char *name, enum AstType type) {
+    int known = ptrmap_get(&c->field_map, name);
+    if (known >= 0 && (enum AstType)(known & ~FIELD_ASSUMED) != type) {
+        error_at(c, n, known & FIELD_ASSUMED ? "field was read as an int before this store"
+                                             : "field was used with a different type before");
+    } else if ((known < 0 || (known & FIELD_ASSUMED)) &&
+               !ptrmap_put(&c->field_map, name, type)) {
+        c->had_error = true;
+    }
+}
+
+static enum AstType load_field_type(Compiler *c, const char *name) {
+    int known = ptrmap_get(&c->field_map, name);
+    if (known < 0) {
+        known = TYPE_INT | FIELD_ASSUMED;
+        if (!ptrmap_put(&c->field_map, name, known)) {
+            c->had_error = true;
+        }
+    }
+
+    return known & ~FIELD_ASSUMED;
+}
+
+/* Expressions */
+
+static bool is_numeric(enum AstType type) { return type == TYPE_INT || type == TYPE_FLOAT; }
+
+static bool is_array(enum AstType type) { return type == TYPE_INTS || type == TYPE_FLOATS; }
+
+static bool is_comparison(enum TokenType op) {
+    return op == TOK_EQEQ || op == TOK_BANGEQ || op == TOK_LT || op == TOK_LTEQ ||
+           op == TOK_GT || op == TOK_GTEQ;
+}
+
+/* Jump taken when the comparison `op` does NOT hold */
+static enum VMOpcode inverse_jump(enum TokenType op) {
+    switch (op) {
+    case TOK_EQEQ:
+        return JNE;
+    case TOK_BANGEQ:
+        return JEQ;
+    case TOK_LT:
+        return JGE;
+    case TOK_LTEQ:
+        return JGR;
+    case TOK_GT:
+        return JLE;
+    default:
+        return JLT;
+    }
+}
+
+/* Jump taken when the comparison `op` holds */
+static enum VMOpcode direct_jump(enum TokenType op) {
+    switch (op) {
+    case TOK_EQEQ:
+        return JEQ;
+    case TOK_BANGEQ:
+        return JNE;
+    case TOK_LT:
+        return JLT;
+    case TOK_LTEQ:
+        return JLE;
+    case TOK_GT:
+        return JGR;
+    default:
+        return JGE;
+    }
+}
+
+static void emit_zero(Compiler *c, enum AstType type) {
+    if (type == TYPE_FLOAT) {
+        emit_f(c, PUSH_F, 0.0f);
+    } else if (type == TYPE_STRING) {
+        emit_i(c, LOADS, make_const(c, ""));
+    } else if (type == TYPE_STRUCT) {
+        emit_i(c, NEWS, 0);
+    } else if (is_array(type)) {
+        emit_i(c, PUSH_I, 0);
+        emit_i(c, NEWA, type == TYPE_FLOATS);
+    } else {
+        emit_i(c, PUSH_I, 0);
+    }
+}
+
+/* Compile both operands of a comparison and the CMP itself */
+static bool compile_compare(Compiler *c, NodeRef n) {
+    enum AstType lhs = compile_expr(c, c->ast->a[n]);
+    enum AstType rhs = compile_expr(c, c->ast->b[n]);
+
+    if (lhs == TYPE_STRING && rhs == TYPE_STRING) {
+        emit(c, CMP_S);
+        return true;
+    }
+
+    if (!is_numeric(lhs) || lhs != rhs) {
+        error_at(c, n, "comparison needs two ints, two floats or two strings");
+        return false;
+    }
+
+    emit(c, lhs == TYPE_INT ? CMP_I : CMP_F);
+    return true;
+}
+
+/* Turn the flags left by a CMP into 0 or 1 on the stack */
+static void materialize_flag(Compiler *c, enum VMOpcode jump_if_true) {
+    int on_true = emit_jump(c, jump_if_true);
+    emit_i(c, PUSH_I, 0);
+    int done = emit_jump(c, J);
+    patch_here(c, on_true);
+    emit_i(c, PUSH_I, 1);
+    patch_here(c, done);
+}
+
+/* Compare a value already on the stack against zero */
+static bool compare_zero(Compiler *c, NodeRef n, enum AstType type) {
+    if (!is_numeric(type)) {
+        error_at(c, n, "condition must be a number");
+        return false;
+    }
+
+    emit_zero(c, type);
+    emit(c, type == TYPE_INT ? CMP_I : CMP_F);
+    return true;
+}
+
+/**
+ * Compile a condition and return the address of the jump taken when it is
+ * false, for the caller to patch.
+ */
+static int compile_cond(Compiler *c, NodeRef n) {
+    Ast *ast = c->ast;
+
+    if (ast->kind[n] == NODE_BINARY && is_comparison(ast->op[n])) {
+        compile_compare(c, n);
+        return emit_jump(c, inverse_jump(ast->op[n]));
+    }
+
+    if (ast->kind[n] == NODE_UNARY && ast->op[n] == TOK_BANG) {
+        compare_zero(c, n, compile_expr(c, ast->a[n]));
+        return emit_jump(c, JNE);
+    }
+
+    compare_zero(c, n, compile_expr(c, n));
+    return emit_jump(c, JEQ);
+}
+
+/* Arrays and loop versioning */
+
+static bool is_jump(enum VMOpcode op) { return (op >= J && op <= JGE) || op == CHKA; }
+
+/* Compile the array and index of `a[i]` or `set a[i] v`, returns the array type */
+static enum AstType compile_element(Compiler *c, NodeRef n) {
+    enum AstType array = compile_expr(c, c->ast->a[n]);
+    if (!is_array(array)) {
+        error_at(c, n, "indexing a value that isn't an array");
+        array = TYPE_INTS;
+    }
+
+    if (compile_expr(c, c->ast->b[n]) != TYPE_INT) {
+        error_at(c, n, "array index must be an int");
+    }
+    return array;
+}
+
+/* Local slot `n` names if it's a local declared before the current loop, else -1 */
+static int outer_local(Compiler *c, NodeRef n) {
+    if (c->ast->kind[n] != NODE_IDENT) {
+        return -1;
+    }
+
+    struct Local *local = resolve_local(c, c->ast->strings[c->ast->a[n]]);
+    if (local == NULL || local - c->fn->locals >= c->loop->outer_count) {
+        return -1;
+    }
+    return local->slot;
+}
+
+/* Record the GETA/SETA at `at` if it indexes an outer array by the loop counter */
+static void note_access(Compiler *c, NodeRef n, int at) {
+    struct LoopState *loop = c->loop;
+    if (loop == NULL || loop->give_up) {
+        return;
+    }
+
+    // The counter is declared in the loop, so it resolves past outer_count
+    NodeRef index       = c->ast->b[n];
+    struct Local *local = c->ast->kind[index] == NODE_IDENT
+                              ? resolve_local(c, c->ast->strings[c->ast->a[index]])
+                              : NULL;
+    int array           = outer_local(c, c->ast->a[n]);
+    if (local == NULL || local->slot != loop->counter || array < 0) {
+        return;
+    }
+
+    int k = 0;
+    while (k < loop->array_count && loop->arrays[k] != array) {
+        k++;
+    }
+
+    if (loop->access_count == LOOP_MAX_ACCESSES || k == LOOP_MAX_ARRAYS) {
+        loop->give_up = true;
+        return;
+    }
+
+    if (k == loop->array_count) {
+        loop->arrays[loop->array_count++] = array;
+    }
+    loop->accesses[loop->access_count++] = at;
+}
+
+/* Whether the body in [from, to) leaves the counter, arrays and their lengths alone */
+static bool loop_is_versionable(Compiler *c, struct LoopState *loop, int from, int to) {
+    if (loop->give_up || loop->access_count == 0) {
+        return false;
+    }
+
+    for (int i = from; i < to; i++) {
+        VMInstruction *ins = &c->code[i];
+        switch (ins->opcode) {
+        case SETL:
+            if (ins->operands[0].int_value == loop->counter) {
+                return false;
+            }
+            for (int k = 0; k < loop->array_count; k++) {
+                if (ins->operands[0].int_value == loop->arrays[k]) {
+                    return false;
+                }
+            }
+            break;
+        case CALL:
+        case TAILCALL:
+        case RESUME: // runs another coroutine, which could pop
+        case YIELD:
+        case POPA:
+        case CHKA: // an inner loop was versioned already, don't double it again
+            return false;
+        default:
+            break;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Version a counted loop whose accesses were all recorded by note_access: one
+ * CHKA per array before the loop tells whether the array covers the counter's
+ * whole range, and if they all do a copy of the loop runs with GETAU/SETAU in
+ * place of the checked accesses. Calls, pops and switching coroutines could
+ * shrink an array behind our back, loops containing them aren't versioned.
+ *
+ *   guard:  j checks              (a NOP until now)
+ *   top:    <loop, checked>       exits to `exit`
+ *   exit:   j end
+ *   checks: chka top, array, counter
+ *   copy:   <loop, unchecked>     exits to `end`
+ *   end:
+ */
+static void version_loop(Compiler *c, struct LoopState *loop, int guard, int top,
+                         int body, int body_end) {
+    if (c->had_error || !loop_is_versionable(c, loop, body, body_end)) {
+        return;
+    }
+
+    int exit = emit_i(c, J, -1);
+    c->code[guard].opcode = J;
+    set_operand(&c->code[guard], 0, c->code_count);
+
+    for (int k = 0; k < loop->array_count; k++) {
+        int at = emit_i(c, CHKA, top);
+        if (!c->had_error) {
+            set_operand(&c->code[at], 1, loop->arrays[k]);
+            set_operand(&c->code[at], 2, loop->counter);
+        }
+    }
+
+    int copy  = c->code_count;
+    int delta = copy - top;
+    int end   = copy + (exit - top);
+    for (int i = top; i < exit && !c->had_error; i++) {
+        VMInstruction ins = c->code[i];
+        int target        = ins.operands[0].int_value;
+        if (is_jump(ins.opcode) && target >= top && target < exit) {
+            ins.operands[0].int_value = target + delta;
+        } else if (is_jump(ins.opcode) && target == exit) {
+            ins.operands[0].int_value = end;
+        }
+
+        int at = emit(c, ins.opcode);
+        if (!c->had_error) {
+            c->code[at] = ins;
+        }
+    }
+
+    for (int k = 0; k < loop->access_count && !c->had_error; k++) {
+        VMInstruction *ins = &c->code[loop->accesses[k] + delta];
+        ins->opcode        = ins->opcode == GETA ? GETAU : SETAU;
+    }
+
+    patch_here(c, exit);
+}
+
+/* Type a builtin's argument or result, `array` is the array argument's type */
+static enum AstType builtin_type(enum BuiltinType type, enum AstType array) {
+    switch (type) {
+    case BT_INT:
+        return TYPE_INT;
+    case BT_INTS:
+        return TYPE_INTS;
+    case BT_FLOATS:
+        return TYPE_FLOATS;
+    case BT_CORO:
+        return TYPE_CORO;
+    case BT_STRING:
+        return TYPE_STRING;
+    case BT_ELEM:
+        return array == TYPE_FLOATS ? TYPE_FLOAT : TYPE_INT;
+    default:
+        return array;
+    }
+}
+
+/* Builtin called by `name`, or -1 if there's none or the program defines its own */
+static int find_builtin(Compiler *c, const char *name) {
+    return ptrmap_get(&c->user_funcs, name) < 0 ? builtin_find(name) : -1;
+}
+
+static enum AstType compile_coroutine(Compiler *c, NodeRef n);
+
+static enum AstType compile_builtin(Compiler *c, NodeRef n, int id) {
+    Ast *ast           = c->ast;
+    const Builtin *b   = &g_builtins[id];
+    uint32_t args      = ast->b[n];
+    uint32_t nargs     = ast_list_count(ast, args);
+    enum AstType array = TYPE_INTS;
+
+    if (b->op == CORO) {
+        return compile_coroutine(c, n);
+    }
+
+    if ((int)nargs != b->nargs) {
+        error_at(c, n, "wrong number of arguments");
+        return builtin_type(b->ret, array);
+    }
+
+    for (uint32_t i = 0; i < nargs; i++) {
+        enum AstType type = compile_expr(c, ast_list_items(ast, args)[i]);
+        if (b->args[i] == BT_ARRAY && is_array(type)) {
+            array = type;
+        } else if (b->args[i] == BT_SIZED) {
+            if (!is_array(type) && type != TYPE_STRING) {
+                error_at(c, n, "argument type does not match parameter");
+            }
+        } else if (b->args[i] == BT_ARRAY ||
+                   type != builtin_type(b->args[i], array)) {
+            error_at(c, n, "argument type does not match parameter");
+        }
+    }
+
+    if (b->op == CALLB) {
+        emit_i(c, CALLB, id);
+    } else if (b->op == NEWA) {
+        emit_i(c, NEWA, b->operand);
+    } else {
+        emit(c, b->op);
+    }
+    return builtin_type(b->ret, array);
+}
+
+/**
+ * Compile the arguments of call `n` to function `index`, skipping the first
+ * `skip`, and check them against its definition or the calls before it.
+ */
+static void compile_args(Compiler *c, NodeRef n, int index, uint32_t skip) {
+    Ast *ast              = c->ast;
+    uint32_t args         = ast->b[n];
+    uint32_t nargs        = ast_list_count(ast, args) - skip;
+    struct FuncInfo *info = &c->infos[index];
+
+    // The first call before the definition fixes the parameter types the later
+    // calls and the definition are checked against
+    bool first = !info->defined && !info->assumed;
+
+    for (uint32_t i = 0; i < nargs; i++) {
+        enum AstType type = compile_expr(c, ast_list_items(ast, args)[skip + i]);
+        if (i >= COMPILER_MAX_LOCALS) {
+            continue;
+        }
+
+        if (first) {
+            info->params[i] = type;
+        } else if (i < (uint32_t)c->funcs[index].nparams && type != info->params[i]) {
+            error_at(c, n, "argument type does not match parameter");
+        }
+    }
+
+    if (first) {
+        // Checked against the definition once we reach it
+        info->assumed           = true;
+        info->line              = ast->line[n];
+        c->funcs[index].nparams = nargs;
+    } else if ((int)nargs != c->funcs[index].nparams) {
+        error_at(c, n, "wrong number of arguments");
+    }
+}
+
+/* `coroutine(f, args...)`, where `f` names one of the program's functions */
+static enum AstType compile_coroutine(Compiler *c, NodeRef n) {
+    Ast *ast      = c->ast;
+    uint32_t args = ast->b[n];
+
+    NodeRef fn = ast_list_count(ast, args) > 0 ? ast_list_items(ast, args)[0] : 0;
+    if (ast_list_count(ast, args) == 0 || ast->kind[fn] != NODE_IDENT ||
+        find_builtin(c, ast->strings[ast->a[fn]]) >= 0) {
+        error_at(c, n, "coroutine needs a function to run");
+        return TYPE_CORO;
+    }
+
+    // What it yields and returns comes back from resume, which returns an int
+    int index = declare_func(c, ast->strings[ast->a[fn]]);
+    compile_args(c, n, index, 1);
+    if (c->infos[index].ret != TYPE_INT) {
+        error_at(c, n, "a coroutine's function must return int");
+    }
+
+    emit_i(c, CORO, index);
+    return TYPE_CORO;
+}
+
+/**
+ * Compile a call. A call in tail position replaces the running frame instead
+ * of pushing a new one, and a function calling itself that way just stores the
+ * new arguments over its parameters and jumps back to its start.
+ */
+static enum AstType compile_call(Compiler *c, NodeRef n, bool tail) {
+    Ast *ast         = c->ast;
+    const char *name = ast->strings[ast->a[n]];
+    uint32_t nargs   = ast_list_count(ast, ast->b[n]);
+
+    int builtin = find_builtin(c, name);
+    if (builtin >= 0) {
+        return compile_builtin(c, n, builtin);
+    }
+
+    int index             = declare_func(c, name);
+    struct FuncInfo *info = &c->infos[index];
+    compile_args(c, n, index, 0);
+
+    if (!tail) {
+        emit_i(c, CALL, index);
+    } else if (index == c->fn->index) {
+        for (int i = nargs - 1; i >= 0; i--) {
+            emit_i(c, SETL, i);
+        }
+        emit_i(c, J, c->funcs[index].entry);
+    } else {
+        emit_i(c, TAILCALL, index);
+    }
+
+    return info->ret;
+}
+
+static enum AstType compile_binary(Compiler *c, NodeRef n) {
+    Ast *ast          = c->ast;
+    enum TokenType op = ast->op[n];
+
+    if (is_comparison(op)) {
+        if (compile_compare(c, n)) {
+            materialize_flag(c, direct_jump(op));
+        }
+        return TYPE_INT;
+    }
+
+    enum AstType lhs = compile_expr(c, ast->a[n]);
+    enum AstType rhs = compile_expr(c, ast->b[n]);
+    if (op == TOK_PLUS && lhs == TYPE_STRING && rhs == TYPE_STRING) {
+        emit(c, CONCAT);
+        return TYPE_STRING;
+    }
+
+    if (!is_numeric(lhs) || lhs != rhs) {
+        error_at(c, n, "arithmetic needs two ints or two floats");
+        return TYPE_INT;
+    }
+
+    bool f = lhs == TYPE_FLOAT;
+    switch (op) {
+    case TOK_PLUS:
+        emit(c, f ? ADD_F : ADD_I);
+        break;
+    case TOK_MINUS:
+        emit(c, f ? SUB_F : SUB_I);
+        break;
+    case TOK_STAR:
+        emit(c, f ? MUL_F : MUL_I);
+        break;
+    default:
+        emit(c, f ? DIV_F : DIV_I);
+        break;
+    }
+
+    return lhs;
+}
+
+static enum AstType compile_expr(Compiler *c, NodeRef n) {
+    Ast *ast = c->ast;
+
+    switch (ast->kind[n]) {
+    case NODE_INT:
+        emit_i(c, PUSH_I, (int)ast->a[n]);
+        return TYPE_INT;
+    case NODE_FLOAT:
+        emit_f(c, PUSH_F, ast_float(ast, n));
+        return TYPE_FLOAT;
+    case NODE_STRING:
+        emit_i(c, LOADS, make_const(c, ast->strings[ast->a[n]]));
+        return TYPE_STRING;
+    case NODE_IDENT: {
+        const char *name    = ast->strings[ast->a[n]];
+        struct Local *local = resolve_local(c, name);
+        if (local != NULL) {
+            emit_i(c, GETL, local->slot);
+            return local->type;
+        }
+
+        int type = global_type(c, name);
+        if (type < 0) {
+            error_at(c, n, "undefined variable");
+            return TYPE_INT;
+        }
+
+        emit_i(c, GETG, make_const(c, name));
+        return type;
+    }
+    case NODE_STRUCT: {
+        // Each INITF stores one field and leaves the structure for the next. NEWS
+        // gets the field count so the fields fit in the structure's inline slots
+        uint32_t fields = ast->a[n];
+        emit_i(c, NEWS, (int)ast_list_count(ast, fields));
+        for (uint32_t i = 0; i < ast_list_count(ast, fields); i++) {
+            NodeRef field    = ast_list_items(ast, fields)[i];
+            const char *name = ast->strings[ast->a[field]];
+            store_field_type(c, field, name, compile_expr(c, ast->b[field]));
+            emit_i(c, INITF, make_const(c, name));
+        }
+        return TYPE_STRUCT;
+    }
+    case NODE_INDEX: {
+        enum AstType array = compile_element(c, n);
+        note_access(c, n, emit(c, GETA));
+        return array == TYPE_FLOATS ? TYPE_FLOAT : TYPE_INT;
+    }
+    case NODE_FIELD: {
+        const char *name = ast->strings[ast->b[n]];
+        if (compile_expr(c, ast->a[n]) != TYPE_STRUCT) {
+            error_at(c, n, "field access on a value that isn't a structure");
+            return TYPE_INT;
+        }
+
+        emit_i(c, GETF, make_const(c, name));
+        return load_field_type(c, name);
+    }
+    case NODE_UNARY: {
+        enum AstType type = compile_expr(c, ast->a[n]);
+        if (ast->op[n] == TOK_BANG) {
+            if (compare_zero(c, n, type)) {
+                materialize_flag(c, JEQ);
+            }
+            return TYPE_INT;
+        }
+
+        if (!is_numeric(type)) {
+            error_at(c, n, "cannot negate a non-number");
+            return TYPE_INT;
+        }
+
+        // Negation is multiplication by -1, the operand is already on the stack
+        if (type == TYPE_INT) {
+            emit_i(c, PUSH_I, -1);
+            emit(c, MUL_I);
+        } else {
+            emit_f(c, PUSH_F, -1.0f);
+            emit(c, MUL_F);
+        }
+        return type;
+    }
+    case NODE_BINARY:
+        return compile_binary(c, n);
+    case NODE_CALL:
+        return compile_call(c, n, false);
+    default:
+        error_at(c, n, "expected an expression");
+        return TYPE_INT;
+    }
+}
+
+/* Statements */
+
+static void compile_local(Compiler *c, NodeRef n) {
+    Ast *ast          = c->ast;
+    enum AstType type = ast->op[n];
+
+    if (ast->b[n] != AST_NONE) {
+        enum AstType init = compile_expr(c, ast->b[n]);
+        if (type != TYPE_ANY && init != type) {
+            error_at(c, n, "initializer does not match the declared type");
+        }
+        type = init;
+    } else {
+        type = type == TYPE_ANY ? TYPE_INT : type;
+        emit_zero(c, type);
+    }
+
+    // Declared after the initializer, so `local x = x` sees the outer x
+    emit_i(c, SETL, declare_local(c, n, ast->strings[ast->a[n]], type));
+}
+
+static void compile_global(Compiler *c, NodeRef n) {
+    Ast *ast          = c->ast;
+    const char *name  = ast->strings[ast->a[n]];
+    enum AstType type = ast->op[n];
+
+    if (ast->b[n] != AST_NONE) {
+        enum AstType init = compile_expr(c, ast->b[n]);
+        if (type != TYPE_ANY && init != type) {
+            error_at(c, n, "initializer does not match the declared type");
+        }
+        type = init;
+    } else {
+        type = type == TYPE_ANY ? TYPE_INT : type;
+        emit_zero(c, type);
+    }
+
+    // Declaring a global again is allowed, as long as the type stays the same
+    int known = global_type(c, name);
+    if (known >= 0 && (enum AstType)known != type) {
+        error_at(c, n, "global was declared with a different type before");
+    } else if (known < 0 && !ptrmap_put(&c->global_map, name, type)) {
+        c->had_error = true;
+    }
+
+    emit_i(c, SETG, make_const(c, name));
+}
+
+static void compile_assign(Compiler *c, NodeRef n) {
+    Ast *ast            = c->ast;
+    const char *name    = ast->strings[ast->a[n]];
+    struct Local *local = resolve_local(c, name);
+    int type            = local != NULL ? (int)local->type : global_type(c, name);
+
+    if (type < 0) {
+        error_at(c, n, "assignment to undefined variable");
+        return;
+    }
+
+    if (compile_expr(c, ast->b[n]) != (enum AstType)type) {
+        error_at(c, n, "assigned value does not match the variable type");
+    }
+
+    if (local != NULL) {
+        emit_i(c, SETL, local->slot);
+    } else {
+        emit_i(c, SETG, make_const(c, name));
+    }
+}
+
+static void compile_setindex(Compiler *c, NodeRef n) {
+    enum AstType array = compile_element(c, n);
+    enum AstType value = compile_expr(c, c->ast->c[n]);
+    if (value != (array == TYPE_FLOATS ? TYPE_FLOAT : TYPE_INT)) {
+        error_at(c, n, "stored value doesn't match the array's element type");
+    }
+
+    note_access(c, n, emit(c, SETA));
+}
+
+static void compile_setfield(Compiler *c, NodeRef n) {
+    Ast *ast         = c->ast;
+    const char *name = ast->strings[ast->b[n]];
+
+    if (compile_expr(c, ast->a[n]) != TYPE_STRUCT) {
+        error_at(c, n, "field access on a value that isn't a structure");
+    }
+
+    store_field_type(c, n, name, compile_expr(c, ast->c[n]));
+    emit_i(c, SETF, make_const(c, name));
+}
+
+static void compile_if(Compiler *c, NodeRef n) {
+    Ast *ast = c->ast;
+
+    int on_false = compile_cond(c, ast->a[n]);
+    compile_block(c, ast->b[n]);
+
+    if (ast->c[n] == AST_NONE) {
+        patch_here(c, on_false);
+        return;
+    }
+
+    int done = emit_jump(c, J);
+    patch_here(c, on_false);
+    compile_block(c, ast->c[n]);
+    patch_here(c, done);
+}
+
+static void compile_while(Compiler *c, NodeRef n) {
+    int top      = c->code_count;
+    int on_false = compile_cond(c, c->ast->a[n]);
+
+    compile_block(c, c->ast->b[n]);
+    emit_i(c, J, top);
+    patch_here(c, on_false);
+}
+
+static void compile_for(Compiler *c, NodeRef n) {
+    Ast *ast        = c->ast;
+    uint32_t range  = ast->b[n];
+    NodeRef from    = ast_list_items(ast, range)[0];
+    NodeRef to      = ast_list_items(ast, range)[1];
+
+    begin_scope(c);
+
+    if (compile_expr(c, from) != TYPE_INT) {
+        error_at(c, from, "loop bounds must be ints");
+    }
+    int counter = declare_local(c, n, ast->strings[ast->a[n]], TYPE_INT);
+    emit_i(c, SETL, counter);
+
+    // The limit is evaluated once, into a hidden local
+    if (compile_expr(c, to) != TYPE_INT) {
+        error_at(c, to, "loop bounds must be ints");
+    }
+    int limit = declare_local(c, n, NULL, TYPE_INT);
+    emit_i(c, SETL, limit);
+
+    struct LoopState loop = {
+        .counter     = counter,
+        .outer_count = c->fn->local_count - 2,
+        .give_up     = limit != counter + 1,
+        .outer       = c->loop,
+    };
+    c->loop   = &loop;
+    int guard = emit(c, NOP);
+
+    int top = c->code_count;
+    emit_i(c, GETL, counter);
+    emit_i(c, GETL, limit);
+    emit(c, CMP_I);
+    int done = emit_jump(c, JGR);
+
+    int body = c->code_count;
+    compile_block(c, ast->c[n]);
+    int body_end = c->code_count;
+
+    emit_i(c, GETL, counter);
+    emit_i(c, PUSH_I, 1);
+    emit(c, ADD_I);
+    emit_i(c, SETL, counter);
+    emit_i(c, J, top);
+    patch_here(c, done);
+
+    c->loop = loop.outer;
+    version_loop(c, &loop, guard, top, body, body_end);
+
+    end_scope(c);
+}
+
+/* Unannotated parameters are ints */
+static enum AstType param_type(Ast *ast, NodeRef param) {
+    return ast->op[param] == TYPE_ANY ? TYPE_INT : ast->op[param];
+}
+
+static void compile_func(Compiler *c, NodeRef n) {
+    Ast *ast = c->ast;
+
+    if (c->fn->index != 0) {
+        error_at(c, n, "functions can only be declared at the top level");
+        return;
+    }
+
+    // Parameters are locals, and FuncInfo only has room for that many
+    if (ast_list_count(ast, ast->b[n]) > COMPILER_MAX_LOCALS) {
+        error_at(c, n, "too many parameters");
+        return;
+    }
+
+    const char *name      = ast->strings[ast->a[n]];
+    int index             = declare_func(c, name);
+    struct FuncInfo *info = &c->infos[index];
+    uint32_t params       = ast->b[n];
+    int nparams           = ast_list_count(ast, params);
+    enum AstType ret      = ast->op[n] == TYPE_ANY ? TYPE_INT : ast->op[n];
+
+    if (info->defined) {
+        error_at(c, n, "function is already defined");
+        return;
+    }
+
+    bool mismatch = info->assumed && (c->funcs[index].nparams != nparams ||
+                                      ret != info->ret);
+    for (int i = 0; info->assumed && !mismatch && i < nparams; i++) {
+        NodeRef param = ast_list_items(ast, params)[i];
+        mismatch      = info->params[i] != param_type(ast, param);
+    }
+
+    if (mismatch) {
+        log_error("line %d: call does not match the later definition of %s\n", info->line,
+                  name);
+        c->had_error = true;
+    }
+
+    // The body is emitted inline, so the enclosing code has to jump over it
+    int skip = emit_jump(c, J);
+
+    struct FuncState state = {.index = index, .ret = ret};
+    struct FuncState *outer = c->fn;
+    struct LoopState *loop  = c->loop;
+    c->fn                   = &state;
+    c->loop                 = NULL;
+
+    info->defined = true;
+    info->ret     = ret;
+
+    c->funcs[index].entry   = c->code_count;
+    c->funcs[index].nparams = nparams;
+
+    // Parameters arrive in the first slots of the frame
+    for (int i = 0; i < nparams; i++) {
+        NodeRef param     = ast_list_items(ast, params)[i];
+        enum AstType type = param_type(ast, param);
+        info->params[i]   = type;
+        declare_local(c, param, ast->strings[ast->a[param]], type);
+    }
+
+    compile_block(c, ast->c[n]);
+
+    // Falling off the end returns the zero value of the return type
+    emit_zero(c, ret);
+    emit(c, RET);
+
+    c->funcs[index].nlocals = state.max_slots;
+    c->fn                   = outer;
+    c->loop                 = loop;
+
+    patch_here(c, skip);
+}
+
+static void compile_return(Compiler *c, NodeRef n) {
+    Ast *ast = c->ast;
+
+    // Builtins run in place, only calls to functions can become tail calls
+    enum AstType type = TYPE_INT;
+    bool tail         = c->fn->index != 0 && ast->kind[ast->a[n]] == NODE_CALL &&
+                find_builtin(c, ast->strings[ast->a[ast->a[n]]]) < 0;
+
+    if (tail) {
+        type = compile_call(c, ast->a[n], true);
+    } else if (ast->a[n] != AST_NONE) {
+        type = compile_expr(c, ast->a[n]);
+    } else if (c->fn->index != 0) {
+        emit_zero(c, c->fn->ret);
+        type = c->fn->ret;
+    }
+
+    // Returning from the top level ends the program, leaving the value as its result
+    if (c->fn->index == 0) {
+        emit(c, HALT);
+        return;
+    }
+
+    if (type != c->fn->ret) {
+        error_at(c, n, "returned value does not match the return type");
+    }
+
+    if (!tail) {
+        emit(c, RET);
+    }
+}
+
+static void compile_statement(Compiler *c, NodeRef n) {
+    c->panic = false;
+    switch (c->ast->kind[n]) {
+    case NODE_LOCAL:
+        compile_local(c, n);
+        break;
+    case NODE_GLOBAL:
+        compile_global(c, n);
+        break;
+    case NODE_ASSIGN:
+        compile_assign(c, n);
+        break;
+    case NODE_SETINDEX:
+        compile_setindex(c, n);
+        break;
+    case NODE_SETFIELD:
+        compile_setfield(c, n);
+        break;
+    case NODE_IF:
+        compile_if(c, n);
+        break;
+    case NODE_WHILE:
+        compile_while(c, n);
+        break;
+    case NODE_FOR:
+        compile_for(c, n);
+        break;
+    case NODE_FUNC:
+        compile_func(c, n);
+        break;
+    case NODE_RETURN:
+        compile_return(c, n);
+        break;
+    case NODE_BLOCK:
+        compile_block(c, n);
+        break;
+    default:
+        // Expression statement, the value is discarded
+        compile_expr(c, n);
+        emit(c, POP);
+        break;
+    }
+}
+
+static void compile_block(Compiler *c, NodeRef n) {
+    Ast *ast      = c->ast;
+    uint32_t list = ast->a[n];
+
+    begin_scope(c);
+    for (uint32_t i = 0; i < ast_list_count(ast, list); i++) {
+        compile_statement(c, ast_list_items(ast, list)[i]);
+    }
+    end_scope(c);
+}
+
+static void compiler_free(Compiler *c) {
+    free(c->code);
+    free(c->consts);
+    free(c->funcs);
+    free(c->infos);
+    ptrmap_free(&c->const_map);
+    ptrmap_free(&c->func_map);
+    ptrmap_free(&c->global_map);
+    ptrmap_free(&c->field_map);
+    ptrmap_free(&c->user_funcs);
+}
+
+int compile_ast(Ast *ast, NodeRef root, struct Bytecode *out) {
+    Compiler c = {.ast = ast};
+
+    // Function 0 is the top-level program
+    struct FuncState main_state = {.index = 0, .ret = TYPE_INT};
+    c.fn                        = &main_state;
+    declare_func(&c, NULL);
+    c.infos[0].defined = true;
+
+    // Functions are only declared at the top level, so a look at its statements
+    // finds every name that hides a builtin before any call is compiled
+    uint32_t top = ast->a[root];
+    for (uint32_t i = 0; i < ast_list_count(ast, top); i++) {
+        NodeRef stmt = ast_list_items(ast, top)[i];
+        if (ast->kind[stmt] == NODE_FUNC &&
+            !ptrmap_put(&c.user_funcs, ast->strings[ast->a[stmt]], 1)) {
+            c.had_error = true;
+        }
+    }
+
+    compile_block(&c, root);
+    emit(&c, HALT);
+    c.funcs[0].nlocals = main_state.max_slots;
+
+    for (size_t i = 1; i < c.func_count; i++) {
+        if (!c.infos[i].defined) {
+            log_error("line %d: call to undefined function %s\n", c.infos[i].line,
+                      c.infos[i].name);
+            c.had_error = true;
+        }
+    }
+
+    if (c.had_error) {
+        compiler_free(&c);
+        return -1;
+    }
+
+    // Hand the arrays over to the bytecode image, constants are copied out of the
+    // string pool since it dies with the lexer
+    memset(out, 0, sizeof(*out));
+    out->header.code_size   = c.code_count;
+    out->header.const_count = c.const_count;
+    out->header.func_count  = c.func_count;
+
+    out->code   = c.code;
+    out->funcs  = c.funcs;
+    out->consts = (char **)malloc((c.const_count + 1) * sizeof(char *));
+    for (size_t i = 0; out->consts != NULL && i < c.const_count; i++) {
+        out->consts[i] = strdup(c.consts[i]);
+    }
+
+    c.code  = NULL;
+    c.funcs = NULL;
+    compiler_free(&c);
+    return out->consts != NULL ? 0 : -1;
+}
+
+int compile_source(Lexer *l, struct Bytecode *out) {
+    Ast *ast = ast_create();
+    if (ast == NULL) {
+        log_error("failed to allocate AST\n");
+        return -1;
+    }
+
+    Parser p     = parser_init(l, ast);
+    NodeRef root = parser_parse(&p);
+
+    int status = root != AST_NONE ? compile_ast(ast, root, out) : -1;
+
+    parser_cleanup(&p);
+    ast_destroy(ast);
+    return status;
+}
+
+int compile_file(const char *path, struct Bytecode *out) {
+    Lexer l;
+
+    // "-" compiles standard input through a streaming lexer
+    int status = strcmp(path, "-") == 0 ? lexer_open_fd(&l, STDIN_FILENO, 0)
+                                        : lexer_open_file(&l, path);
+    if (status != 0) {
+        return -1;
+    }
+
+    // Big files are lexed on every CPU first, the parser then replays the tokens
+    if (l.length >= LEXER_PARALLEL_MIN_SOURCE && lexer_lex_ahead(&l, 0) != 0) {
+        log_warn("parallel lexing failed, lexing as we parse\n");
+    }
+
+    status = compile_source(&l, out);
+    lexer_cleanup(&l);
+    return status;
+}
@@ -0,0 +1,25 @@
+/**
+ * Source to bytecode compiler for Taro.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_COMPILER_H
+#define TARO_COMPILER_H
+
+#include "ast.h"
+#include "lexer.h"
+#include "runtime/bytecode.h"
+
+/** Bumped whenever the compiler emits different code for the same source */
+#define COMPILER_VERSION 9
+
+/** Most locals (parameters and hidden loop locals included) one function can have */
+#define COMPILER_MAX_LOCALS 256
+
+int compile_ast(Ast *ast, NodeRef root, struct Bytecode *out);
+int compile_source(Lexer *l, struct Bytecode *out);
+int compile_file(const char *path, struct Bytecode *out);
+
+#endif
@@ -7,92 +7,314 @@
 
 #include "lexer.h"
 #include "util/logger.h"
+#include "util/scan.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static bool at_eof(Lexer *l);
 static char advance(Lexer *l);
 static char peek(Lexer *l, int offset);
+static bool lexer_refill(Lexer *l);
+static void lexer_scan_run(Lexer *l, size_t (*scan)(const char *, size_t));
 
-static struct Token make_token(Lexer *l, enum TokenType type, char *value, int length);
+static struct Token make_token(Lexer *l, enum TokenType type);
 static struct Token make_error(Lexer *l, const char *message);
 static struct Token lexer_scan_kw(Lexer *l);
 static struct Token lexer_scan_number(Lexer *l);
+static struct Token lexer_scan_string(Lexer *l);
+
+/* Longest reserved keyword, anything longer is always an identifier */
+#define KEYWORD_MAX_LENGTH 8
+
+/* Match one reserved keyword against the current slice */
+#define KEYWORD(_name, _type)                                                            \
+    if (length == sizeof(_name) - 1 && memcmp(text, _name, sizeof(_name) - 1) == 0)     \
+    return _type
+
+/**
+ * Classify an identifier slice as a reserved keyword. Dispatching on the first
+ * character leaves at most a couple of length-guarded memcmp()s per identifier;
+ * new keywords go under the case for their first letter.
+ */
+static enum TokenType keyword_type(const char *text, int length) {
+    if (length < 2 || length > KEYWORD_MAX_LENGTH)
+        return TOK_IDENTIFIER;
+
+    switch (text[0]) {
+    case 'c':
+        KEYWORD("call", TOK_KWCALL);
+        break;
+    case 'd':
+        KEYWORD("do", TOK_KWDO);
+        break;
+    case 'e':
+        KEYWORD("end", TOK_KWEND);
+        KEYWORD("else", TOK_KWELSE);
+        break;
+    case 'f':
+        KEYWORD("for", TOK_KWFOR);
+        KEYWORD("func", TOK_KWFUNC);
+        KEYWORD("function", TOK_KWFUNCTION);
+        break;
+    case 'g':
+        KEYWORD("global", TOK_KWGLOBAL);
+        break;
+    case 'i':
+        KEYWORD("if", TOK_KWIF);
+        break;
+    case 'l':
+        KEYWORD("local", TOK_KWLOCAL);
+        break;
+    case 'r':
+        // `ret` is the spelling used by the VM docs
+        KEYWORD("ret", TOK_KWRETURN);
+        KEYWORD("return", TOK_KWRETURN);
+        break;
+    case 's':
+        KEYWORD("set", TOK_KWSET);
+        break;
+    case 't':
+        KEYWORD("then", TOK_KWTHEN);
+        break;
+    case 'w':
+        KEYWORD("while", TOK_KWWHILE);
+        break;
+    }
+
+    return TOK_IDENTIFIER;
+}
+
+#undef KEYWORD
+
+Lexer lexer_init(char *src) { return lexer_init_n(src, strlen(src)); }
+
+Lexer lexer_init_n(char *src, int length) {
+    scan_init();
 
-/* Reserved keywords */
-static struct Keyword g_reserved_keywords[] = {
-    {"if",       TOK_KWIF      },
-    {"then",     TOK_KWTHEN    },
-    {"else",     TOK_KWELSE    },
-    {"end",      TOK_KWEND     },
-    {"while",    TOK_KWWHILE   },
-    {"for",      TOK_KWFOR     },
-    {"function", TOK_KWFUNCTION},
-};
-
-Lexer lexer_init(char *src) {
     Lexer l;
     l.src     = src;
+    l.length  = length;
     l.line    = 1;
     l.start   = 0;
     l.current = 0;
 
-    // Reserved keywords
-    l.reserved_kw       = g_reserved_keywords;
-    l.reserved_kw_count = (sizeof(g_reserved_keywords) / sizeof(struct Keyword));
+    l.strings  = strpool_create();
+    l.mode     = LEXER_MEMORY;
+    l.fd       = -1;
+    l.eof      = true;
+    l.capacity = length;
+    l.offset   = 0;
+    l.released = 0;
 
+    l.ahead      = (struct TokenArray){0};
+    l.ahead_next = 0;
     return l;
 }
 
+int lexer_open_file(Lexer *l, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("failed to open file: %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        log_error("failed to stat file: %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size > __INT_MAX__) {
+        log_error("source file too large: %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // mmap() refuses empty mappings, an empty file is just an empty source
+    static char empty[1] = "";
+    char *src            = empty;
+    if (st.st_size > 0) {
+        src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src == MAP_FAILED) {
+            log_error("failed to map file: %s\n", path);
+            close(fd);
+            return -1;
+        }
+
+        madvise(src, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    // The mapping keeps the file alive, we don't need the descriptor anymore
+    close(fd);
+
+    *l      = lexer_init_n(src, st.st_size);
+    l->mode = LEXER_MMAP;
+    return 0;
+}
+
+int lexer_open_fd(Lexer *l, int fd, int chunk_size) {
+    if (chunk_size <= 0) {
+        chunk_size = LEXER_CHUNK_SIZE;
+    }
+
+    char *buf = (char *)malloc(chunk_size);
+    if (buf == NULL) {
+        log_error("failed to allocate lexer buffer\n");
+        return -1;
+    }
+
+    *l          = lexer_init_n(buf, 0);
+    l->mode     = LEXER_STREAM;
+    l->fd       = fd;
+    l->eof      = false;
+    l->capacity = chunk_size;
+    return 0;
+}
+
 void lexer_cleanup(Lexer *l) {
+    if (l->mode == LEXER_MMAP && l->length > 0) {
+        munmap(l->src, l->length);
+    } else if (l->mode == LEXER_STREAM) {
+        free(l->src);
+    }
+
     l->src     = NULL;
+    l->length  = 0;
     l->line    = 0;
     l->start   = 0;
     l->current = 0;
+
+    strpool_free(l->strings);
+    l->strings = NULL;
+
+    token_array_free(&l->ahead);
+    l->ahead_next = 0;
 }
 
-static struct Token make_token(Lexer *l, enum TokenType type, char *value, int length) {
+const char *lexer_intern_token(Lexer *l, struct Token *t) {
+    return strpool_intern(l->strings, t->value, t->length);
+}
+
+static struct Token make_token(Lexer *l, enum TokenType type) {
+    // The token borrows its text from the source, nothing is copied here
     struct Token t;
-    t.type  = type;
-    t.value = strdup(value);
-    t.line  = l->line;
-    t.start = l->start;
-    t.end   = length;
+    t.type      = type;
+    t.value     = l->src + l->start;
+    t.length    = l->current - l->start;
+    t.line      = l->line;
+    t.start     = l->offset + l->start;
+    t.end       = l->offset + l->current;
+    t.int_value = 0;
 
     return t;
 }
 
 static struct Token make_error(Lexer *l, const char *message) {
     struct Token t;
-    t.type  = TOK_ERR;
-    t.value = strdup(message);
-    t.line  = l->line;
-    t.start = l->start;
-    t.end   = (int)(l->current - l->start);
+    t.type      = TOK_ERR;
+    t.value     = message;
+    t.length    = strlen(message);
+    t.line      = l->line;
+    t.start     = l->offset + l->start;
+    t.end       = l->offset + l->current;
+    t.int_value = 0;
 
     return t;
 }
 
-static void skip_whitespace(Lexer *l) {
-    while (!at_eof(l)) {
-        char c = peek(l, 0);
-        switch (c) {
-        case ' ':
-        case '\r':
-        case '\t':
-            advance(l);
-            break;
-        case '\n':
-            l->line++;
-            advance(l);
-            break;
-        default:
-            return;
+/**
+ * Pull more input into a streaming lexer. Everything before the start of the
+ * current token is discarded to make room, so the window only ever has to hold
+ * the longest single token plus one chunk.
+ */
+static bool lexer_refill(Lexer *l) {
+    if (l->mode != LEXER_STREAM || l->eof) {
+        return false;
+    }
+
+    // Slide the current token to the front of the buffer
+    if (l->start > 0) {
+        memmove(l->src, l->src + l->start, l->length - l->start);
+        l->offset += l->start;
+        l->length -= l->start;
+        l->current -= l->start;
+        l->start = 0;
+    }
+
+    // A single token filled the whole window, so we have to grow it
+    if (l->length == l->capacity) {
+        char *buf = (char *)realloc(l->src, l->capacity * 2);
+        if (buf == NULL) {
+            log_error("failed to grow lexer buffer\n");
+            l->eof = true;
+            return false;
         }
+
+        l->src = buf;
+        l->capacity *= 2;
     }
+
+    ssize_t n;
+    do {
+        n = read(l->fd, l->src + l->length, l->capacity - l->length);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        if (n < 0) {
+            log_error("failed to read lexer input\n");
+        }
+
+        l->eof = true;
+        return false;
+    }
+
+    l->length += n;
+    return true;
+}
+
+/* Hand pages we've finished with back to the kernel, they're refaulted on use */
+static void lexer_release(Lexer *l) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t done = (size_t)l->start & ~(page - 1);
+
+    if (done - l->released >= LEXER_RELEASE_SIZE) {
+        madvise(l->src + l->released, done - l->released, MADV_DONTNEED);
+        l->released = done;
+    }
+}
+
+/* Consume a run of characters of one class, refilling across chunk boundaries */
+static void lexer_scan_run(Lexer *l, size_t (*scan)(const char *, size_t)) {
+    do {
+        l->current += scan(l->src + l->current, l->length - l->current);
+    } while (l->current == l->length && lexer_refill(l));
+}
+
+static void skip_whitespace(Lexer *l) {
+    // Most tokens are directly adjacent to the next one
+    if (at_eof(l) || (unsigned char)peek(l, 0) > ' ')
+        return;
+
+    // Whitespace runs are skipped in bulk, counting newlines as we go
+    int newlines = 0;
+    do {
+        l->current += scan_blanks(l->src + l->current, l->length - l->current, &newlines);
+
+        // Nothing skipped needs to survive a refill
+        l->start = l->current;
+    } while (l->current == l->length && lexer_refill(l));
+
+    l->line += newlines;
 }
 
 void format_token(struct Token t, char *buf) {
@@ -103,7 +325,7 @@ void format_token(struct Token t, char *buf) {
 
     switch (t.type) {
     case TOK_IDENTIFIER:
-        sprintf(buf, "TOK_IDENTIFIER(%s)", t.value);
+        sprintf(buf, "TOK_IDENTIFIER(%.*s)", t.length, t.value);
         break;
     case TOK_INT:
         sprintf(buf, "TOK_INT(%d)", t.int_value);
@@ -112,13 +334,13 @@ void format_token(struct Token t, char *buf) {
         sprintf(buf, "TOK_FLOAT(%f)", t.float_value);
         break;
     case TOK_STRING:
-        sprintf(buf, "TOK_STRING(%s)", t.value);
+        sprintf(buf, "TOK_STRING(%.*s)", t.length, t.value);
         break;
     case TOK_COMMENT:
-        sprintf(buf, "TOK_COMMENT(%s)", t.value);
+        sprintf(buf, "TOK_COMMENT(%.*s)", t.length, t.value);
         break;
     case TOK_ERR:
-        sprintf(buf, "TOK_ERR(%s)", t.value);
+        sprintf(buf, "TOK_ERR(%.*s)", t.length, t.value);
         break;
     case TOK_EOF:
         sprintf(buf, "TOK_EOF");
@@ -162,6 +384,33 @@ void format_token(struct Token t, char *buf) {
     case TOK_ARROW:
         sprintf(buf, "TOK_ARROW");
         break;
+    case TOK_LPAREN:
+        sprintf(buf, "TOK_LPAREN");
+        break;
+    case TOK_RPAREN:
+        sprintf(buf, "TOK_RPAREN");
+        break;
+    case TOK_COMMA:
+        sprintf(buf, "TOK_COMMA");
+        break;
+    case TOK_COLON:
+        sprintf(buf, "TOK_COLON");
+        break;
+    case TOK_DOT:
+        sprintf(buf, "TOK_DOT");
+        break;
+    case TOK_LBRACE:
+        sprintf(buf, "TOK_LBRACE");
+        break;
+    case TOK_RBRACE:
+        sprintf(buf, "TOK_RBRACE");
+        break;
+    case TOK_LBRACKET:
+        sprintf(buf, "TOK_LBRACKET");
+        break;
+    case TOK_RBRACKET:
+        sprintf(buf, "TOK_RBRACKET");
+        break;
     case TOK_KWIF:
         sprintf(buf, "TOK_KWIF");
         break;
@@ -183,13 +432,34 @@ void format_token(struct Token t, char *buf) {
     case TOK_KWFUNCTION:
         sprintf(buf, "TOK_KWFUNCTION");
         break;
+    case TOK_KWFUNC:
+        sprintf(buf, "TOK_KWFUNC");
+        break;
+    case TOK_KWLOCAL:
+        sprintf(buf, "TOK_KWLOCAL");
+        break;
+    case TOK_KWSET:
+        sprintf(buf, "TOK_KWSET");
+        break;
+    case TOK_KWRETURN:
+        sprintf(buf, "TOK_KWRETURN");
+        break;
+    case TOK_KWCALL:
+        sprintf(buf, "TOK_KWCALL");
+        break;
+    case TOK_KWDO:
+        sprintf(buf, "TOK_KWDO");
+        break;
+    case TOK_KWGLOBAL:
+        sprintf(buf, "TOK_KWGLOBAL");
+        break;
     default:
         sprintf(buf, "TOK_UNKNOWN");
         break;
     }
 }
 
-bool at_eof(Lexer *l) { return l->current >= strlen(l->src); }
+bool at_eof(Lexer *l) { return l->current >= l->length && !lexer_refill(l); }
 
 char advance(Lexer *l) {
     if (at_eof(l)) {
@@ -205,15 +475,32 @@ char advance(Lexer *l) {
 }
 
 char peek(Lexer *l, int offset) {
-    return l->src[l->current + offset] != '\0' ? l->src[l->current + offset] : '\0';
+    while (l->current + offset >= l->length) {
+        if (!lexer_refill(l))
+            return '\0';
+    }
+
+    return l->src[l->current + offset];
 }
 
 struct Token lexer_poll(Lexer *l) {
+    // Lexed ahead, the last token is EOF and stays the current one
+    if (l->ahead.count > 0) {
+        struct Token t = l->ahead.tokens[l->ahead_next];
+        if (l->ahead_next + 1 < l->ahead.count) {
+            l->ahead_next++;
+        }
+        return t;
+    }
+
     skip_whitespace(l);
     l->start = l->current;
 
+    if (l->mode == LEXER_MMAP)
+        lexer_release(l);
+
     if (at_eof(l))
-        return make_token(l, TOK_EOF, "", 0);
+        return make_token(l, TOK_EOF);
 
     char c = advance(l);
 
@@ -225,116 +512,177 @@ struct Token lexer_poll(Lexer *l) {
 
     switch (c) {
     case '+':
-        return make_token(l, TOK_PLUS, "+", 1);
+        return make_token(l, TOK_PLUS);
     case '-':
-        return make_token(l, TOK_MINUS, "-", 1);
+        return make_token(l, TOK_MINUS);
     case '*':
-        return make_token(l, TOK_STAR, "*", 1);
+        return make_token(l, TOK_STAR);
     case '/':
-        return make_token(l, TOK_SLASH, "/", 1);
+        return make_token(l, TOK_SLASH);
+    case '(':
+        return make_token(l, TOK_LPAREN);
+    case ')':
+        return make_token(l, TOK_RPAREN);
+    case ',':
+        return make_token(l, TOK_COMMA);
+    case ':':
+        return make_token(l, TOK_COLON);
+    case '.':
+        return make_token(l, TOK_DOT);
+    case '{':
+        return make_token(l, TOK_LBRACE);
+    case '}':
+        return make_token(l, TOK_RBRACE);
+    case '[':
+        return make_token(l, TOK_LBRACKET);
+    case ']':
+        return make_token(l, TOK_RBRACKET);
     case '=':
         if (peek(l, 0) == '=') {
             advance(l);
-            return make_token(l, TOK_EQEQ, "==", 2);
+            return make_token(l, TOK_EQEQ);
         } else {
-            return make_token(l, TOK_EQ, "=", 1);
+            return make_token(l, TOK_EQ);
         }
     case '!':
         if (peek(l, 0) == '=') {
             advance(l);
-            return make_token(l, TOK_BANGEQ, "!=", 2);
+            return make_token(l, TOK_BANGEQ);
         } else {
-            return make_token(l, TOK_BANG, "!", 1);
+            return make_token(l, TOK_BANG);
         }
     case '<':
         if (peek(l, 0) == '=') {
             advance(l);
-            return make_token(l, TOK_LTEQ, "<=", 2);
+            return make_token(l, TOK_LTEQ);
         } else {
-            return make_token(l, TOK_LT, "<", 1);
+            return make_token(l, TOK_LT);
         }
     case '>':
         if (peek(l, 0) == '=') {
             advance(l);
-            return make_token(l, TOK_GTEQ, ">=", 2);
+            return make_token(l, TOK_GTEQ);
         } else {
-            return make_token(l, TOK_GT, ">", 1);
+            return make_token(l, TOK_GT);
         }
-    case '#':
-        while (!at_eof(l) && peek(l, 0) != '\n')
-            advance(l);
-
-        return make_token(l, TOK_COMMENT, l->src + l->start + 1,
-                          l->current - l->start - 1);
+    case '#': {
+        // Skip to the end of the line, the newline itself is left for the next poll
+        lexer_scan_run(l, scan_line);
+
+        // The comment text excludes the leading '#'
+        struct Token t = make_token(l, TOK_COMMENT);
+        t.value++;
+        t.length--;
+        return t;
+    }
+    case '"':
+        return lexer_scan_string(l);
     }
 
     return make_error(l, "unexpected character");
 }
 
-struct Token lexer_scan_kw(Lexer *l) {
-    // Find the start of the keyword or identifier
-    l->start = l->current - 1;
-
+struct Token lexer_scan_string(Lexer *l) {
+    // Strings can't span lines, which keeps every newline a safe place to split
     char c;
-    while ((c = peek(l, 0))) {
-        if (!isalpha(c) && !isdigit(c) && c != '_') {
-            break;
+    while ((c = peek(l, 0)) != '"') {
+        if (c == '\0' || c == '\n') {
+            return make_error(l, "unterminated string");
         }
 
         advance(l);
     }
 
-    // Calculate the length of the keyword or identifier
-    int length = l->current - l->start;
-    char *text = strndup(l->src + l->start, length);
+    advance(l);
 
-    // Check if the keyword is a reserved keyword
-    enum TokenType type = TOK_IDENTIFIER;
-    for (int i = 0; i < l->reserved_kw_count; i++) {
-        if (strcmp(text, l->reserved_kw[i].name) == 0) {
-            type = l->reserved_kw[i].type;
-            break;
-        }
-    }
+    // The string text excludes the quotes
+    struct Token t = make_token(l, TOK_STRING);
+    t.value++;
+    t.length -= 2;
+    return t;
+}
+
+struct Token lexer_scan_kw(Lexer *l) {
+    lexer_scan_run(l, scan_ident);
 
-    struct Token token = make_token(l, type, text, length);
-    free(text);
+    struct Token token = make_token(l, TOK_IDENTIFIER);
+    token.type         = keyword_type(token.value, token.length);
 
     return token;
 }
 
 struct Token lexer_scan_number(Lexer *l) {
-    // Find the start of the number
-    l->start = l->current;
-
-    char c;
     bool floating = false;
 
-    while ((c = peek(l, 0))) {
-        if (!isdigit(c)) {
-            if (c == '.' && !floating) {
-                floating = true;
-            } else {
-                break;
-            }
-        }
-
+    lexer_scan_run(l, scan_digits);
+    if (peek(l, 0) == '.') {
+        floating = true;
         advance(l);
+        lexer_scan_run(l, scan_digits);
     }
 
-    // Calculate the length of the number
-    int length = l->current - l->start + 1;
-    char *text = strndup(l->src + (l->start - 1), length);
-
-    struct Token token = make_token(l, TOK_INT, text, length);
+    struct Token token = make_token(l, TOK_INT);
 
     if (floating) {
+        // strtof needs a terminated string, so copy the digits onto the stack
+        char text[64];
+        int length = token.length < (int)sizeof(text) - 1 ? token.length
+                                                          : (int)sizeof(text) - 1;
+        memcpy(text, token.value, length);
+        text[length] = '\0';
+
         token.type        = TOK_FLOAT;
         token.float_value = strtof(text, NULL);
     } else {
-        token.int_value = strtol(text, NULL, 10);
+        // Wide enough that one more digit past INT_MAX can't overflow
+        long long value = 0;
+        for (int i = 0; i < token.length; i++) {
+            value = value * 10 + (token.value[i] - '0');
+            if (value > INT_MAX) {
+                return make_error(l, "integer literal too large");
+            }
+        }
+
+        token.int_value = (int)value;
     }
 
-    free(text);
     return token;
 }
+
+int token_array_push(struct TokenArray *arr, struct Token t) {
+    if (arr->count == arr->capacity) {
+        size_t capacity = arr->capacity ? arr->capacity * 2 : 256;
+        struct Token *tokens =
+            (struct Token *)realloc(arr->tokens, capacity * sizeof(struct Token));
+        if (tokens == NULL) {
+            log_error("failed to grow token array\n");
+            return -1;
+        }
+
+        arr->tokens   = tokens;
+        arr->capacity = capacity;
+    }
+
+    arr->tokens[arr->count++] = t;
+    return 0;
+}
+
+void token_array_free(struct TokenArray *arr) {
+    free(arr->tokens);
+    arr->tokens   = NULL;
+    arr->count    = 0;
+    arr->capacity = 0;
+}
+
+int lexer_tokenize(Lexer *l, struct TokenArray *out) {
+    // Poll until EOF, the EOF token is included in the output
+    struct Token t;
+    do {
+        t = lexer_poll(l);
+        if (token_array_push(out, t) != 0) {
+            return -1;
+        }
+    } while (t.type != TOK_EOF);
+
+    return 0;
+}
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "util/strpool.h"
+
 enum TokenType {
     TOK_IDENTIFIER,
     TOK_INT,
@@ -28,6 +30,15 @@ enum TokenType {
     TOK_GT,
     TOK_GTEQ,
     TOK_ARROW,
+    TOK_LPAREN,
+    TOK_RPAREN,
+    TOK_COMMA,
+    TOK_COLON,
+    TOK_DOT,
+    TOK_LBRACE,
+    TOK_RBRACE,
+    TOK_LBRACKET,
+    TOK_RBRACKET,
 
     /* Reserved keywords */
     TOK_KWIF,
@@ -37,11 +48,27 @@ enum TokenType {
     TOK_KWWHILE,
     TOK_KWFOR,
     TOK_KWFUNCTION,
+    TOK_KWFUNC,
+    TOK_KWLOCAL,
+    TOK_KWSET,
+    TOK_KWRETURN,
+    TOK_KWCALL,
+    TOK_KWDO,
+    TOK_KWGLOBAL,
 };
 
+/**
+ * A token is a view into the lexer source: `value` points at the first character
+ * of the lexeme and is NOT NUL-terminated, use `length` (or intern it with
+ * lexer_intern_token) when a C string is needed.
+ *
+ * With a streaming lexer the view is only valid until the next lexer_poll, since
+ * refilling the buffer moves the text around.
+ */
 struct Token {
     enum TokenType type;
-    char *value;
+    const char *value;
+    int length;
     int line, start, end;
 
     union {
@@ -50,21 +77,69 @@ struct Token {
     };
 };
 
-struct Keyword {
-    const char *name;
-    enum TokenType type;
+/** Growable array of tokens, as produced by lexer_tokenize */
+struct TokenArray {
+    struct Token *tokens;
+    size_t count, capacity;
+};
+
+/** Sources smaller than this are never split for parallel lexing */
+#define LEXER_PARALLEL_MIN_CHUNK (1024 * 1024)
+
+/** compile_file lexes files at least this big in parallel before parsing them */
+#define LEXER_PARALLEL_MIN_SOURCE (4 * LEXER_PARALLEL_MIN_CHUNK)
+
+/** Default refill buffer size of a streaming lexer */
+#define LEXER_CHUNK_SIZE (64 * 1024)
+
+/** A mapped lexer drops pages behind it every this many bytes */
+#define LEXER_RELEASE_SIZE (16 * 1024 * 1024)
+
+enum LexerMode {
+    LEXER_MEMORY, // caller-owned buffer holding the whole program
+    LEXER_MMAP,   // whole file mapped read-only, pages released behind the lexer
+    LEXER_STREAM, // refillable window over a pipe or stdin
 };
 
 typedef struct {
     char *src;
+    int length; // length of src, so we never have to strlen() it again
     int line, start, current;
 
-    struct Keyword *reserved_kw;
-    int reserved_kw_count;
+    // Materialized token text (identifiers, strings) lives here
+    StrPool *strings;
+
+    // Input source, src is a window starting at `offset` for streaming lexers
+    enum LexerMode mode;
+    int fd;
+    bool eof;
+    int capacity;
+    size_t offset;
+    size_t released;
+
+    // Tokens lexed up front by lexer_lex_ahead, which lexer_poll hands out instead
+    struct TokenArray ahead;
+    size_t ahead_next;
 } Lexer;
 
 Lexer lexer_init(char *src);
+Lexer lexer_init_n(char *src, int length);
+int lexer_open_file(Lexer *l, const char *path);
+int lexer_open_fd(Lexer *l, int fd, int chunk_size);
 void lexer_cleanup(Lexer *l);
 
 struct Token lexer_poll(Lexer *l);
+int lexer_tokenize(Lexer *l, struct TokenArray *out);
+int lexer_tokenize_parallel(char *src, int length, int nthreads, struct TokenArray *out);
+
+/**
+ * Lex the whole source of an in-memory or mapped lexer on `nthreads` threads
+ * (0 for one per CPU), for lexer_poll to replay. Nothing changes with one thread.
+ */
+int lexer_lex_ahead(Lexer *l, int nthreads);
+
+int token_array_push(struct TokenArray *arr, struct Token t);
+void token_array_free(struct TokenArray *arr);
+const char *lexer_intern_token(Lexer *l, struct Token *t);
+void format_token(struct Token t, char *buf);
 #endif
@@ -0,0 +1,157 @@
+/**
+ * Parallel tokenization of large in-memory sources.
+ *
+ * The source is cut into chunks just after a newline. No token in Taro can
+ * contain a newline (comments stop in front of it, strings can't span lines and
+ * it's otherwise plain whitespace), so a fresh lexer started at any line start produces exactly the
+ * tokens the sequential lexer would, only with chunk-relative line numbers.
+ * Chunks are lexed on a pool of threads and then stitched back together.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "lexer.h"
+#include "util/logger.h"
+#include "util/parallel.h"
+
+#include <string.h>
+
+struct LexChunk {
+    int begin, end;
+
+    struct TokenArray tokens;
+    int newlines; // newlines inside the chunk, to rebase later chunks
+    int status;
+};
+
+struct LexJob {
+    char *src;
+    struct LexChunk *chunks;
+};
+
+static void lex_chunk(void *ctx, size_t index) {
+    struct LexJob *job      = (struct LexJob *)ctx;
+    struct LexChunk *chunk = &job->chunks[index];
+
+    Lexer l  = lexer_init_n(job->src + chunk->begin, chunk->end - chunk->begin);
+    l.offset = chunk->begin;
+
+    chunk->status   = lexer_tokenize(&l, &chunk->tokens);
+    chunk->newlines = l.line - 1;
+
+    lexer_cleanup(&l);
+}
+
+/* Find the first line start at or after `pos` */
+static int next_line_start(const char *src, int length, int pos) {
+    if (pos >= length) {
+        return length;
+    }
+
+    const char *nl = memchr(src + pos, '\n', length - pos);
+    return nl ? (int)(nl - src) + 1 : length;
+}
+
+int lexer_tokenize_parallel(char *src, int length, int nthreads, struct TokenArray *out) {
+    if (nthreads <= 0) {
+        nthreads = parallel_default_threads();
+    }
+
+    // Over-split a little so uneven chunks still balance across the pool
+    int nchunks = nthreads * 4;
+    if (length / nchunks < LEXER_PARALLEL_MIN_CHUNK) {
+        nchunks = length / LEXER_PARALLEL_MIN_CHUNK;
+    }
+
+    if (nthreads == 1 || nchunks <= 1) {
+        Lexer l    = lexer_init_n(src, length);
+        int status = lexer_tokenize(&l, out);
+        lexer_cleanup(&l);
+        return status;
+    }
+
+    struct LexChunk *chunks = (struct LexChunk *)calloc(nchunks, sizeof(struct LexChunk));
+    if (chunks == NULL) {
+        log_error("failed to allocate lexer chunks\n");
+        return -1;
+    }
+
+    int pos = 0;
+    for (int i = 0; i < nchunks; i++) {
+        // A long line can push a cut past the next chunk's nominal start
+        int cut = (int)((long)length * (i + 1) / nchunks);
+        if (cut < pos) {
+            cut = pos;
+        }
+
+        chunks[i].begin = pos;
+        chunks[i].end   = i == nchunks - 1 ? length : next_line_start(src, length, cut);
+        pos             = chunks[i].end;
+    }
+
+    struct LexJob job = {.src = src, .chunks = chunks};
+    parallel_for(nthreads, nchunks, lex_chunk, &job);
+
+    // Stitch: every chunk but the last ends in an EOF token that we drop
+    int status   = 0;
+    size_t total = 0;
+    for (int i = 0; i < nchunks; i++) {
+        status |= chunks[i].status;
+        total += chunks[i].tokens.count - (i < nchunks - 1);
+    }
+
+    if (status == 0 && out->capacity - out->count < total) {
+        struct Token *tokens = (struct Token *)realloc(
+            out->tokens, (out->count + total) * sizeof(struct Token));
+        if (tokens == NULL) {
+            log_error("failed to grow token array\n");
+            status = -1;
+        } else {
+            out->tokens   = tokens;
+            out->capacity = out->count + total;
+        }
+    }
+
+    int line = 0;
+    for (int i = 0; i < nchunks; i++) {
+        struct TokenArray *arr = &chunks[i].tokens;
+        size_t n               = arr->count - (i < nchunks - 1);
+
+        if (status == 0) {
+            struct Token *dst = out->tokens + out->count;
+            memcpy(dst, arr->tokens, n * sizeof(struct Token));
+            for (size_t j = 0; j < n; j++) {
+                dst[j].line += line;
+            }
+            out->count += n;
+        }
+
+        line += chunks[i].newlines;
+        token_array_free(arr);
+    }
+
+    free(chunks);
+    return status;
+}
+
+int lexer_lex_ahead(Lexer *l, int nthreads) {
+    if (nthreads <= 0) {
+        nthreads = parallel_default_threads();
+    }
+
+    // On one thread polling as the parser goes is as fast and holds less
+    if (nthreads == 1 || l->mode == LEXER_STREAM) {
+        return 0;
+    }
+
+    struct TokenArray tokens = {0};
+    if (lexer_tokenize_parallel(l->src, l->length, nthreads, &tokens) != 0) {
+        token_array_free(&tokens);
+        return -1;
+    }
+
+    l->ahead      = tokens;
+    l->ahead_next = 0;
+    return 0;
+}
@@ -1,33 +1,313 @@
+#include "aot.h"
+#include "cache.h"
+#include "compiler.h"
 #include "lexer.h"
+#include "optimizer.h"
 #include "runtime/bytecode.h"
 #include "runtime/gc.h"
+#include "runtime/sched.h"
 #include "runtime/value.h"
 #include "runtime/vm.h"
 #include "util/arena.h"
 #include "util/common.h"
+#include "util/logger.h"
+#include "util/parallel.h"
 
 #include <stdio.h>
-#include <strings.h> // For bzero
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-int main() {
-    // VM testing ground
+struct Options {
+    const char *input;
+    const char *output;
+    bool optimize;
+    bool use_cache;
+    bool jit;
+    int vms; // copies of the program to run on the scheduler, 0 to run it directly
+    int64_t fuel;
+};
+
+static void usage(void) {
+    fprintf(stderr, "usage: taro compile [-O0] [--no-cache] <file.tr|-> [-o <file.bc>]\n"
+                    "       taro run [-O0] [--no-cache] [--jit] [--vms <n>] [--fuel <n>] "
+                    "<file.tr|file.bc>\n"
+                    "       taro dis [-O0] [--no-cache] <file.tr|file.bc>\n"
+                    "       taro aot [-O0] [--no-cache] <file.tr|file.bc> [-o <file>]\n");
+}
+
+static bool has_suffix(const char *str, const char *suffix) {
+    size_t n = strlen(str), m = strlen(suffix);
+    return n >= m && strcmp(str + n - m, suffix) == 0;
+}
+
+static int parse_options(int argc, char **argv, struct Options *opts) {
+    *opts = (struct Options){
+        .optimize = true, .use_cache = true, .fuel = VM_FUEL_UNLIMITED};
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            opts->output = argv[++i];
+        } else if (strcmp(argv[i], "-O0") == 0) {
+            opts->optimize = false;
+        } else if (strcmp(argv[i], "-O1") == 0) {
+            opts->optimize = true;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            opts->use_cache = false;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            opts->jit = true;
+        } else if (strcmp(argv[i], "--vms") == 0 && i + 1 < argc) {
+            opts->vms = atoi(argv[++i]);
+            if (opts->vms < 1) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc) {
+            opts->fuel = strtoll(argv[++i], NULL, 10);
+            if (opts->fuel < 1) {
+                return -1;
+            }
+        } else if (opts->input == NULL) {
+            opts->input = argv[i];
+        } else {
+            return -1;
+        }
+    }
+
+    return opts->input != NULL ? 0 : -1;
+}
+
+/**
+ * Compile a source file, running the optimizer over the result unless disabled.
+ * Files (not stdin) go through the bytecode cache.
+ */
+static int compile_program(struct Options *opts, struct Bytecode *bc) {
+    CacheKey key;
+    bool cached = opts->use_cache && strcmp(opts->input, "-") != 0;
+    if (cached && cache_load(opts->input, opts->optimize ? CACHE_FLAG_OPTIMIZE : 0, &key,
+                             bc) == 0) {
+        return 0;
+    }
+
+    if (compile_file(opts->input, bc) != 0) {
+        return -1;
+    }
+
+    if (opts->optimize && optimize_bytecode(bc) != 0) {
+        bytecode_free(bc);
+        return -1;
+    }
+
+    if (cached && cache_store(&key, bc) != 0) {
+        log_warn("cache: failed to store %s\n", opts->input);
+    }
+
+    return 0;
+}
+
+/* Load a program, compiling it first if it's source */
+static int load_program(struct Options *opts, struct Bytecode *bc) {
+    if (strcmp(opts->input, "-") == 0 || has_suffix(opts->input, ".tr")) {
+        return compile_program(opts, bc);
+    }
+
+    return read_bytecode_file(opts->input, bc);
+}
+
+static int cmd_compile(struct Options *opts) {
+    const char *output = opts->output;
+
+    // Default to the input name with a .bc extension
+    char default_output[4096];
+    if (output == NULL) {
+        if (strcmp(opts->input, "-") == 0) {
+            log_error("compiling stdin needs an output file (-o)\n");
+            return 1;
+        }
+
+        size_t n = strlen(opts->input) - (has_suffix(opts->input, ".tr") ? 3 : 0);
+        snprintf(default_output, sizeof(default_output), "%.*s.bc", (int)n, opts->input);
+        output = default_output;
+    }
+
+    struct Bytecode bc;
+    if (compile_program(opts, &bc) != 0) {
+        return 1;
+    }
+
+    int status = write_bytecode_file(output, &bc);
+    bytecode_free(&bc);
+    return status == 0 ? 0 : 1;
+}
+
+/* One copy of the program run by `taro run --vms` */
+struct Instance {
+    VM vm;
+    Arena *arena;
+    enum VMStatus status;
+};
+
+static void instance_done(VM *vm, enum VMStatus status, void *ctx) {
+    (void)vm;
+    ((struct Instance *)ctx)->status = status;
+}
+
+/**
+ * Run `opts->vms` isolated copies of a program on the scheduler, one worker per
+ * CPU, and print their results in order once they have all finished.
+ */
+static int run_instances(struct Options *opts, struct Bytecode *bc) {
+    // Each VM rewrites its code as it runs, so each loads its own copy
+    uint8_t *image;
+    size_t len;
+    int status = write_bytecode_image(bc, &image, &len);
+    bytecode_free(bc);
+    if (status != 0) {
+        return 1;
+    }
+
+    struct Instance *instances = (struct Instance *)calloc(opts->vms, sizeof(*instances));
+    Scheduler *sched = sched_create(parallel_default_threads(), SCHED_DEFAULT_SLICE);
+    int loaded       = 0;
+    if (instances == NULL || sched == NULL) {
+        log_error("failed to start the scheduler\n");
+        status = 1;
+    }
+
+    for (; status == 0 && loaded < opts->vms; loaded++) {
+        struct Instance *in = &instances[loaded];
+        struct Bytecode copy;
+        if (read_bytecode_image(image, len, &copy) != 0) {
+            status = 1;
+            break;
+        }
+
+        in->arena  = arena_create(1024);
+        in->status = VM_RUNNING;
+        vm_init(&in->vm, VM_DEFAULT_GC_THRESHOLD);
+        in->vm.use_jit = opts->jit;
+        in->vm.fuel    = opts->fuel;
+        vm_load(in->arena, &in->vm, &copy);
+        if (sched_spawn(sched, &in->vm, in->arena, instance_done, in) != 0) {
+            in->status = VM_ERROR;
+            status     = 1;
+        }
+    }
+
+    if (sched != NULL) {
+        sched_destroy(sched);
+    }
+
+    for (int i = 0; i < loaded; i++) {
+        struct Instance *in = &instances[i];
+        Value *result       = vm_result(&in->vm);
+        if (in->status == VM_HALTED && result != NULL) {
+            value_print(result);
+            printf("\n");
+        } else if (in->status == VM_YIELDED) {
+            log_error("VM: out of fuel (ip: %zu)\n", in->vm.ip);
+        }
+        status = in->status == VM_HALTED ? status : 1;
+        vm_cleanup(in->arena, &in->vm);
+    }
+
+    free(instances);
+    free(image);
+    return status;
+}
+
+static int cmd_run(struct Options *opts) {
+    struct Bytecode bc;
+    if (load_program(opts, &bc) != 0) {
+        return 1;
+    }
+
+    if (opts->vms > 0) {
+        return run_instances(opts, &bc);
+    }
+
     VM vm;
     Arena *arena = arena_create(1024);
 
     vm_init(&vm, VM_DEFAULT_GC_THRESHOLD);
+    vm.use_jit = opts->jit;
+    vm.fuel    = opts->fuel;
+    vm_load(arena, &vm, &bc);
 
-    struct Bytecode bc = {0};
-    read_bytecode_file("/home/rem/Documents/Coding/taro/exe.bc", &bc);
-    vm_load(arena, &vm, bc.code, bc.header.code_size);
+    enum VMStatus status = vm_run(arena, &vm);
 
-    while (true) {
-        sleep(1);
-        vm_cycle(arena, &vm);
+    Value *result = vm_result(&vm);
+    if (status == VM_HALTED && result != NULL) {
+        value_print(result);
+        printf("\n");
+    } else if (status == VM_YIELDED) {
+        log_error("VM: out of fuel (ip: %zu)\n", vm.ip);
     }
 
-    sleep(2);
     vm_cleanup(arena, &vm);
+    return status == VM_HALTED ? 0 : 1;
+}
+
+static int cmd_dis(struct Options *opts) {
+    struct Bytecode bc;
+    if (load_program(opts, &bc) != 0) {
+        return 1;
+    }
 
+    bytecode_dump(&bc);
+    bytecode_free(&bc);
     return 0;
 }
+
+/* Translate a program to C, next to the input unless an output is given */
+static int cmd_aot(struct Options *opts) {
+    const char *output = opts->output;
+
+    char default_output[4096];
+    if (output == NULL) {
+        if (strcmp(opts->input, "-") == 0) {
+            log_error("translating stdin needs an output file (-o)\n");
+            return 1;
+        }
+
+        size_t n = strlen(opts->input);
+        n -= has_suffix(opts->input, ".tr") || has_suffix(opts->input, ".bc") ? 3 : 0;
+        snprintf(default_output, sizeof(default_output), "%.*s.c", (int)n, opts->input);
+        output = default_output;
+    }
+
+    struct Bytecode bc;
+    if (load_program(opts, &bc) != 0) {
+        return 1;
+    }
+
+    int status = aot_write_file(output, &bc);
+    bytecode_free(&bc);
+    return status == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    struct Options opts;
+    if (argc < 3 || parse_options(argc - 2, argv + 2, &opts) != 0) {
+        usage();
+        return 1;
+    }
+
+    if (strcmp(argv[1], "compile") == 0) {
+        return cmd_compile(&opts);
+    }
+
+    if (strcmp(argv[1], "run") == 0 && opts.output == NULL) {
+        return cmd_run(&opts);
+    }
+
+    if (strcmp(argv[1], "dis") == 0 && opts.output == NULL) {
+        return cmd_dis(&opts);
+    }
+
+    if (strcmp(argv[1], "aot") == 0) {
+        return cmd_aot(&opts);
+    }
+
+    usage();
+    return 1;
+}
@@ -0,0 +1,375 @@
+/**
+ * Bytecode optimizer.
+ *
+ * Runs over a compiled image in rounds until nothing changes:
+ *
+ *   folding     PUSH a, PUSH b, op becomes PUSH (a op b), and a CMP of two
+ *               constants followed by a conditional jump becomes either an
+ *               unconditional J or nothing. Values pushed only to be popped
+ *               are dropped.
+ *   threading   jumps to a J go straight to its final target, a J to a RET,
+ *               TAILCALL or HALT is replaced by that instruction and jumps to
+ *               the next instruction are dropped.
+ *   compaction  instructions that can't be reached from any function entry,
+ *               and the NOPs left behind by the other passes, are removed and
+ *               every jump target and function entry is renumbered.
+ *
+ * Folding never looks across a jump target, and relies on the compiler only
+ * ever reading the flags of a CMP from the jump right after it.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "optimizer.h"
+#include "util/logger.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Optimizer {
+    VMInstruction *code;
+    size_t count;
+    VMFunction *funcs;
+    int func_count;
+
+    // Scratch, one entry per instruction (plus one for the end of the code)
+    bool *leader;
+    bool *reachable;
+    size_t *remap;
+    size_t *worklist;
+} Optimizer;
+
+/* CHKA branches to its target when its bounds check fails */
+static bool is_jump(enum VMOpcode op) { return (op >= J && op <= JGE) || op == CHKA; }
+
+/* Instructions that leave the running function, none of them fall through */
+static bool ends_function(enum VMOpcode op) {
+    return op == RET || op == TAILCALL || op == HALT;
+}
+
+static bool is_push(enum VMOpcode op) { return op == PUSH_I || op == PUSH_F; }
+
+static int target_of(VMInstruction *ins) { return ins->operands[0].int_value; }
+
+static void make_nop(VMInstruction *ins) {
+    ins->opcode         = NOP;
+    ins->operands_count = 0;
+}
+
+static void make_jump(VMInstruction *ins, int target) {
+    ins->opcode                 = J;
+    ins->operands_count         = 1;
+    ins->operands[0].type       = TY_INT;
+    ins->operands[0].int_value  = target;
+}
+
+/* Mark instructions that control can enter other than by falling through */
+static void find_leaders(Optimizer *o) {
+    memset(o->leader, 0, (o->count + 1) * sizeof(bool));
+
+    for (int i = 0; i < o->func_count; i++) {
+        if (o->funcs[i].entry >= 0 && (size_t)o->funcs[i].entry <= o->count) {
+            o->leader[o->funcs[i].entry] = true;
+        }
+    }
+
+    for (size_t i = 0; i < o->count; i++) {
+        int target = target_of(&o->code[i]);
+        if (is_jump(o->code[i].opcode) && target >= 0 && (size_t)target <= o->count) {
+            o->leader[target] = true;
+        }
+    }
+}
+
+/* True if instructions first..last exist and none of them is a jump target */
+static bool straight_line(Optimizer *o, size_t first, size_t last) {
+    if (last >= o->count) {
+        return false;
+    }
+
+    for (size_t i = first; i <= last; i++) {
+        if (o->leader[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Evaluate a binary operator on two constants, b is the left hand side */
+static bool fold_arith(enum VMOpcode op, VMOperand b, VMOperand a, VMOperand *out) {
+    out->type = b.type;
+
+    // Wrap on overflow like the hardware does, rather than invoke undefined behavior
+    unsigned ub = (unsigned)b.int_value, ua = (unsigned)a.int_value;
+
+    switch (op) {
+    case ADD_I:
+        out->int_value = (int)(ub + ua);
+        return true;
+    case SUB_I:
+        out->int_value = (int)(ub - ua);
+        return true;
+    case MUL_I:
+        out->int_value = (int)(ub * ua);
+        return true;
+    case DIV_I:
+        // Division by zero is left for the VM to report at runtime
+        if (a.int_value == 0 || (b.int_value == INT_MIN && a.int_value == -1)) {
+            return false;
+        }
+        out->int_value = b.int_value / a.int_value;
+        return true;
+    case ADD_F:
+        out->float_value = b.float_value + a.float_value;
+        return true;
+    case SUB_F:
+        out->float_value = b.float_value - a.float_value;
+        return true;
+    case MUL_F:
+        out->float_value = b.float_value * a.float_value;
+        return true;
+    case DIV_F:
+        out->float_value = b.float_value / a.float_value;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Would `jump` be taken after comparing b against a? Mirrors the VM */
+static bool jump_taken(enum VMOpcode jump, double b, double a) {
+    int eq  = b == a;
+    int dif = b < a ? -1 : (b > a ? 1 : 0);
+
+    switch (jump) {
+    case JEQ:
+        return eq == 1;
+    case JNE:
+        return eq == 0;
+    case JLT:
+        return dif == -1;
+    case JGR:
+        return dif == 1;
+    case JLE:
+        return dif != 1;
+    default:
+        return dif != -1;
+    }
+}
+
+static bool arith_matches(enum VMOpcode push, enum VMOpcode op) {
+    return push == PUSH_I ? (op >= ADD_I && op <= DIV_I) : (op >= ADD_F && op <= DIV_F);
+}
+
+static size_t fold(Optimizer *o) {
+    VMInstruction *code = o->code;
+    size_t changed      = 0;
+
+    for (size_t i = 0; i < o->count; i++) {
+        enum VMOpcode op = code[i].opcode;
+
+        // A value pushed and immediately discarded
+        if ((is_push(op) || op == LOADS || op == GETL) && straight_line(o, i + 1, i + 1) &&
+            code[i + 1].opcode == POP) {
+            make_nop(&code[i]);
+            make_nop(&code[i + 1]);
+            changed++;
+            continue;
+        }
+
+        if (!is_push(op) || !straight_line(o, i + 1, i + 2) || code[i + 1].opcode != op) {
+            continue;
+        }
+
+        VMOperand b    = code[i].operands[0];
+        VMOperand a    = code[i + 1].operands[0];
+        enum VMOpcode next = code[i + 2].opcode;
+
+        // The result replaces the operator, so it can feed a fold further along
+        VMOperand result;
+        if (arith_matches(op, next) && fold_arith(next, b, a, &result)) {
+            make_nop(&code[i]);
+            make_nop(&code[i + 1]);
+            code[i + 2].opcode         = op;
+            code[i + 2].operands_count = 1;
+            code[i + 2].operands[0]    = result;
+            changed++;
+            continue;
+        }
+
+        bool cmp = (op == PUSH_I && next == CMP_I) || (op == PUSH_F && next == CMP_F);
+        if (cmp && straight_line(o, i + 3, i + 3) && code[i + 3].opcode >= JEQ &&
+            code[i + 3].opcode <= JGE) {
+            bool taken = op == PUSH_I
+                             ? jump_taken(code[i + 3].opcode, b.int_value, a.int_value)
+                             : jump_taken(code[i + 3].opcode, b.float_value, a.float_value);
+
+            make_nop(&code[i]);
+            make_nop(&code[i + 1]);
+            make_nop(&code[i + 2]);
+            if (taken) {
+                make_jump(&code[i + 3], target_of(&code[i + 3]));
+            } else {
+                make_nop(&code[i + 3]);
+            }
+            changed++;
+        }
+    }
+
+    return changed;
+}
+
+static size_t thread_jumps(Optimizer *o) {
+    VMInstruction *code = o->code;
+    size_t changed      = 0;
+
+    for (size_t i = 0; i < o->count; i++) {
+        if (!is_jump(code[i].opcode)) {
+            continue;
+        }
+
+        // Follow chains of J, bounded so a J-to-itself loop can't hang us
+        int target = target_of(&code[i]);
+        for (size_t hops = 0; hops < o->count; hops++) {
+            if (target < 0 || (size_t)target >= o->count || code[target].opcode != J ||
+                target_of(&code[target]) == target) {
+                break;
+            }
+            target = target_of(&code[target]);
+        }
+
+        if (target != target_of(&code[i])) {
+            code[i].operands[0].int_value = target;
+            changed++;
+        }
+
+        if ((size_t)target == i + 1) {
+            make_nop(&code[i]);
+            changed++;
+        } else if (code[i].opcode == J && target >= 0 && (size_t)target < o->count &&
+                   ends_function(code[target].opcode)) {
+            code[i] = code[target];
+            changed++;
+        }
+    }
+
+    return changed;
+}
+
+static void mark_reachable(Optimizer *o) {
+    size_t top = 0;
+    memset(o->reachable, 0, (o->count + 1) * sizeof(bool));
+
+    for (int i = 0; i < o->func_count; i++) {
+        size_t entry = o->funcs[i].entry;
+        if (entry < o->count && !o->reachable[entry]) {
+            o->reachable[entry] = true;
+            o->worklist[top++]  = entry;
+        }
+    }
+
+    while (top > 0) {
+        size_t i          = o->worklist[--top];
+        enum VMOpcode op  = o->code[i].opcode;
+        size_t next[2]    = {i + 1, 0};
+        int n             = 1;
+
+        if (op == J || ends_function(op)) {
+            n = 0;
+        }
+
+        if (is_jump(op) && target_of(&o->code[i]) >= 0) {
+            next[n++] = target_of(&o->code[i]);
+        }
+
+        for (int k = 0; k < n; k++) {
+            if (next[k] < o->count && !o->reachable[next[k]]) {
+                o->reachable[next[k]] = true;
+                o->worklist[top++]    = next[k];
+            }
+        }
+    }
+}
+
+/* Drop unreachable instructions and NOPs, returns how many were removed */
+static size_t compact(Optimizer *o) {
+    VMInstruction *code = o->code;
+    size_t kept         = 0;
+
+    mark_reachable(o);
+
+    // remap[i] is where instruction i ends up, or where control continues if it's
+    // removed, which is the next instruction that is kept
+    for (size_t i = 0; i < o->count; i++) {
+        o->remap[i] = kept;
+        if (o->reachable[i] && code[i].opcode != NOP) {
+            code[kept++] = code[i];
+        }
+    }
+    o->remap[o->count] = kept;
+
+    size_t removed = o->count - kept;
+    if (removed == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < kept; i++) {
+        int target = target_of(&code[i]);
+        if (is_jump(code[i].opcode) && target >= 0 && (size_t)target <= o->count) {
+            code[i].operands[0].int_value = o->remap[target];
+        }
+    }
+
+    for (int i = 0; i < o->func_count; i++) {
+        if (o->funcs[i].entry >= 0 && (size_t)o->funcs[i].entry <= o->count) {
+            o->funcs[i].entry = o->remap[o->funcs[i].entry];
+        }
+    }
+
+    o->count = kept;
+    return removed;
+}
+
+int optimize_bytecode(struct Bytecode *bc) {
+    Optimizer o = {
+        .code       = bc->code,
+        .count      = bc->header.code_size,
+        .funcs      = bc->funcs,
+        .func_count = bc->header.func_count,
+    };
+
+    size_t n    = o.count + 1;
+    o.leader    = (bool *)malloc(n * sizeof(bool));
+    o.reachable = (bool *)malloc(n * sizeof(bool));
+    o.remap     = (size_t *)malloc(n * sizeof(size_t));
+    o.worklist  = (size_t *)malloc(n * sizeof(size_t));
+
+    int status = 0;
+    if (o.leader == NULL || o.reachable == NULL || o.remap == NULL || o.worklist == NULL) {
+        log_error("optimizer: out of memory\n");
+        status = -1;
+    }
+
+    for (int round = 0; status == 0 && round < OPTIMIZER_MAX_ROUNDS; round++) {
+        find_leaders(&o);
+
+        size_t changed = fold(&o);
+        changed += thread_jumps(&o);
+        changed += compact(&o);
+
+        if (changed == 0) {
+            break;
+        }
+    }
+
+    bc->header.code_size = o.count;
+
+    free(o.leader);
+    free(o.reachable);
+    free(o.remap);
+    free(o.worklist);
+    return status;
+}
@@ -0,0 +1,18 @@
+/**
+ * Bytecode optimizer for Taro.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_OPTIMIZER_H
+#define TARO_OPTIMIZER_H
+
+#include "runtime/bytecode.h"
+
+/** Upper bound on optimizer rounds, each round usually exposes less to do */
+#define OPTIMIZER_MAX_ROUNDS 8
+
+int optimize_bytecode(struct Bytecode *bc);
+
+#endif
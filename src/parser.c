@@ -0,0 +1,563 @@
+/**
+ * Frontend parser for Taro. Statements are parsed by recursive descent and
+ * expressions by precedence climbing (Pratt) over g_prec_table. The result is
+ * a flat AST, see ast.h.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "parser.h"
+#include "util/logger.h"
+
+#include <string.h>
+
+/* Prefix operators bind tighter than any binary operator */
+#define PREC_UNARY 5
+
+/* Binary operators, indexed by token type. Anything missing has precedence 0 */
+static const struct Prec g_prec_table[] = {
+    [TOK_EQEQ]   = {TOK_EQEQ,   1, ASSOC_LEFT},
+    [TOK_BANGEQ] = {TOK_BANGEQ, 1, ASSOC_LEFT},
+    [TOK_LT]     = {TOK_LT,     2, ASSOC_LEFT},
+    [TOK_LTEQ]   = {TOK_LTEQ,   2, ASSOC_LEFT},
+    [TOK_GT]     = {TOK_GT,     2, ASSOC_LEFT},
+    [TOK_GTEQ]   = {TOK_GTEQ,   2, ASSOC_LEFT},
+    [TOK_PLUS]   = {TOK_PLUS,   3, ASSOC_LEFT},
+    [TOK_MINUS]  = {TOK_MINUS,  3, ASSOC_LEFT},
+    [TOK_STAR]   = {TOK_STAR,   4, ASSOC_LEFT},
+    [TOK_SLASH]  = {TOK_SLASH,  4, ASSOC_LEFT},
+};
+
+static NodeRef parse_statement(Parser *p);
+static NodeRef parse_expr(Parser *p, int min_prec);
+
+Parser parser_init(Lexer *l, Ast *ast) {
+    Parser p;
+    p.lexer     = l;
+    p.ast       = ast;
+    p.had_error = false;
+    p.panic     = false;
+
+    p.scratch          = NULL;
+    p.scratch_count    = 0;
+    p.scratch_capacity = 0;
+
+    p.curr      = (struct Token){0};
+    p.curr_text = NULL;
+    p.prev_text = NULL;
+    return p;
+}
+
+void parser_cleanup(Parser *p) {
+    free(p->scratch);
+    p->scratch          = NULL;
+    p->scratch_count    = 0;
+    p->scratch_capacity = 0;
+    p->lexer            = NULL;
+    p->ast              = NULL;
+}
+
+static void error_at(Parser *p, struct Token *t, const char *message) {
+    // Only report the first error until we've resynchronized
+    if (p->panic) {
+        return;
+    }
+
+    p->panic     = true;
+    p->had_error = true;
+
+    if (t->type == TOK_EOF) {
+        log_error("line %d: %s at end of file\n", t->line, message);
+    } else {
+        log_error("line %d: %s near '%.*s'\n", t->line, message, t->length, t->value);
+    }
+}
+
+static void advance(Parser *p) {
+    p->prev      = p->curr;
+    p->prev_text = p->curr_text;
+
+    // Error messages quote prev after the poll below, which can refill a stream
+    int length = p->curr.length < PARSER_LEXEME_MAX ? p->curr.length : PARSER_LEXEME_MAX;
+    if (length > 0) {
+        memcpy(p->prev_lexeme, p->curr.value, length);
+    }
+    p->prev.value  = p->prev_lexeme;
+    p->prev.length = length;
+
+    for (;;) {
+        p->curr = lexer_poll(p->lexer);
+        if (p->curr.type == TOK_COMMENT) {
+            continue;
+        }
+
+        // A bad token counts as the statement's error, so the parser doesn't
+        // report the hole it leaves as a second one
+        if (p->curr.type == TOK_ERR) {
+            if (!p->panic) {
+                log_error("line %d: %.*s\n", p->curr.line, p->curr.length, p->curr.value);
+            }
+            p->panic     = true;
+            p->had_error = true;
+            continue;
+        }
+
+        break;
+    }
+
+    // Intern names now, before the next poll can invalidate the token text
+    p->curr_text = NULL;
+    if (p->curr.type == TOK_IDENTIFIER || p->curr.type == TOK_STRING) {
+        p->curr_text = lexer_intern_token(p->lexer, &p->curr);
+    }
+}
+
+static bool check(Parser *p, enum TokenType type) { return p->curr.type == type; }
+
+static bool match(Parser *p, enum TokenType type) {
+    if (!check(p, type)) {
+        return false;
+    }
+
+    advance(p);
+    return true;
+}
+
+static void expect(Parser *p, enum TokenType type, const char *message) {
+    if (!match(p, type)) {
+        error_at(p, &p->curr, message);
+    }
+}
+
+static void scratch_push(Parser *p, NodeRef n) {
+    if (p->scratch_count == p->scratch_capacity) {
+        size_t cap = p->scratch_capacity ? p->scratch_capacity * 2 : 64;
+        NodeRef *scratch = (NodeRef *)realloc(p->scratch, cap * sizeof(NodeRef));
+        if (scratch == NULL) {
+            // The list would be missing a node, so the parse can't succeed
+            log_error("parser: out of memory\n");
+            p->had_error = true;
+            p->panic     = true;
+            return;
+        }
+
+        p->scratch          = scratch;
+        p->scratch_capacity = cap;
+    }
+
+    p->scratch[p->scratch_count++] = n;
+}
+
+/* Move everything pushed since `mark` into a list in the AST */
+static uint32_t scratch_finish(Parser *p, size_t mark) {
+    uint32_t list = ast_add_list(p->ast, p->scratch + mark, p->scratch_count - mark);
+    p->scratch_count = mark;
+    return list;
+}
+
+static uint32_t expect_name(Parser *p, const char *message) {
+    expect(p, TOK_IDENTIFIER, message);
+    return p->prev.type == TOK_IDENTIFIER ? ast_add_string(p->ast, p->prev_text) : 0;
+}
+
+static enum AstType parse_type(Parser *p) {
+    if (!match(p, TOK_COLON)) {
+        return TYPE_ANY;
+    }
+
+    // Arrays are `[int]` or `[float]`
+    if (match(p, TOK_LBRACKET)) {
+        expect(p, TOK_IDENTIFIER, "expected an element type");
+        bool name   = p->prev.type == TOK_IDENTIFIER;
+        bool ints   = name && strcmp(p->prev_text, "int") == 0;
+        bool floats = name && strcmp(p->prev_text, "float") == 0;
+        if (name && !ints && !floats) {
+            error_at(p, &p->prev, "arrays hold ints or floats");
+        }
+
+        expect(p, TOK_RBRACKET, "expected ']' after element type");
+        return ints ? TYPE_INTS : floats ? TYPE_FLOATS : TYPE_ANY;
+    }
+
+    expect(p, TOK_IDENTIFIER, "expected a type name");
+    if (p->prev.type != TOK_IDENTIFIER) {
+        return TYPE_ANY;
+    }
+
+    if (strcmp(p->prev_text, "int") == 0)
+        return TYPE_INT;
+    if (strcmp(p->prev_text, "float") == 0)
+        return TYPE_FLOAT;
+    if (strcmp(p->prev_text, "string") == 0)
+        return TYPE_STRING;
+    if (strcmp(p->prev_text, "struct") == 0)
+        return TYPE_STRUCT;
+    if (strcmp(p->prev_text, "coroutine") == 0)
+        return TYPE_CORO;
+
+    error_at(p, &p->prev, "unknown type");
+    return TYPE_ANY;
+}
+
+static bool starts_expression(Parser *p) {
+    switch (p->curr.type) {
+    case TOK_INT:
+    case TOK_FLOAT:
+    case TOK_STRING:
+    case TOK_IDENTIFIER:
+    case TOK_LPAREN:
+    case TOK_LBRACE:
+    case TOK_MINUS:
+    case TOK_BANG:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static struct Prec binary_prec(enum TokenType tt) {
+    if (tt < sizeof(g_prec_table) / sizeof(g_prec_table[0])) {
+        return g_prec_table[tt];
+    }
+
+    return (struct Prec){tt, 0, ASSOC_LEFT};
+}
+
+static NodeRef parse_call(Parser *p, uint32_t name, int line) {
+    size_t mark = p->scratch_count;
+
+    if (!check(p, TOK_RPAREN)) {
+        do {
+            scratch_push(p, parse_expr(p, 1));
+        } while (match(p, TOK_COMMA));
+    }
+
+    expect(p, TOK_RPAREN, "expected ')' after arguments");
+    return ast_add(p->ast, NODE_CALL, 0, name, scratch_finish(p, mark), 0, line);
+}
+
+/* Struct constructor, `{ name = value, ... }` */
+static NodeRef parse_struct(Parser *p, int line) {
+    size_t mark = p->scratch_count;
+
+    if (!check(p, TOK_RBRACE)) {
+        do {
+            int field_line = p->curr.line;
+            uint32_t name  = expect_name(p, "expected a field name");
+            expect(p, TOK_EQ, "expected '=' after field name");
+            scratch_push(p, ast_add(p->ast, NODE_ASSIGN, 0, name, parse_expr(p, 1), 0,
+                                    field_line));
+        } while (match(p, TOK_COMMA));
+    }
+
+    expect(p, TOK_RBRACE, "expected '}' after fields");
+    return ast_add(p->ast, NODE_STRUCT, 0, scratch_finish(p, mark), 0, 0, line);
+}
+
+static NodeRef parse_prefix(Parser *p) {
+    int line = p->curr.line;
+
+    if (match(p, TOK_INT)) {
+        return ast_add(p->ast, NODE_INT, 0, (uint32_t)p->prev.int_value, 0, 0, line);
+    }
+
+    if (match(p, TOK_FLOAT)) {
+        uint32_t bits;
+        memcpy(&bits, &p->prev.float_value, sizeof(bits));
+        return ast_add(p->ast, NODE_FLOAT, 0, bits, 0, 0, line);
+    }
+
+    if (match(p, TOK_STRING)) {
+        return ast_add(p->ast, NODE_STRING, 0, ast_add_string(p->ast, p->prev_text), 0, 0,
+                       line);
+    }
+
+    if (match(p, TOK_IDENTIFIER)) {
+        uint32_t name = ast_add_string(p->ast, p->prev_text);
+        if (match(p, TOK_LPAREN)) {
+            return parse_call(p, name, line);
+        }
+
+        return ast_add(p->ast, NODE_IDENT, 0, name, 0, 0, line);
+    }
+
+    if (match(p, TOK_LBRACE)) {
+        return parse_struct(p, line);
+    }
+
+    if (match(p, TOK_LPAREN)) {
+        NodeRef inner = parse_expr(p, 1);
+        expect(p, TOK_RPAREN, "expected ')' after expression");
+        return inner;
+    }
+
+    if (match(p, TOK_MINUS) || match(p, TOK_BANG)) {
+        enum TokenType op = p->prev.type;
+        NodeRef operand   = parse_expr(p, PREC_UNARY);
+        return ast_add(p->ast, NODE_UNARY, op, operand, 0, 0, line);
+    }
+
+    error_at(p, &p->curr, "expected an expression");
+    return AST_NONE;
+}
+
+/* Any number of `.field` and `[index]` accesses to `n` */
+static NodeRef parse_accesses(Parser *p, NodeRef n) {
+    while (check(p, TOK_DOT) || check(p, TOK_LBRACKET)) {
+        int line = p->curr.line;
+        if (match(p, TOK_LBRACKET)) {
+            NodeRef index = parse_expr(p, 1);
+            expect(p, TOK_RBRACKET, "expected ']' after index");
+            n = ast_add(p->ast, NODE_INDEX, 0, n, index, 0, line);
+            continue;
+        }
+
+        advance(p);
+        n = ast_add(p->ast, NODE_FIELD, 0, n, expect_name(p, "expected a field name"), 0,
+                    line);
+    }
+
+    return n;
+}
+
+static NodeRef parse_postfix(Parser *p) { return parse_accesses(p, parse_prefix(p)); }
+
+static NodeRef parse_expr(Parser *p, int min_prec) {
+    NodeRef lhs = parse_postfix(p);
+
+    for (;;) {
+        struct Prec prec = binary_prec(p->curr.type);
+        if (prec.precedence == 0 || prec.precedence < min_prec) {
+            break;
+        }
+
+        int line = p->curr.line;
+        advance(p);
+
+        // Left associative operators don't let an equal precedence rhs nest
+        int next    = prec.assoc == ASSOC_LEFT ? prec.precedence + 1 : prec.precedence;
+        NodeRef rhs = parse_expr(p, next);
+        lhs         = ast_add(p->ast, NODE_BINARY, prec.tt, lhs, rhs, 0, line);
+    }
+
+    return lhs;
+}
+
+static bool at_block_end(Parser *p) {
+    return check(p, TOK_KWEND) || check(p, TOK_KWELSE) || check(p, TOK_EOF);
+}
+
+static bool at_statement_start(Parser *p) {
+    switch (p->curr.type) {
+    case TOK_KWIF:
+    case TOK_KWWHILE:
+    case TOK_KWFOR:
+    case TOK_KWFUNC:
+    case TOK_KWFUNCTION:
+    case TOK_KWLOCAL:
+    case TOK_KWGLOBAL:
+    case TOK_KWSET:
+    case TOK_KWRETURN:
+    case TOK_KWCALL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Skip ahead to something that looks like the start of a statement. Bad
+ * characters in what's skipped belong to the error already reported.
+ */
+static void synchronize(Parser *p) {
+    while (!at_block_end(p) && !at_statement_start(p)) {
+        advance(p);
+    }
+    p->panic = false;
+}
+
+static NodeRef parse_block(Parser *p) {
+    int line    = p->curr.line;
+    size_t mark = p->scratch_count;
+
+    while (!at_block_end(p)) {
+        scratch_push(p, parse_statement(p));
+        if (p->panic) {
+            synchronize(p);
+        }
+    }
+
+    return ast_add(p->ast, NODE_BLOCK, 0, scratch_finish(p, mark), 0, 0, line);
+}
+
+static NodeRef parse_if(Parser *p, int line) {
+    NodeRef cond = parse_expr(p, 1);
+    expect(p, TOK_KWTHEN, "expected 'then' after condition");
+
+    NodeRef then_block = parse_block(p);
+    NodeRef else_block = AST_NONE;
+    if (match(p, TOK_KWELSE)) {
+        else_block = parse_block(p);
+    }
+
+    expect(p, TOK_KWEND, "expected 'end' to close 'if'");
+    return ast_add(p->ast, NODE_IF, 0, cond, then_block, else_block, line);
+}
+
+static NodeRef parse_while(Parser *p, int line) {
+    NodeRef cond = parse_expr(p, 1);
+    expect(p, TOK_KWDO, "expected 'do' after condition");
+
+    NodeRef body = parse_block(p);
+    expect(p, TOK_KWEND, "expected 'end' to close 'while'");
+    return ast_add(p->ast, NODE_WHILE, 0, cond, body, 0, line);
+}
+
+static NodeRef parse_for(Parser *p, int line) {
+    uint32_t name = expect_name(p, "expected a loop counter name");
+    expect(p, TOK_EQ, "expected '=' after loop counter");
+
+    NodeRef range[2];
+    range[0] = parse_expr(p, 1);
+    expect(p, TOK_COMMA, "expected ',' between loop bounds");
+    range[1] = parse_expr(p, 1);
+    expect(p, TOK_KWDO, "expected 'do' after loop bounds");
+
+    NodeRef body = parse_block(p);
+    expect(p, TOK_KWEND, "expected 'end' to close 'for'");
+    return ast_add(p->ast, NODE_FOR, 0, name, ast_add_list(p->ast, range, 2), body, line);
+}
+
+static NodeRef parse_func(Parser *p, int line) {
+    uint32_t name = expect_name(p, "expected a function name");
+    expect(p, TOK_LPAREN, "expected '(' after function name");
+
+    size_t mark = p->scratch_count;
+    if (!check(p, TOK_RPAREN)) {
+        do {
+            int param_line      = p->curr.line;
+            uint32_t param_name = expect_name(p, "expected a parameter name");
+            enum AstType type   = parse_type(p);
+            scratch_push(p, ast_add(p->ast, NODE_PARAM, type, param_name, 0, 0, param_line));
+        } while (match(p, TOK_COMMA));
+    }
+
+    uint32_t params = scratch_finish(p, mark);
+    expect(p, TOK_RPAREN, "expected ')' after parameters");
+
+    enum AstType ret = parse_type(p);
+    NodeRef body     = parse_block(p);
+    expect(p, TOK_KWEND, "expected 'end' to close function");
+    return ast_add(p->ast, NODE_FUNC, ret, name, params, body, line);
+}
+
+/* `local` and `global` declarations share a syntax */
+static NodeRef parse_declaration(Parser *p, enum NodeKind kind, int line) {
+    uint32_t name     = expect_name(p, "expected a variable name");
+    enum AstType type = parse_type(p);
+
+    NodeRef init = AST_NONE;
+    if (match(p, TOK_EQ)) {
+        init = parse_expr(p, 1);
+    }
+
+    return ast_add(p->ast, kind, type, name, init, 0, line);
+}
+
+/* Turn `target = value` into an assignment, if the target can be assigned to */
+static NodeRef parse_assignment(Parser *p, NodeRef target, NodeRef value, int line) {
+    Ast *ast = p->ast;
+
+    if (target != AST_NONE && ast->kind[target] == NODE_IDENT) {
+        return ast_add(ast, NODE_ASSIGN, 0, ast->a[target], value, 0, line);
+    }
+
+    if (target != AST_NONE && ast->kind[target] == NODE_FIELD) {
+        return ast_add(ast, NODE_SETFIELD, 0, ast->a[target], ast->b[target], value, line);
+    }
+
+    if (target != AST_NONE && ast->kind[target] == NODE_INDEX) {
+        return ast_add(ast, NODE_SETINDEX, 0, ast->a[target], ast->b[target], value,
+                       line);
+    }
+
+    error_at(p, &p->prev, "cannot assign to this expression");
+    return AST_NONE;
+}
+
+static NodeRef parse_statement(Parser *p) {
+    int line = p->curr.line;
+
+    if (match(p, TOK_KWIF))
+        return parse_if(p, line);
+    if (match(p, TOK_KWWHILE))
+        return parse_while(p, line);
+    if (match(p, TOK_KWFOR))
+        return parse_for(p, line);
+    if (match(p, TOK_KWFUNC) || match(p, TOK_KWFUNCTION))
+        return parse_func(p, line);
+    if (match(p, TOK_KWLOCAL))
+        return parse_declaration(p, NODE_LOCAL, line);
+    if (match(p, TOK_KWGLOBAL))
+        return parse_declaration(p, NODE_GLOBAL, line);
+
+    if (match(p, TOK_KWSET)) {
+        // VM docs spell this `set x 123`, the '=' is optional
+        if (!check(p, TOK_IDENTIFIER)) {
+            error_at(p, &p->curr, "expected a name after 'set'");
+            return AST_NONE;
+        }
+
+        // The target is a name with accesses but never a call, so in `set x (y)`
+        // the parenthesised value isn't taken as x's arguments
+        uint32_t name  = expect_name(p, "expected a name after 'set'");
+        NodeRef target = ast_add(p->ast, NODE_IDENT, 0, name, 0, 0, line);
+        target         = parse_accesses(p, target);
+        match(p, TOK_EQ);
+        return parse_assignment(p, target, parse_expr(p, 1), line);
+    }
+
+    if (match(p, TOK_KWRETURN)) {
+        NodeRef value = starts_expression(p) ? parse_expr(p, 1) : AST_NONE;
+        return ast_add(p->ast, NODE_RETURN, 0, value, 0, 0, line);
+    }
+
+    if (match(p, TOK_KWCALL)) {
+        uint32_t name = expect_name(p, "expected a function name after 'call'");
+        expect(p, TOK_LPAREN, "expected '(' after function name");
+        return parse_call(p, name, line);
+    }
+
+    NodeRef expr = parse_expr(p, 1);
+
+    // `name = value` parses as an expression followed by '='
+    if (match(p, TOK_EQ)) {
+        return parse_assignment(p, expr, parse_expr(p, 1), line);
+    }
+
+    return expr;
+}
+
+NodeRef parser_parse(Parser *p) {
+    advance(p);
+
+    int line    = p->curr.line;
+    size_t mark = p->scratch_count;
+
+    while (!check(p, TOK_EOF)) {
+        if (check(p, TOK_KWEND) || check(p, TOK_KWELSE)) {
+            error_at(p, &p->curr, "unexpected token");
+            advance(p);
+        } else {
+            scratch_push(p, parse_statement(p));
+        }
+
+        if (p->panic) {
+            synchronize(p);
+        }
+    }
+
+    NodeRef program = ast_add(p->ast, NODE_BLOCK, 0, scratch_finish(p, mark), 0, 0, line);
+    return p->had_error ? AST_NONE : program;
+}
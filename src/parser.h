@@ -8,6 +8,7 @@
 #ifndef TARO_PARSER_H
 #define TARO_PARSER_H
 
+#include "ast.h"
 #include "lexer.h"
 
 enum AssocDirection {
@@ -21,12 +22,31 @@ struct Prec {
     enum AssocDirection assoc;
 };
 
+/* How much of the previous token's text is kept for error messages */
+#define PARSER_LEXEME_MAX 64
+
 typedef struct {
     Lexer *lexer;
-    Token curr;
+    struct Token curr, prev;
+
+    // Interned text of curr/prev, token views don't survive a streaming refill
+    const char *curr_text, *prev_text;
+
+    // prev's view points here, polling curr may have moved the lexer's copy
+    char prev_lexeme[PARSER_LEXEME_MAX];
+
+    // Tree being built, and a stack of children for lists still being parsed
+    Ast *ast;
+    NodeRef *scratch;
+    size_t scratch_count, scratch_capacity;
+
+    bool had_error;
+    bool panic;
 } Parser;
 
-Parser parser_init(Lexer *l);
+Parser parser_init(Lexer *l, Ast *ast);
 void parser_cleanup(Parser *p);
 
+NodeRef parser_parse(Parser *p);
+
 #endif
@@ -0,0 +1,333 @@
+/**
+ * Asynchronous I/O on io_uring, or epoll where that isn't available.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "aio.h"
+
+#include "../util/logger.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void aio_perform(AioRequest *req) {
+    ssize_t n;
+    do {
+        n = req->op == AIO_READ ? read(req->fd, req->buf, req->len)
+                                : write(req->fd, req->buf, req->len);
+    } while (n < 0 && errno == EINTR);
+
+    req->result = n < 0 ? -errno : n;
+}
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Readiness events the epoll backend takes at once */
+#define AIO_EPOLL_EVENTS 64
+
+/**
+ * Queues shared with the kernel. We own the submission tail and the completion
+ * head, the kernel the other two, and each side publishes its index with a
+ * release store after writing the entries it covers.
+ */
+typedef struct Ring {
+    int fd;
+    unsigned entries;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_size, cq_size, sqes_size;
+} Ring;
+
+struct Aio {
+    bool uring;
+    Ring ring;
+
+    // epoll backend, `ready` holds requests done without waiting
+    int epfd;
+    AioRequest *ready;
+    size_t watched;
+
+    size_t pending;
+};
+
+static inline unsigned load_acquire(unsigned *p) {
+    return atomic_load_explicit((_Atomic unsigned *)p, memory_order_acquire);
+}
+
+static inline void store_release(unsigned *p, unsigned value) {
+    atomic_store_explicit((_Atomic unsigned *)p, value, memory_order_release);
+}
+
+static void ring_unmap(Ring *r) {
+    if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_map != NULL && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_size);
+    }
+    if (r->sq_map != NULL && r->sq_map != MAP_FAILED) {
+        munmap(r->sq_map, r->sq_size);
+    }
+    close(r->fd);
+}
+
+static bool ring_setup(Ring *r, unsigned entries) {
+    struct io_uring_params p = {0};
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return false;
+    }
+
+    // Idle workers wait for completions with a timeout, which needs EXT_ARG (5.11)
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(r->fd);
+        return false;
+    }
+
+    r->entries   = p.sq_entries;
+    r->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both queues with one call
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && r->cq_size > r->sq_size) {
+        r->sq_size = r->cq_size;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    r->cq_map = single ? r->sq_map
+                       : mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes   = (struct io_uring_sqe *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, r->fd,
+                                            IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+        ring_unmap(r);
+        return false;
+    }
+
+    char *sq    = (char *)r->sq_map;
+    char *cq    = (char *)r->cq_map;
+    r->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+static bool ring_submit(Ring *r, AioRequest *req) {
+    unsigned tail = *r->sq_tail;
+    if (tail - load_acquire(r->sq_head) == r->entries) {
+        return false;
+    }
+
+    // An offset of -1 reads or writes at the file position, as read(2) does
+    unsigned index           = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = req->op == AIO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd        = req->fd;
+    sqe->addr      = (uintptr_t)req->buf;
+    sqe->len       = req->len;
+    sqe->off       = (uint64_t)-1;
+    sqe->user_data = (uintptr_t)req;
+
+    r->sq_array[index] = index;
+    store_release(r->sq_tail, tail + 1);
+    return true;
+}
+
+/**
+ * Hand the requests queued since the last call to the kernel and, if `wait` is
+ * set, wait up to `timeout_ms` (forever if negative) for one to finish.
+ */
+static void ring_enter(Ring *r, bool wait, int timeout_ms) {
+    struct __kernel_timespec ts = {
+        .tv_sec  = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L,
+    };
+    struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&ts};
+
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    if (wait && timeout_ms >= 0) {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    // The kernel takes what it can of the queue, the rest goes with the next call
+    unsigned queued = *r->sq_tail - load_acquire(r->sq_head);
+    int n = (int)syscall(__NR_io_uring_enter, r->fd, queued, wait ? 1 : 0, flags,
+                         (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                         (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+    if (n < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        log_error("aio: io_uring_enter failed (%s)\n", strerror(errno));
+    }
+}
+
+static size_t ring_reap(Aio *aio, AioRequest **done, size_t max, int timeout_ms) {
+    Ring *r     = &aio->ring;
+    bool queued = *r->sq_tail != load_acquire(r->sq_head);
+    bool wait   = timeout_ms != 0 && aio->pending > 0 &&
+                  *r->cq_head == load_acquire(r->cq_tail);
+
+    if (queued || wait) {
+        ring_enter(r, wait, timeout_ms);
+    }
+
+    size_t count  = 0;
+    unsigned head = *r->cq_head;
+    unsigned tail = load_acquire(r->cq_tail);
+    for (; head != tail && count < max; head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        AioRequest *req          = (AioRequest *)(uintptr_t)cqe->user_data;
+        req->result              = cqe->res;
+        done[count++]            = req;
+    }
+    store_release(r->cq_head, head);
+    return count;
+}
+
+static bool poll_submit(Aio *aio, AioRequest *req) {
+    struct epoll_event event = {
+        .events   = req->op == AIO_READ ? EPOLLIN : EPOLLOUT,
+        .data.ptr = req,
+    };
+    if (epoll_ctl(aio->epfd, EPOLL_CTL_ADD, req->fd, &event) == 0) {
+        aio->watched++;
+        return true;
+    }
+
+    // Another request waits on it already, which is left to a blocking call
+    if (errno == EEXIST) {
+        return false;
+    }
+
+    // Regular files are always ready, and a bad descriptor fails the same either way
+    aio_perform(req);
+    req->next  = aio->ready;
+    aio->ready = req;
+    return true;
+}
+
+static size_t poll_reap(Aio *aio, AioRequest **done, size_t max, int timeout_ms) {
+    size_t count = 0;
+    while (aio->ready != NULL && count < max) {
+        done[count++] = aio->ready;
+        aio->ready    = aio->ready->next;
+    }
+
+    if (aio->watched == 0 || count == max) {
+        return count;
+    }
+
+    struct epoll_event events[AIO_EPOLL_EVENTS];
+    size_t room = max - count < AIO_EPOLL_EVENTS ? max - count : AIO_EPOLL_EVENTS;
+    int n       = epoll_wait(aio->epfd, events, (int)room, count > 0 ? 0 : timeout_ms);
+    for (int i = 0; i < n; i++) {
+        AioRequest *req = (AioRequest *)events[i].data.ptr;
+        epoll_ctl(aio->epfd, EPOLL_CTL_DEL, req->fd, NULL);
+        aio->watched--;
+
+        // Ready, so this doesn't block (a hang up or error is reported by the call)
+        aio_perform(req);
+        done[count++] = req;
+    }
+
+    return count;
+}
+
+Aio *aio_create(unsigned entries) {
+    Aio *aio = (Aio *)calloc(1, sizeof(Aio));
+    if (aio == NULL) {
+        log_error("aio: out of memory\n");
+        return NULL;
+    }
+
+    aio->epfd  = -1;
+    aio->uring = ring_setup(&aio->ring, entries);
+    if (!aio->uring) {
+        aio->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (aio->epfd < 0) {
+            log_error("aio: neither io_uring nor epoll is available\n");
+            free(aio);
+            return NULL;
+        }
+    }
+
+    return aio;
+}
+
+void aio_destroy(Aio *aio) {
+    if (aio == NULL) {
+        return;
+    }
+
+    if (aio->uring) {
+        ring_unmap(&aio->ring);
+    } else {
+        close(aio->epfd);
+    }
+    free(aio);
+}
+
+const char *aio_backend(Aio *aio) { return aio->uring ? "io_uring" : "epoll"; }
+
+bool aio_submit(Aio *aio, AioRequest *req) {
+    // Never more in flight than completions fit in the ring
+    if (aio->pending >= (aio->uring ? aio->ring.entries : AIO_DEFAULT_ENTRIES)) {
+        return false;
+    }
+
+    bool queued = aio->uring ? ring_submit(&aio->ring, req) : poll_submit(aio, req);
+    aio->pending += queued;
+    return queued;
+}
+
+size_t aio_pending(Aio *aio) { return aio->pending; }
+
+size_t aio_reap(Aio *aio, AioRequest **done, size_t max, int timeout_ms) {
+    size_t count = aio->uring ? ring_reap(aio, done, max, timeout_ms)
+                              : poll_reap(aio, done, max, timeout_ms);
+    aio->pending -= count;
+    return count;
+}
+
+#else
+
+Aio *aio_create(unsigned entries) {
+    log_warn("aio: only supported on Linux, doing blocking I/O\n");
+    return NULL;
+}
+
+void aio_destroy(Aio *aio) {}
+
+const char *aio_backend(Aio *aio) { return "none"; }
+
+bool aio_submit(Aio *aio, AioRequest *req) { return false; }
+
+size_t aio_pending(Aio *aio) { return 0; }
+
+size_t aio_reap(Aio *aio, AioRequest **done, size_t max, int timeout_ms) { return 0; }
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * Asynchronous reads and writes for VMs that share a worker thread.
+ *
+ * Requests go on an io_uring submission queue, made with the raw system calls,
+ * and are handed to the kernel together the next time completions are reaped,
+ * so a scheduler tick costs one system call however many VMs started I/O in
+ * it. Where io_uring isn't available (or can't wait with a timeout) readiness
+ * is watched with epoll instead and the read or write is done once the file
+ * descriptor is ready; regular files, which epoll can't watch, are read and
+ * written right away.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_RUNTIME_AIO_H
+#define TARO_RUNTIME_AIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Entries of a ring, the most requests it has in flight at once */
+#define AIO_DEFAULT_ENTRIES 256
+
+enum AioOp {
+    AIO_READ,
+    AIO_WRITE,
+};
+
+typedef struct AioRequest {
+    enum AioOp op;
+    int fd;
+    char *buf;
+    size_t len;
+    long result; // bytes transferred, or -errno
+
+    void *data; // for whoever waits on it
+    struct AioRequest *next;
+} AioRequest;
+
+typedef struct Aio Aio;
+
+/* Ring with room for `entries` requests, NULL if neither backend works here */
+Aio *aio_create(unsigned entries);
+void aio_destroy(Aio *aio);
+
+/* "io_uring" or "epoll" */
+const char *aio_backend(Aio *aio);
+
+/* Queue a request, false if there is no room for it */
+bool aio_submit(Aio *aio, AioRequest *req);
+
+/* Requests submitted and not reaped yet */
+size_t aio_pending(Aio *aio);
+
+/**
+ * Submit what was queued and collect up to `max` finished requests into `done`,
+ * waiting up to `timeout_ms` for the first one if none has finished yet.
+ */
+size_t aio_reap(Aio *aio, AioRequest **done, size_t max, int timeout_ms);
+
+/* Do a request with a plain blocking read or write */
+void aio_perform(AioRequest *req);
+
+#endif
@@ -0,0 +1,407 @@
+/**
+ * Builtin functions. The bulk array operations hand whole arrays to the
+ * vector kernels instead of looping in bytecode, and reads and writes go to the
+ * VM's ring when it has one.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "builtins.h"
+
+#include "gc.h"
+#include "kernels.h"
+#include "object.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+const Builtin g_builtins[BUILTIN_COUNT] = {
+    [BUILTIN_INTS]       = {"ints",       1, {BT_INT},            BT_INTS,   NEWA,  0},
+    [BUILTIN_FLOATS]     = {"floats",     1, {BT_INT},            BT_FLOATS, NEWA,  1},
+    [BUILTIN_SUM]        = {"sum",        1, {BT_ARRAY},          BT_ELEM,   CALLB},
+    [BUILTIN_ADD]        = {"add",        2, {BT_ARRAY, BT_ELEM}, BT_SAME,   CALLB},
+    [BUILTIN_SCALE]      = {"scale",      2, {BT_ARRAY, BT_ELEM}, BT_SAME,   CALLB},
+    [BUILTIN_DOT]        = {"dot",        2, {BT_ARRAY, BT_SAME}, BT_ELEM,   CALLB},
+    [BUILTIN_MIN]        = {"min",        1, {BT_ARRAY},          BT_ELEM,   CALLB},
+    [BUILTIN_MAX]        = {"max",        1, {BT_ARRAY},          BT_ELEM,   CALLB},
+    [BUILTIN_LT]         = {"lt",         2, {BT_ARRAY, BT_ELEM}, BT_INTS,   CALLB},
+    [BUILTIN_GT]         = {"gt",         2, {BT_ARRAY, BT_ELEM}, BT_INTS,   CALLB},
+    [BUILTIN_EQ]         = {"eq",         2, {BT_ARRAY, BT_ELEM}, BT_INTS,   CALLB},
+    [BUILTIN_PUSH]       = {"push",       2, {BT_ARRAY, BT_ELEM}, BT_SAME,   PUSHA},
+    [BUILTIN_POP]        = {"pop",        1, {BT_ARRAY},          BT_ELEM,   POPA},
+    [BUILTIN_LEN]        = {"len",        1, {BT_SIZED},          BT_INT,    LENA},
+    [BUILTIN_CORO]       = {"coroutine",  1, {BT_INT},            BT_CORO,   CORO},
+    [BUILTIN_RESUME]     = {"resume",     2, {BT_CORO, BT_INT},   BT_INT,    RESUME},
+    [BUILTIN_YIELD]      = {"yield",      1, {BT_INT},            BT_INT,    YIELD},
+    [BUILTIN_DONE]       = {"done",       1, {BT_CORO},           BT_INT,    CALLB},
+    [BUILTIN_OPEN]       = {"open",       2, {BT_STRING, BT_INT}, BT_INT,    CALLB},
+    [BUILTIN_CLOSE]      = {"close",      1, {BT_INT},            BT_INT,    CALLB},
+    [BUILTIN_READ]       = {"read",       2, {BT_INT, BT_INT},    BT_STRING, CALLB},
+    [BUILTIN_WRITE]      = {"write",      2, {BT_INT, BT_STRING}, BT_INT,    CALLB},
+    [BUILTIN_SOCKETPAIR] = {"socketpair", 0, {0},                 BT_INTS,   CALLB},
+};
+
+int builtin_find(const char *name) {
+    for (int i = 0; i < BUILTIN_COUNT; i++) {
+        if (strcmp(g_builtins[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static ArrayObj *as_array(VM *vm, Value *value) {
+    if (value->type != TY_INTARRAY && value->type != TY_FLOATARRAY) {
+        vm_error(vm, "builtin expects an array");
+        return NULL;
+    }
+
+    return (ArrayObj *)value->data.object;
+}
+
+/* Allocate an array, collecting first. The arguments are still on the stack */
+static ArrayObj *alloc_array(VM *vm, enum RuntimeValueType type, int count) {
+    gc_maybe_collect(vm);
+    ArrayObj *a = array_new(&vm->mem, type, count);
+    if (a == NULL || a->ints == NULL) {
+        vm->status = VM_ERROR;
+        return NULL;
+    }
+
+    return a;
+}
+
+/**
+ * Give descriptor `fd` a handle in the VM's table, reusing a closed slot. The
+ * descriptor is closed if the table can't grow.
+ */
+static int add_handle(VM *vm, int fd) {
+    int handle = 0;
+    while (handle < vm->handle_count && vm->handles[handle] >= 0) {
+        handle++;
+    }
+
+    if (handle == vm->handle_capacity) {
+        int capacity = vm->handle_capacity ? vm->handle_capacity * 2 : 8;
+        int *handles = (int *)realloc(vm->handles, capacity * sizeof(int));
+        if (handles == NULL) {
+            log_error("VM: out of memory for a handle\n");
+            close(fd);
+            return -1;
+        }
+
+        vm->handles         = handles;
+        vm->handle_capacity = capacity;
+    }
+
+    if (handle == vm->handle_count) {
+        vm->handle_count++;
+    }
+    vm->handles[handle] = fd;
+    return handle;
+}
+
+/* Descriptor behind one of the VM's handles, -1 if it isn't open */
+static int handle_fd(VM *vm, int handle) {
+    return handle >= 0 && handle < vm->handle_count ? vm->handles[handle] : -1;
+}
+
+/* Result of the read or write in `vm->io`, which frees its buffer */
+static bool io_result(VM *vm, Value *result) {
+    AioRequest *io = &vm->io;
+    bool ok        = io->result >= 0;
+    if (!ok) {
+        char message[128];
+        snprintf(message, sizeof(message), "%s failed: %s",
+                 io->op == AIO_READ ? "read" : "write", strerror((int)-io->result));
+        vm_error(vm, message);
+    } else if (io->op == AIO_READ) {
+        gc_maybe_collect(vm);
+        ok = string_new(&vm->mem, io->buf, (int)io->result, result);
+        if (!ok) {
+            vm->status = VM_ERROR;
+        }
+    } else {
+        *result = new_int((int)io->result);
+    }
+
+    free(io->buf);
+    io->buf = NULL;
+    return ok;
+}
+
+/**
+ * Read or write through the VM's ring, stopping it as VM_WAITING with a
+ * placeholder result until builtin_io_complete fills in the real one, or right
+ * away if there's no ring or it is full.
+ */
+static bool start_io(VM *vm, int id, Value *args, Value *result) {
+    AioRequest *io = &vm->io;
+    int fd         = handle_fd(vm, args[0].data.int_value);
+
+    if (fd < 0) {
+        vm_error(vm, id == BUILTIN_READ ? "read from a handle that isn't open"
+                                        : "write to a handle that isn't open");
+        return false;
+    }
+
+    if (id == BUILTIN_READ) {
+        if (args[1].data.int_value < 0) {
+            vm_error(vm, "read size must be a non-negative int");
+            return false;
+        }
+        io->op  = AIO_READ;
+        io->len = (size_t)args[1].data.int_value;
+        io->buf = (char *)malloc(io->len > 0 ? io->len : 1);
+    } else {
+        // Copied, the string may be collected or moved while the write waits
+        const char *chars = string_chars(&args[1]);
+        if (chars == NULL) {
+            vm->status = VM_ERROR;
+            return false;
+        }
+
+        io->op  = AIO_WRITE;
+        io->len = (size_t)string_length(&args[1]);
+        io->buf = (char *)malloc(io->len > 0 ? io->len : 1);
+        if (io->buf != NULL) {
+            memcpy(io->buf, chars, io->len);
+        }
+    }
+
+    if (io->buf == NULL) {
+        log_error("VM: out of memory for an I/O buffer\n");
+        vm->status = VM_ERROR;
+        return false;
+    }
+
+    // The kernel only touches `buf`, so the GC is free to run while it waits
+    io->fd     = fd;
+    io->result = 0;
+    if (vm->aio != NULL && aio_submit(vm->aio, io)) {
+        vm->status = VM_WAITING;
+        *result    = new_int(0);
+        return true;
+    }
+
+    aio_perform(io);
+    return io_result(vm, result);
+}
+
+static bool run_io(VM *vm, int id, Value *args, Value *result) {
+    const Builtin *b = &g_builtins[id];
+    for (int i = 0; i < b->nargs; i++) {
+        if (b->args[i] == BT_INT ? args[i].type != TY_INT : !is_string(args[i])) {
+            vm_error(vm, "builtin argument of the wrong type");
+            return false;
+        }
+    }
+
+    switch (id) {
+    case BUILTIN_OPEN: {
+        static const int flags[] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC,
+                                    O_WRONLY | O_CREAT | O_APPEND};
+        int mode                 = args[1].data.int_value;
+        const char *path         = string_chars(&args[0]);
+        if (mode < 0 || mode > 2) {
+            vm_error(vm, "open mode must be 0 (read), 1 (write) or 2 (append)");
+            return false;
+        } else if (path == NULL) {
+            vm->status = VM_ERROR;
+            return false;
+        }
+
+        int fd  = open(path, flags[mode] | O_CLOEXEC, 0644);
+        *result = new_int(fd < 0 ? -1 : add_handle(vm, fd));
+        return true;
+    }
+    case BUILTIN_CLOSE: {
+        int fd = handle_fd(vm, args[0].data.int_value);
+        if (fd >= 0) {
+            vm->handles[args[0].data.int_value] = -1;
+        }
+        *result = new_int(fd < 0 ? -1 : close(fd));
+        return true;
+    }
+    case BUILTIN_SOCKETPAIR: {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+            char message[128];
+            snprintf(message, sizeof(message), "socketpair failed: %s", strerror(errno));
+            vm_error(vm, message);
+            return false;
+        }
+
+        ArrayObj *pair = alloc_array(vm, TY_INTARRAY, 2);
+        if (pair == NULL) {
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+
+        // If only the first gets a handle it stays in the table until cleanup
+        int first = add_handle(vm, fds[0]);
+        if (first < 0) {
+            close(fds[1]);
+        }
+        int second = first < 0 ? -1 : add_handle(vm, fds[1]);
+        if (second < 0) {
+            vm->status = VM_ERROR;
+            return false;
+        }
+
+        pair->ints[0] = first;
+        pair->ints[1] = second;
+        *result       = new_object(TY_INTARRAY, pair);
+        return true;
+    }
+    default:
+        return start_io(vm, id, args, result);
+    }
+}
+
+static bool run_builtin(VM *vm, int id, Value *args, Value *result) {
+    if (id == BUILTIN_INTS || id == BUILTIN_FLOATS) {
+        if (args[0].type != TY_INT || args[0].data.int_value < 0) {
+            vm_error(vm, "array size must be a non-negative int");
+            return false;
+        }
+
+        enum RuntimeValueType type = id == BUILTIN_INTS ? TY_INTARRAY : TY_FLOATARRAY;
+        ArrayObj *a                = alloc_array(vm, type, args[0].data.int_value);
+        *result                    = new_object(type, a);
+        return a != NULL;
+    }
+
+    if (id >= BUILTIN_OPEN) {
+        return run_io(vm, id, args, result);
+    }
+
+    if (id == BUILTIN_DONE) {
+        if (args[0].type != TY_COROUTINE) {
+            vm_error(vm, "done expects a coroutine");
+            return false;
+        }
+
+        *result = new_int(((CoroObj *)args[0].data.object)->state == CORO_DEAD);
+        return true;
+    }
+
+    ArrayObj *a = as_array(vm, &args[0]);
+    if (a == NULL) {
+        return false;
+    }
+
+    // The second argument is an element or an array of the same type
+    bool f      = a->obj.type == TY_FLOATARRAY;
+    size_t n    = a->count;
+    Value *x    = &args[1];
+    bool scalar = g_builtins[id].nargs == 2 && g_builtins[id].args[1] == BT_ELEM;
+    if (scalar && x->type != (f ? TY_FLOAT : TY_INT)) {
+        vm_error(vm, "builtin argument doesn't match the array's element type");
+        return false;
+    }
+
+    switch (id) {
+    case BUILTIN_SUM:
+        *result = f ? new_float(kernel_sum_f32(a->floats, n))
+                    : new_int(kernel_sum_i32(a->ints, n));
+        return true;
+    case BUILTIN_ADD:
+        f ? kernel_add_f32(a->floats, n, x->data.float_value)
+          : kernel_add_i32(a->ints, n, x->data.int_value);
+        *result = args[0];
+        return true;
+    case BUILTIN_SCALE:
+        f ? kernel_scale_f32(a->floats, n, x->data.float_value)
+          : kernel_scale_i32(a->ints, n, x->data.int_value);
+        *result = args[0];
+        return true;
+    case BUILTIN_DOT: {
+        if (x->type != a->obj.type || ((ArrayObj *)x->data.object)->count != a->count) {
+            vm_error(vm, "dot needs two arrays of the same type and length");
+            return false;
+        }
+
+        ArrayObj *b = (ArrayObj *)x->data.object;
+        *result     = f ? new_float(kernel_dot_f32(a->floats, b->floats, n))
+                        : new_int(kernel_dot_i32(a->ints, b->ints, n));
+        return true;
+    }
+    case BUILTIN_MIN:
+    case BUILTIN_MAX:
+        if (n == 0) {
+            vm_error(vm, "min or max of an empty array");
+            return false;
+        }
+
+        if (id == BUILTIN_MIN) {
+            *result = f ? new_float(kernel_min_f32(a->floats, n))
+                        : new_int(kernel_min_i32(a->ints, n));
+        } else {
+            *result = f ? new_float(kernel_max_f32(a->floats, n))
+                        : new_int(kernel_max_i32(a->ints, n));
+        }
+        return true;
+    case BUILTIN_LT:
+    case BUILTIN_GT:
+    case BUILTIN_EQ: {
+        enum KernelCmp op = id == BUILTIN_LT   ? KERNEL_LT
+                            : id == BUILTIN_GT ? KERNEL_GT
+                                               : KERNEL_EQ;
+        ArrayObj *mask    = alloc_array(vm, TY_INTARRAY, n);
+        if (mask == NULL) {
+            return false;
+        }
+
+        f ? kernel_mask_f32(a->floats, n, x->data.float_value, op, mask->ints)
+          : kernel_mask_i32(a->ints, n, x->data.int_value, op, mask->ints);
+        *result = new_object(TY_INTARRAY, mask);
+        return true;
+    }
+    default:
+        // Including the builtins that have instructions of their own
+        vm_error(vm, "call to an unknown builtin");
+        return false;
+    }
+}
+
+void builtin_call(VM *vm, int id) {
+    VMMem *mem = &vm->mem;
+    if (id < 0 || id >= BUILTIN_COUNT) {
+        vm_error(vm, "call to an unknown builtin");
+        return;
+    }
+
+    int nargs = g_builtins[id].nargs;
+    if (mem->sp < (size_t)nargs) {
+        vm_error(vm, "stack underflow in builtin call");
+        return;
+    }
+
+    // Arguments stay on the stack, and so stay GC roots, until the result is ready
+    Value result;
+    if (!run_builtin(vm, id, &mem->stack[mem->sp - nargs], &result)) {
+        return;
+    }
+
+    mem->sp -= nargs;
+    if (!stack_push(mem, &result)) {
+        vm_error(vm, "stack overflow");
+    }
+}
+
+void builtin_io_complete(VM *vm) {
+    Value result;
+    if (io_result(vm, &result)) {
+        vm->mem.stack[vm->mem.sp - 1] = result;
+        vm->status                    = VM_RUNNING;
+    }
+}
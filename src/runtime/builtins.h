@@ -0,0 +1,79 @@
+/**
+ * Builtin functions, called by number with the `callb` instruction.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_RUNTIME_BUILTINS_H
+#define TARO_RUNTIME_BUILTINS_H
+
+#include "vm.h"
+
+/** Builtin numbers are part of the bytecode format, only ever append */
+enum BuiltinId {
+    BUILTIN_INTS,       // ints(n): [int] of n zeros
+    BUILTIN_FLOATS,     // floats(n): [float] of n zeros
+    BUILTIN_SUM,        // sum(a)
+    BUILTIN_ADD,        // add(a, x): a[i] += x in place, returns a
+    BUILTIN_SCALE,      // scale(a, k): a[i] *= k in place, returns a
+    BUILTIN_DOT,        // dot(a, b): sum of a[i] * b[i], same length
+    BUILTIN_MIN,        // min(a)
+    BUILTIN_MAX,        // max(a)
+    BUILTIN_LT,         // lt(a, x): [int] with 1 where a[i] < x, else 0
+    BUILTIN_GT,         // gt(a, x)
+    BUILTIN_EQ,         // eq(a, x)
+    BUILTIN_PUSH,       // push(a, x): append x, returns a
+    BUILTIN_POP,        // pop(a): remove and return the last element
+    BUILTIN_LEN,        // len(a), also the length of a string
+    BUILTIN_CORO,       // coroutine(f, args...): f(args...) suspended before it starts
+    BUILTIN_RESUME,     // resume(co, x): run co until it yields or returns, giving that
+    BUILTIN_YIELD,      // yield(x): suspend the running coroutine, resume returns x
+    BUILTIN_DONE,       // done(co): 1 once co's function has returned, else 0
+    BUILTIN_OPEN,       // open(path, mode): handle to read (0), write (1) or append (2)
+    BUILTIN_CLOSE,      // close(h): 0, or -1 on failure
+    BUILTIN_READ,       // read(h, n): string of up to n bytes, empty at the end
+    BUILTIN_WRITE,      // write(h, s): number of bytes written
+    BUILTIN_SOCKETPAIR, // socketpair(): [int] with handles to two connected sockets
+    BUILTIN_COUNT
+};
+
+/** How the compiler types the arguments and result of a builtin */
+enum BuiltinType {
+    BT_INT,    // int
+    BT_INTS,   // [int]
+    BT_FLOATS, // [float]
+    BT_ARRAY,  // [int] or [float], the element type the others refer to
+    BT_ELEM,   // a scalar of the element type
+    BT_SAME,   // an array of the same type
+    BT_SIZED,  // an array or a string
+    BT_CORO,   // coroutine
+    BT_STRING, // string
+};
+
+/**
+ * Most builtins compile to `callb <id>`. The array primitives and coroutine
+ * switches have instructions of their own with the same stack effect: `op` is
+ * that instruction and `operand` its operand, `op` is CALLB for the rest.
+ * `coroutine` is compiled specially, its first argument names a function.
+ */
+typedef struct Builtin {
+    const char *name;
+    int nargs;
+    enum BuiltinType args[2], ret;
+    enum VMOpcode op;
+    int operand;
+} Builtin;
+
+extern const Builtin g_builtins[BUILTIN_COUNT];
+
+/* Number of builtin `name`, or -1 */
+int builtin_find(const char *name);
+
+/* Run builtin `id` on the arguments on top of the stack, replacing them with the result */
+void builtin_call(VM *vm, int id);
+
+/* Put the result of the read or write a VM waited on in place, and let it run on */
+void builtin_io_complete(VM *vm);
+
+#endif
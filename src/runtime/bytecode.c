@@ -8,16 +8,104 @@
 #include "bytecode.h"
 #include "../util/common.h"
 #include "../util/logger.h"
+#include "builtins.h"
 #include "value.h"
 #include "vm.h"
 
-// static int serialize_operand(VMOperand operand, uint8_t *buffer);
+#include <stdio.h>
+
+/* Mnemonics, in opcode order (see _instructions.txt) */
+static const char *g_opcode_names[OPCODE_COUNT] = {
+    "nop",   "setl",  "getl",  "push.i", "push.f", "pop",   "stores", "loads",
+    "cmp.i", "cmp.f", "j",     "jeq",    "jne",    "jlt",   "jgr",    "jle",
+    "jge",   "add.i", "sub.i", "mul.i",  "div.i",  "add.f", "sub.f",  "mul.f",
+    "div.f", "call",  "ret",   "halt",   "tailcall", "getg", "setg",  "news",
+    "getf",  "setf",  "initf", "callb", "newa",  "geta",  "seta",  "pusha",
+    "popa",  "lena",  "getau", "setau", "chka",  "concat", "cmp.s", "add",
+    "sub",   "mul",   "div",   "cmp",   "coro",  "resume", "yield", "getl2",
+    "incl",  "jcmp.l", "jcmp.k",
+};
+
+static int serialize_operand(VMOperand operand, uint8_t *buffer);
 static int deserialize_operand(uint8_t *buffer, VMOperand *operand);
 
 /* Encode and decode instructions */
 static inline int encode_instruction(int op, int operands_count, VMOperand *operands,
                                      uint8_t *output);
-static inline int decode_instruction(uint8_t *buffer, VMInstruction *inst);
+static inline int decode_instruction(uint8_t *buffer, size_t len, VMInstruction *inst);
+
+const char *opcode_name(enum VMOpcode op) {
+    return op < OPCODE_COUNT ? g_opcode_names[op] : "???";
+}
+
+bool instruction_stack_use(VMInstruction *ins, VMFunction *funcs, int func_count, int *pops,
+                           int *pushes) {
+    static const signed char use[OPCODE_COUNT][2] = {
+        [NOP] = {0, 0},   [SETL] = {1, 0},   [GETL] = {0, 1},   [PUSH_I] = {0, 1},
+        [PUSH_F] = {0, 1}, [POP] = {1, 0},   [LOADS] = {0, 1},  [CMP_I] = {2, 0},
+        [CMP_F] = {2, 0}, [J] = {0, 0},      [JEQ] = {0, 0},    [JNE] = {0, 0},
+        [JLT] = {0, 0},   [JGR] = {0, 0},    [JLE] = {0, 0},    [JGE] = {0, 0},
+        [ADD_I] = {2, 1}, [SUB_I] = {2, 1},  [MUL_I] = {2, 1},  [DIV_I] = {2, 1},
+        [ADD_F] = {2, 1}, [SUB_F] = {2, 1},  [MUL_F] = {2, 1},  [DIV_F] = {2, 1},
+        [GETG] = {0, 1},  [SETG] = {1, 0},   [NEWS] = {0, 1},   [GETF] = {1, 1},
+        [SETF] = {2, 0},  [INITF] = {2, 1},  [NEWA] = {1, 1},   [GETA] = {2, 1},
+        [SETA] = {3, 0},  [PUSHA] = {2, 1},  [POPA] = {1, 1},   [LENA] = {1, 1},
+        [GETAU] = {2, 1}, [SETAU] = {3, 0},  [CHKA] = {0, 0},   [CONCAT] = {2, 1},
+        [CMP_S] = {2, 0}, [ADD] = {2, 1},    [SUB] = {2, 1},    [MUL] = {2, 1},
+        [DIV] = {2, 1},   [CMP] = {2, 0},    [RESUME] = {2, 1}, [YIELD] = {1, 1},
+        [GETL2] = {0, 1}, [INCL] = {0, 1},   [JCMP_L] = {0, 1}, [JCMP_K] = {0, 1},
+    };
+
+    int index = ins->operands_count > 0 ? ins->operands[0].int_value : -1;
+    switch (ins->opcode) {
+    case CALL:
+    case CORO:
+        if (index < 0 || index >= func_count) {
+            return false;
+        }
+        *pops   = funcs[index].nparams;
+        *pushes = 1;
+        return true;
+    case CALLB:
+        if (index < 0 || index >= BUILTIN_COUNT) {
+            return false;
+        }
+        *pops   = g_builtins[index].nargs;
+        *pushes = 1;
+        return true;
+    case RET:
+    case HALT:
+    case TAILCALL:
+    case STORES:
+        return false;
+    default:
+        if ((unsigned)ins->opcode >= OPCODE_COUNT) {
+            return false;
+        }
+        *pops   = use[ins->opcode][0];
+        *pushes = use[ins->opcode][1];
+        return true;
+    }
+}
+
+static int serialize_operand(VMOperand input, uint8_t *output) {
+    output[0] = input.type;
+    output[1] = 0; // padding for future size of operand
+
+    switch (input.type) {
+    case TY_INT:
+        memcpy(output + 2, &input.int_value, sizeof(int));
+        break;
+    case TY_FLOAT:
+        memcpy(output + 2, &input.float_value, sizeof(float));
+        break;
+    default:
+        log_error(__FILE__ ": invalid operand type %d\n", input.type);
+        return -1;
+    }
+
+    return 0;
+}
 
 static int deserialize_operand(uint8_t *input, VMOperand *output) {
     output->type = input[0];
@@ -30,7 +118,7 @@ static int deserialize_operand(uint8_t *input, VMOperand *output) {
         memcpy(&output->float_value, input + 2, sizeof(float));
         break;
     default:
-        log_error(__FILE__ ": invalid operand type %d\n");
+        log_error(__FILE__ ": invalid operand type %d\n", output->type);
         return -1;
     }
 
@@ -39,82 +127,454 @@ static int deserialize_operand(uint8_t *input, VMOperand *output) {
 
 static inline int encode_instruction(int op, int operands_count, VMOperand *operands,
                                      uint8_t *output) {
-    size_t nbytes  = 0;
-    uint8_t header = (op << 4) | operands_count;
-    output[0]      = header;
-
-    log_info(__FILE__ ": header encoded as: %02x\n", header);
-
-    size_t offset = 1;
-    VMOperand it;
-    foreach (it, operands, operands_count) {
-        output[offset++] = it.type;
-        output[offset++] = 0; // padding for future size of operand
-
-        switch (it.type) {
-        case TY_INT:
-            memcpy(output + offset, &it.int_value, sizeof(int));
-            offset += sizeof(int);
-            break;
-        case TY_FLOAT:
-            memcpy(output + offset, &it.float_value, sizeof(float));
-            offset += sizeof(float);
-            break;
-        default:
-            log_error(__FILE__ ": invalid operand type %d\n");
+    output[0] = op;
+    output[1] = operands_count;
+
+    size_t offset = BYTECODE_INS_SIZE;
+    foreach_n(i, operands, operands_count) {
+        if (serialize_operand(operands[i], output + offset) != 0) {
             return -1;
         }
+
+        offset += BYTECODE_OPERAND_SIZE;
     }
 
-    nbytes = offset;
-    return nbytes;
+    return offset;
 }
 
-static inline int decode_instruction(uint8_t *input, VMInstruction *output) {
-    output->opcode         = input[0] >> 4;
-    output->operands_count = input[0] & 0x0F;
+static inline int decode_instruction(uint8_t *input, size_t len, VMInstruction *output) {
+    if (len < BYTECODE_INS_SIZE) {
+        log_error(__FILE__ ": truncated instruction\n");
+        return -1;
+    }
 
-    // opcode operand_count [rest] opcode operand_count [rest] ...
+    output->opcode         = input[0];
+    output->operands_count = input[1];
 
-    size_t offset = 1;
+    // opcode operand_count [operands] opcode operand_count [operands] ...
+    size_t size = BYTECODE_INS_SIZE + output->operands_count * BYTECODE_OPERAND_SIZE;
+    if (output->opcode >= GETL2 || output->operands_count > 3 || len < size) {
+        log_error(__FILE__ ": malformed instruction\n");
+        return -1;
+    }
+
+    size_t offset = BYTECODE_INS_SIZE;
     foreach_n(i, input, output->operands_count) {
         if (deserialize_operand(input + offset, &output->operands[i]) != 0) {
             log_error(__FILE__ ": failed to deserialize operand\n");
             return -1;
         }
 
-        offset += 6;
+        offset += BYTECODE_OPERAND_SIZE;
     }
 
-    log_info("Decoded instruction: %d (number of operands: %d)\n", output->opcode,
-             output->operands_count);
-
-    return 0;
+    return size;
 }
 
 int read_bytecode_stream(uint8_t *stream, size_t len, VMInstruction *out_insts,
-                         size_t *out_count) {
+                         size_t capacity, size_t *out_count) {
 
-    // Read len instructions from the stream and decode an instruction stream
+    // Decode instructions until the stream runs out
     size_t offset    = 0;
     size_t curr_inst = 0;
 
-    VMInstruction inst;
-
     while (offset < len) {
-        if (decode_instruction(stream + offset, &inst) != 0) {
+        if (curr_inst == capacity) {
+            log_error(__FILE__ ": more than the %zu instructions expected\n", capacity);
+            return -1;
+        }
+
+        int size = decode_instruction(stream + offset, len - offset, &out_insts[curr_inst]);
+        if (size < 0) {
             log_error(__FILE__ ": failed to decode instruction\n");
             return -1;
         }
 
-        out_insts[curr_inst++] = inst;
-        offset += 5;
+        curr_inst++;
+        offset += size;
     }
 
     *out_count = curr_inst;
     return 0;
 }
 
+static int read_i32(uint8_t *image, size_t len, size_t *offset, int *out) {
+    if (len - *offset < sizeof(int32_t)) {
+        return -1;
+    }
+
+    int32_t v;
+    memcpy(&v, image + *offset, sizeof(v));
+    *offset += sizeof(v);
+    *out = v;
+    return 0;
+}
+
+/* Values the body of a versioned loop may keep on the stack, deeper ones are rejected */
+#define LOOP_STACK_MAX 64
+
+static bool is_branch(enum VMOpcode op) { return (op >= J && op <= JGE) || op == CHKA; }
+
+static inline int operand(VMInstruction *ins, int i) {
+    return ins->operands_count > i ? ins->operands[i].int_value : -1;
+}
+
+static bool is_op(VMInstruction *ins, enum VMOpcode op, int value) {
+    return ins->opcode == op && operand(ins, 0) == value;
+}
+
+/* First and last instruction jumping to an instruction, -1 if none does */
+typedef struct JumpSources {
+    int first, last;
+} JumpSources;
+
+/**
+ * The unchecked copy of a loop in [start, end), entered from the CHKAs in
+ * [first, start) that check its arrays against the range of `counter`.
+ */
+typedef struct VersionedLoop {
+    VMInstruction *code;
+    int first, start, end;
+    int counter;
+} VersionedLoop;
+
+/**
+ * Stack in the copy of a loop before an instruction: for each value the local
+ * it was read from with GETL, or -1. `depth` counts from the stack the loop
+ * starts with and is -1 until the instruction is reached.
+ */
+typedef struct LoopStack {
+    int depth;
+    int slots[LOOP_STACK_MAX];
+} LoopStack;
+
+static bool checked_array(VersionedLoop *loop, int slot) {
+    for (int i = loop->first; i < loop->start; i++) {
+        if (operand(&loop->code[i], 1) == slot) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Merge `in` into the stack before `at`, false if their depths differ */
+static bool merge_stack(LoopStack *stacks, int at, LoopStack *in, bool *changed) {
+    LoopStack *s = &stacks[at];
+    if (s->depth < 0) {
+        *s       = *in;
+        *changed = true;
+        return true;
+    } else if (s->depth != in->depth) {
+        return false;
+    }
+
+    for (int k = 0; k < s->depth; k++) {
+        if (s->slots[k] != in->slots[k] && s->slots[k] != -1) {
+            s->slots[k] = -1;
+            *changed    = true;
+        }
+    }
+    return true;
+}
+
+/**
+ * Follow the stack through the copy of a loop until nothing changes, and check
+ * that every GETAU/SETAU indexes one of the checked arrays by the counter, both
+ * read from their locals.
+ */
+static bool check_loop_stack(struct Bytecode *bc, VersionedLoop *loop) {
+    int count         = loop->end - loop->start;
+    LoopStack *stacks = (LoopStack *)malloc(count * sizeof(LoopStack));
+    if (stacks == NULL) {
+        log_error(__FILE__ ": out of memory\n");
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        stacks[i].depth = -1;
+    }
+    stacks[0].depth = 0;
+
+    bool ok = true, changed = true;
+    while (ok && changed) {
+        changed = false;
+        for (int i = 0; i < count && ok; i++) {
+            VMInstruction *ins = &loop->code[loop->start + i];
+            LoopStack s        = stacks[i];
+            if (s.depth < 0 || ins->opcode == RET || ins->opcode == HALT) {
+                continue;
+            }
+
+            if (ins->opcode == GETAU || ins->opcode == SETAU) {
+                int array = s.depth - (ins->opcode == GETAU ? 2 : 3);
+                ok        = array >= 0 && checked_array(loop, s.slots[array]) &&
+                            s.slots[array + 1] == loop->counter;
+            }
+
+            int pops, pushes;
+            ok = ok &&
+                 instruction_stack_use(ins, bc->funcs, bc->header.func_count, &pops,
+                                       &pushes) &&
+                 pops <= s.depth && s.depth - pops + pushes <= LOOP_STACK_MAX;
+            if (!ok) {
+                break;
+            }
+
+            s.depth -= pops;
+            for (int k = 0; k < pushes; k++) {
+                s.slots[s.depth++] = ins->opcode == GETL ? operand(ins, 0) : -1;
+            }
+
+            // Jumps out of the copy leave the loop
+            int target = operand(ins, 0) - loop->start;
+            if (is_branch(ins->opcode) && target >= 0 && target < count) {
+                ok = merge_stack(stacks, target, &s, &changed);
+            }
+            if (ok && ins->opcode != J && i + 1 < count) {
+                ok = merge_stack(stacks, i + 1, &s, &changed);
+            }
+        }
+    }
+
+    free(stacks);
+    return ok;
+}
+
+/**
+ * Check that the code after the CHKAs in [first, start) is the unchecked copy
+ * of a loop as version_loop makes it:
+ *
+ *   start:  getl counter, getl counter + 1, cmp.i, jgr <out of the loop>
+ *           <body>
+ *           getl counter, push.i 1, add.i, setl counter, j start
+ *
+ * The body doesn't set the counter, the limit after it or the arrays, and does
+ * nothing that could shrink an array behind our back (calls, pops, switching
+ * coroutines). Only the copy's own jumps land in it, none in the middle of the
+ * head or the increment, and only at the first of the CHKAs.
+ */
+static bool check_versioned_loop(struct Bytecode *bc, int first, int start,
+                                 JumpSources *sources, int *out_end) {
+    VMInstruction *code = bc->code;
+    int n               = bc->header.code_size;
+    int counter         = operand(&code[first], 2);
+
+    for (int i = first; i < start; i++) {
+        if (code[i].operands_count != 3 || operand(&code[i], 2) != counter ||
+            operand(&code[i], 0) != operand(&code[first], 0)) {
+            return false;
+        }
+    }
+
+    int end = start;
+    while (end < n && !is_op(&code[end], J, start)) {
+        end++;
+    }
+    *out_end = ++end;
+
+    if (end > n || end - start < 9 || !is_op(&code[start], GETL, counter) ||
+        !is_op(&code[start + 1], GETL, counter + 1) || code[start + 2].opcode != CMP_I ||
+        code[start + 3].opcode != JGR || !is_op(&code[end - 5], GETL, counter) ||
+        !is_op(&code[end - 4], PUSH_I, 1) || code[end - 3].opcode != ADD_I ||
+        !is_op(&code[end - 2], SETL, counter)) {
+        return false;
+    }
+
+    int exit   = operand(&code[start + 3], 0);
+    int failed = operand(&code[first], 0);
+    if ((exit >= first && exit < end) || (failed > first && failed < end)) {
+        return false;
+    }
+
+    VersionedLoop loop = {code, first, start, end, counter};
+    for (int i = first + 1; i < end; i++) {
+        JumpSources *from = &sources[i];
+        bool midway       = i < start || (i > start && i < start + 4) ||
+                            (i > end - 5 && i < end - 1);
+        if (from->first >= 0 && (midway || from->first < start || from->last >= end)) {
+            return false;
+        }
+
+        int slot = operand(&code[i], 0);
+        switch (i < start ? NOP : code[i].opcode) {
+        case SETL:
+            if (i != end - 2 &&
+                (slot == counter || slot == counter + 1 || checked_array(&loop, slot))) {
+                return false;
+            }
+            break;
+        case CALL:
+        case TAILCALL:
+        case POPA:
+        case CHKA:
+        case CORO:
+        case RESUME:
+        case YIELD:
+        case STORES:
+            return false;
+        default:
+            break;
+        }
+    }
+
+    for (int i = 0; i < bc->header.func_count; i++) {
+        if (bc->funcs[i].entry > first && bc->funcs[i].entry < end) {
+            return false;
+        }
+    }
+
+    return check_loop_stack(bc, &loop);
+}
+
+/**
+ * GETAU/SETAU skip the checks of GETA/SETA, so an image may only use them in
+ * the unchecked copy of a versioned loop, behind the CHKAs that make the same
+ * checks up front for the whole loop.
+ */
+static bool check_unchecked_access(struct Bytecode *bc) {
+    VMInstruction *code = bc->code;
+    int n               = bc->header.code_size;
+
+    bool any = false;
+    for (int i = 0; i < n && !any; i++) {
+        any = code[i].opcode == GETAU || code[i].opcode == SETAU;
+    }
+    if (!any) {
+        return true;
+    }
+
+    JumpSources *sources = (JumpSources *)malloc(n * sizeof(JumpSources));
+    bool *covered        = (bool *)calloc(n, sizeof(bool));
+    if (sources == NULL || covered == NULL) {
+        log_error(__FILE__ ": out of memory\n");
+        free(sources);
+        free(covered);
+        return false;
+    }
+
+    for (int i = 0; i < n; i++) {
+        sources[i] = (JumpSources){-1, -1};
+    }
+    for (int i = 0; i < n; i++) {
+        int target = operand(&code[i], 0);
+        if (is_branch(code[i].opcode) && target >= 0 && target < n) {
+            if (sources[target].first < 0) {
+                sources[target].first = i;
+            }
+            sources[target].last = i;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (code[i].opcode != CHKA || (i > 0 && code[i - 1].opcode == CHKA)) {
+            continue;
+        }
+
+        int start = i, end;
+        while (start < n && code[start].opcode == CHKA) {
+            start++;
+        }
+        if (check_versioned_loop(bc, i, start, sources, &end)) {
+            memset(&covered[start], true, end - start);
+        }
+    }
+
+    bool ok = true;
+    for (int i = 0; i < n && ok; i++) {
+        ok = covered[i] || (code[i].opcode != GETAU && code[i].opcode != SETAU);
+    }
+
+    free(sources);
+    free(covered);
+    return ok;
+}
+
+int read_bytecode_image(uint8_t *image, size_t len, struct Bytecode *bc) {
+    memset(bc, 0, sizeof(*bc));
+
+    if (len < sizeof(struct BytecodeHdr)) {
+        log_error(__FILE__ ": image too small for a header\n");
+        return -1;
+    }
+
+    memcpy(&bc->header, image, sizeof(struct BytecodeHdr));
+    if (strncmp(bc->header.magic, BYTECODE_MAGIC, 4) != 0) {
+        log_error(__FILE__ ": magic number did not match\n");
+        return -1;
+    }
+
+    if (bc->header.version != BYTECODE_VERSION) {
+        log_error(__FILE__ ": unsupported bytecode version %d\n", bc->header.version);
+        return -1;
+    }
+
+    struct BytecodeHdr *hdr = &bc->header;
+    if (hdr->code_size < 0 || hdr->const_count < 0 || hdr->func_count < 1) {
+        log_error(__FILE__ ": corrupt header\n");
+        return -1;
+    }
+
+    bc->code   = (VMInstruction *)malloc(hdr->code_size * sizeof(VMInstruction) + 1);
+    bc->consts = (char **)calloc(hdr->const_count + 1, sizeof(char *));
+    bc->funcs  = (VMFunction *)malloc(hdr->func_count * sizeof(VMFunction));
+    if (bc->code == NULL || bc->consts == NULL || bc->funcs == NULL) {
+        log_error(__FILE__ ": failed to allocate bytecode\n");
+        goto fail;
+    }
+
+    size_t offset = sizeof(struct BytecodeHdr);
+    for (int i = 0; i < hdr->const_count; i++) {
+        int length;
+        if (read_i32(image, len, &offset, &length) != 0 || length < 0 ||
+            len - offset < (size_t)length) {
+            log_error(__FILE__ ": truncated constant pool\n");
+            goto fail;
+        }
+
+        bc->consts[i] = strndup((char *)image + offset, length);
+        offset += length;
+    }
+
+    for (int i = 0; i < hdr->func_count; i++) {
+        VMFunction *fn = &bc->funcs[i];
+        if (read_i32(image, len, &offset, &fn->entry) != 0 ||
+            read_i32(image, len, &offset, &fn->nparams) != 0 ||
+            read_i32(image, len, &offset, &fn->nlocals) != 0 ||
+            read_i32(image, len, &offset, &fn->name) != 0) {
+            log_error(__FILE__ ": truncated function table\n");
+            goto fail;
+        }
+
+        if (fn->entry < 0 || fn->entry >= hdr->code_size || fn->nparams < 0 ||
+            fn->nlocals < fn->nparams || fn->name < 0 || fn->name >= hdr->const_count) {
+            log_error(__FILE__ ": corrupt function table entry %d\n", i);
+            goto fail;
+        }
+    }
+
+    size_t count;
+    if (read_bytecode_stream(image + offset, len - offset, bc->code, hdr->code_size,
+                             &count) != 0) {
+        goto fail;
+    }
+
+    if (count != (size_t)hdr->code_size) {
+        log_error(__FILE__ ": expected %d instructions, found %zu\n", hdr->code_size,
+                  count);
+        goto fail;
+    }
+
+    if (!check_unchecked_access(bc)) {
+        log_error(__FILE__ ": unchecked array access outside a versioned loop\n");
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    bytecode_free(bc);
+    return -1;
+}
+
 int read_bytecode_file(const char *filename, struct Bytecode *bc) {
     FILE *file   = fopen(filename, "rb");
     uint8_t *buf = NULL;
@@ -122,7 +582,6 @@ int read_bytecode_file(const char *filename, struct Bytecode *bc) {
 
     if (!file) {
         log_error("failed to open file: %s\n", filename);
-        perror("failed to open file");
         return -1;
     }
 
@@ -131,31 +590,149 @@ int read_bytecode_file(const char *filename, struct Bytecode *bc) {
     rewind(file);
 
     // Allocate a buffer
-    buf      = malloc(len + 1);
-    buf[len] = '\0';
-
-    // Read the header
-    size_t read_size;
-    if ((read_size = fread(&bc->header, sizeof(struct BytecodeHdr), 1, file)) != 1) {
-        printf("read size: %zu\n", read_size);
-        perror("fread");
+    buf = malloc(len + 1);
+    if (buf == NULL || fread(buf, 1, len, file) != len) {
+        log_error("failed to read file: %s\n", filename);
+        free(buf);
         fclose(file);
-        return EXIT_FAILURE;
+        return -1;
     }
 
-    if (strncmp(bc->header.magic, "TARO", 4) != 0) {
-        perror("magic number did not match");
-        fclose(file);
-        return EXIT_FAILURE;
+    fclose(file);
+
+    int status = read_bytecode_image(buf, len, bc);
+    free(buf);
+    return status;
+}
+
+static void write_i32(uint8_t *image, size_t *offset, int value) {
+    int32_t v = value;
+    memcpy(image + *offset, &v, sizeof(v));
+    *offset += sizeof(v);
+}
+
+int write_bytecode_image(struct Bytecode *bc, uint8_t **out_image, size_t *out_len) {
+    struct BytecodeHdr *hdr = &bc->header;
+    memcpy(hdr->magic, BYTECODE_MAGIC, 4);
+    hdr->version = BYTECODE_VERSION;
+
+    // Work out the exact size up front so we only allocate once
+    size_t len = sizeof(struct BytecodeHdr);
+    for (int i = 0; i < hdr->const_count; i++) {
+        len += sizeof(int32_t) + strlen(bc->consts[i]);
     }
 
-    printf("magic: %s\n", bc->header.magic);
-    printf("version: %d\n", bc->header.version);
-    printf("code size: %d\n", bc->header.code_size);
+    len += hdr->func_count * 4 * sizeof(int32_t);
+    for (int i = 0; i < hdr->code_size; i++) {
+        len += BYTECODE_INS_SIZE + bc->code[i].operands_count * BYTECODE_OPERAND_SIZE;
+    }
 
-    bc->code = (uint8_t *)malloc(bc->header.code_size);
-    fread(&bc->code, sizeof(bc->code), bc->header.code_size, file);
-    fclose(file);
+    uint8_t *image = (uint8_t *)malloc(len);
+    if (image == NULL) {
+        log_error(__FILE__ ": failed to allocate image\n");
+        return -1;
+    }
+
+    memcpy(image, hdr, sizeof(struct BytecodeHdr));
+    size_t offset = sizeof(struct BytecodeHdr);
+
+    for (int i = 0; i < hdr->const_count; i++) {
+        size_t length = strlen(bc->consts[i]);
+        write_i32(image, &offset, length);
+        memcpy(image + offset, bc->consts[i], length);
+        offset += length;
+    }
+
+    for (int i = 0; i < hdr->func_count; i++) {
+        write_i32(image, &offset, bc->funcs[i].entry);
+        write_i32(image, &offset, bc->funcs[i].nparams);
+        write_i32(image, &offset, bc->funcs[i].nlocals);
+        write_i32(image, &offset, bc->funcs[i].name);
+    }
+
+    for (int i = 0; i < hdr->code_size; i++) {
+        VMInstruction *ins = &bc->code[i];
+        int size =
+            encode_instruction(ins->opcode, ins->operands_count, ins->operands, image + offset);
+        if (size < 0) {
+            free(image);
+            return -1;
+        }
+
+        offset += size;
+    }
+
+    *out_image = image;
+    *out_len   = len;
+    return 0;
+}
 
-    return EXIT_SUCCESS;
+int write_bytecode_file(const char *filename, struct Bytecode *bc) {
+    uint8_t *image;
+    size_t len;
+    if (write_bytecode_image(bc, &image, &len) != 0) {
+        return -1;
+    }
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        log_error("failed to open file: %s\n", filename);
+        free(image);
+        return -1;
+    }
+
+    int status = fwrite(image, 1, len, file) == len ? 0 : -1;
+    if (fclose(file) != 0 || status != 0) {
+        log_error("failed to write file: %s\n", filename);
+        status = -1;
+    }
+
+    free(image);
+    return status;
+}
+
+void bytecode_free(struct Bytecode *bc) {
+    if (bc->consts != NULL) {
+        for (int i = 0; i < bc->header.const_count; i++) {
+            free(bc->consts[i]);
+        }
+    }
+
+    free(bc->code);
+    free(bc->consts);
+    free(bc->funcs);
+
+    bc->code   = NULL;
+    bc->consts = NULL;
+    bc->funcs  = NULL;
+}
+
+void bytecode_dump(struct Bytecode *bc) {
+    printf("; %d instructions, %d constants, %d functions\n", bc->header.code_size,
+           bc->header.const_count, bc->header.func_count);
+
+    for (int i = 0; i < bc->header.const_count; i++) {
+        printf("; const %d: \"%s\"\n", i, bc->consts[i]);
+    }
+
+    for (int i = 0; i < bc->header.code_size; i++) {
+        for (int f = 0; f < bc->header.func_count; f++) {
+            VMFunction *fn = &bc->funcs[f];
+            if (fn->entry == i) {
+                printf("%s:  ; params %d, locals %d\n", bc->consts[fn->name], fn->nparams,
+                       fn->nlocals);
+            }
+        }
+
+        VMInstruction *ins = &bc->code[i];
+        printf("%6d  %-8s", i, opcode_name(ins->opcode));
+        for (int j = 0; j < ins->operands_count; j++) {
+            if (ins->operands[j].type == TY_FLOAT) {
+                printf(" %g", ins->operands[j].float_value);
+            } else {
+                printf(" %d", ins->operands[j].int_value);
+            }
+        }
+        printf("\n");
+    }
 }
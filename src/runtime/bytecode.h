@@ -5,25 +5,61 @@
 #include "vm.h"
 #include <stdint.h>
 
+#define BYTECODE_MAGIC "TARO"
+#define BYTECODE_VERSION 2
+
+/* Encoded size of an instruction header and of each operand */
+#define BYTECODE_INS_SIZE 2
+#define BYTECODE_OPERAND_SIZE 6
+
 struct packed_t BytecodeHdr {
     char magic[4]; // TARO
     int version;   // Binary version
 
-    int code_size;
+    int code_size;   // number of instructions
+    int const_count; // number of string constants
+    int func_count;  // number of entries in the function table
 };
 
 /**
- * Executable bytecode format.
+ * Executable bytecode format. On disk an image is laid out as:
+ *
+ *   header
+ *   constants       u32 length + bytes, const_count times
+ *   function table  entry, nparams, nlocals, name (i32 each), func_count times
+ *   code            u8 opcode, u8 operand count, 6 bytes per operand
+ *
+ * Function 0 is the top-level program.
  */
-struct packed_t Bytecode {
-    struct packed_t BytecodeHdr header;
+struct Bytecode {
+    struct BytecodeHdr header;
 
-    uint8_t *code;
+    VMInstruction *code;
+    char **consts;
+    VMFunction *funcs;
 };
 
+/* Decode the instructions in `stream` into `out_insts`, failing past `capacity` */
 int read_bytecode_stream(uint8_t *stream, size_t len, VMInstruction *out_insts,
-                         size_t *out_count);
+                         size_t capacity, size_t *out_count);
 
+int read_bytecode_image(uint8_t *image, size_t len, struct Bytecode *bc);
 int read_bytecode_file(const char *filename, struct Bytecode *bc);
 
+int write_bytecode_image(struct Bytecode *bc, uint8_t **out_image, size_t *out_len);
+int write_bytecode_file(const char *filename, struct Bytecode *bc);
+
+void bytecode_free(struct Bytecode *bc);
+void bytecode_dump(struct Bytecode *bc);
+
+const char *opcode_name(enum VMOpcode op);
+
+/**
+ * Values an instruction pops and pushes, false if that isn't known statically
+ * or the instruction doesn't continue to the next one. Calls look their callee
+ * up in `funcs`.
+ */
+bool instruction_stack_use(VMInstruction *ins, VMFunction *funcs, int func_count, int *pops,
+                           int *pushes);
+
 #endif
@@ -1,100 +1,140 @@
 /**
  * Barebones mark and sweep garbage collector.
  *
+ * Roots are the operand stack (which holds every frame's locals), the
+ * globals, the string constants and the running coroutine, whose saved context
+ * leads to the stacks of the ones waiting on it. Marking uses an explicit gray stack rather
+ * than recursion, so deeply linked structures and ropes can't overflow the C
+ * stack. Collections only happen at allocation points in the interpreter, where
+ * every live value is reachable from a root.
+ *
  * Authors:
  * - Charlotte (megabytesofrem)
  */
 
 #include "gc.h"
-
-#include <pthread.h>
-#include <unistd.h>
+#include "object.h"
 
 #include "../util/logger.h"
 
-void heap_free(VMMem *mem, void *pentry);
+static void gray_push(VMMem *mem, HeapObj *obj) {
+    if (mem->gray_count == mem->gray_capacity) {
+        size_t capacity = mem->gray_capacity ? mem->gray_capacity * 2 : 256;
+        HeapObj **gray  = (HeapObj **)realloc(mem->gray, capacity * sizeof(HeapObj *));
+        if (gray == NULL) {
+            // Dropping the object would let it be freed while still reachable
+            log_error("GC: out of memory while marking\n");
+            abort();
+        }
+
+        mem->gray          = gray;
+        mem->gray_capacity = capacity;
+    }
+
+    mem->gray[mem->gray_count++] = obj;
+}
 
-void gc_mark(Value *val) {
-    if (val == NULL || val->marked)
+void gc_mark(VMMem *mem, Value *val) {
+    if (val == NULL || !is_object(*val) || val->data.object->marked)
         return;
 
-    // Mark the object
-    val->marked = true;
+    // Mark the object, its children are marked when it's popped off the gray stack
+    val->data.object->marked = true;
+    gray_push(mem, val->data.object);
 
 #ifdef GC_DEBUG
-    log_info("GC: marking value at %p\n", (void *)val);
+    log_info("GC: marking object at %p\n", (void *)val->data.object);
 #endif
+}
 
-    // Managed objects hold references to other objects
-    if (value_has_child_nodes(val)) {
-        if (val->s_children != NULL) {
-            for (int i = 0; i < val->s_children_count; i++) {
-                if (val->s_children[i] != NULL) {
-#ifdef GC_DEBUG
-                    log_info("GC: marking child %d at %p\n", i,
-                             (void *)val->s_children[i]);
-#endif
-                    gc_mark(val->s_children[i]);
-                }
-            }
+static void gc_mark_children(VMMem *mem, HeapObj *obj) {
+    switch (obj->type) {
+    case TY_STRUCTURE: {
+        StructObj *s = (StructObj *)obj;
+        for (int i = 0; i < s->shape->count; i++) {
+            gc_mark(mem, &s->fields[i]);
         }
+        break;
+    }
+    case TY_LONGSTRING: {
+        // Both halves are ints once a rope is flattened
+        StringObj *s = (StringObj *)obj;
+        gc_mark(mem, &s->left);
+        gc_mark(mem, &s->right);
+        break;
+    }
+    case TY_COROUTINE: {
+        CoroObj *co = (CoroObj *)obj;
+        for (size_t i = 0; i < co->ctx.sp; i++) {
+            gc_mark(mem, &co->ctx.stack[i]);
+        }
+        if (co->resumer != NULL) {
+            gc_mark(mem, &new_object(TY_COROUTINE, co->resumer));
+        }
+        break;
+    }
+    default:
+        break;
     }
 }
 
 void gc_mark_all(VM *vm) {
-    // Iterate through the heap allocation list and mark all objects
-    log_info("GC: marking all objects in the heap\n");
+    VMMem *mem = &vm->mem;
 
-    HeapObj *entry = vm->mem.heap;
-    while (entry != NULL) {
-        if (entry->value != NULL) {
 #ifdef GC_DEBUG
-            printf("GC: marking object at %p\n", (void *)entry->value);
+    log_info("GC: marking from %zu stack slots and %zu globals\n", mem->sp,
+             vm->globals.count);
 #endif
-            gc_mark(entry->value);
-        }
-        entry = entry->next;
+
+    for (size_t i = 0; i < mem->sp; i++) {
+        gc_mark(mem, &mem->stack[i]);
+    }
+
+    for (size_t i = 0; i < vm->globals.count; i++) {
+        gc_mark(mem, &vm->globals.values[i]);
+    }
+
+    for (int i = 0; i < vm->string_count; i++) {
+        gc_mark(mem, &vm->constants[i]);
+    }
+
+    if (vm->coro != NULL) {
+        gc_mark(mem, &new_object(TY_COROUTINE, vm->coro));
+    }
+
+    while (mem->gray_count > 0) {
+        gc_mark_children(mem, mem->gray[--mem->gray_count]);
     }
 }
 
 void gc_sweep(VM *vm) {
-    log_info("GC: performing a sweep\n");
-
-    // HeapObject *prev = NULL;
-    HeapObj *entry = vm->mem.heap;
+    int live       = 0;
+    HeapObj **link = &vm->mem.heap;
 
-    while (entry != NULL) {
-        if (entry->value != NULL) {
-#ifdef GC_DEBUG
-            log_info("GC: examining entry at %p, marked: %d\n", (void *)entry,
-                     entry->value->marked);
-#endif
-        }
+    while (*link != NULL) {
+        HeapObj *entry = *link;
 
-        if (entry->value == NULL || !entry->value->marked) {
+        if (!entry->marked) {
             // Unreached entry so let's free it
-            HeapObj *unreached = entry;
-            entry              = entry->next;
-
-            if (unreached != NULL) {
-                heap_free(&vm->mem, unreached);
-            }
+            *link = entry->next;
+            heap_free(&vm->mem, entry);
         } else {
-#ifdef GC_DEBUG
             // This entry was reached, so unmark it for the next GC cycle
-            log_info("GC: unmarking object at %p for next cycle\n", (void *)entry->value);
-#endif
-            entry->value->marked = false;
-            entry                = entry->next;
+            entry->marked = false;
+            link          = &entry->next;
+            live++;
         }
     }
+
+    vm->mem.gc_live = live;
+
+#ifdef GC_DEBUG
+    log_info("GC: %d objects survived\n", live);
+#endif
 }
 
 void gc_collect(VM *vm) {
     gc_mark_all(vm);
-
-    // Sweep once and then once more to ensure all unreachable objects are freed
-    gc_sweep(vm);
     gc_sweep(vm);
     vm->mem.gc_counter = 0;
 }
@@ -2,16 +2,22 @@
 #define TARO_RUNTIME_GC_H
 
 /* If defined, the GC will log debug messages for allocations */
-#define GC_DEBUG 1
+// #define GC_DEBUG 1
 
 #include "value.h"
 #include "vm.h"
 
-void gc_create_thread(VM *vm);
-
-void gc_mark(Value *val);
+void gc_mark(VMMem *mem, Value *val);
 void gc_mark_all(VM *vm);
-void gc_perform_sweep(VM *vm);
+void gc_sweep(VM *vm);
 void gc_collect(VM *vm);
 
+/* Collect if enough has been allocated since the last collection */
+static inline void gc_maybe_collect(VM *vm) {
+    VMMem *mem = &vm->mem;
+    if (mem->gc_counter >= mem->gc_threshold && mem->gc_counter >= mem->gc_live) {
+        gc_collect(vm);
+    }
+}
+
 #endif
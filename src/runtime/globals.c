@@ -0,0 +1,93 @@
+/**
+ * Global variable table.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "globals.h"
+
+#include "../util/hashtable.h"
+#include "../util/logger.h"
+
+void globals_init(Globals *g) { memset(g, 0, sizeof(*g)); }
+
+void globals_free(Globals *g) {
+    free(g->names);
+    free(g->values);
+    free(g->index);
+    memset(g, 0, sizeof(*g));
+}
+
+/* Bucket holding `name`, or the empty bucket where it would go */
+static size_t globals_bucket(Globals *g, const char *name) {
+    size_t mask   = g->index_capacity - 1;
+    size_t bucket = fnv_hash_n(name, strlen(name)) & mask;
+
+    while (g->index[bucket] != 0 && strcmp(g->names[g->index[bucket] - 1], name) != 0) {
+        bucket = (bucket + 1) & mask;
+    }
+
+    return bucket;
+}
+
+int globals_find(Globals *g, const char *name) {
+    if (g->index_capacity == 0) {
+        return -1;
+    }
+
+    return g->index[globals_bucket(g, name)] - 1;
+}
+
+static bool globals_grow(Globals *g) {
+    size_t capacity    = g->capacity ? g->capacity * 2 : 16;
+    const char **names = (const char **)realloc(g->names, capacity * sizeof(const char *));
+    if (names != NULL) {
+        g->names = names;
+    }
+
+    Value *values = (Value *)realloc(g->values, capacity * sizeof(Value));
+    if (values != NULL) {
+        g->values = values;
+    }
+
+    if (names == NULL || values == NULL) {
+        log_error("VM: failed to grow globals\n");
+        return false;
+    }
+
+    g->capacity = capacity;
+
+    // Keep the index at most half full
+    free(g->index);
+    g->index_capacity = capacity * 2;
+    g->index          = (int *)calloc(g->index_capacity, sizeof(int));
+    if (g->index == NULL) {
+        log_error("VM: failed to grow globals\n");
+        g->index_capacity = 0;
+        return false;
+    }
+
+    for (size_t i = 0; i < g->count; i++) {
+        g->index[globals_bucket(g, g->names[i])] = i + 1;
+    }
+
+    return true;
+}
+
+int globals_define(Globals *g, const char *name) {
+    int slot = globals_find(g, name);
+    if (slot >= 0) {
+        return slot;
+    }
+
+    if (g->count == g->capacity && !globals_grow(g)) {
+        return -1;
+    }
+
+    slot                              = g->count++;
+    g->names[slot]                    = name;
+    g->values[slot]                   = new_int(0);
+    g->index[globals_bucket(g, name)] = slot + 1;
+    return slot;
+}
@@ -0,0 +1,37 @@
+/**
+ * Global variables, looked up by name.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_RUNTIME_GLOBALS_H
+#define TARO_RUNTIME_GLOBALS_H
+
+#include "value.h"
+
+#include <stddef.h>
+
+/**
+ * Globals live in a flat array in definition order, and never move slot once
+ * defined. `index` is an open addressing table from name to slot.
+ */
+typedef struct Globals {
+    const char **names;
+    Value *values;
+    size_t count, capacity;
+
+    int *index; // slot + 1, 0 for an empty bucket
+    size_t index_capacity;
+} Globals;
+
+void globals_init(Globals *g);
+void globals_free(Globals *g);
+
+/* Slot of global `name`, or -1 if it hasn't been defined */
+int globals_find(Globals *g, const char *name);
+
+/* Slot of global `name`, defining it if needed. -1 when out of memory */
+int globals_define(Globals *g, const char *name);
+
+#endif
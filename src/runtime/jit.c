@@ -0,0 +1,983 @@
+/**
+ * Baseline template JIT for Linux on x86-64.
+ *
+ * Native code works on the VM's own operand stack so the interpreter can pick
+ * up anywhere: rbx holds the VM, r12 the running frame's locals and r13 the
+ * next free stack slot. A region is entered at an instruction where nothing is
+ * cached in registers (its start, jump targets and the instruction after one
+ * the interpreter runs) and leaves through a shared exit that writes `ip` and
+ * `sp` back.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "jit.h"
+#include "bytecode.h"
+#include "vm.h"
+
+#include "../util/logger.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Room a single instruction's template needs at most */
+#define JIT_MAX_TEMPLATE 128
+
+_Static_assert(TY_FLOATARRAY == TY_INTARRAY + 1 && TY_FLOAT == TY_INT + 1,
+               "array templates pick the element type arithmetically");
+
+enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13 };
+
+/* Condition codes, as in the low nibble of jcc and setcc */
+enum Cond {
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A  = 0x7,
+    CC_NP = 0xB,
+    CC_L  = 0xC,
+    CC_G  = 0xF,
+};
+
+#define VM_REG RBX
+#define LOCALS R12
+#define SP R13
+
+#define VSIZE ((int)sizeof(Value))
+#define VTYPE ((int)offsetof(Value, type))
+#define VDATA ((int)offsetof(Value, data))
+
+/* Displacement of the value `n` slots below the stack pointer */
+#define TOP(n, field) (-(n) * VSIZE + (field))
+
+#define VM_STACK ((int)(offsetof(VM, mem) + offsetof(VMMem, stack)))
+#define VM_SP ((int)(offsetof(VM, mem) + offsetof(VMMem, sp)))
+
+typedef struct Emitter {
+    unsigned char *code;
+    size_t size, capacity;
+    bool full;
+} Emitter;
+
+static void byte(Emitter *e, unsigned value) {
+    if (e->size < e->capacity) {
+        e->code[e->size++] = (unsigned char)value;
+    } else {
+        e->full = true;
+    }
+}
+
+static void imm32(Emitter *e, int32_t value) {
+    for (int i = 0; i < 4; i++) {
+        byte(e, ((uint32_t)value >> (8 * i)) & 0xFF);
+    }
+}
+
+static void patch32(Emitter *e, size_t at, int32_t value) {
+    if (at + 4 <= e->size) {
+        memcpy(e->code + at, &value, 4);
+    }
+}
+
+/* REX prefix for the registers in the reg and r/m fields, left out when plain */
+static void rex(Emitter *e, bool wide, int reg, int rm) {
+    unsigned prefix = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0);
+    if (prefix != 0x40) {
+        byte(e, prefix);
+    }
+}
+
+/* ModRM for [base + disp32], rsp and r12 need a SIB byte */
+static void mem(Emitter *e, int reg, int base, int32_t disp) {
+    byte(e, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) {
+        byte(e, 0x24);
+    }
+    imm32(e, disp);
+}
+
+static void regs(Emitter *e, int reg, int rm) {
+    byte(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* op reg, [base + disp] or op [base + disp], reg */
+static void op_mem(Emitter *e, bool wide, unsigned op, int reg, int base, int32_t disp) {
+    rex(e, wide, reg, base);
+    byte(e, op);
+    mem(e, reg, base, disp);
+}
+
+static void load32(Emitter *e, int reg, int base, int32_t disp) {
+    op_mem(e, false, 0x8B, reg, base, disp);
+}
+
+static void store32(Emitter *e, int base, int32_t disp, int reg) {
+    op_mem(e, false, 0x89, reg, base, disp);
+}
+
+static void load64(Emitter *e, int reg, int base, int32_t disp) {
+    op_mem(e, true, 0x8B, reg, base, disp);
+}
+
+static void store64(Emitter *e, int base, int32_t disp, int reg) {
+    op_mem(e, true, 0x89, reg, base, disp);
+}
+
+static void store_imm32(Emitter *e, int base, int32_t disp, int32_t value) {
+    op_mem(e, false, 0xC7, 0, base, disp);
+    imm32(e, value);
+}
+
+/* cmp dword [base + disp], imm8 */
+static void cmp_mem_imm(Emitter *e, int base, int32_t disp, int8_t value) {
+    op_mem(e, false, 0x83, 7, base, disp);
+    byte(e, (uint8_t)value);
+}
+
+/* Two register ALU op, `op` is the r/m, reg form: add 01, sub 29, cmp 39, mov 89 */
+static void alu(Emitter *e, unsigned op, int dst, int src) {
+    rex(e, false, src, dst);
+    byte(e, op);
+    regs(e, src, dst);
+}
+
+/* add, sub or cmp (ext 0, 5, 7) of an 8-bit immediate to a 32 or 64-bit register */
+static void alu_imm(Emitter *e, bool wide, int ext, int reg, int8_t value) {
+    rex(e, wide, 0, reg);
+    byte(e, 0x83);
+    regs(e, ext, reg);
+    byte(e, (uint8_t)value);
+}
+
+/* Move the stack pointer by `n` values */
+static void move_sp(Emitter *e, int n) {
+    rex(e, true, 0, SP);
+    byte(e, 0x81);
+    regs(e, 0, SP);
+    imm32(e, n * VSIZE);
+}
+
+static void mov_imm(Emitter *e, int reg, int32_t value) {
+    rex(e, false, 0, reg);
+    byte(e, 0xB8 + (reg & 7));
+    imm32(e, value);
+}
+
+static void setcc(Emitter *e, enum Cond cc, int reg) {
+    byte(e, 0x0F);
+    byte(e, 0x90 + cc);
+    regs(e, 0, reg);
+}
+
+static void movzx8(Emitter *e, int dst, int src) {
+    byte(e, 0x0F);
+    byte(e, 0xB6);
+    regs(e, dst, src);
+}
+
+/* SSE op between registers, `prefix` 0 for none */
+static void sse(Emitter *e, unsigned prefix, unsigned op, int dst, int src) {
+    if (prefix != 0) {
+        byte(e, prefix);
+    }
+    byte(e, 0x0F);
+    byte(e, op);
+    regs(e, dst, src);
+}
+
+/* movss/movdqu between a register and memory, prefix F3 */
+static void sse_mem(Emitter *e, unsigned op, int xmm, int base, int32_t disp) {
+    byte(e, 0xF3);
+    rex(e, false, xmm, base);
+    byte(e, 0x0F);
+    byte(e, op);
+    mem(e, xmm, base, disp);
+}
+
+#define MOVSS_LOAD 0x10
+#define MOVSS_STORE 0x11
+#define MOVDQU_LOAD 0x6F
+#define MOVDQU_STORE 0x7F
+
+/* Copy a whole value between two stack or local slots */
+static void copy_value(Emitter *e, int dst, int32_t dst_disp, int src, int32_t src_disp) {
+    _Static_assert(sizeof(Value) == 24, "values are copied in a 16 and an 8 byte move");
+    sse_mem(e, MOVDQU_LOAD, 1, src, src_disp);
+    sse_mem(e, MOVDQU_STORE, 1, dst, dst_disp);
+    load64(e, RCX, src, src_disp + 16);
+    store64(e, dst, dst_disp + 16, RCX);
+}
+
+/* jmp or jcc with a rel32 to fill in, returns where the rel32 is */
+static size_t jump(Emitter *e, int cc) {
+    if (cc < 0) {
+        byte(e, 0xE9);
+    } else {
+        byte(e, 0x0F);
+        byte(e, 0x80 + cc);
+    }
+    imm32(e, 0);
+    return e->size - 4;
+}
+
+static void link_jump(Emitter *e, size_t at, size_t target) {
+    patch32(e, at, (int32_t)((ptrdiff_t)target - (ptrdiff_t)(at + 4)));
+}
+
+/* Where the value on top of the stack is while compiling */
+enum Cached {
+    IN_MEMORY, // on the stack like in the interpreter
+    IN_EAX,    // an int in eax, not pushed yet
+    IN_XMM0,   // a float in xmm0, not pushed yet
+};
+
+enum {
+    IN_REGION = 1, // reachable from the start
+    LABEL     = 2, // entered with nothing cached: jumped to or resumed at
+    NATIVE    = 4, // has a template
+};
+
+typedef struct Fixup {
+    size_t at;
+    size_t target; // instruction to jump to, or to leave native code at
+} Fixup;
+
+typedef struct Region {
+    VM *vm;
+    Jit *jit;
+    Emitter e;
+    enum Cached cached;
+
+    // Indexed by instruction
+    unsigned char *flags;
+    int *depth; // stack depth relative to the start
+    size_t *offset;
+
+    Fixup *fixups;
+    size_t fixup_count;
+    Fixup *exits; // conditional exits, `target` is the instruction
+    size_t exit_count;
+
+    int max_depth, locals;
+} Region;
+
+static bool is_jump(enum VMOpcode op) { return op >= J && op <= JGE; }
+
+/* Whether an _I or _F instruction was quickened and checks its operand types */
+static bool is_guarded(VMInstruction *ins) {
+    switch (ins->opcode) {
+    case CMP_I:
+    case CMP_F:
+    case ADD_I:
+    case SUB_I:
+    case MUL_I:
+    case DIV_I:
+    case ADD_F:
+    case SUB_F:
+    case MUL_F:
+    case DIV_F:
+        return ins->operands[VM_IC_OPERAND].int_value >= 0;
+    default:
+        return false;
+    }
+}
+
+/* Jump target of a jump or CHKA, -1 when it leaves the code */
+static long branch_target(Region *r, VMInstruction *ins) {
+    long target = ins->operands_count > 0 ? ins->operands[0].int_value : -1;
+    return target >= 0 && (size_t)target < r->vm->code_size ? target : -1;
+}
+
+static bool has_template(VMInstruction *ins) {
+    switch (ins->opcode) {
+    case NOP:
+    case SETL:
+    case GETL:
+    case GETL2:
+    case INCL:
+    case JCMP_L:
+    case JCMP_K:
+    case PUSH_I:
+    case PUSH_F:
+    case POP:
+    case CMP_I:
+    case CMP_F:
+    case ADD_I:
+    case SUB_I:
+    case MUL_I:
+    case DIV_I:
+    case ADD_F:
+    case SUB_F:
+    case MUL_F:
+    case DIV_F:
+    case GETA:
+    case SETA:
+    case GETAU:
+    case SETAU:
+        return true;
+    default:
+        return is_jump(ins->opcode);
+    }
+}
+
+/* Reach `next` with `depth` values on the stack, queueing it the first time */
+static bool visit(Region *r, size_t next, int depth, size_t *queue, size_t *count) {
+    if (r->flags[next] & IN_REGION) {
+        return r->depth[next] == depth;
+    }
+
+    r->flags[next] |= IN_REGION;
+    r->depth[next] = depth;
+    queue[(*count)++] = next;
+    return true;
+}
+
+/**
+ * Find the instructions reachable from `start` and the stack depth at each, which
+ * has to be the same along every path. Instructions without a template end the
+ * native code and the ones after them become labels to resume at.
+ */
+static bool region_scan(Region *r, size_t start) {
+    VM *vm        = r->vm;
+    size_t *queue = (size_t *)malloc(vm->code_size * sizeof(size_t));
+    size_t count  = 0;
+    bool ok       = queue != NULL && visit(r, start, 0, queue, &count);
+    r->flags[start] |= LABEL;
+
+    while (ok && count > 0) {
+        size_t ip          = queue[--count];
+        VMInstruction *ins = &vm->code[ip];
+        int depth          = r->depth[ip];
+        int pops, pushes;
+
+        if (!instruction_stack_use(ins, vm->funcs, vm->func_count, &pops, &pushes)) {
+            continue;
+        }
+
+        if (depth < pops) {
+            ok = false;
+            break;
+        }
+
+        depth += pushes - pops;
+        if (depth > r->max_depth) {
+            r->max_depth = depth;
+        }
+
+        bool native = has_template(ins);
+        if (is_getl(ins->opcode) || ins->opcode == SETL) {
+            int slot = ins->operands[0].int_value;
+            native   = slot >= 0 && slot < INT_MAX / VSIZE;
+            if (native && slot + 1 > r->locals) {
+                r->locals = slot + 1;
+            }
+        }
+
+        if (is_jump(ins->opcode) || ins->opcode == CHKA) {
+            long target = branch_target(r, ins);
+            if (target < 0) {
+                native = false;
+            } else {
+                ok = visit(r, target, depth, queue, &count);
+                r->flags[target] |= LABEL;
+            }
+        }
+
+        if (native) {
+            r->flags[ip] |= NATIVE;
+        }
+
+        // Everything else can go on to the next instruction, which the
+        // interpreter resumes native code at after running one without a template
+        if (ok && ins->opcode != J && ip + 1 < vm->code_size) {
+            ok = visit(r, ip + 1, depth, queue, &count);
+            if (!native || ins->opcode == DIV_I || ins->opcode == GETA ||
+                ins->opcode == SETA || is_guarded(ins)) {
+                r->flags[ip + 1] |= LABEL;
+            }
+        }
+    }
+
+    free(queue);
+    return ok;
+}
+
+/* Push whatever is cached in a register */
+static void flush(Region *r) {
+    Emitter *e = &r->e;
+    if (r->cached == IN_EAX) {
+        store_imm32(e, SP, VTYPE, TY_INT);
+        store32(e, SP, VDATA, RAX);
+        move_sp(e, 1);
+    } else if (r->cached == IN_XMM0) {
+        store_imm32(e, SP, VTYPE, TY_FLOAT);
+        sse_mem(e, MOVSS_STORE, 0, SP, VDATA);
+        move_sp(e, 1);
+    }
+    r->cached = IN_MEMORY;
+}
+
+static bool add_fixup(Fixup **list, size_t *count, size_t at, size_t target) {
+    Fixup *grown = (Fixup *)realloc(*list, (*count + 1) * sizeof(Fixup));
+    if (grown == NULL) {
+        return false;
+    }
+
+    *list              = grown;
+    grown[(*count)++] = (Fixup){.at = at, .target = target};
+    return true;
+}
+
+/* Leave native code at instruction `ip` when condition `cc` holds */
+static void exit_if(Region *r, enum Cond cc, size_t ip) {
+    size_t at = jump(&r->e, cc);
+    if (!add_fixup(&r->exits, &r->exit_count, at, ip)) {
+        r->e.full = true;
+    }
+}
+
+/* Leave native code at instruction `ip` */
+static void exit_to(Region *r, size_t ip) {
+    flush(r);
+    mov_imm(&r->e, RAX, (int32_t)ip);
+    link_jump(&r->e, jump(&r->e, -1), r->jit->leave);
+}
+
+/**
+ * Charge the block a jump at `ip` ends. A backward jump leaves native code first
+ * if there isn't enough fuel, so the interpreter charges it and yields.
+ */
+static void charge_fuel(Region *r, size_t ip) {
+    Emitter *e = &r->e;
+    int cost   = r->vm->charges[ip];
+    if (cost == 0) {
+        return;
+    }
+
+    if ((size_t)r->vm->code[ip].operands[0].int_value <= ip) {
+        op_mem(e, true, 0x81, 7, VM_REG, offsetof(VM, fuel)); // cmp qword [fuel], cost
+        imm32(e, cost);
+        exit_if(r, CC_L, ip);
+    }
+    op_mem(e, true, 0x81, 5, VM_REG, offsetof(VM, fuel)); // sub qword [fuel], cost
+    imm32(e, cost);
+}
+
+/* Pop two ints, the right hand side into eax and the left into ecx */
+static void int_operands(Region *r) {
+    Emitter *e = &r->e;
+    if (r->cached == IN_XMM0) {
+        flush(r);
+    }
+
+    if (r->cached == IN_EAX) {
+        load32(e, RCX, SP, TOP(1, VDATA));
+        move_sp(e, -1);
+    } else {
+        load32(e, RAX, SP, TOP(1, VDATA));
+        load32(e, RCX, SP, TOP(2, VDATA));
+        move_sp(e, -2);
+    }
+    r->cached = IN_MEMORY;
+}
+
+/* Pop two floats, the right hand side into xmm0 and the left into xmm1 */
+static void float_operands(Region *r) {
+    Emitter *e = &r->e;
+    if (r->cached == IN_EAX) {
+        flush(r);
+    }
+
+    if (r->cached == IN_XMM0) {
+        sse_mem(e, MOVSS_LOAD, 1, SP, TOP(1, VDATA));
+        move_sp(e, -1);
+    } else {
+        sse_mem(e, MOVSS_LOAD, 0, SP, TOP(1, VDATA));
+        sse_mem(e, MOVSS_LOAD, 1, SP, TOP(2, VDATA));
+        move_sp(e, -2);
+    }
+    r->cached = IN_MEMORY;
+}
+
+/**
+ * Leave native code at a quickened instruction unless both operands have the
+ * type it was specialized for, the interpreter then turns it back into the
+ * generic instruction.
+ */
+static void guard_operands(Region *r, size_t ip, VMInstruction *ins,
+                           enum RuntimeValueType type) {
+    if (!is_guarded(ins)) {
+        return;
+    }
+
+    flush(r);
+    cmp_mem_imm(&r->e, SP, TOP(1, VTYPE), type);
+    exit_if(r, CC_NE, ip);
+    cmp_mem_imm(&r->e, SP, TOP(2, VTYPE), type);
+    exit_if(r, CC_NE, ip);
+}
+
+/* Store the comparison flags, eq from dl and dif as al - cl */
+static void store_flags(Emitter *e) {
+    movzx8(e, RDX, RDX);
+    store32(e, VM_REG, offsetof(VM, eq), RDX);
+    movzx8(e, RAX, RAX);
+    movzx8(e, RCX, RCX);
+    alu(e, 0x29, RAX, RCX);
+    store32(e, VM_REG, offsetof(VM, dif), RAX);
+}
+
+/**
+ * Check the array and index under the top `skip` values, leaving the array in
+ * rdx, the index in rax and the element type in ecx.
+ */
+static void array_operands(Region *r, size_t ip, int skip, bool checked) {
+    Emitter *e = &r->e;
+    int array = skip + 2, index = skip + 1;
+
+    load32(e, RCX, SP, TOP(array, VTYPE));
+    alu_imm(e, false, 5, RCX, TY_INTARRAY);
+    if (checked) {
+        cmp_mem_imm(e, SP, TOP(index, VTYPE), TY_INT);
+        exit_if(r, CC_NE, ip);
+        alu_imm(e, false, 7, RCX, 1);
+        exit_if(r, CC_A, ip);
+    }
+    alu_imm(e, false, 0, RCX, TY_INT);
+
+    load64(e, RDX, SP, TOP(array, VDATA));
+    load32(e, RAX, SP, TOP(index, VDATA));
+    if (checked) {
+        // One unsigned compare covers both ends
+        op_mem(e, false, 0x3B, RAX, RDX, offsetof(ArrayObj, count));
+        exit_if(r, CC_AE, ip);
+    }
+    load64(e, RDX, RDX, offsetof(ArrayObj, ints));
+}
+
+static void emit_geta(Region *r, size_t ip, bool checked) {
+    Emitter *e = &r->e;
+    flush(r);
+    array_operands(r, ip, 0, checked);
+
+    // mov eax, [rdx + rax * 4]
+    byte(e, 0x8B);
+    byte(e, 0x04);
+    byte(e, 0x82);
+    store32(e, SP, TOP(2, VTYPE), RCX);
+    store32(e, SP, TOP(2, VDATA), RAX);
+    move_sp(e, -1);
+}
+
+static void emit_seta(Region *r, size_t ip, bool checked) {
+    Emitter *e = &r->e;
+    flush(r);
+    array_operands(r, ip, 1, checked);
+    if (checked) {
+        op_mem(e, false, 0x3B, RCX, SP, TOP(1, VTYPE));
+        exit_if(r, CC_NE, ip);
+    }
+
+    // mov [rdx + rax * 4], ecx
+    load32(e, RCX, SP, TOP(1, VDATA));
+    byte(e, 0x89);
+    byte(e, 0x0C);
+    byte(e, 0x82);
+    move_sp(e, -3);
+}
+
+static void emit_instruction(Region *r, size_t ip) {
+    Emitter *e         = &r->e;
+    VMInstruction *ins = &r->vm->code[ip];
+    int operand        = ins->operands[0].int_value;
+
+    // A superinstruction runs as the GETL it replaced, followed by the rest of its
+    // sequence which is still in place
+    switch (is_getl(ins->opcode) ? GETL : ins->opcode) {
+    case NOP:
+        break;
+    case PUSH_I:
+        flush(r);
+        mov_imm(e, RAX, operand);
+        r->cached = IN_EAX;
+        break;
+    case PUSH_F:
+        flush(r);
+        mov_imm(e, RAX, operand); // the float's bits
+        byte(e, 0x66);
+        sse(e, 0, 0x6E, 0, RAX); // movd xmm0, eax
+        r->cached = IN_XMM0;
+        break;
+    case GETL:
+        flush(r);
+        copy_value(e, SP, 0, LOCALS, operand * VSIZE);
+        move_sp(e, 1);
+        break;
+    case SETL:
+        if (r->cached == IN_EAX) {
+            store_imm32(e, LOCALS, operand * VSIZE + VTYPE, TY_INT);
+            store32(e, LOCALS, operand * VSIZE + VDATA, RAX);
+        } else if (r->cached == IN_XMM0) {
+            store_imm32(e, LOCALS, operand * VSIZE + VTYPE, TY_FLOAT);
+            sse_mem(e, MOVSS_STORE, 0, LOCALS, operand * VSIZE + VDATA);
+        } else {
+            copy_value(e, LOCALS, operand * VSIZE, SP, TOP(1, 0));
+            move_sp(e, -1);
+        }
+        r->cached = IN_MEMORY;
+        break;
+    case POP:
+        if (r->cached == IN_MEMORY) {
+            move_sp(e, -1);
+        }
+        r->cached = IN_MEMORY;
+        break;
+    case ADD_I:
+    case SUB_I:
+    case MUL_I:
+        guard_operands(r, ip, ins, TY_INT);
+        int_operands(r);
+        if (ins->opcode == MUL_I) {
+            byte(e, 0x0F); // imul ecx, eax
+            byte(e, 0xAF);
+            regs(e, RCX, RAX);
+        } else {
+            alu(e, ins->opcode == ADD_I ? 0x01 : 0x29, RCX, RAX);
+        }
+        alu(e, 0x89, RAX, RCX);
+        r->cached = IN_EAX;
+        break;
+    case DIV_I:
+        // Zero and -1 divisors go to the interpreter, which reports division by
+        // zero and INT_MIN / -1 as errors and divides by -1 otherwise
+        guard_operands(r, ip, ins, TY_INT);
+        flush(r);
+        load32(e, RCX, SP, TOP(1, VDATA));
+        alu(e, 0x89, RDX, RCX);
+        alu_imm(e, false, 0, RDX, 1);
+        alu_imm(e, false, 7, RDX, 1);
+        exit_if(r, CC_BE, ip);
+        load32(e, RAX, SP, TOP(2, VDATA));
+        byte(e, 0x99); // cdq
+        byte(e, 0xF7); // idiv ecx
+        regs(e, 7, RCX);
+        move_sp(e, -2);
+        r->cached = IN_EAX;
+        break;
+    case ADD_F:
+    case SUB_F:
+    case MUL_F:
+    case DIV_F: {
+        static const unsigned char ops[] = {0x58, 0x5C, 0x59, 0x5E};
+        guard_operands(r, ip, ins, TY_FLOAT);
+        float_operands(r);
+        sse(e, 0xF3, ops[ins->opcode - ADD_F], 1, 0);
+        sse(e, 0, 0x28, 0, 1); // movaps xmm0, xmm1
+        r->cached = IN_XMM0;
+        break;
+    }
+    case CMP_I:
+        guard_operands(r, ip, ins, TY_INT);
+        int_operands(r);
+        alu(e, 0x39, RCX, RAX);
+        setcc(e, CC_E, RDX);
+        setcc(e, CC_G, RAX);
+        setcc(e, CC_L, RCX);
+        store_flags(e);
+        break;
+    case CMP_F:
+        // Unordered sets ZF, PF and CF: NaN compares unequal and neither less nor greater
+        guard_operands(r, ip, ins, TY_FLOAT);
+        float_operands(r);
+        sse(e, 0, 0x2E, 1, 0); // ucomiss xmm1, xmm0
+        setcc(e, CC_A, RAX);
+        setcc(e, CC_E, RDX);
+        setcc(e, CC_NP, RCX);
+        byte(e, 0x20); // and dl, cl
+        regs(e, RCX, RDX);
+        sse(e, 0, 0x2E, 0, 1); // ucomiss xmm0, xmm1
+        setcc(e, CC_A, RCX);
+        store_flags(e);
+        break;
+    case J:
+    case JEQ:
+    case JNE:
+    case JLT:
+    case JGR:
+    case JLE:
+    case JGE: {
+        flush(r);
+        charge_fuel(r, ip);
+        int cc = -1;
+        if (ins->opcode == JEQ || ins->opcode == JNE) {
+            cmp_mem_imm(e, VM_REG, offsetof(VM, eq), ins->opcode == JEQ);
+            cc = CC_E;
+        } else if (ins->opcode != J) {
+            int dif = ins->opcode == JLT || ins->opcode == JGE ? -1 : 1;
+            cmp_mem_imm(e, VM_REG, offsetof(VM, dif), dif);
+            cc = ins->opcode == JLT || ins->opcode == JGR ? CC_E : CC_NE;
+        }
+        if (!add_fixup(&r->fixups, &r->fixup_count, jump(e, cc), operand)) {
+            e->full = true;
+        }
+        break;
+    }
+    case GETA:
+    case GETAU:
+        emit_geta(r, ip, ins->opcode == GETA);
+        break;
+    case SETA:
+    case SETAU:
+        emit_seta(r, ip, ins->opcode == SETA);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Translate the region, returning false if the buffer fills up */
+static bool region_emit(Region *r) {
+    VM *vm     = r->vm;
+    Emitter *e = &r->e;
+
+    for (size_t ip = 0; ip < vm->code_size && !e->full; ip++) {
+        if (!(r->flags[ip] & IN_REGION)) {
+            continue;
+        }
+
+        // Whatever falls through into a label has to match a jump into it
+        if (r->flags[ip] & LABEL) {
+            flush(r);
+        }
+        r->offset[ip] = e->size;
+
+        if (e->capacity - e->size < JIT_MAX_TEMPLATE) {
+            e->full = true;
+        } else if (!(r->flags[ip] & NATIVE)) {
+            exit_to(r, ip);
+        } else {
+            emit_instruction(r, ip);
+
+            // The instruction after has no code when it isn't in the region
+            bool falls = vm->code[ip].opcode != J;
+            if (falls && (ip + 1 >= vm->code_size || !(r->flags[ip + 1] & IN_REGION))) {
+                exit_to(r, ip + 1);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < r->fixup_count; i++) {
+        link_jump(e, r->fixups[i].at, r->offset[r->fixups[i].target]);
+    }
+
+    // Conditional exits run the instruction in the interpreter, nothing is cached
+    for (size_t i = 0; i < r->exit_count && !e->full; i++) {
+        if (e->capacity - e->size < JIT_MAX_TEMPLATE) {
+            e->full = true;
+            break;
+        }
+        link_jump(e, r->exits[i].at, e->size);
+        r->cached = IN_MEMORY;
+        exit_to(r, r->exits[i].target);
+    }
+
+    return !e->full;
+}
+
+/* Make the bytes in [from, to) of the buffer writable or executable */
+static bool protect(Jit *jit, size_t from, size_t to, bool exec) {
+    size_t page  = (size_t)sysconf(_SC_PAGESIZE);
+    size_t first = from / page * page;
+    size_t last  = (to + page - 1) / page * page;
+    int prot     = exec ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE;
+    return mprotect(jit->buffer + first, last - first, prot) == 0;
+}
+
+static bool region_compile(VM *vm, size_t start) {
+    Jit *jit = vm->jit;
+    Region r = {.vm = vm, .jit = jit};
+    bool ok  = false;
+
+    r.flags  = (unsigned char *)calloc(vm->code_size, 1);
+    r.depth  = (int *)calloc(vm->code_size, sizeof(int));
+    r.offset = (size_t *)calloc(vm->code_size, sizeof(size_t));
+    if (r.flags == NULL || r.depth == NULL || r.offset == NULL ||
+        !region_scan(&r, start)) {
+        goto done;
+    }
+
+    // Offsets are from the start of the buffer, so exits can reach the shared code
+    r.e = (Emitter){.code = jit->buffer, .size = jit->used, .capacity = JIT_BUFFER_SIZE};
+    if (!protect(jit, jit->used, JIT_BUFFER_SIZE, false)) {
+        goto done;
+    }
+
+    ok = region_emit(&r);
+    if (!protect(jit, jit->used, JIT_BUFFER_SIZE, true)) {
+        ok = false;
+    }
+    if (!ok) {
+        goto done;
+    }
+
+    for (size_t ip = 0; ip < vm->code_size; ip++) {
+        if ((r.flags[ip] & LABEL) && jit->entries[ip].code == NULL) {
+            jit->entries[ip] = (JitEntry){
+                .code   = jit->buffer + r.offset[ip],
+                .locals = r.locals,
+                .below  = r.depth[ip],
+                .above  = r.max_depth - r.depth[ip],
+            };
+        }
+    }
+    jit->used = r.e.size;
+
+done:
+    free(r.flags);
+    free(r.depth);
+    free(r.offset);
+    free(r.fixups);
+    free(r.exits);
+    return ok;
+}
+
+/**
+ * Shared entry and exit. Entering is a call of (vm, locals, sp, target) that
+ * saves the callee-saved registers it uses; leaving takes the instruction to
+ * resume at in eax.
+ */
+static bool emit_trampolines(Jit *jit) {
+    Emitter e = {.code = jit->buffer, .capacity = JIT_BUFFER_SIZE};
+
+    jit->enter = e.size;
+    byte(&e, 0x53); // push rbx
+    byte(&e, 0x41); // push r12
+    byte(&e, 0x54);
+    byte(&e, 0x41); // push r13
+    byte(&e, 0x55);
+    rex(&e, true, RDI, VM_REG);
+    byte(&e, 0x89);
+    regs(&e, RDI, VM_REG);
+    rex(&e, true, RSI, LOCALS);
+    byte(&e, 0x89);
+    regs(&e, RSI, LOCALS);
+    rex(&e, true, RDX, SP);
+    byte(&e, 0x89);
+    regs(&e, RDX, SP);
+    byte(&e, 0xFF); // jmp rcx
+    regs(&e, 4, RCX);
+
+    jit->leave = e.size;
+    store64(&e, VM_REG, offsetof(VM, ip), RAX);
+    rex(&e, true, SP, RAX); // mov rax, r13
+    byte(&e, 0x89);
+    regs(&e, SP, RAX);
+    load64(&e, RCX, VM_REG, VM_STACK); // mov rcx, [rbx + stack]
+    rex(&e, true, RCX, RAX); // sub rax, rcx
+    byte(&e, 0x29);
+    regs(&e, RCX, RAX);
+    alu(&e, 0x31, RDX, RDX); // xor edx, edx
+    mov_imm(&e, RCX, VSIZE);
+    rex(&e, true, 0, RCX); // div rcx
+    byte(&e, 0xF7);
+    regs(&e, 6, RCX);
+    store64(&e, VM_REG, VM_SP, RAX);
+    byte(&e, 0x41); // pop r13
+    byte(&e, 0x5D);
+    byte(&e, 0x41); // pop r12
+    byte(&e, 0x5C);
+    byte(&e, 0x5B); // pop rbx
+    byte(&e, 0xC3); // ret
+
+    jit->used = e.size;
+    return !e.full;
+}
+
+Jit *jit_create(size_t code_size) {
+    Jit *jit = (Jit *)calloc(1, sizeof(Jit));
+    if (jit == NULL) {
+        log_error("JIT: failed to allocate\n");
+        return NULL;
+    }
+
+    jit->code_size = code_size;
+    jit->entries   = (JitEntry *)calloc(code_size ? code_size : 1, sizeof(JitEntry));
+    jit->buffer    = (unsigned char *)mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED) {
+        jit->buffer = NULL;
+    }
+
+    if (jit->entries == NULL || jit->buffer == NULL ||
+        !emit_trampolines(jit) || !protect(jit, 0, jit->used, true)) {
+        log_error("JIT: failed to set up the code buffer\n");
+        jit_free(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void jit_free(Jit *jit) {
+    if (jit == NULL) {
+        return;
+    }
+
+    if (jit->buffer != NULL) {
+        munmap(jit->buffer, JIT_BUFFER_SIZE);
+    }
+    free(jit->entries);
+    free(jit);
+}
+
+bool jit_compile(VM *vm, size_t ip) {
+    if (ip >= vm->jit->code_size) {
+        return false;
+    }
+
+    // Already compiled as part of an earlier region
+    return vm->jit->entries[ip].code != NULL || region_compile(vm, ip);
+}
+
+void jit_enter(VM *vm) {
+    VMMem *mem = &vm->mem;
+    if (vm->ip >= vm->jit->code_size || vm->jit->entries[vm->ip].code == NULL ||
+        mem->frame_count == 0) {
+        return;
+    }
+
+    JitEntry *entry = &vm->jit->entries[vm->ip];
+    Frame *frame = &mem->frames[mem->frame_count - 1];
+    if (frame->nlocals < entry->locals || mem->sp < (size_t)entry->below ||
+        !stack_reserve(mem, mem->sp + entry->above)) {
+        return;
+    }
+
+    typedef void (*Enter)(VM *, Value *, Value *, const void *);
+    Enter enter = (Enter)(vm->jit->buffer + vm->jit->enter);
+    enter(vm, &mem->stack[frame->fp], &mem->stack[mem->sp], entry->code);
+}
+
+#else
+
+Jit *jit_create(size_t code_size) {
+    log_warn("JIT: only supported on x86-64 Linux, interpreting\n");
+    return NULL;
+}
+
+void jit_free(Jit *jit) {}
+
+bool jit_compile(struct VM *vm, size_t ip) { return false; }
+
+void jit_enter(struct VM *vm) {}
+
+#endif
@@ -0,0 +1,63 @@
+/**
+ * Baseline template JIT for Linux on x86-64.
+ *
+ * Hot code is translated one region at a time: everything reachable from a
+ * function entry or loop header without leaving the function. Each instruction
+ * is copied from a fixed machine code template into an executable buffer,
+ * jumps become native jumps and the value on top of the stack stays in a
+ * register between instructions when its type is known. Instructions without
+ * a template leave native code and run in the interpreter, which re-enters
+ * native code right after them.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_RUNTIME_JIT_H
+#define TARO_RUNTIME_JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Size of the executable buffer, nothing more is compiled once it fills up */
+#define JIT_BUFFER_SIZE (4 * 1024 * 1024)
+
+struct VM;
+
+/**
+ * Native entry point at an instruction. Entering needs `locals` local slots in
+ * the running frame, at least `below` values on the stack and room for `above`
+ * more.
+ */
+typedef struct JitEntry {
+    const void *code;
+    int locals;
+    int below, above;
+} JitEntry;
+
+typedef struct Jit {
+    unsigned char *buffer;
+    size_t used;
+
+    // Indexed by instruction
+    JitEntry *entries;
+    size_t code_size;
+
+    // Shared code at the start of the buffer that enters and leaves regions
+    size_t enter, leave;
+} Jit;
+
+/* JIT for `code_size` instructions, NULL if it's unsupported or allocation fails */
+Jit *jit_create(size_t code_size);
+void jit_free(Jit *jit);
+
+/* Compile the region starting at function entry or loop header `ip` */
+bool jit_compile(struct VM *vm, size_t ip);
+
+/**
+ * Run native code from the current instruction if there is any. Returns when it
+ * reaches an instruction left to the interpreter, with `ip` pointing there.
+ */
+void jit_enter(struct VM *vm);
+
+#endif
@@ -0,0 +1,560 @@
+#include "kernels.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Scalar kernels, used on targets without SIMD and for the tails the vector
+ * loops leave over. Int arithmetic goes through uint32_t so it wraps.
+ */
+
+static int32_t scalar_sum_i32(const int32_t *a, size_t n) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += (uint32_t)a[i];
+    return (int32_t)sum;
+}
+
+static float scalar_sum_f32(const float *a, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++)
+        sum += a[i];
+    return sum;
+}
+
+static void scalar_add_i32(int32_t *a, size_t n, int32_t x) {
+    for (size_t i = 0; i < n; i++)
+        a[i] = (int32_t)((uint32_t)a[i] + (uint32_t)x);
+}
+
+static void scalar_add_f32(float *a, size_t n, float x) {
+    for (size_t i = 0; i < n; i++)
+        a[i] += x;
+}
+
+static void scalar_scale_i32(int32_t *a, size_t n, int32_t k) {
+    for (size_t i = 0; i < n; i++)
+        a[i] = (int32_t)((uint32_t)a[i] * (uint32_t)k);
+}
+
+static void scalar_scale_f32(float *a, size_t n, float k) {
+    for (size_t i = 0; i < n; i++)
+        a[i] *= k;
+}
+
+static int32_t scalar_dot_i32(const int32_t *a, const int32_t *b, size_t n) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += (uint32_t)a[i] * (uint32_t)b[i];
+    return (int32_t)sum;
+}
+
+static float scalar_dot_f32(const float *a, const float *b, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+/* Fold `n` more elements into a running minimum or maximum */
+
+static int32_t scalar_min_i32_from(int32_t m, const int32_t *a, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        m = a[i] < m ? a[i] : m;
+    return m;
+}
+
+static int32_t scalar_max_i32_from(int32_t m, const int32_t *a, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        m = a[i] > m ? a[i] : m;
+    return m;
+}
+
+static float scalar_min_f32_from(float m, const float *a, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        m = a[i] < m ? a[i] : m;
+    return m;
+}
+
+static float scalar_max_f32_from(float m, const float *a, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        m = a[i] > m ? a[i] : m;
+    return m;
+}
+
+static int32_t scalar_min_i32(const int32_t *a, size_t n) {
+    return scalar_min_i32_from(a[0], a + 1, n - 1);
+}
+
+static int32_t scalar_max_i32(const int32_t *a, size_t n) {
+    return scalar_max_i32_from(a[0], a + 1, n - 1);
+}
+
+static float scalar_min_f32(const float *a, size_t n) {
+    return scalar_min_f32_from(a[0], a + 1, n - 1);
+}
+
+static float scalar_max_f32(const float *a, size_t n) {
+    return scalar_max_f32_from(a[0], a + 1, n - 1);
+}
+
+static void scalar_mask_i32(const int32_t *a, size_t n, int32_t x, enum KernelCmp op,
+                            int32_t *out) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = op == KERNEL_LT ? a[i] < x : op == KERNEL_GT ? a[i] > x : a[i] == x;
+    }
+}
+
+static void scalar_mask_f32(const float *a, size_t n, float x, enum KernelCmp op,
+                            int32_t *out) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = op == KERNEL_LT ? a[i] < x : op == KERNEL_GT ? a[i] > x : a[i] == x;
+    }
+}
+
+#ifdef KERNELS_X86
+
+/*
+ * SSE2: 4 lanes per step. Reductions keep one accumulator per lane and fold
+ * the lanes together at the end, in lane order.
+ */
+
+/* SSE2 has no 32-bit low multiply, build it from two 32x32->64 multiplies */
+static inline __m128i sse2_mullo_epi32(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd  = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128i sse2_select(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static int32_t sse2_lanes_sum_i32(__m128i v) {
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return scalar_sum_i32(lanes, 4);
+}
+
+static float sse2_lanes_sum_f32(__m128 v) {
+    float lanes[4];
+    _mm_storeu_ps(lanes, v);
+    return scalar_sum_f32(lanes, 4);
+}
+
+static int32_t sse2_sum_i32(const int32_t *a, size_t n) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i    = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i *)(a + i)));
+    return (int32_t)((uint32_t)sse2_lanes_sum_i32(acc) +
+                     (uint32_t)scalar_sum_i32(a + i, n - i));
+}
+
+static float sse2_sum_f32(const float *a, size_t n) {
+    __m128 acc = _mm_setzero_ps();
+    size_t i   = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_add_ps(acc, _mm_loadu_ps(a + i));
+    return sse2_lanes_sum_f32(acc) + scalar_sum_f32(a + i, n - i);
+}
+
+static void sse2_add_i32(int32_t *a, size_t n, int32_t x) {
+    __m128i vx = _mm_set1_epi32(x);
+    size_t i   = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+        _mm_storeu_si128((__m128i *)(a + i), _mm_add_epi32(v, vx));
+    }
+    scalar_add_i32(a + i, n - i, x);
+}
+
+static void sse2_add_f32(float *a, size_t n, float x) {
+    __m128 vx = _mm_set1_ps(x);
+    size_t i  = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(a + i, _mm_add_ps(_mm_loadu_ps(a + i), vx));
+    scalar_add_f32(a + i, n - i, x);
+}
+
+static void sse2_scale_i32(int32_t *a, size_t n, int32_t k) {
+    __m128i vk = _mm_set1_epi32(k);
+    size_t i   = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+        _mm_storeu_si128((__m128i *)(a + i), sse2_mullo_epi32(v, vk));
+    }
+    scalar_scale_i32(a + i, n - i, k);
+}
+
+static void sse2_scale_f32(float *a, size_t n, float k) {
+    __m128 vk = _mm_set1_ps(k);
+    size_t i  = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(a + i, _mm_mul_ps(_mm_loadu_ps(a + i), vk));
+    scalar_scale_f32(a + i, n - i, k);
+}
+
+static int32_t sse2_dot_i32(const int32_t *a, const int32_t *b, size_t n) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i    = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        acc        = _mm_add_epi32(acc, sse2_mullo_epi32(va, vb));
+    }
+    return (int32_t)((uint32_t)sse2_lanes_sum_i32(acc) +
+                     (uint32_t)scalar_dot_i32(a + i, b + i, n - i));
+}
+
+static float sse2_dot_f32(const float *a, const float *b, size_t n) {
+    __m128 acc = _mm_setzero_ps();
+    size_t i   = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    return sse2_lanes_sum_f32(acc) + scalar_dot_f32(a + i, b + i, n - i);
+}
+
+static int32_t sse2_min_i32(const int32_t *a, size_t n) {
+    __m128i acc = _mm_set1_epi32(a[0]);
+    size_t i    = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+        acc       = sse2_select(_mm_cmplt_epi32(v, acc), v, acc);
+    }
+
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return scalar_min_i32_from(scalar_min_i32(lanes, 4), a + i, n - i);
+}
+
+static int32_t sse2_max_i32(const int32_t *a, size_t n) {
+    __m128i acc = _mm_set1_epi32(a[0]);
+    size_t i    = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+        acc       = sse2_select(_mm_cmpgt_epi32(v, acc), v, acc);
+    }
+
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return scalar_max_i32_from(scalar_max_i32(lanes, 4), a + i, n - i);
+}
+
+static float sse2_min_f32(const float *a, size_t n) {
+    __m128 acc = _mm_set1_ps(a[0]);
+    size_t i   = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_min_ps(_mm_loadu_ps(a + i), acc);
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    return scalar_min_f32_from(scalar_min_f32(lanes, 4), a + i, n - i);
+}
+
+static float sse2_max_f32(const float *a, size_t n) {
+    __m128 acc = _mm_set1_ps(a[0]);
+    size_t i   = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_max_ps(_mm_loadu_ps(a + i), acc);
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    return scalar_max_f32_from(scalar_max_f32(lanes, 4), a + i, n - i);
+}
+
+static void sse2_mask_i32(const int32_t *a, size_t n, int32_t x, enum KernelCmp op,
+                          int32_t *out) {
+    __m128i vx  = _mm_set1_epi32(x);
+    __m128i one = _mm_set1_epi32(1);
+    size_t i    = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i m = op == KERNEL_LT   ? _mm_cmplt_epi32(v, vx)
+                    : op == KERNEL_GT ? _mm_cmpgt_epi32(v, vx)
+                                      : _mm_cmpeq_epi32(v, vx);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(m, one));
+    }
+    scalar_mask_i32(a + i, n - i, x, op, out + i);
+}
+
+static void sse2_mask_f32(const float *a, size_t n, float x, enum KernelCmp op,
+                          int32_t *out) {
+    __m128 vx   = _mm_set1_ps(x);
+    __m128i one = _mm_set1_epi32(1);
+    size_t i    = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(a + i);
+        __m128 m = op == KERNEL_LT   ? _mm_cmplt_ps(v, vx)
+                   : op == KERNEL_GT ? _mm_cmpgt_ps(v, vx)
+                                     : _mm_cmpeq_ps(v, vx);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(_mm_castps_si128(m), one));
+    }
+    scalar_mask_f32(a + i, n - i, x, op, out + i);
+}
+
+/* AVX2: the same kernels 8 lanes at a time, only called when cpuid allows it */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static int32_t avx2_sum_i32(const int32_t *a, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i    = 0;
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_add_epi32(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return (int32_t)((uint32_t)scalar_sum_i32(lanes, 8) +
+                     (uint32_t)scalar_sum_i32(a + i, n - i));
+}
+
+AVX2 static float avx2_sum_f32(const float *a, size_t n) {
+    __m256 acc = _mm256_setzero_ps();
+    size_t i   = 0;
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_add_ps(acc, _mm256_loadu_ps(a + i));
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, acc);
+    return scalar_sum_f32(lanes, 8) + scalar_sum_f32(a + i, n - i);
+}
+
+AVX2 static void avx2_add_i32(int32_t *a, size_t n, int32_t x) {
+    __m256i vx = _mm256_set1_epi32(x);
+    size_t i   = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+        _mm256_storeu_si256((__m256i *)(a + i), _mm256_add_epi32(v, vx));
+    }
+    scalar_add_i32(a + i, n - i, x);
+}
+
+AVX2 static void avx2_add_f32(float *a, size_t n, float x) {
+    __m256 vx = _mm256_set1_ps(x);
+    size_t i  = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(a + i, _mm256_add_ps(_mm256_loadu_ps(a + i), vx));
+    scalar_add_f32(a + i, n - i, x);
+}
+
+AVX2 static void avx2_scale_i32(int32_t *a, size_t n, int32_t k) {
+    __m256i vk = _mm256_set1_epi32(k);
+    size_t i   = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+        _mm256_storeu_si256((__m256i *)(a + i), _mm256_mullo_epi32(v, vk));
+    }
+    scalar_scale_i32(a + i, n - i, k);
+}
+
+AVX2 static void avx2_scale_f32(float *a, size_t n, float k) {
+    __m256 vk = _mm256_set1_ps(k);
+    size_t i  = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(a + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), vk));
+    scalar_scale_f32(a + i, n - i, k);
+}
+
+AVX2 static int32_t avx2_dot_i32(const int32_t *a, const int32_t *b, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i    = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        acc        = _mm256_add_epi32(acc, _mm256_mullo_epi32(va, vb));
+    }
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return (int32_t)((uint32_t)scalar_sum_i32(lanes, 8) +
+                     (uint32_t)scalar_dot_i32(a + i, b + i, n - i));
+}
+
+AVX2 static float avx2_dot_f32(const float *a, const float *b, size_t n) {
+    __m256 acc = _mm256_setzero_ps();
+    size_t i   = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 va = _mm256_loadu_ps(a + i);
+        acc       = _mm256_add_ps(acc, _mm256_mul_ps(va, _mm256_loadu_ps(b + i)));
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, acc);
+    return scalar_sum_f32(lanes, 8) + scalar_dot_f32(a + i, b + i, n - i);
+}
+
+AVX2 static int32_t avx2_min_i32(const int32_t *a, size_t n) {
+    __m256i acc = _mm256_set1_epi32(a[0]);
+    size_t i    = 0;
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_min_epi32(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return scalar_min_i32_from(scalar_min_i32(lanes, 8), a + i, n - i);
+}
+
+AVX2 static int32_t avx2_max_i32(const int32_t *a, size_t n) {
+    __m256i acc = _mm256_set1_epi32(a[0]);
+    size_t i    = 0;
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_max_epi32(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return scalar_max_i32_from(scalar_max_i32(lanes, 8), a + i, n - i);
+}
+
+AVX2 static float avx2_min_f32(const float *a, size_t n) {
+    __m256 acc = _mm256_set1_ps(a[0]);
+    size_t i   = 0;
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_min_ps(_mm256_loadu_ps(a + i), acc);
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, acc);
+    return scalar_min_f32_from(scalar_min_f32(lanes, 8), a + i, n - i);
+}
+
+AVX2 static float avx2_max_f32(const float *a, size_t n) {
+    __m256 acc = _mm256_set1_ps(a[0]);
+    size_t i   = 0;
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_max_ps(_mm256_loadu_ps(a + i), acc);
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, acc);
+    return scalar_max_f32_from(scalar_max_f32(lanes, 8), a + i, n - i);
+}
+
+AVX2 static void avx2_mask_i32(const int32_t *a, size_t n, int32_t x, enum KernelCmp op,
+                               int32_t *out) {
+    __m256i vx  = _mm256_set1_epi32(x);
+    __m256i one = _mm256_set1_epi32(1);
+    size_t i    = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i m = op == KERNEL_LT   ? _mm256_cmpgt_epi32(vx, v)
+                    : op == KERNEL_GT ? _mm256_cmpgt_epi32(v, vx)
+                                      : _mm256_cmpeq_epi32(v, vx);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_and_si256(m, one));
+    }
+    scalar_mask_i32(a + i, n - i, x, op, out + i);
+}
+
+AVX2 static void avx2_mask_f32(const float *a, size_t n, float x, enum KernelCmp op,
+                               int32_t *out) {
+    __m256 vx   = _mm256_set1_ps(x);
+    __m256i one = _mm256_set1_epi32(1);
+    size_t i    = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(a + i);
+        __m256 m = op == KERNEL_LT   ? _mm256_cmp_ps(v, vx, _CMP_LT_OQ)
+                   : op == KERNEL_GT ? _mm256_cmp_ps(v, vx, _CMP_GT_OQ)
+                                     : _mm256_cmp_ps(v, vx, _CMP_EQ_OQ);
+        _mm256_storeu_si256((__m256i *)(out + i),
+                            _mm256_and_si256(_mm256_castps_si256(m), one));
+    }
+    scalar_mask_f32(a + i, n - i, x, op, out + i);
+}
+
+#endif
+
+/* Runtime dispatch, resolved once by kernels_init() */
+
+static struct {
+    int32_t (*sum_i32)(const int32_t *, size_t);
+    float (*sum_f32)(const float *, size_t);
+    void (*add_i32)(int32_t *, size_t, int32_t);
+    void (*add_f32)(float *, size_t, float);
+    void (*scale_i32)(int32_t *, size_t, int32_t);
+    void (*scale_f32)(float *, size_t, float);
+    int32_t (*dot_i32)(const int32_t *, const int32_t *, size_t);
+    float (*dot_f32)(const float *, const float *, size_t);
+    int32_t (*min_i32)(const int32_t *, size_t);
+    int32_t (*max_i32)(const int32_t *, size_t);
+    float (*min_f32)(const float *, size_t);
+    float (*max_f32)(const float *, size_t);
+    void (*mask_i32)(const int32_t *, size_t, int32_t, enum KernelCmp, int32_t *);
+    void (*mask_f32)(const float *, size_t, float, enum KernelCmp, int32_t *);
+} g_kernels;
+
+static pthread_once_t g_kernels_once = PTHREAD_ONCE_INIT;
+
+#define KERNELS_USE(_prefix)                                                             \
+    do {                                                                                 \
+        g_kernels.sum_i32   = _prefix##_sum_i32;                                         \
+        g_kernels.sum_f32   = _prefix##_sum_f32;                                         \
+        g_kernels.add_i32   = _prefix##_add_i32;                                         \
+        g_kernels.add_f32   = _prefix##_add_f32;                                         \
+        g_kernels.scale_i32 = _prefix##_scale_i32;                                       \
+        g_kernels.scale_f32 = _prefix##_scale_f32;                                       \
+        g_kernels.dot_i32   = _prefix##_dot_i32;                                         \
+        g_kernels.dot_f32   = _prefix##_dot_f32;                                         \
+        g_kernels.min_i32   = _prefix##_min_i32;                                         \
+        g_kernels.max_i32   = _prefix##_max_i32;                                         \
+        g_kernels.min_f32   = _prefix##_min_f32;                                         \
+        g_kernels.max_f32   = _prefix##_max_f32;                                         \
+        g_kernels.mask_i32  = _prefix##_mask_i32;                                        \
+        g_kernels.mask_f32  = _prefix##_mask_f32;                                        \
+    } while (0)
+
+static void kernels_select(void) {
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        KERNELS_USE(avx2);
+    } else {
+        KERNELS_USE(sse2);
+    }
+#else
+    KERNELS_USE(scalar);
+#endif
+}
+
+void kernels_init(void) { pthread_once(&g_kernels_once, kernels_select); }
+
+int32_t kernel_sum_i32(const int32_t *a, size_t n) { return g_kernels.sum_i32(a, n); }
+
+float kernel_sum_f32(const float *a, size_t n) { return g_kernels.sum_f32(a, n); }
+
+void kernel_add_i32(int32_t *a, size_t n, int32_t x) { g_kernels.add_i32(a, n, x); }
+
+void kernel_add_f32(float *a, size_t n, float x) { g_kernels.add_f32(a, n, x); }
+
+void kernel_scale_i32(int32_t *a, size_t n, int32_t k) { g_kernels.scale_i32(a, n, k); }
+
+void kernel_scale_f32(float *a, size_t n, float k) { g_kernels.scale_f32(a, n, k); }
+
+int32_t kernel_dot_i32(const int32_t *a, const int32_t *b, size_t n) {
+    return g_kernels.dot_i32(a, b, n);
+}
+
+float kernel_dot_f32(const float *a, const float *b, size_t n) {
+    return g_kernels.dot_f32(a, b, n);
+}
+
+int32_t kernel_min_i32(const int32_t *a, size_t n) { return g_kernels.min_i32(a, n); }
+
+int32_t kernel_max_i32(const int32_t *a, size_t n) { return g_kernels.max_i32(a, n); }
+
+float kernel_min_f32(const float *a, size_t n) { return g_kernels.min_f32(a, n); }
+
+float kernel_max_f32(const float *a, size_t n) { return g_kernels.max_f32(a, n); }
+
+void kernel_mask_i32(const int32_t *a, size_t n, int32_t x, enum KernelCmp op,
+                     int32_t *out) {
+    g_kernels.mask_i32(a, n, x, op, out);
+}
+
+void kernel_mask_f32(const float *a, size_t n, float x, enum KernelCmp op,
+                     int32_t *out) {
+    g_kernels.mask_f32(a, n, x, op, out);
+}
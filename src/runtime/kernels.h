@@ -0,0 +1,53 @@
+/**
+ * Vectorized kernels behind the bulk array builtins.
+ *
+ * Every kernel works on `n` contiguous unboxed elements. SSE2 is used on every
+ * x86-64 CPU and AVX2 when cpuid reports it, other targets run plain loops.
+ * Int arithmetic wraps like the interpreter's. Float sums and dot products add
+ * lane by lane, so the last bits can differ from a left to right loop.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_RUNTIME_KERNELS_H
+#define TARO_RUNTIME_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Comparison computed by the mask kernels */
+enum KernelCmp {
+    KERNEL_LT,
+    KERNEL_GT,
+    KERNEL_EQ,
+};
+
+/* Pick the widest implementation the CPU supports, must run before any kernel */
+void kernels_init(void);
+
+int32_t kernel_sum_i32(const int32_t *a, size_t n);
+float kernel_sum_f32(const float *a, size_t n);
+
+/* a[i] += x */
+void kernel_add_i32(int32_t *a, size_t n, int32_t x);
+void kernel_add_f32(float *a, size_t n, float x);
+
+/* a[i] *= k */
+void kernel_scale_i32(int32_t *a, size_t n, int32_t k);
+void kernel_scale_f32(float *a, size_t n, float k);
+
+int32_t kernel_dot_i32(const int32_t *a, const int32_t *b, size_t n);
+float kernel_dot_f32(const float *a, const float *b, size_t n);
+
+/* Smallest or largest element, `n` must be at least 1 */
+int32_t kernel_min_i32(const int32_t *a, size_t n);
+int32_t kernel_max_i32(const int32_t *a, size_t n);
+float kernel_min_f32(const float *a, size_t n);
+float kernel_max_f32(const float *a, size_t n);
+
+/* out[i] = 1 if `a[i] op x` holds, else 0 */
+void kernel_mask_i32(const int32_t *a, size_t n, int32_t x, enum KernelCmp op, int32_t *out);
+void kernel_mask_f32(const float *a, size_t n, float x, enum KernelCmp op, int32_t *out);
+
+#endif
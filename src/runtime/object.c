@@ -0,0 +1,437 @@
+/**
+ * Structures and shapes, arrays, strings and coroutines.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "object.h"
+
+#include "../util/hashtable.h"
+#include "../util/logger.h"
+
+#include <limits.h>
+
+static Shape *shape_create(Shape *parent, const char *name) {
+    Shape *shape = (Shape *)calloc(1, sizeof(Shape));
+    if (shape == NULL) {
+        log_error("VM: failed to allocate shape\n");
+        return NULL;
+    }
+
+    shape->parent = parent;
+    shape->name   = name;
+    if (parent != NULL) {
+        shape->count     = parent->count + 1;
+        shape->sibling   = parent->children;
+        parent->children = shape;
+    }
+
+    return shape;
+}
+
+int shape_tree_init(ShapeTree *tree) {
+    tree->root  = shape_create(NULL, NULL);
+    tree->count = 1;
+
+    return tree->root != NULL ? 0 : -1;
+}
+
+void shape_tree_free(ShapeTree *tree) {
+    // Free the tree bottom up without recursing, a chain can be as deep as a
+    // structure has fields
+    Shape *shape = tree->root;
+    while (shape != NULL) {
+        if (shape->children != NULL) {
+            Shape *child    = shape->children;
+            shape->children = child->sibling;
+            shape           = child;
+        } else {
+            Shape *parent = shape->parent;
+            free(shape);
+            shape = parent;
+        }
+    }
+
+    tree->root  = NULL;
+    tree->count = 0;
+}
+
+static bool same_name(const char *a, const char *b) {
+    return a == b || strcmp(a, b) == 0;
+}
+
+Shape *shape_add_field(ShapeTree *tree, Shape *shape, const char *name) {
+    for (Shape *child = shape->children; child != NULL; child = child->sibling) {
+        if (same_name(child->name, name)) {
+            return child;
+        }
+    }
+
+    Shape *fresh = shape_create(shape, name);
+    if (fresh != NULL) {
+        tree->count++;
+    }
+
+    return fresh;
+}
+
+int shape_find(Shape *shape, const char *name) {
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (same_name(shape->name, name)) {
+            return shape->count - 1;
+        }
+    }
+
+    return -1;
+}
+
+StructObj *struct_new(VMMem *mem, ShapeTree *tree, int slots) {
+    int capacity = slots > 0 ? slots : STRUCT_MIN_CAPACITY;
+    size_t size  = sizeof(StructObj) + capacity * sizeof(Value);
+    StructObj *s = (StructObj *)heap_alloc(mem, size, TY_STRUCTURE);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->shape    = tree->root;
+    s->fields   = s->slots;
+    s->capacity = capacity;
+    return s;
+}
+
+bool struct_grow(StructObj *s, Shape *shape, int slot) {
+    if (slot >= s->capacity) {
+        // The inline slots can't grow, move the fields out on the first overflow
+        int capacity  = s->capacity * 2;
+        Value *fields = s->fields == s->slots
+                            ? (Value *)malloc(capacity * sizeof(Value))
+                            : (Value *)realloc(s->fields, capacity * sizeof(Value));
+        if (fields == NULL) {
+            log_error("VM: failed to grow structure\n");
+            return false;
+        }
+
+        if (s->fields == s->slots) {
+            memcpy(fields, s->slots, s->shape->count * sizeof(Value));
+        }
+
+        s->fields   = fields;
+        s->capacity = capacity;
+    }
+
+    s->shape = shape;
+    return true;
+}
+
+ArrayObj *array_new(VMMem *mem, enum RuntimeValueType type, int count) {
+    ArrayObj *a = (ArrayObj *)heap_alloc(mem, sizeof(ArrayObj), type);
+    if (a == NULL) {
+        return NULL;
+    }
+
+    // Both element types are 4 bytes
+    a->ints = (int32_t *)calloc(count > 0 ? count : 1, sizeof(int32_t));
+    if (a->ints == NULL) {
+        log_error("VM: failed to allocate array of %d elements\n", count);
+        return NULL;
+    }
+
+    a->count    = count;
+    a->capacity = count;
+    return a;
+}
+
+bool array_reserve(ArrayObj *a, int count) {
+    if (count <= a->capacity) {
+        return true;
+    }
+
+    // Doubling keeps appends amortized O(1)
+    int capacity = a->capacity > 0 ? a->capacity : ARRAY_MIN_CAPACITY;
+    while (capacity < count) {
+        capacity = capacity > INT_MAX / 2 ? count : capacity * 2;
+    }
+
+    int32_t *ints = (int32_t *)realloc(a->ints, (size_t)capacity * sizeof(int32_t));
+    if (ints == NULL) {
+        return false;
+    }
+
+    a->ints     = ints;
+    a->capacity = capacity;
+    return true;
+}
+
+static Value small_string(const char *chars, int length) {
+    Value s             = {.type = TY_STRING};
+    s.data.small.length = (uint8_t)length;
+    memcpy(s.data.small.chars, chars, length);
+    return s;
+}
+
+bool string_new(VMMem *mem, const char *chars, int length, Value *out) {
+    if (length <= STRING_INLINE_MAX) {
+        *out = small_string(chars, length);
+        return true;
+    }
+
+    size_t size  = sizeof(StringObj) + (size_t)length + 1;
+    StringObj *s = (StringObj *)heap_alloc(mem, size, TY_LONGSTRING);
+    if (s == NULL) {
+        return false;
+    }
+
+    memcpy(s->data, chars, length);
+    s->length = length;
+    s->chars  = s->data;
+    *out      = new_object(TY_LONGSTRING, s);
+    return true;
+}
+
+/* Bytes of a string known to be inline or flat */
+static const char *flat_chars(Value *s) {
+    if (s->type == TY_STRING) {
+        return s->data.small.chars;
+    }
+
+    return ((StringObj *)s->data.object)->chars;
+}
+
+static bool is_rope(Value *s) {
+    return s->type == TY_LONGSTRING && ((StringObj *)s->data.object)->chars == NULL;
+}
+
+bool string_concat(VMMem *mem, Value *a, Value *b, Value *out) {
+    int la = string_length(a);
+    int lb = string_length(b);
+    if (lb == 0 || la == 0) {
+        *out = lb == 0 ? *a : *b;
+        return true;
+    }
+
+    if (la > INT_MAX - lb) {
+        log_error("VM: string too long\n");
+        return false;
+    }
+
+    if (la + lb <= STRING_INLINE_MAX) {
+        *out = small_string(a->data.small.chars, la);
+        memcpy(out->data.small.chars + la, b->data.small.chars, lb);
+        out->data.small.length = (uint8_t)(la + lb);
+        return true;
+    }
+
+    // Appending short pieces one at a time would make a node per piece, merge
+    // them into the inline right half of the rope while they fit
+    Value left = *a, right = *b;
+    if (is_rope(a) && b->type == TY_STRING) {
+        StringObj *rope = (StringObj *)a->data.object;
+        if (rope->right.type == TY_STRING &&
+            rope->right.data.small.length + lb <= STRING_INLINE_MAX) {
+            left = rope->left;
+            string_concat(mem, &rope->right, b, &right);
+        }
+    }
+
+    StringObj *s = (StringObj *)heap_alloc(mem, sizeof(StringObj), TY_LONGSTRING);
+    if (s == NULL) {
+        return false;
+    }
+
+    s->length = la + lb;
+    s->left   = left;
+    s->right  = right;
+    *out      = new_object(TY_LONGSTRING, s);
+    return true;
+}
+
+/* Copy the bytes of rope `s` into a buffer of its own */
+static bool string_flatten(StringObj *s) {
+    char *chars     = (char *)malloc((size_t)s->length + 1);
+    Value **pending = NULL;
+    size_t count = 0, capacity = 0;
+
+    // Fill the buffer back to front, finishing each right half before its left
+    // half. Left halves wait on an explicit stack: ropes built by appending in
+    // a loop are as deep as the loop ran, but they lean left and keep it short
+    char *end    = chars + s->length;
+    Value *piece = &s->right, *rest = &s->left;
+    while (chars != NULL) {
+        if (is_rope(piece)) {
+            StringObj *node = (StringObj *)piece->data.object;
+            if (rest != NULL) {
+                if (count == capacity) {
+                    capacity      = capacity ? capacity * 2 : 64;
+                    Value **grown =
+                        (Value **)realloc(pending, capacity * sizeof(Value *));
+                    if (grown == NULL) {
+                        break;
+                    }
+                    pending = grown;
+                }
+                pending[count++] = rest;
+            }
+
+            piece = &node->right;
+            rest  = &node->left;
+            continue;
+        }
+
+        int length = string_length(piece);
+        end -= length;
+        memcpy(end, flat_chars(piece), length);
+
+        if (rest != NULL) {
+            piece = rest;
+            rest  = NULL;
+        } else if (count > 0) {
+            piece = pending[--count];
+        } else {
+            free(pending);
+            chars[s->length] = '\0';
+            s->chars         = chars;
+            s->left          = new_int(0);
+            s->right         = new_int(0);
+            return true;
+        }
+    }
+
+    log_error("VM: failed to flatten string of %d bytes\n", s->length);
+    free(chars);
+    free(pending);
+    return false;
+}
+
+const char *string_chars(Value *s) {
+    if (is_rope(s) && !string_flatten((StringObj *)s->data.object)) {
+        return NULL;
+    }
+
+    return flat_chars(s);
+}
+
+uint32_t string_hash(Value *s) {
+    const char *chars = string_chars(s);
+    if (chars == NULL) {
+        return 0;
+    }
+
+    if (s->type == TY_STRING) {
+        return (uint32_t)fnv_hash_n(chars, s->data.small.length);
+    }
+
+    StringObj *obj = (StringObj *)s->data.object;
+    if (obj->hash == 0) {
+        obj->hash = (uint32_t)fnv_hash_n(chars, obj->length);
+    }
+
+    return obj->hash;
+}
+
+bool string_equal(Value *a, Value *b) {
+    int length = string_length(a);
+    if (length != string_length(b)) {
+        return false;
+    }
+
+    if (a->type == TY_LONGSTRING && a->data.object == b->data.object) {
+        return true;
+    }
+
+    // Long strings cache their hash, so comparing against the same one again
+    // is usually decided without touching the bytes
+    if (length > STRING_INLINE_MAX && string_hash(a) != string_hash(b)) {
+        return false;
+    }
+
+    const char *ca = string_chars(a), *cb = string_chars(b);
+    return ca != NULL && cb != NULL && memcmp(ca, cb, length) == 0;
+}
+
+int string_compare(Value *a, Value *b) {
+    const char *ca = string_chars(a), *cb = string_chars(b);
+    if (ca == NULL || cb == NULL) {
+        return 0;
+    }
+
+    int la = string_length(a), lb = string_length(b);
+    int order = memcmp(ca, cb, la < lb ? la : lb);
+    return order != 0 ? order : (la > lb) - (la < lb);
+}
+
+CoroObj *coro_new(VMMem *mem, CoroContext *spare) {
+    CoroObj *co = (CoroObj *)heap_alloc(mem, sizeof(CoroObj), TY_COROUTINE);
+    if (co == NULL) {
+        return NULL;
+    }
+
+    // Until then it is left to the collector with nothing to release
+    co->state = CORO_DEAD;
+    VMMem stack = {.stack_max = CORO_STACK_MAX, .frames_max = CORO_FRAMES_MAX};
+    if (spare != NULL) {
+        stack.stack            = spare->stack;
+        stack.stack_max        = spare->stack_max;
+        stack.stack_committed  = spare->stack_committed;
+        stack.frames           = spare->frames;
+        stack.frames_max       = spare->frames_max;
+        stack.frames_committed = spare->frames_committed;
+    } else if (!mem_reserve(&stack)) {
+        mem_release(&stack);
+        return NULL;
+    }
+
+    // What a spare had committed stays committed
+    co->ctx = (CoroContext){
+        .stack            = stack.stack,
+        .stack_max        = stack.stack_max,
+        .stack_committed  = stack.stack_committed,
+        .frames           = stack.frames,
+        .frames_max       = stack.frames_max,
+        .frames_committed = stack.frames_committed,
+    };
+    co->state = CORO_SUSPENDED;
+    return co;
+}
+
+void coro_release(CoroContext *ctx) {
+    VMMem stack = {
+        .stack      = ctx->stack,
+        .stack_max  = ctx->stack_max,
+        .frames     = ctx->frames,
+        .frames_max = ctx->frames_max,
+    };
+    mem_release(&stack);
+
+    *ctx = (CoroContext){0};
+}
+
+void object_free(HeapObj *obj) {
+    switch (obj->type) {
+    case TY_STRUCTURE: {
+        StructObj *s = (StructObj *)obj;
+        if (s->fields != s->slots) {
+            free(s->fields);
+        }
+        break;
+    }
+    case TY_INTARRAY:
+    case TY_FLOATARRAY:
+        free(((ArrayObj *)obj)->ints);
+        break;
+    case TY_LONGSTRING: {
+        StringObj *s = (StringObj *)obj;
+        if (s->chars != s->data) {
+            free(s->chars);
+        }
+        break;
+    }
+    case TY_COROUTINE:
+        coro_release(&((CoroObj *)obj)->ctx);
+        break;
+    default:
+        break;
+    }
+
+    free(obj);
+}
@@ -0,0 +1,195 @@
+/**
+ * Heap objects of the runtime: structures and the shapes describing their
+ * layout, arrays, strings and coroutines.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_RUNTIME_OBJECT_H
+#define TARO_RUNTIME_OBJECT_H
+
+#include "value.h"
+#include "vm_mem.h"
+
+#include <stdint.h>
+
+/** Inline slots of a structure allocated without a size hint */
+#define STRUCT_MIN_CAPACITY 4
+
+/** Capacity an array gets the first time it grows */
+#define ARRAY_MIN_CAPACITY 8
+
+/**
+ * A shape (hidden class) is the sequence of field names of a structure, field
+ * i lives in slot i. Shapes form a transition tree rooted at the empty shape:
+ * adding a field follows the child edge for that name, creating it the first
+ * time. Structures that got the same fields in the same order therefore share
+ * one shape, and a pointer compare tells whether two have the same layout.
+ */
+typedef struct Shape {
+    struct Shape *parent;   // shape without the last field, NULL for the root
+    struct Shape *children; // first shape extending this one by a field
+    struct Shape *sibling;  // next child of `parent`
+
+    const char *name; // last field, in slot count - 1
+    int count;
+} Shape;
+
+typedef struct ShapeTree {
+    Shape *root; // shape of a structure without fields
+    size_t count;
+} ShapeTree;
+
+/**
+ * Field values are stored in a flat slot array, allocated inline right after
+ * the header. `fields` points at `slots` until the structure gets more fields
+ * than it was allocated for, then at a separate array.
+ */
+typedef struct StructObj {
+    HeapObj obj;
+
+    Shape *shape;
+    Value *fields;
+    int capacity;
+    Value slots[];
+} StructObj;
+
+int shape_tree_init(ShapeTree *tree);
+void shape_tree_free(ShapeTree *tree);
+
+/* Shape with `name` appended to `shape` */
+Shape *shape_add_field(ShapeTree *tree, Shape *shape, const char *name);
+
+/* Slot of field `name`, or -1 */
+int shape_find(Shape *shape, const char *name);
+
+/* Structure without fields, with inline room for `slots` of them (0 for the default) */
+StructObj *struct_new(VMMem *mem, ShapeTree *tree, int slots);
+
+/* Make room for slot `slot` and switch to `shape`, which adds at most that slot */
+bool struct_grow(StructObj *s, Shape *shape, int slot);
+
+/**
+ * Arrays of ints or floats keep their elements unboxed in one contiguous
+ * buffer, so bulk operations can run vector kernels straight over it. The
+ * element type is the object's type, TY_INTARRAY or TY_FLOATARRAY.
+ */
+typedef struct ArrayObj {
+    HeapObj obj;
+
+    union {
+        int32_t *ints;
+        float *floats;
+    };
+    int count, capacity;
+} ArrayObj;
+
+/* Array of `count` zeroed elements, `type` is TY_INTARRAY or TY_FLOATARRAY */
+ArrayObj *array_new(VMMem *mem, enum RuntimeValueType type, int count);
+
+/* Make room for at least `count` elements, growing the capacity geometrically */
+bool array_reserve(ArrayObj *a, int count);
+
+static inline Value array_get(ArrayObj *a, int i) {
+    return a->obj.type == TY_INTARRAY ? new_int(a->ints[i]) : new_float(a->floats[i]);
+}
+
+static inline void array_set(ArrayObj *a, int i, Value *value) {
+    if (a->obj.type == TY_INTARRAY) {
+        a->ints[i] = value->data.int_value;
+    } else {
+        a->floats[i] = value->data.float_value;
+    }
+}
+
+/* Element type an array stores, TY_INT or TY_FLOAT */
+static inline enum RuntimeValueType array_elem_type(ArrayObj *a) {
+    return a->obj.type == TY_INTARRAY ? TY_INT : TY_FLOAT;
+}
+
+/**
+ * A string too long to store inline. Flat strings keep their bytes right after
+ * the header. Concatenation builds a rope node instead, holding both halves
+ * until the bytes are first needed; flattening copies them into a buffer of
+ * the node's own and drops the halves. Either way `length` is known up front
+ * and the hash is computed once, on first use.
+ */
+typedef struct StringObj {
+    HeapObj obj;
+
+    int length;
+    uint32_t hash; // 0 until computed
+    char *chars;   // NUL terminated, NULL while the rope isn't flattened
+    Value left, right;
+    char data[];
+} StringObj;
+
+/* String holding a copy of `length` bytes of `chars`, inline when it is short enough */
+bool string_new(VMMem *mem, const char *chars, int length, Value *out);
+
+/* `a` followed by `b`, sharing both rather than copying them when the result is long */
+bool string_concat(VMMem *mem, Value *a, Value *b, Value *out);
+
+static inline int string_length(Value *s) {
+    return s->type == TY_STRING ? s->data.small.length
+                                : ((StringObj *)s->data.object)->length;
+}
+
+/* NUL terminated bytes of a string, flattening a rope. NULL if that fails */
+const char *string_chars(Value *s);
+
+uint32_t string_hash(Value *s);
+bool string_equal(Value *a, Value *b);
+
+/* Negative, zero or positive as `a` sorts before, with or after `b` */
+int string_compare(Value *a, Value *b);
+
+/* Limits of a coroutine's stack, in values, and of its call nesting */
+#define CORO_STACK_MAX 4096
+#define CORO_FRAMES_MAX 1024
+
+enum CoroState {
+    CORO_SUSPENDED, // created or yielded, waiting to be resumed
+    CORO_RUNNING,
+    CORO_NORMAL, // resumed another coroutine and waits for it to yield
+    CORO_DEAD,   // its function returned or the VM was unloaded under it
+};
+
+/**
+ * Stack, frames and registers a coroutine runs on. The running one is in the VM
+ * itself, switching swaps it with the context saved in the coroutine object.
+ */
+typedef struct CoroContext {
+    Value *stack;
+    size_t sp, stack_max, stack_committed;
+    Frame *frames;
+    size_t frame_count, frames_max, frames_committed;
+    size_t ip;
+    int eq, dif;
+} CoroContext;
+
+/**
+ * A coroutine runs a function on a stack of its own, reserved like the VM's
+ * and committed as it grows. While it is suspended `ctx` holds its own context;
+ * while it runs it holds the context of the one that resumed it, `resumer`, to
+ * go back to when it yields or returns (NULL for the main program).
+ */
+typedef struct CoroObj {
+    HeapObj obj;
+
+    CoroContext ctx;
+    struct CoroObj *resumer;
+    enum CoroState state;
+    bool started; // resumed at least once, so a resume hands it a value
+} CoroObj;
+
+/* Suspended coroutine on the stack of `spare`, or on one it reserves if that is NULL */
+CoroObj *coro_new(VMMem *mem, CoroContext *spare);
+
+/* Release the stack and frames of `ctx`, a coroutine object stays until it is collected */
+void coro_release(CoroContext *ctx);
+
+void object_free(HeapObj *obj);
+
+#endif
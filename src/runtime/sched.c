@@ -0,0 +1,368 @@
+/**
+ * Work-stealing scheduler for VMs.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "sched.h"
+
+#include "builtins.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "../util/logger.h"
+#include "../util/parallel.h"
+
+/* Finished reads and writes a worker takes per tick */
+#define SCHED_IO_BATCH 64
+
+/* How long a worker with nothing to run but I/O in flight waits on it at once */
+#define SCHED_IO_WAIT_MS 1
+
+typedef struct SchedTask {
+    VM *vm;
+    Arena *arena;
+    SchedDone done;
+    void *ctx;
+} SchedTask;
+
+/**
+ * Run queue of one worker, a ring buffer of tasks in the order they are to run.
+ * The worker takes from the head and puts a VM that used up its slice back at
+ * the tail, so the VMs it holds take turns; thieves take from the head too.
+ */
+typedef struct SchedQueue {
+    pthread_mutex_t lock;
+    SchedTask **tasks;
+    size_t head, count, capacity;
+} SchedQueue;
+
+typedef struct SchedWorker {
+    Scheduler *sched;
+    SchedQueue queue;
+    pthread_t thread;
+    uint32_t seed; // picks the first worker to steal from
+
+    // Reads and writes of the VMs this worker ran, NULL if they block instead.
+    // A VM waiting on one is in no queue until the worker reaps it
+    Aio *aio;
+} SchedWorker;
+
+struct Scheduler {
+    SchedWorker *workers;
+    int count;           // workers set up
+    atomic_int nthreads; // workers started
+    size_t slice;
+
+    atomic_size_t queued; // tasks waiting in any queue
+    atomic_int sleeping;  // workers waiting for `work`
+    atomic_uint next;     // worker the next spawned task is queued on
+
+    // `live` counts the tasks not finished yet
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    size_t live;
+    bool stopping;
+};
+
+static int queue_push(SchedQueue *queue, SchedTask *task) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity == 0 ? 64 : queue->capacity * 2;
+        SchedTask **tasks = (SchedTask **)malloc(capacity * sizeof(SchedTask *));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+
+        // Unwrap the ring into the new buffer
+        for (size_t i = 0; i < queue->count; i++) {
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        }
+        free(queue->tasks);
+        queue->tasks    = tasks;
+        queue->head     = 0;
+        queue->capacity = capacity;
+    }
+
+    queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+static SchedTask *queue_take(SchedQueue *queue) {
+    SchedTask *task = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        task        = queue->tasks[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+/* Queue a task on `worker` and wake a sleeping worker to steal it */
+static int sched_queue(Scheduler *sched, SchedWorker *worker, SchedTask *task) {
+    if (queue_push(&worker->queue, task) != 0) {
+        return -1;
+    }
+    atomic_fetch_add(&sched->queued, 1);
+
+    // Both counters are sequentially consistent: a worker counts itself as
+    // sleeping before it checks `queued`, so if we don't see it, it sees the task
+    if (atomic_load(&sched->sleeping) > 0) {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_signal(&sched->work);
+        pthread_mutex_unlock(&sched->lock);
+    }
+
+    return 0;
+}
+
+/* Next task for `self`, from its own queue or stolen from another worker's */
+static SchedTask *find_task(SchedWorker *self) {
+    Scheduler *sched = self->sched;
+
+    SchedTask *task = queue_take(&self->queue);
+    if (task == NULL) {
+        int nthreads = atomic_load(&sched->nthreads);
+
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 17;
+        self->seed ^= self->seed << 5;
+        for (int i = 0; i < nthreads && task == NULL; i++) {
+            SchedWorker *victim = &sched->workers[(self->seed + i) % nthreads];
+            if (victim != self) {
+                task = queue_take(&victim->queue);
+            }
+        }
+    }
+
+    if (task != NULL) {
+        atomic_fetch_sub(&sched->queued, 1);
+    }
+    return task;
+}
+
+static void run_task(SchedWorker *self, SchedTask *task) {
+    Scheduler *sched = self->sched;
+    task->vm->aio    = self->aio;
+
+    enum VMStatus status = vm_run_slice(task->arena, task->vm, sched->slice);
+
+    if (status == VM_RUNNING) {
+        if (sched_queue(sched, self, task) == 0) {
+            return;
+        }
+
+        log_warn("scheduler: out of memory, running a VM to completion\n");
+        status = vm_run(task->arena, task->vm);
+    }
+
+    // Parked on the ring, reap_io picks it up again
+    if (status == VM_WAITING) {
+        task->vm->io.data = task;
+        return;
+    }
+
+    task->vm->aio = NULL;
+    if (task->done != NULL) {
+        task->done(task->vm, status, task->ctx);
+    }
+    free(task);
+
+    pthread_mutex_lock(&sched->lock);
+    if (--sched->live == 0) {
+        pthread_cond_broadcast(&sched->idle);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+static inline bool io_pending(SchedWorker *self) {
+    return self->aio != NULL && aio_pending(self->aio) > 0;
+}
+
+/**
+ * Hand the requests queued since the last tick to the kernel and queue the VMs
+ * whose requests finished, waiting up to `timeout_ms` for one if none has.
+ */
+static void reap_io(SchedWorker *self, int timeout_ms) {
+    AioRequest *done[SCHED_IO_BATCH];
+    size_t count = aio_reap(self->aio, done, SCHED_IO_BATCH, timeout_ms);
+
+    for (size_t i = 0; i < count; i++) {
+        SchedTask *task = (SchedTask *)done[i]->data;
+        builtin_io_complete(task->vm);
+
+        // A failed read or write ends the VM, which run_task reports
+        if (task->vm->status != VM_RUNNING || sched_queue(self->sched, self, task) != 0) {
+            run_task(self, task);
+        }
+    }
+}
+
+static void *sched_worker(void *arg) {
+    SchedWorker *self = (SchedWorker *)arg;
+    Scheduler *sched  = self->sched;
+
+    for (;;) {
+        if (io_pending(self)) {
+            reap_io(self, 0);
+        }
+
+        SchedTask *task = find_task(self);
+        if (task != NULL) {
+            run_task(self, task);
+            continue;
+        }
+
+        // The VMs parked here only wake up when this worker reaps them
+        if (io_pending(self)) {
+            reap_io(self, SCHED_IO_WAIT_MS);
+            continue;
+        }
+
+        // Counted as sleeping before looking at `queued`, so sched_queue either
+        // sees us and signals or its task is seen here
+        pthread_mutex_lock(&sched->lock);
+        atomic_fetch_add(&sched->sleeping, 1);
+        while (atomic_load(&sched->queued) == 0 && !sched->stopping) {
+            pthread_cond_wait(&sched->work, &sched->lock);
+        }
+        atomic_fetch_sub(&sched->sleeping, 1);
+        bool stop = sched->stopping && atomic_load(&sched->queued) == 0;
+        pthread_mutex_unlock(&sched->lock);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+Scheduler *sched_create(int nthreads, size_t slice) {
+    if (nthreads < 1) {
+        nthreads = 1;
+    } else if (nthreads > PARALLEL_MAX_THREADS) {
+        nthreads = PARALLEL_MAX_THREADS;
+    }
+
+    Scheduler *sched = (Scheduler *)calloc(1, sizeof(Scheduler));
+    if (sched == NULL) {
+        log_error("scheduler: out of memory\n");
+        return NULL;
+    }
+    sched->workers = (SchedWorker *)calloc(nthreads, sizeof(SchedWorker));
+    if (sched->workers == NULL) {
+        log_error("scheduler: out of memory\n");
+        free(sched);
+        return NULL;
+    }
+
+    sched->count = nthreads;
+    sched->slice = slice > 0 ? slice : SCHED_DEFAULT_SLICE;
+    atomic_init(&sched->nthreads, 0);
+    atomic_init(&sched->queued, 0);
+    atomic_init(&sched->sleeping, 0);
+    atomic_init(&sched->next, 0);
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        sched->workers[i].sched = sched;
+        sched->workers[i].seed  = (uint32_t)i * 2654435761u + 1;
+        sched->workers[i].aio   = aio_create(AIO_DEFAULT_ENTRIES);
+        pthread_mutex_init(&sched->workers[i].queue.lock, NULL);
+    }
+
+    // Workers only steal from the ones started before them
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&sched->workers[i].thread, NULL, sched_worker,
+                           &sched->workers[i]) != 0) {
+            log_warn("scheduler: failed to create worker thread, continuing with %d\n",
+                     i);
+            break;
+        }
+        atomic_store(&sched->nthreads, i + 1);
+    }
+
+    if (atomic_load(&sched->nthreads) == 0) {
+        log_error("scheduler: no worker threads\n");
+        sched_destroy(sched);
+        return NULL;
+    }
+
+    return sched;
+}
+
+void sched_destroy(Scheduler *sched) {
+    sched_wait(sched);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = true;
+    pthread_cond_broadcast(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+
+    int nthreads = atomic_load(&sched->nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(sched->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < sched->count; i++) {
+        pthread_mutex_destroy(&sched->workers[i].queue.lock);
+        free(sched->workers[i].queue.tasks);
+        aio_destroy(sched->workers[i].aio);
+    }
+
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->work);
+    pthread_cond_destroy(&sched->idle);
+    free(sched->workers);
+    free(sched);
+}
+
+int sched_spawn(Scheduler *sched, VM *vm, Arena *arena, SchedDone done, void *ctx) {
+    SchedTask *task = (SchedTask *)malloc(sizeof(SchedTask));
+    if (task == NULL) {
+        log_error("scheduler: out of memory\n");
+        return -1;
+    }
+    *task = (SchedTask){.vm = vm, .arena = arena, .done = done, .ctx = ctx};
+
+    pthread_mutex_lock(&sched->lock);
+    sched->live++;
+    pthread_mutex_unlock(&sched->lock);
+
+    unsigned next       = atomic_fetch_add(&sched->next, 1);
+    SchedWorker *worker = &sched->workers[next % atomic_load(&sched->nthreads)];
+    if (sched_queue(sched, worker, task) != 0) {
+        log_error("scheduler: out of memory\n");
+        free(task);
+
+        pthread_mutex_lock(&sched->lock);
+        if (--sched->live == 0) {
+            pthread_cond_broadcast(&sched->idle);
+        }
+        pthread_mutex_unlock(&sched->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+void sched_wait(Scheduler *sched) {
+    pthread_mutex_lock(&sched->lock);
+    while (sched->live > 0) {
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
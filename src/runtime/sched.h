@@ -0,0 +1,47 @@
+/**
+ * Scheduler that runs many isolated VMs on a fixed pool of worker threads.
+ *
+ * Each VM is a task that runs for a slice of instructions and then goes back
+ * on the queue of the worker that ran it. Every worker has a queue of its own
+ * and steals from the others when it runs dry, so thousands of VMs balance
+ * across the pool without a shared queue to fight over. A VM is only ever run
+ * by one worker at a time and collects its own garbage while it runs, so the
+ * collection work is spread over the pool along with everything else.
+ *
+ * Each worker also has an I/O ring. A VM that reads or writes submits to the
+ * ring of the worker running it and stays off the queues until that worker,
+ * which reaps finished requests once per tick, finds it done.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_RUNTIME_SCHED_H
+#define TARO_RUNTIME_SCHED_H
+
+#include "vm.h"
+
+/* Instructions a VM runs before it yields to the next one */
+#define SCHED_DEFAULT_SLICE 10000
+
+/* Called on a worker thread once a VM has halted, failed or run out of fuel */
+typedef void (*SchedDone)(VM *vm, enum VMStatus status, void *ctx);
+
+typedef struct Scheduler Scheduler;
+
+/* Start `nthreads` workers, NULL if none could be started */
+Scheduler *sched_create(int nthreads, size_t slice);
+
+/* Wait for every VM to finish, then stop the workers */
+void sched_destroy(Scheduler *sched);
+
+/**
+ * Queue a loaded VM. It belongs to the scheduler until `done` is called, which
+ * may be NULL.
+ */
+int sched_spawn(Scheduler *sched, VM *vm, Arena *arena, SchedDone done, void *ctx);
+
+/* Wait until every VM spawned so far has finished */
+void sched_wait(Scheduler *sched);
+
+#endif
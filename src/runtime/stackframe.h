@@ -1,18 +1,19 @@
 #ifndef TARO_RUNTIME_FRAME_H
 #define TARO_RUNTIME_FRAME_H
 
-#include "value.h"
+#include <stddef.h>
 
 /**
- * Stack frame
+ * Call frame. Frames are kept in a contiguous array in VMMem and don't own any
+ * storage: a frame's locals are the `nlocals` operand stack slots starting at
+ * `fp` (parameters first, pushed there by the caller), and its operands are
+ * pushed on top of them. Calling a function never allocates.
  */
 typedef struct Frame {
-    int pc;
-    Value locals[16];
-    int locals_count;
-
-    // Parent frame
-    struct Frame *parent;
+    size_t ret_ip; // where RET continues in the caller
+    size_t fp;     // stack index of local slot 0
+    int nlocals;   // copied from the function table
+    int func;      // function table index
 } Frame;
 
 #endif
@@ -0,0 +1,112 @@
+/**
+ * Tiered execution: moving hot code to native code or superinstructions.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#include "tier.h"
+#include "vm.h"
+
+#include "../util/logger.h"
+
+/* Whether `ins` is `op` as emitted by the compiler, not quickened from a generic one */
+static bool is_static(VMInstruction *ins, enum VMOpcode op) {
+    return ins->opcode == op && ins->operands[VM_IC_OPERAND].int_value < 0;
+}
+
+static bool is_cond_jump(enum VMOpcode op) {
+    return op >= JEQ && op <= JGE;
+}
+
+/**
+ * Replace the GETL at `ip` with the superinstruction for the sequence it
+ * starts, if there is one. Only its opcode changes: the handler reads the
+ * operands of the rest of the sequence where they are, and a jump into the
+ * middle still runs the original instructions.
+ */
+static void fuse(VM *vm, size_t ip) {
+    VMInstruction *ins = &vm->code[ip];
+    size_t left        = vm->code_size - ip;
+    if (ins->opcode != GETL || left < 2) {
+        return;
+    }
+
+    // The compiler only emits these with int operands, a quickened ADD_I or
+    // CMP_I could still turn back into a generic instruction
+    int slot = ins->operands[0].int_value;
+    if (left >= 4 && ins[1].opcode == PUSH_I && is_static(&ins[2], ADD_I) &&
+        ins[3].opcode == SETL && ins[3].operands[0].int_value == slot) {
+        ins->opcode = INCL;
+    } else if (left >= 4 && (is_getl(ins[1].opcode) || ins[1].opcode == PUSH_I) &&
+               is_static(&ins[2], CMP_I) && is_cond_jump(ins[3].opcode)) {
+        ins->opcode = ins[1].opcode == PUSH_I ? JCMP_K : JCMP_L;
+    } else if (is_getl(ins[1].opcode)) {
+        ins->opcode = GETL2;
+    }
+}
+
+/* Rewrite the instructions reachable from `start` without leaving its function */
+static void fuse_region(VM *vm, size_t start) {
+    unsigned char *seen = (unsigned char *)calloc(vm->code_size, 1);
+    size_t *queue       = (size_t *)malloc(vm->code_size * sizeof(size_t));
+    size_t count        = 0;
+    if (seen == NULL || queue == NULL) {
+        log_warn("VM: out of memory, interpreting without superinstructions\n");
+        free(seen);
+        free(queue);
+        return;
+    }
+
+    seen[start]    = 1;
+    queue[count++] = start;
+    while (count > 0) {
+        size_t ip          = queue[--count];
+        VMInstruction *ins = &vm->code[ip];
+        size_t next[2];
+        int targets = 0;
+
+        // Calls come back to the next instruction, superinstructions go on
+        // through the rest of their sequence
+        switch (ins->opcode) {
+        case RET:
+        case HALT:
+        case TAILCALL:
+            break;
+        case J:
+            next[targets++] = ins->operands[0].int_value;
+            break;
+        default:
+            if (is_cond_jump(ins->opcode) || ins->opcode == CHKA) {
+                next[targets++] = ins->operands[0].int_value;
+            }
+            next[targets++] = ip + 1;
+            break;
+        }
+
+        for (int i = 0; i < targets; i++) {
+            if (next[i] < vm->code_size && !seen[next[i]]) {
+                seen[next[i]]  = 1;
+                queue[count++] = next[i];
+            }
+        }
+    }
+
+    for (size_t ip = 0; ip < vm->code_size; ip++) {
+        if (seen[ip]) {
+            fuse(vm, ip);
+        }
+    }
+
+    free(seen);
+    free(queue);
+}
+
+void tier_up(VM *vm, size_t ip) {
+    // Native code is entered from the run loop, as soon as it reaches `ip`
+    if (vm->jit != NULL && jit_compile(vm, ip)) {
+        return;
+    }
+
+    fuse_region(vm, ip);
+}
@@ -0,0 +1,30 @@
+/**
+ * Tiered execution.
+ *
+ * Function entries and loop headers count how often they are reached. Once one
+ * is hot, the code reachable from it in its function moves up a tier: to native
+ * code when the JIT is on, otherwise to superinstructions rewritten in place.
+ * Either way the interpreter picks the new code up at the next instruction, so a
+ * long running loop switches tiers while it runs instead of on the next call.
+ *
+ * Authors:
+ * - Charlotte (megabytesofrem)
+ */
+
+#ifndef TARO_RUNTIME_TIER_H
+#define TARO_RUNTIME_TIER_H
+
+#include <stddef.h>
+
+/* Calls of a function before it moves up a tier */
+#define TIER_HOT_CALLS 32
+
+/* Backward jumps to a loop header before the loop moves up a tier */
+#define TIER_HOT_LOOPS 64
+
+struct VM;
+
+/* Move the code reachable from function entry or loop header `ip` up a tier */
+void tier_up(struct VM *vm, size_t ip);
+
+#endif
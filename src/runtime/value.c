@@ -1,7 +1,10 @@
 #include "value.h"
+#include "object.h"
 
 #include "../util/logger.h"
 
+#include <stdio.h>
+
 Value *value_create(enum RuntimeValueType type) {
     Value *val = (Value *)malloc(sizeof(Value));
     if (val == NULL) {
@@ -15,6 +18,76 @@ Value *value_create(enum RuntimeValueType type) {
     return val;
 }
 
-bool value_has_child_nodes(Value *val) {
-    return val->type == TY_GROWARRAY || val->type == TY_STRUCTURE || val->s_children > 0;
+/* Nested structures deeper than this print as {...}, which also stops cycles */
+#define VALUE_PRINT_DEPTH 4
+
+/* Arrays print at most this many elements */
+#define VALUE_PRINT_ITEMS 32
+
+static void value_print_depth(Value *val, int depth);
+
+/* Print the fields of `shape` in slot order, a shape only knows its last field */
+static void fields_print(StructObj *s, Shape *shape, int depth) {
+    if (shape->parent == NULL) {
+        return;
+    }
+
+    fields_print(s, shape->parent, depth);
+    printf(shape->count == 1 ? "%s = " : ", %s = ", shape->name);
+    value_print_depth(&s->fields[shape->count - 1], depth + 1);
+}
+
+static void struct_print(StructObj *s, int depth) {
+    if (depth >= VALUE_PRINT_DEPTH) {
+        printf("{...}");
+        return;
+    }
+
+    printf("{");
+    fields_print(s, s->shape, depth);
+    printf("}");
+}
+
+static void array_print(ArrayObj *a) {
+    printf("[");
+    for (int i = 0; i < a->count && i < VALUE_PRINT_ITEMS; i++) {
+        if (a->obj.type == TY_INTARRAY) {
+            printf(i == 0 ? "%d" : ", %d", a->ints[i]);
+        } else {
+            printf(i == 0 ? "%g" : ", %g", a->floats[i]);
+        }
+    }
+    printf(a->count > VALUE_PRINT_ITEMS ? ", ...]" : "]");
+}
+
+void value_print(Value *val) { value_print_depth(val, 0); }
+
+static void value_print_depth(Value *val, int depth) {
+    switch (val->type) {
+    case TY_INT:
+        printf("%d", val->data.int_value);
+        break;
+    case TY_FLOAT:
+        printf("%g", val->data.float_value);
+        break;
+    case TY_STRING:
+    case TY_LONGSTRING: {
+        const char *chars = string_chars(val);
+        printf("%s", chars != NULL ? chars : "<string>");
+        break;
+    }
+    case TY_STRUCTURE:
+        struct_print((StructObj *)val->data.object, depth);
+        break;
+    case TY_INTARRAY:
+    case TY_FLOATARRAY:
+        array_print((ArrayObj *)val->data.object);
+        break;
+    case TY_COROUTINE:
+        printf("<coroutine>");
+        break;
+    default:
+        printf("<value of type %d>", val->type);
+        break;
+    }
 }
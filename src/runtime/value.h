@@ -2,27 +2,28 @@
 #define TARO_RUNTIME_VALUE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-/* Macros to define values */
+/* Longest string stored inline in a value, longer ones live on the heap */
+#define STRING_INLINE_MAX 14
 
-#define FIXED_ARRAY false   /* The array is a fixed size */
-#define GROWABLE_ARRAY true /* The array is growable */
+/* Macros to define values */
 
 #define new_int(_val) ((Value){.type = TY_INT, .data.int_value = _val})
 #define new_float(_val) ((Value){.type = TY_FLOAT, .data.float_value = _val})
-#define new_string(_val) ((Value){.type = TY_STRING, .data.string_value = _val})
-
-#define new_array(_val, _count, _capacity, _growable)                                    \
-    ((Value){.type                = _growable ? TY_GROWARRAY : TY_FIXEDARRAY,            \
-             .s_children          = _val,                                                \
-             .s_children_count    = _count,                                              \
-             .s_children_capacity = _capacity})
+#define new_object(_type, _obj)                                                          \
+    ((Value){.type = _type, .data.object = (struct HeapObj *)(_obj)})
 
 #define as_int(_val) _val.int_value
 #define as_float(_val) _val.float_value
-#define as_string(_val) _val.string_value
+
+/* Whether a value refers to a heap object (and is traced by the GC) */
+#define is_object(_val) ((_val).type >= TY_STRUCTURE)
+
+/* Whether a value is a string, inline or on the heap */
+#define is_string(_val) ((_val).type == TY_STRING || (_val).type == TY_LONGSTRING)
 
 /**
  * Value type enumeration
@@ -31,10 +32,14 @@ enum RuntimeValueType {
     TY_UNKNOWN,
     TY_INT,
     TY_FLOAT,
-    TY_STRING,
+    TY_STRING,     // String of at most STRING_INLINE_MAX bytes, stored inline
     TY_GROWARRAY,  // Growable array
     TY_FIXEDARRAY, // Fixed size array
     TY_STRUCTURE,
+    TY_INTARRAY,   // Unboxed int32 array
+    TY_FLOATARRAY, // Unboxed float32 array
+    TY_LONGSTRING, // Heap string, flat or a rope
+    TY_COROUTINE,
 };
 
 typedef struct RuntimeValue {
@@ -42,23 +47,23 @@ typedef struct RuntimeValue {
     enum RuntimeValueType type;
 
     union {
-        char *string_value;
         int int_value;
         float float_value;
-    } data;
 
-    // Representing arrays/structures
-    struct RuntimeValue **s_children;
-    int s_children_count;    // current number of children
-    int s_children_capacity; // maximum number of children
+        // Short strings, NUL terminated
+        struct {
+            char chars[STRING_INLINE_MAX + 1];
+            uint8_t length;
+        } small;
+
+        // Heap objects such as structures, owned by the VM heap
+        struct HeapObj *object;
+    } data;
 } Value;
 
 Value *value_create(enum RuntimeValueType type);
 
-/**
- * Return whether the value has child nodes. This is used to determine if we
- * need to traverse the children of a value during garbage collection.
- */
-bool value_has_child_nodes(Value *val);
+/* Print a value to stdout, without a trailing newline */
+void value_print(Value *val);
 
 #endif
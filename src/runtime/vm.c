@@ -6,9 +6,12 @@
  */
 
 #include "vm.h"
+#include "builtins.h"
 #include "bytecode.h"
 #include "gc.h"
+#include "kernels.h"
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -17,104 +20,997 @@
 #include "../util/arena.h"
 #include "../util/logger.h"
 
-// Background GC thread function
-static void *gc_thread_func(void *arg) {
-    VM *vm = (VM *)arg;
+void vm_init(VM *vm, int gc_threshold) {
+    vm->ip     = 0;
+    vm->eq     = 0;
+    vm->dif    = 0;
+    vm->status = VM_RUNNING;
 
-    while (!vm->stop_gc) {
-        pthread_mutex_lock(&vm->gc_mutex);
-        if (vm->mem.gc_counter >= vm->mem.gc_threshold) {
-            pthread_mutex_unlock(&vm->gc_mutex);
-            gc_collect(vm);
-        } else {
-            pthread_mutex_unlock(&vm->gc_mutex);
-        }
+    vm->code         = NULL;
+    vm->code_size    = 0;
+    vm->strings      = NULL;
+    vm->constants    = NULL;
+    vm->string_count = 0;
+    vm->funcs        = NULL;
+    vm->func_count   = 0;
+    vm->caches          = NULL;
+    vm->cache_count     = 0;
+    vm->feedback        = NULL;
+    vm->feedback_count  = 0;
+    vm->hotness         = NULL;
+    vm->use_jit         = false;
+    vm->jit             = NULL;
+    vm->fuel            = VM_FUEL_UNLIMITED;
+    vm->charges         = NULL;
+    vm->coro            = NULL;
+    vm->spare_count     = 0;
+    vm->aio             = NULL;
+    vm->io              = (AioRequest){0};
+    vm->handles         = NULL;
+    vm->handle_count    = 0;
+    vm->handle_capacity = 0;
 
-        // Sleep for a short duration to prevent busy waiting
-        usleep(100000); // 100ms
+    // Allocating and calling into the runtime cost more than the rest
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        vm->costs[i] = 1;
     }
+    vm->costs[CALL]     = 2;
+    vm->costs[TAILCALL] = 2;
+    vm->costs[NEWS]     = 4;
+    vm->costs[NEWA]     = 4;
+    vm->costs[CONCAT]   = 4;
+    vm->costs[CALLB]    = 8;
 
-    log_info("GC thread exiting...\n");
-    return NULL;
-}
+    vm->mem.sp               = 0;
+    vm->mem.heap             = NULL;
+    vm->mem.frame_count      = 0;
+    vm->mem.stack            = NULL;
+    vm->mem.stack_max        = VM_STACK_MAX_SIZE;
+    vm->mem.stack_committed  = 0;
+    vm->mem.frames           = NULL;
+    vm->mem.frames_max       = VM_FRAMES_MAX;
+    vm->mem.frames_committed = 0;
 
-void vm_init(VM *vm, int gc_threshold) {
-    vm->ip = 0;
+    vm->mem.gc_counter    = 0;
+    vm->mem.gc_threshold  = gc_threshold;
+    vm->mem.gc_live       = 0;
+    vm->mem.gray          = NULL;
+    vm->mem.gray_count    = 0;
+    vm->mem.gray_capacity = 0;
+
+    vm->string_tbl = hashtable_create();
+    kernels_init();
+    globals_init(&vm->globals);
+    if (shape_tree_init(&vm->shapes) != 0) {
+        log_error("failed to allocate shape tree\n");
+    }
+}
 
-    vm->code      = NULL;
-    vm->code_size = 0;
-    vm->mem.sp    = 0;
+static void coro_swap(VM *vm, CoroObj *co);
 
-    vm->mem.stack_top = vm->mem.stack;
-    vm->mem.heap      = NULL;
+/* Drop the loaded image and everything the program created while running it */
+static void vm_unload(VM *vm) {
+    // Go back to the main program's stack, leaving the coroutines with their own
+    while (vm->coro != NULL) {
+        CoroObj *co = vm->coro;
+        coro_swap(vm, co);
+        co->state = CORO_DEAD;
+        vm->coro  = co->resumer;
+    }
 
-    vm->mem.gc_counter   = 0;
-    vm->mem.gc_threshold = gc_threshold;
-    vm->stop_gc          = false;
+    while (vm->spare_count > 0) {
+        coro_release(&vm->spare[--vm->spare_count]);
+    }
 
-    vm->string_tbl = hashtable_create();
+    // A VM isn't unloaded while the kernel still has its buffer
+    free(vm->io.buf);
+    vm->io.buf = NULL;
 
-    pthread_mutex_init(&vm->gc_mutex, NULL);
-    if (pthread_create(&vm->gc_thread, NULL, gc_thread_func, vm) != 0) {
-        log_error("failed to create GC thread\n");
+    HeapObj *entry = vm->mem.heap;
+    while (entry) {
+        HeapObj *next = entry->next;
+        heap_free(&vm->mem, entry);
+        entry = next;
     }
 
-    // Detach so the thread runs in the background
-    pthread_detach(vm->gc_thread);
+    vm->mem.heap       = NULL;
+    vm->mem.sp         = 0;
+    vm->mem.gc_counter = 0;
+    vm->mem.gc_live    = 0;
+
+    // Shapes and globals point at names in the constant pool
+    globals_free(&vm->globals);
+    shape_tree_free(&vm->shapes);
+    shape_tree_init(&vm->shapes);
+
+    struct Bytecode bc = {.code = vm->code, .consts = vm->strings, .funcs = vm->funcs};
+    bc.header.const_count = vm->string_count;
+    bytecode_free(&bc);
+    free(vm->caches);
+    free(vm->feedback);
+    free(vm->hotness);
+    free(vm->charges);
+    free(vm->constants);
+    jit_free(vm->jit);
+
+    vm->code           = NULL;
+    vm->code_size      = 0;
+    vm->strings        = NULL;
+    vm->constants      = NULL;
+    vm->string_count   = 0;
+    vm->funcs          = NULL;
+    vm->func_count     = 0;
+    vm->caches         = NULL;
+    vm->cache_count    = 0;
+    vm->feedback       = NULL;
+    vm->feedback_count = 0;
+    vm->hotness        = NULL;
+    vm->charges        = NULL;
+    vm->jit            = NULL;
 }
 
 void vm_cleanup(Arena *arena, VM *vm) {
+    // Whatever the program left open goes with it
+    for (int i = 0; i < vm->handle_count; i++) {
+        if (vm->handles[i] >= 0) {
+            close(vm->handles[i]);
+        }
+    }
+    free(vm->handles);
+    vm->handles      = NULL;
+    vm->handle_count = 0;
+
     hashtable_free(vm->string_tbl);
+    vm_unload(vm);
 
-    pthread_mutex_lock(&vm->gc_mutex);
-    vm->stop_gc = true;
-    pthread_mutex_unlock(&vm->gc_mutex);
+    shape_tree_free(&vm->shapes);
+    free(vm->mem.gray);
+    mem_release(&vm->mem);
+    arena_destroy(arena);
+}
 
-    HeapObj *entry = vm->mem.heap;
-    while (entry) {
-        HeapObj *next = entry->next;
-        entry->free   = true;
-        free(entry);
-        entry = next;
+void vm_error(VM *vm, const char *message) {
+    log_error("VM: %s (ip: %zu)\n", message, vm->ip - 1);
+    vm->status = VM_ERROR;
+}
+
+/* Count an arrival at function entry or loop header `ip`, tiering it up once hot */
+static inline void count_arrival(VM *vm, size_t ip, int threshold) {
+    if (ip < vm->code_size && vm->hotness[ip] >= 0 && ++vm->hotness[ip] >= threshold) {
+        vm->hotness[ip] = -1;
+        tier_up(vm, ip);
     }
+}
 
-    pthread_mutex_destroy(&vm->gc_mutex);
-    arena_destroy(arena);
+/* Push a value, stopping the VM if the stack is full */
+static inline void push(VM *vm, Value *value) {
+    if (!stack_push(&vm->mem, value)) {
+        vm_error(vm, "stack overflow");
+    }
+}
+
+/**
+ * Charge the block ending at instruction `at`. Once fuel runs out the VM yields
+ * if `check` is set, which is only done where it stops at a resumable `ip`.
+ */
+static inline void charge(VM *vm, size_t at, bool check) {
+    vm->fuel -= vm->charges[at];
+    if (check && vm->fuel < 0 && vm->status == VM_RUNNING) {
+        vm->status = VM_YIELDED;
+    }
+}
+
+/**
+ * Push a frame for function `index` and jump to it. Its arguments are the top
+ * `nparams` values on the stack and become the first locals in place, the rest
+ * of the locals are zeroed.
+ */
+static bool enter_function(VM *vm, int index, size_t ret_ip) {
+    VMMem *mem = &vm->mem;
+
+    if (index < 0 || index >= vm->func_count) {
+        vm_error(vm, "call to an unknown function");
+        return false;
+    }
+
+    VMFunction *fn = &vm->funcs[index];
+    if (mem->frame_count == mem->frames_committed &&
+        !frames_grow(mem, mem->frame_count + 1)) {
+        vm_error(vm, "call stack overflow");
+        return false;
+    }
+
+    if (mem->sp < (size_t)fn->nparams) {
+        vm_error(vm, "stack underflow in call");
+        return false;
+    }
+
+    size_t fp = mem->sp - fn->nparams;
+    if (!stack_reserve(mem, fp + fn->nlocals)) {
+        vm_error(vm, "stack overflow in call");
+        return false;
+    }
+
+    for (size_t i = mem->sp; i < fp + fn->nlocals; i++) {
+        mem->stack[i] = new_int(0);
+    }
+
+    mem->sp                         = fp + fn->nlocals;
+    mem->frames[mem->frame_count++] = (Frame){
+        .ret_ip  = ret_ip,
+        .fp      = fp,
+        .nlocals = fn->nlocals,
+        .func    = index,
+    };
+
+    vm->ip = fn->entry;
+    count_arrival(vm, vm->ip, TIER_HOT_CALLS);
+    return true;
+}
+
+static inline VMCache *cache_of(VM *vm, VMInstruction *ins) {
+    return &vm->caches[ins->operands[VM_IC_OPERAND].int_value];
+}
+
+static inline const char *name_of(VM *vm, VMInstruction *ins) {
+    return vm->strings[ins->operands[0].int_value];
+}
+
+/* Slot of the global an instruction refers to, -1 if it isn't defined yet */
+static int global_slot(VM *vm, VMInstruction *ins, bool define) {
+    VMCache *cache = cache_of(vm, ins);
+    if (cache->count > 0) {
+        return cache->entries[0].slot;
+    }
+
+    // Slots never move, so the first successful lookup is good forever
+    const char *name = name_of(vm, ins);
+    int slot         = define ? globals_define(&vm->globals, name)
+                              : globals_find(&vm->globals, name);
+    if (slot >= 0) {
+        cache->entries[0].slot = slot;
+        cache->count           = 1;
+    }
+
+    return slot;
+}
+
+static void cache_insert(VMCache *cache, Shape *shape, Shape *next, int slot) {
+    int i = cache->count < VM_IC_ENTRIES ? cache->count++
+                                         : cache->victim++ % VM_IC_ENTRIES;
+    cache->entries[i] = (VMCacheEntry){.shape = shape, .next = next, .slot = slot};
+}
+
+static StructObj *as_struct(VM *vm, Value *value) {
+    if (value == NULL || value->type != TY_STRUCTURE) {
+        vm_error(vm, "field access on a value that isn't a structure");
+        return NULL;
+    }
+
+    return (StructObj *)value->data.object;
+}
+
+/* Value on top of the stack, or NULL when it's empty */
+static Value *stack_top(VM *vm) {
+    return vm->mem.sp > 0 ? &vm->mem.stack[vm->mem.sp - 1] : NULL;
+}
+
+static ArrayObj *as_array(VM *vm, Value *value) {
+    if (value == NULL || (value->type != TY_INTARRAY && value->type != TY_FLOATARRAY)) {
+        vm_error(vm, "indexing a value that isn't an array");
+        return NULL;
+    }
+
+    return (ArrayObj *)value->data.object;
+}
+
+/* Pop an index and the array under it, checking the index is in bounds */
+static ArrayObj *pop_element(VM *vm, int *index) {
+    Value *i    = stack_pop(&vm->mem);
+    ArrayObj *a = as_array(vm, stack_pop(&vm->mem));
+    if (a == NULL || i == NULL) {
+        vm->status = VM_ERROR;
+        return NULL;
+    }
+
+    // One unsigned compare covers both ends
+    if (i->type != TY_INT || (unsigned)i->data.int_value >= (unsigned)a->count) {
+        vm_error(vm, "array index out of bounds");
+        return NULL;
+    }
+
+    *index = i->data.int_value;
+    return a;
+}
+
+/**
+ * Check that array local `slot` can be indexed by every value the loop counter
+ * in local `counter` will take, up to the limit in local `counter + 1`. The
+ * compiler only emits this before a loop that can't change either local or the
+ * array's length.
+ */
+static bool loop_in_bounds(VM *vm, int slot, int counter) {
+    Frame *frame = &vm->mem.frames[vm->mem.frame_count - 1];
+    if (slot < 0 || slot >= frame->nlocals || counter < 0 ||
+        counter + 1 >= frame->nlocals) {
+        return false;
+    }
+
+    Value *locals = &vm->mem.stack[frame->fp];
+    if ((locals[slot].type != TY_INTARRAY && locals[slot].type != TY_FLOATARRAY) ||
+        locals[counter].type != TY_INT || locals[counter + 1].type != TY_INT) {
+        return false;
+    }
+
+    int from = locals[counter].data.int_value;
+    int to   = locals[counter + 1].data.int_value;
+    return from > to || (from >= 0 && to < ((ArrayObj *)locals[slot].data.object)->count);
+}
+
+static void get_field(VM *vm, VMInstruction *ins, StructObj *s) {
+    VMCache *cache = cache_of(vm, ins);
+
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == s->shape) {
+            push(vm, &s->fields[cache->entries[i].slot]);
+            return;
+        }
+    }
+
+    int slot = shape_find(s->shape, name_of(vm, ins));
+    if (slot < 0) {
+        vm_error(vm, "structure has no such field");
+        return;
+    }
+
+    cache_insert(cache, s->shape, s->shape, slot);
+    push(vm, &s->fields[slot]);
+}
+
+static void set_field(VM *vm, VMInstruction *ins, StructObj *s, Value *value) {
+    VMCache *cache    = cache_of(vm, ins);
+    VMCacheEntry *hit = NULL;
+
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == s->shape) {
+            hit = &cache->entries[i];
+            break;
+        }
+    }
+
+    VMCacheEntry miss;
+    if (hit == NULL) {
+        // A store either finds the field or adds it, moving the structure to a new shape
+        const char *name = name_of(vm, ins);
+        int slot         = shape_find(s->shape, name);
+        Shape *next      = slot >= 0 ? s->shape
+                                     : shape_add_field(&vm->shapes, s->shape, name);
+        if (next == NULL) {
+            vm->status = VM_ERROR;
+            return;
+        }
+
+        miss = (VMCacheEntry){
+            .shape = s->shape,
+            .next  = next,
+            .slot  = slot >= 0 ? slot : s->shape->count,
+        };
+        cache_insert(cache, miss.shape, miss.next, miss.slot);
+        hit = &miss;
+    }
+
+    if (hit->next != s->shape && !struct_grow(s, hit->next, hit->slot)) {
+        vm->status = VM_ERROR;
+        return;
+    }
+
+    s->fields[hit->slot] = *value;
+}
+
+/**
+ * Replace the running frame with one for function `index`. The arguments on top
+ * of the stack are moved down over the current locals and the frame keeps its
+ * return address, so tail calls run in constant stack space.
+ */
+static bool replace_function(VM *vm, int index) {
+    VMMem *mem = &vm->mem;
+
+    if (index < 0 || index >= vm->func_count) {
+        vm_error(vm, "call to an unknown function");
+        return false;
+    }
+
+    VMFunction *fn = &vm->funcs[index];
+    Frame *frame   = &mem->frames[mem->frame_count - 1];
+    if (mem->sp < frame->fp + fn->nparams) {
+        vm_error(vm, "stack underflow in call");
+        return false;
+    }
+
+    if (!stack_reserve(mem, frame->fp + fn->nlocals)) {
+        vm_error(vm, "stack overflow in call");
+        return false;
+    }
+
+    memmove(&mem->stack[frame->fp], &mem->stack[mem->sp - fn->nparams],
+            fn->nparams * sizeof(Value));
+    for (size_t i = frame->fp + fn->nparams; i < frame->fp + fn->nlocals; i++) {
+        mem->stack[i] = new_int(0);
+    }
+
+    mem->sp        = frame->fp + fn->nlocals;
+    frame->nlocals = fn->nlocals;
+    frame->func    = index;
+
+    vm->ip = fn->entry;
+    count_arrival(vm, vm->ip, TIER_HOT_CALLS);
+    return true;
+}
+
+/* Exchange the running stack, frames and registers with those saved in `co` */
+static void coro_swap(VM *vm, CoroObj *co) {
+    VMMem *mem       = &vm->mem;
+    CoroContext next = co->ctx;
+
+    co->ctx = (CoroContext){
+        .stack            = mem->stack,
+        .sp               = mem->sp,
+        .stack_max        = mem->stack_max,
+        .stack_committed  = mem->stack_committed,
+        .frames           = mem->frames,
+        .frame_count      = mem->frame_count,
+        .frames_max       = mem->frames_max,
+        .frames_committed = mem->frames_committed,
+        .ip               = vm->ip,
+        .eq               = vm->eq,
+        .dif              = vm->dif,
+    };
+
+    mem->stack            = next.stack;
+    mem->sp               = next.sp;
+    mem->stack_max        = next.stack_max;
+    mem->stack_committed  = next.stack_committed;
+    mem->frames           = next.frames;
+    mem->frame_count      = next.frame_count;
+    mem->frames_max       = next.frames_max;
+    mem->frames_committed = next.frames_committed;
+    vm->ip                = next.ip;
+    vm->eq                = next.eq;
+    vm->dif               = next.dif;
+}
+
+/**
+ * Create a coroutine that runs function `index` on the arguments on top of the
+ * stack, which it takes, and push it. It is suspended at the function's entry.
+ */
+static void coro_create(VM *vm, int index) {
+    if (index < 0 || index >= vm->func_count) {
+        vm_error(vm, "coroutine of an unknown function");
+        return;
+    }
+
+    int nparams = vm->funcs[index].nparams;
+    if (vm->mem.sp < (size_t)nparams) {
+        vm_error(vm, "stack underflow in coroutine");
+        return;
+    }
+
+    gc_maybe_collect(vm);
+    CoroContext *spare = vm->spare_count > 0 ? &vm->spare[--vm->spare_count] : NULL;
+    CoroObj *co        = coro_new(&vm->mem, spare);
+    if (co == NULL) {
+        vm->status = VM_ERROR;
+        return;
+    }
+
+    // Set up its first frame on its own stack, copying the arguments over from ours
+    Value *args = &vm->mem.stack[vm->mem.sp - nparams];
+    coro_swap(vm, co);
+    for (int i = 0; i < nparams && vm->status == VM_RUNNING; i++) {
+        push(vm, &args[i]);
+    }
+    if (vm->status == VM_RUNNING) {
+        enter_function(vm, index, 0);
+    }
+    coro_swap(vm, co);
+
+    vm->mem.sp -= nparams;
+    push(vm, &new_object(TY_COROUTINE, co));
+}
+
+/* Switch to the coroutine below `value` on the stack, handing it `value` */
+static void coro_resume(VM *vm) {
+    Value *value  = stack_pop(&vm->mem);
+    Value *target = stack_pop(&vm->mem);
+    if (value == NULL || target == NULL) {
+        vm->status = VM_ERROR;
+        return;
+    }
+
+    if (target->type != TY_COROUTINE) {
+        vm_error(vm, "resume of a value that isn't a coroutine");
+        return;
+    }
+
+    CoroObj *co = (CoroObj *)target->data.object;
+    if (co->state != CORO_SUSPENDED) {
+        vm_error(vm, co->state == CORO_DEAD ? "resume of a finished coroutine"
+                                            : "resume of a running coroutine");
+        return;
+    }
+
+    // Popped slots stay valid until the next push, which is on the other stack
+    Value sent = *value;
+    if (vm->coro != NULL) {
+        vm->coro->state = CORO_NORMAL;
+    }
+    co->resumer = vm->coro;
+    co->state   = CORO_RUNNING;
+    vm->coro    = co;
+    coro_swap(vm, co);
+
+    // The first resume starts it, the others return from its yield
+    if (co->started) {
+        push(vm, &sent);
+    }
+    co->started = true;
+}
+
+/* Switch back to whoever resumed the running coroutine, handing them `value` */
+static void coro_return(VM *vm, Value value, enum CoroState state) {
+    CoroObj *co = vm->coro;
+    coro_swap(vm, co);
+
+    vm->coro    = co->resumer;
+    co->resumer = NULL;
+    co->state   = state;
+    if (vm->coro != NULL) {
+        vm->coro->state = CORO_RUNNING;
+    }
+
+    // Nothing runs on the stack of a finished coroutine again, the next one can
+    if (state == CORO_DEAD && vm->spare_count < VM_CORO_SPARE) {
+        vm->spare[vm->spare_count++] = co->ctx;
+        co->ctx                      = (CoroContext){0};
+    } else if (state == CORO_DEAD) {
+        coro_release(&co->ctx);
+    }
+    push(vm, &value);
+}
+
+static void coro_yield(VM *vm) {
+    Value *value = stack_pop(&vm->mem);
+    if (value == NULL) {
+        vm->status = VM_ERROR;
+        return;
+    }
+
+    if (vm->coro == NULL) {
+        vm_error(vm, "yield outside of a coroutine");
+        return;
+    }
+    coro_return(vm, *value, CORO_SUSPENDED);
+}
+
+/* Pop the running frame, leaving its return value where its locals started */
+static void leave_function(VM *vm) {
+    VMMem *mem    = &vm->mem;
+    Value *result = stack_pop(mem);
+    if (result == NULL) {
+        vm->status = VM_ERROR;
+        return;
+    }
+
+    Value value  = *result;
+    Frame *frame = &mem->frames[--mem->frame_count];
+    mem->sp      = frame->fp;
+
+    // A coroutine's function returning finishes it
+    if (mem->frame_count == 0 && vm->coro != NULL) {
+        coro_return(vm, value, CORO_DEAD);
+        return;
+    }
+
+    stack_push(mem, &value);
+    vm->ip = frame->ret_ip;
+    if (mem->frame_count == 0) {
+        vm->status = VM_HALTED;
+    }
+}
+
+Value *vm_result(VM *vm) {
+    // Anything above the top-level locals is a value left by the program
+    Frame *main = vm->mem.frames;
+    size_t base = vm->mem.frame_count > 0 ? main->fp + main->nlocals : 0;
+    return vm->mem.sp > base ? &vm->mem.stack[vm->mem.sp - 1] : NULL;
+}
+
+static bool is_lookup(enum VMOpcode op) {
+    return op >= GETG && op <= INITF && op != NEWS;
+}
+
+/**
+ * Give every global and field lookup instruction an inline cache. The cache
+ * index goes in an operand slot past operands_count, which is never encoded.
+ */
+static bool vm_attach_caches(VM *vm) {
+    size_t count = 0;
+    for (size_t i = 0; i < vm->code_size; i++) {
+        VMInstruction *ins = &vm->code[i];
+        if (!is_lookup(ins->opcode)) {
+            continue;
+        }
+
+        int name = ins->operands[0].int_value;
+        if (ins->operands_count < 1 || name < 0 || name >= vm->string_count) {
+            log_error("VM: lookup of a name outside the constant pool (ip: %zu)\n", i);
+            return false;
+        }
+
+        ins->operands[VM_IC_OPERAND].int_value = count++;
+    }
+
+    vm->caches      = (VMCache *)calloc(count ? count : 1, sizeof(VMCache));
+    vm->cache_count = count;
+    if (vm->caches == NULL) {
+        log_error("VM: failed to allocate inline caches\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool is_generic(enum VMOpcode op) {
+    return op >= ADD && op <= CMP;
+}
+
+static bool is_specialized(enum VMOpcode op) {
+    return (op >= ADD_I && op <= DIV_F) || op == CMP_I || op == CMP_F;
+}
+
+/**
+ * Give every generic instruction a feedback slot, and mark the _I and _F
+ * instructions already in the image as not needing a type guard.
+ */
+static bool vm_attach_feedback(VM *vm) {
+    size_t count = 0;
+    for (size_t i = 0; i < vm->code_size; i++) {
+        VMInstruction *ins = &vm->code[i];
+        if (is_generic(ins->opcode)) {
+            ins->operands[VM_IC_OPERAND].int_value = count++;
+        } else if (is_specialized(ins->opcode)) {
+            ins->operands[VM_IC_OPERAND].int_value = -1;
+        }
+    }
+
+    vm->feedback       = (VMFeedback *)calloc(count ? count : 1, sizeof(VMFeedback));
+    vm->feedback_count = count;
+    if (vm->feedback == NULL) {
+        log_error("VM: failed to allocate type feedback\n");
+        return false;
+    }
+
+    for (size_t i = 0; i < vm->code_size; i++) {
+        VMInstruction *ins = &vm->code[i];
+        if (is_generic(ins->opcode)) {
+            vm->feedback[ins->operands[VM_IC_OPERAND].int_value].generic = ins->opcode;
+        }
+    }
+
+    return true;
 }
 
-void vm_load(Arena *arena, VM *vm, uint8_t *code, size_t len) {
-    if (vm->code != NULL) {
-        free(vm->code);
+/* Whether an instruction ends a block, which is charged when it runs */
+static bool ends_block(enum VMOpcode op) {
+    return (op >= J && op <= JGE) || op == CALL || op == TAILCALL || op == RET ||
+           op == CHKA;
+}
+
+/**
+ * Work out the fuel each block costs, as the sum of its opcodes' costs since the
+ * instruction that ended the block before it. A jump into the middle of a block
+ * is charged for all of it.
+ */
+static bool vm_price_blocks(VM *vm) {
+    vm->charges = (int *)calloc(vm->code_size ? vm->code_size : 1, sizeof(int));
+    if (vm->charges == NULL) {
+        log_error("VM: failed to allocate block costs\n");
+        return false;
+    }
+
+    int cost = 0;
+    for (size_t i = 0; i < vm->code_size; i++) {
+        enum VMOpcode op = vm->code[i].opcode;
+        cost += vm->costs[op];
+        if (ends_block(op)) {
+            vm->charges[i] = cost;
+            cost           = 0;
+        }
     }
 
-    // Allocate memory for code
-    vm->code = (VMInstruction *)malloc(len * sizeof(VMInstruction));
-    read_bytecode_stream(code, len, vm->code, &vm->code_size);
+    return true;
+}
+
+/* Make a string value of every constant, long ones are kept alive as GC roots */
+static bool vm_load_constants(VM *vm) {
+    size_t count  = vm->string_count ? vm->string_count : 1;
+    vm->constants = (Value *)calloc(count, sizeof(Value));
+    if (vm->constants == NULL) {
+        log_error("VM: failed to allocate string constants\n");
+        return false;
+    }
+
+    for (int i = 0; i < vm->string_count; i++) {
+        const char *chars = vm->strings[i];
+        if (!string_new(&vm->mem, chars, strlen(chars), &vm->constants[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void vm_load(Arena *arena, VM *vm, struct Bytecode *bc) {
+    vm_unload(vm);
+
+    // The VM takes ownership of the image
+    vm->code         = bc->code;
+    vm->code_size    = bc->header.code_size;
+    vm->strings      = bc->consts;
+    vm->string_count = bc->header.const_count;
+    vm->funcs        = bc->funcs;
+    vm->func_count   = bc->header.func_count;
+
+    bc->code   = NULL;
+    bc->consts = NULL;
+    bc->funcs  = NULL;
+
+    if (!vm_attach_caches(vm) || !vm_attach_feedback(vm) || !vm_price_blocks(vm) ||
+        !vm_load_constants(vm)) {
+        vm->status = VM_ERROR;
+        return;
+    }
+
+    vm->hotness = (int *)calloc(vm->code_size ? vm->code_size : 1, sizeof(int));
+    if (vm->hotness == NULL) {
+        log_error("VM: failed to allocate hotness counters\n");
+        vm->status = VM_ERROR;
+        return;
+    }
+
+    // Without a JIT hot code tiers up to superinstructions only
+    if (vm->use_jit) {
+        vm->jit = jit_create(vm->code_size);
+    }
+
+    if (!mem_reserve(&vm->mem)) {
+        vm->status = VM_ERROR;
+        return;
+    }
+
+    // Execution starts at the top-level program, in a frame of its own
+    vm->mem.sp          = 0;
+    vm->mem.frame_count = 0;
+    vm->status          = VM_RUNNING;
+    enter_function(vm, 0, vm->code_size);
+
+    log_info("VM: loaded %zu instructions\n", vm->code_size);
+}
+
+enum VMStatus vm_run(Arena *arena, VM *vm) {
+    while (vm->status == VM_RUNNING) {
+        // Native code returns at an instruction it can't run, which the
+        // interpreter runs before native code is tried again
+        if (vm->jit != NULL) {
+            jit_enter(vm);
+        }
+        vm_cycle(arena, vm);
+    }
+
+    return vm->status;
+}
+
+void vm_add_fuel(VM *vm, int64_t fuel) {
+    bool saturates = vm->fuel > 0 && fuel > VM_FUEL_UNLIMITED - vm->fuel;
+    vm->fuel       = saturates ? VM_FUEL_UNLIMITED : vm->fuel + fuel;
+    if (vm->status == VM_YIELDED && vm->fuel >= 0) {
+        vm->status = VM_RUNNING;
+    }
+}
+
+/**
+ * Enter native code with at most `left` fuel, so its back edges leave it once
+ * the slice is used up, and return the fuel it spent.
+ */
+static int64_t jit_enter_slice(VM *vm, size_t left) {
+    int64_t fuel = vm->fuel;
+    if (fuel <= (int64_t)left) {
+        // The program's own budget runs out first, native code stops at that
+        jit_enter(vm);
+        return fuel - vm->fuel;
+    }
+
+    vm->fuel = (int64_t)left;
+    jit_enter(vm);
+    int64_t spent = (int64_t)left - vm->fuel;
+    vm->fuel      = fuel - spent;
+    return spent;
+}
+
+enum VMStatus vm_run_slice(Arena *arena, VM *vm, size_t budget) {
+    for (size_t n = 0; n < budget && vm->status == VM_RUNNING; n++) {
+        if (vm->jit != NULL) {
+            int64_t spent = jit_enter_slice(vm, budget - n);
+            n += spent > 0 ? (size_t)spent : 0;
+        }
+        vm_cycle(arena, vm);
+    }
 
-    log_info("VM: loaded %d instructions\n", vm->code_size);
+    return vm->status;
 }
 
 void vm_cycle(Arena *arena, VM *vm) {
     // Fetch-decode-execute cycle
 
-    if (vm->code == NULL) {
+    if (vm->code == NULL || vm->ip >= vm->code_size) {
+        // Running off the end of the program is a normal exit
+        vm->status = VM_HALTED;
         return;
     }
 
-    if (vm->ip >= vm->code_size) {
-        log_error("VM: ip out of bounds\n");
+    VMInstruction *ins = &vm->code[vm->ip];
+    vm_trace("VM: ip: %zu, opcode: %d\n", vm->ip, ins->opcode);
+
+    // Jumps overwrite ip, everything else falls through to the next instruction
+    vm->ip++;
+    vm_decode(arena, vm, ins);
+}
+
+/* Pop the two operands of a binary operator, b is the left hand side */
+static bool pop_operands(VM *vm, Value **a, Value **b) {
+    *a = stack_pop(&vm->mem);
+    *b = stack_pop(&vm->mem);
+    if (*a == NULL || *b == NULL) {
+        vm->status = VM_ERROR;
+        return false;
+    }
+
+    return true;
+}
+
+static bool pop_strings(VM *vm, Value **a, Value **b) {
+    if (!pop_operands(vm, a, b)) {
+        return false;
+    }
+
+    if (!is_string(**a) || !is_string(**b)) {
+        vm_error(vm, "string operation on a value that isn't a string");
+        return false;
+    }
+
+    return true;
+}
+
+static void compare(VM *vm, double b, double a) {
+    vm->eq  = b == a;
+    vm->dif = b < a ? -1 : (b > a ? 1 : 0);
+}
+
+/* Whether conditional jump `op` is taken with the flags as they are */
+static bool jump_taken(VM *vm, enum VMOpcode op) {
+    switch (op) {
+    case JEQ:
+        return vm->eq == 1;
+    case JNE:
+        return vm->eq == 0;
+    case JLT:
+        return vm->dif == -1;
+    case JGR:
+        return vm->dif == 1;
+    case JLE:
+        return vm->dif != 1;
+    default:
+        return vm->dif != -1;
+    }
+}
+
+/* Local `slot` of the running frame, NULL after reporting a bad slot */
+static Value *local_at(VM *vm, int slot) {
+    Frame *frame = &vm->mem.frames[vm->mem.frame_count - 1];
+    if (slot < 0 || slot >= frame->nlocals) {
+        vm_error(vm, "bad local slot");
+        return NULL;
+    }
+
+    return &vm->mem.stack[frame->fp + slot];
+}
+
+/* The _I or _F form of a generic instruction */
+static enum VMOpcode specialize(enum VMOpcode generic, bool floats) {
+    if (generic == CMP) {
+        return floats ? CMP_F : CMP_I;
+    }
+
+    return (enum VMOpcode)((floats ? ADD_F : ADD_I) + (generic - ADD));
+}
+
+/**
+ * Run a generic arithmetic or compare instruction as the specialized one that
+ * fits its operands: ints stay ints, an int next to a float is converted in
+ * place and two strings are joined or compared. After VM_QUICKEN_AFTER runs of
+ * the same numeric type the instruction is rewritten to that form for good.
+ */
+static void generic_op(Arena *arena, VM *vm, VMInstruction *ins) {
+    VMFeedback *fb = &vm->feedback[ins->operands[VM_IC_OPERAND].int_value];
+    if (vm->mem.sp < 2) {
+        vm_error(vm, "stack underflow");
         return;
     }
 
-    VMInstruction ins = vm->code[vm->ip];
-    if (ins.opcode >= OPCODE_COUNT) {
+    Value *a = &vm->mem.stack[vm->mem.sp - 1];
+    Value *b = a - 1;
+    bool numeric_a = a->type == TY_INT || a->type == TY_FLOAT;
+    bool numeric_b = b->type == TY_INT || b->type == TY_FLOAT;
+
+    enum RuntimeValueType seen = a->type == b->type ? a->type : TY_UNKNOWN;
+    VMInstruction run          = {.opcode = specialize(fb->generic, seen != TY_INT)};
+    if (numeric_a && numeric_b) {
+        if (a->type == TY_INT && seen != TY_INT) {
+            *a = new_float((float)a->data.int_value);
+        } else if (b->type == TY_INT && seen != TY_INT) {
+            *b = new_float((float)b->data.int_value);
+        }
+    } else if (is_string(*a) && is_string(*b) &&
+               (fb->generic == ADD || fb->generic == CMP)) {
+        run.opcode = fb->generic == ADD ? CONCAT : CMP_S;
+        seen       = TY_UNKNOWN;
+    } else {
+        vm_error(vm, "operand types don't fit a generic instruction");
         return;
     }
 
-    log_info("VM: ip: %d, opcode: %d\n", vm->ip, ins.opcode);
+    // Only int and float are quickened, anything else keeps the count at zero
+    if (seen != TY_INT && seen != TY_FLOAT) {
+        fb->hits = 0;
+    } else if (seen == fb->seen) {
+        fb->hits++;
+    } else {
+        fb->hits = 1;
+    }
+    fb->seen = seen;
 
-    vm_decode(arena, vm, &ins);
-    vm->ip++;
+    if (fb->hits >= VM_QUICKEN_AFTER && fb->deopts < VM_DEOPT_MAX) {
+        ins->opcode = run.opcode;
+    }
+
+    run.operands[VM_IC_OPERAND].int_value = -1;
+    vm_decode(arena, vm, &run);
+}
+
+/**
+ * Check that the operands of a quickened instruction still have the type it
+ * was specialized for. If they don't, the instruction goes back to its generic
+ * form, which runs on them instead. _I and _F instructions emitted as such
+ * always pass.
+ */
+static bool guard_types(Arena *arena, VM *vm, VMInstruction *ins,
+                        enum RuntimeValueType type) {
+    int index = ins->operands[VM_IC_OPERAND].int_value;
+    if (index < 0 || vm->mem.sp < 2) {
+        return true;
+    }
+
+    Value *top = &vm->mem.stack[vm->mem.sp - 1];
+    if (top[0].type == type && top[-1].type == type) {
+        return true;
+    }
+
+    VMFeedback *fb = &vm->feedback[index];
+    ins->opcode    = fb->generic;
+    fb->hits       = 0;
+    fb->deopts++;
+    generic_op(arena, vm, ins);
+    return false;
 }
 
 void vm_decode(Arena *arena, VM *vm, VMInstruction *ins) {
@@ -122,79 +1018,455 @@ void vm_decode(Arena *arena, VM *vm, VMInstruction *ins) {
 
     switch (ins->opcode) {
     case NOP:
-        log_info("VM: NOP\n");
+        vm_trace("VM: NOP\n");
+        break;
+    case SETL: {
+        Frame *frame = &vm->mem.frames[vm->mem.frame_count - 1];
+        int slot     = ins->operands[0].int_value;
+        vm_trace("VM: SETL %d\n", slot);
+        if (slot < 0 || slot >= frame->nlocals || (a = stack_pop(&vm->mem)) == NULL) {
+            vm_error(vm, "bad local slot");
+            break;
+        }
+        vm->mem.stack[frame->fp + slot] = *a;
+        break;
+    }
+    case GETL: {
+        Frame *frame = &vm->mem.frames[vm->mem.frame_count - 1];
+        int slot     = ins->operands[0].int_value;
+        vm_trace("VM: GETL %d\n", slot);
+        if (slot < 0 || slot >= frame->nlocals) {
+            vm_error(vm, "bad local slot");
+            break;
+        }
+        push(vm, &vm->mem.stack[frame->fp + slot]);
         break;
+    }
     case PUSH_I:
-        log_info("VM: PUSHI %d\n", as_int(ins->operands[0]));
-        stack_push(&vm->mem, &new_int(ins->operands[0].int_value));
+        vm_trace("VM: PUSHI %d\n", as_int(ins->operands[0]));
+        push(vm, &new_int(ins->operands[0].int_value));
         break;
     case PUSH_F:
-        log_info("VM: PUSHF %f\n", as_float(ins->operands[0]));
-        stack_push(&vm->mem, &new_float(ins->operands[0].float_value));
+        vm_trace("VM: PUSHF %f\n", as_float(ins->operands[0]));
+        push(vm, &new_float(ins->operands[0].float_value));
         break;
     case POP:
-        log_info("VM: POP\n");
-        stack_pop(&vm->mem);
-        break;
-    case J:
-        log_info("VM: J %d\n", ins->operands[0].int_value);
-        vm->ip = ins->operands[0].int_value;
-        break;
-    case JEQ:
-        log_info("VM: JEQ\n");
-        if (vm->eq == 1) {
-            vm->ip = ins->operands[0].int_value;
+        vm_trace("VM: POP\n");
+        if (stack_pop(&vm->mem) == NULL) {
+            vm->status = VM_ERROR;
         }
         break;
-    case JNE:
-        log_info("VM: JNE\n");
-        if (vm->eq == 0) {
-            vm->ip = ins->operands[0].int_value;
+    case LOADS:
+        vm_trace("VM: LOADS %d\n", ins->operands[0].int_value);
+        if (ins->operands[0].int_value < 0 ||
+            ins->operands[0].int_value >= vm->string_count) {
+            vm_error(vm, "string constant out of range");
+            break;
         }
+        push(vm, &vm->constants[ins->operands[0].int_value]);
         break;
-    case JLT:
-        log_info("VM: JLT\n");
-        if (vm->dif == -1) {
-            vm->ip = ins->operands[0].int_value;
+    case CMP_I:
+        if (!guard_types(arena, vm, ins, TY_INT) || !pop_operands(vm, &a, &b))
+            break;
+        vm_trace("VM: CMPI %d %d\n", b->data.int_value, a->data.int_value);
+        compare(vm, b->data.int_value, a->data.int_value);
+        break;
+    case CMP_F:
+        if (!guard_types(arena, vm, ins, TY_FLOAT) || !pop_operands(vm, &a, &b))
+            break;
+        vm_trace("VM: CMPF %f %f\n", b->data.float_value, a->data.float_value);
+        compare(vm, b->data.float_value, a->data.float_value);
+        break;
+    case J: {
+        vm_trace("VM: J %d\n", ins->operands[0].int_value);
+        // A backward jump closes a loop
+        size_t at = ins - vm->code;
+        if ((size_t)ins->operands[0].int_value <= at) {
+            count_arrival(vm, ins->operands[0].int_value, TIER_HOT_LOOPS);
         }
+        vm->ip = ins->operands[0].int_value;
+        charge(vm, at, vm->ip <= at);
         break;
+    }
+    case JEQ:
+    case JNE:
+    case JLT:
     case JGR:
-        log_info("VM: JGR\n");
-        if (vm->dif == 1) {
+    case JLE:
+    case JGE: {
+        vm_trace("VM: %s %d\n", opcode_name(ins->opcode), ins->operands[0].int_value);
+        size_t at = ins - vm->code;
+        if (jump_taken(vm, ins->opcode)) {
             vm->ip = ins->operands[0].int_value;
         }
+        charge(vm, at, (size_t)ins->operands[0].int_value <= at);
         break;
+    }
     case ADD_I:
-        a = stack_pop(&vm->mem);
-        b = stack_pop(&vm->mem);
-        log_info("VM: ADDI %d %d\n", b->data.int_value, a->data.int_value);
-        stack_push(&vm->mem, &new_int(b->data.int_value + a->data.int_value));
-        stack_dump(&vm->mem);
+        if (!guard_types(arena, vm, ins, TY_INT) || !pop_operands(vm, &a, &b))
+            break;
+        vm_trace("VM: ADDI %d %d\n", b->data.int_value, a->data.int_value);
+        push(vm, &new_int(b->data.int_value + a->data.int_value));
         break;
     case SUB_I:
-        a = stack_pop(&vm->mem);
-        b = stack_pop(&vm->mem);
-        log_info("VM: SUBI %d %d\n", b->data.int_value, a->data.int_value);
-        stack_push(&vm->mem, &new_int(b->data.int_value - a->data.int_value));
-        stack_dump(&vm->mem);
+        if (!guard_types(arena, vm, ins, TY_INT) || !pop_operands(vm, &a, &b))
+            break;
+        vm_trace("VM: SUBI %d %d\n", b->data.int_value, a->data.int_value);
+        push(vm, &new_int(b->data.int_value - a->data.int_value));
         break;
     case MUL_I:
-        a = stack_pop(&vm->mem);
-        b = stack_pop(&vm->mem);
-        log_info("VM: MUL %d %d\n", b->data.int_value, a->data.int_value);
-        stack_push(&vm->mem, &new_int(b->data.int_value * a->data.int_value));
-        stack_dump(&vm->mem);
+        if (!guard_types(arena, vm, ins, TY_INT) || !pop_operands(vm, &a, &b))
+            break;
+        vm_trace("VM: MUL %d %d\n", b->data.int_value, a->data.int_value);
+        push(vm, &new_int(b->data.int_value * a->data.int_value));
         break;
     case DIV_I:
-        a = stack_pop(&vm->mem);
-        b = stack_pop(&vm->mem);
-        log_info("VM: DIV %d %d\n", b->data.int_value, a->data.int_value);
-        stack_push(&vm->mem, &new_int(b->data.int_value / a->data.int_value));
-        stack_dump(&vm->mem);
+        if (!guard_types(arena, vm, ins, TY_INT) || !pop_operands(vm, &a, &b))
+            break;
+        vm_trace("VM: DIV %d %d\n", b->data.int_value, a->data.int_value);
+        if (a->data.int_value == 0) {
+            vm_error(vm, "integer division by zero");
+            break;
+        }
+        if (a->data.int_value == -1 && b->data.int_value == INT_MIN) {
+            // The quotient doesn't fit, and the CPU faults rather than wrapping
+            vm_error(vm, "integer division overflow");
+            break;
+        }
+        push(vm, &new_int(b->data.int_value / a->data.int_value));
+        break;
+    case ADD_F:
+        if (!guard_types(arena, vm, ins, TY_FLOAT) || !pop_operands(vm, &a, &b))
+            break;
+        vm_trace("VM: ADDF %f %f\n", b->data.float_value, a->data.float_value);
+        push(vm, &new_float(b->data.float_value + a->data.float_value));
+        break;
+    case SUB_F:
+        if (!guard_types(arena, vm, ins, TY_FLOAT) || !pop_operands(vm, &a, &b))
+            break;
+        vm_trace("VM: SUBF %f %f\n", b->data.float_value, a->data.float_value);
+        push(vm, &new_float(b->data.float_value - a->data.float_value));
+        break;
+    case MUL_F:
+        if (!guard_types(arena, vm, ins, TY_FLOAT) || !pop_operands(vm, &a, &b))
+            break;
+        vm_trace("VM: MULF %f %f\n", b->data.float_value, a->data.float_value);
+        push(vm, &new_float(b->data.float_value * a->data.float_value));
+        break;
+    case DIV_F:
+        if (!guard_types(arena, vm, ins, TY_FLOAT) || !pop_operands(vm, &a, &b))
+            break;
+        vm_trace("VM: DIVF %f %f\n", b->data.float_value, a->data.float_value);
+        push(vm, &new_float(b->data.float_value / a->data.float_value));
+        break;
+    case CALL:
+        vm_trace("VM: CALL %d\n", ins->operands[0].int_value);
+        enter_function(vm, ins->operands[0].int_value, vm->ip);
+        charge(vm, ins - vm->code, true);
+        break;
+    case RET:
+        vm_trace("VM: RET\n");
+        charge(vm, ins - vm->code, false);
+        leave_function(vm);
+        break;
+    case TAILCALL:
+        vm_trace("VM: TAILCALL %d\n", ins->operands[0].int_value);
+        replace_function(vm, ins->operands[0].int_value);
+        charge(vm, ins - vm->code, true);
+        break;
+    case GETG: {
+        vm_trace("VM: GETG %s\n", name_of(vm, ins));
+        int slot = global_slot(vm, ins, false);
+        if (slot < 0) {
+            vm_error(vm, "undefined global");
+            break;
+        }
+        push(vm, &vm->globals.values[slot]);
+        break;
+    }
+    case SETG: {
+        vm_trace("VM: SETG %s\n", name_of(vm, ins));
+        int slot = global_slot(vm, ins, true);
+        if (slot < 0 || (a = stack_pop(&vm->mem)) == NULL) {
+            vm->status = VM_ERROR;
+            break;
+        }
+        vm->globals.values[slot] = *a;
+        break;
+    }
+    case NEWS: {
+        vm_trace("VM: NEWS\n");
+
+        // Allocation is the GC's safepoint, everything live is on the stack or in a
+        // global
+        gc_maybe_collect(vm);
+        // The operand is the number of fields the constructor will store
+        int slots    = ins->operands_count > 0 ? ins->operands[0].int_value : 0;
+        StructObj *s = struct_new(&vm->mem, &vm->shapes, slots > 0 ? slots : 0);
+        if (s == NULL) {
+            vm->status = VM_ERROR;
+            break;
+        }
+        push(vm, &new_object(TY_STRUCTURE, s));
+        break;
+    }
+    case GETF: {
+        vm_trace("VM: GETF %s\n", name_of(vm, ins));
+        StructObj *s = as_struct(vm, stack_pop(&vm->mem));
+        if (s != NULL) {
+            get_field(vm, ins, s);
+        }
+        break;
+    }
+    case SETF:
+    case INITF: {
+        vm_trace("VM: %s %s\n", ins->opcode == SETF ? "SETF" : "INITF", name_of(vm, ins));
+
+        // SETF consumes the structure, INITF leaves it for the next field initializer
+        Value value = vm->mem.sp > 0 ? vm->mem.stack[vm->mem.sp - 1] : new_int(0);
+        if (stack_pop(&vm->mem) == NULL) {
+            vm->status = VM_ERROR;
+            break;
+        }
+
+        Value *target = ins->opcode == SETF ? stack_pop(&vm->mem)
+                        : vm->mem.sp > 0    ? &vm->mem.stack[vm->mem.sp - 1]
+                                            : NULL;
+        StructObj *s = as_struct(vm, target);
+        if (s != NULL) {
+            set_field(vm, ins, s, &value);
+        }
+        break;
+    }
+    case CALLB:
+        vm_trace("VM: CALLB %d\n", ins->operands[0].int_value);
+        builtin_call(vm, ins->operands[0].int_value);
+        break;
+    case CORO:
+        vm_trace("VM: CORO %d\n", ins->operands[0].int_value);
+        coro_create(vm, ins->operands[0].int_value);
+        break;
+    case RESUME:
+        vm_trace("VM: RESUME\n");
+        coro_resume(vm);
+        break;
+    case YIELD:
+        vm_trace("VM: YIELD\n");
+        coro_yield(vm);
+        break;
+    case NEWA: {
+        vm_trace("VM: NEWA %d\n", ins->operands[0].int_value);
+        a = stack_top(vm);
+        if (a == NULL || a->type != TY_INT || a->data.int_value < 0) {
+            vm_error(vm, "array size must be a non-negative int");
+            break;
+        }
+
+        gc_maybe_collect(vm);
+        enum RuntimeValueType type = ins->operands[0].int_value ? TY_FLOATARRAY
+                                                                : TY_INTARRAY;
+        ArrayObj *array            = array_new(&vm->mem, type, a->data.int_value);
+        if (array == NULL || array->ints == NULL) {
+            vm->status = VM_ERROR;
+            break;
+        }
+        vm->mem.stack[vm->mem.sp - 1] = new_object(type, array);
+        break;
+    }
+    case GETA: {
+        vm_trace("VM: GETA\n");
+        int i;
+        ArrayObj *array = pop_element(vm, &i);
+        if (array != NULL) {
+            Value element = array_get(array, i);
+            push(vm, &element);
+        }
+        break;
+    }
+    case SETA: {
+        vm_trace("VM: SETA\n");
+        Value value = vm->mem.sp > 0 ? vm->mem.stack[vm->mem.sp - 1] : new_int(0);
+        if (stack_pop(&vm->mem) == NULL) {
+            vm->status = VM_ERROR;
+            break;
+        }
+
+        int i;
+        ArrayObj *array = pop_element(vm, &i);
+        if (array != NULL && value.type != array_elem_type(array)) {
+            vm_error(vm, "stored value doesn't match the array's element type");
+        } else if (array != NULL) {
+            array_set(array, i, &value);
+        }
+        break;
+    }
+    case PUSHA: {
+        vm_trace("VM: PUSHA\n");
+        Value value = vm->mem.sp > 0 ? vm->mem.stack[vm->mem.sp - 1] : new_int(0);
+        if (stack_pop(&vm->mem) == NULL) {
+            vm->status = VM_ERROR;
+            break;
+        }
+
+        // The array stays on the stack as the result
+        ArrayObj *array = as_array(vm, stack_top(vm));
+        if (array == NULL) {
+            break;
+        }
+        if (value.type != array_elem_type(array)) {
+            vm_error(vm, "pushed value doesn't match the array's element type");
+            break;
+        }
+
+        // Growing counts as an allocation, and a failed one gets a collection and a retry
+        if (array->count == array->capacity) {
+            vm->mem.gc_counter++;
+            gc_maybe_collect(vm);
+            if (!array_reserve(array, array->count + 1)) {
+                gc_collect(vm);
+                if (!array_reserve(array, array->count + 1)) {
+                    vm_error(vm, "out of memory growing an array");
+                    break;
+                }
+            }
+        }
+        array_set(array, array->count++, &value);
+        break;
+    }
+    case POPA: {
+        vm_trace("VM: POPA\n");
+        ArrayObj *array = as_array(vm, stack_top(vm));
+        if (array == NULL) {
+            break;
+        }
+        if (array->count == 0) {
+            vm_error(vm, "pop from an empty array");
+            break;
+        }
+        vm->mem.stack[vm->mem.sp - 1] = array_get(array, --array->count);
+        break;
+    }
+    case LENA: {
+        vm_trace("VM: LENA\n");
+        Value *top = stack_top(vm);
+        if (top != NULL && is_string(*top)) {
+            *top = new_int(string_length(top));
+            break;
+        }
+
+        ArrayObj *array = as_array(vm, stack_top(vm));
+        if (array != NULL) {
+            vm->mem.stack[vm->mem.sp - 1] = new_int(array->count);
+        }
+        break;
+    }
+    case GETAU: {
+        // Bounds and types were checked by the CHKA guarding the loop, which
+        // read_bytecode_image makes sure of for code from an image
+        vm_trace("VM: GETAU\n");
+        Value *i        = &vm->mem.stack[--vm->mem.sp];
+        ArrayObj *array = (ArrayObj *)vm->mem.stack[vm->mem.sp - 1].data.object;
+        vm->mem.stack[vm->mem.sp - 1] = array_get(array, i->data.int_value);
+        break;
+    }
+    case SETAU: {
+        vm_trace("VM: SETAU\n");
+        vm->mem.sp -= 3;
+        Value *top      = &vm->mem.stack[vm->mem.sp];
+        ArrayObj *array = (ArrayObj *)top[0].data.object;
+        array_set(array, top[1].data.int_value, &top[2]);
+        break;
+    }
+    case CHKA:
+        vm_trace("VM: CHKA %d\n", ins->operands[0].int_value);
+        if (!loop_in_bounds(vm, ins->operands[1].int_value, ins->operands[2].int_value)) {
+            vm->ip = ins->operands[0].int_value;
+        }
+        charge(vm, ins - vm->code, false);
+        break;
+    case CONCAT: {
+        vm_trace("VM: CONCAT\n");
+        // Collect while both halves are still on the stack
+        gc_maybe_collect(vm);
+        Value result;
+        if (!pop_strings(vm, &a, &b)) {
+            break;
+        }
+        if (!string_concat(&vm->mem, b, a, &result)) {
+            vm->status = VM_ERROR;
+            break;
+        }
+        push(vm, &result);
+        break;
+    }
+    case CMP_S:
+        vm_trace("VM: CMPS\n");
+        if (!pop_strings(vm, &a, &b)) {
+            break;
+        }
+        if (string_chars(a) == NULL || string_chars(b) == NULL) {
+            vm->status = VM_ERROR;
+            break;
+        }
+        vm->eq  = string_equal(b, a);
+        vm->dif = vm->eq ? 0 : (string_compare(b, a) < 0 ? -1 : 1);
+        break;
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case CMP:
+        vm_trace("VM: %s\n", opcode_name(ins->opcode));
+        generic_op(arena, vm, ins);
+        break;
+    case GETL2:
+        // Superinstructions take their operands from the instructions they stand
+        // for and skip over them
+        vm_trace("VM: GETL2\n");
+        if ((a = local_at(vm, ins[0].operands[0].int_value)) == NULL ||
+            (b = local_at(vm, ins[1].operands[0].int_value)) == NULL) {
+            break;
+        }
+        push(vm, a);
+        push(vm, b);
+        vm->ip += 1;
+        break;
+    case INCL:
+        vm_trace("VM: INCL\n");
+        if ((a = local_at(vm, ins[0].operands[0].int_value)) == NULL) {
+            break;
+        }
+        *a = new_int(a->data.int_value + ins[1].operands[0].int_value);
+        vm->ip += 3;
+        break;
+    case JCMP_L:
+    case JCMP_K: {
+        vm_trace("VM: %s\n", opcode_name(ins->opcode));
+        if ((b = local_at(vm, ins[0].operands[0].int_value)) == NULL) {
+            break;
+        }
+        int rhs = ins[1].operands[0].int_value;
+        if (ins->opcode == JCMP_L) {
+            if ((a = local_at(vm, rhs)) == NULL) {
+                break;
+            }
+            rhs = a->data.int_value;
+        }
+        compare(vm, b->data.int_value, rhs);
+        vm->ip = jump_taken(vm, ins[3].opcode) ? (size_t)ins[3].operands[0].int_value
+                                               : vm->ip + 3;
+        size_t at = ins + 3 - vm->code;
+        charge(vm, at, (size_t)ins[3].operands[0].int_value <= at);
+        break;
+    }
+    case HALT:
+        vm_trace("VM: HALT\n");
+        vm->status = VM_HALTED;
         break;
 
     default:
-        log_error("VM: unknown opcode %d\n", ins->opcode);
+        log_error("VM: unsupported opcode %d\n", ins->opcode);
+        vm->status = VM_ERROR;
         break;
     }
 }
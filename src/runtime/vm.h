@@ -3,15 +3,44 @@
 
 #include "../util/arena.h"
 #include "../util/hashtable.h"
+#include "../util/logger.h"
+#include "aio.h"
+#include "globals.h"
+#include "jit.h"
+#include "object.h"
 #include "stackframe.h"
+#include "tier.h"
 #include "value.h"
 #include "vm_mem.h"
 
-#include <pthread.h>
 #include <stdint.h>
 
 #define VM_DEFAULT_GC_THRESHOLD 1000
-#define OPCODE_COUNT (24 + 1)
+#define OPCODE_COUNT (58 + 1)
+
+/* Shapes an inline cache remembers before it starts evicting */
+#define VM_IC_ENTRIES 4
+
+/* Runs with the same operand types before a generic instruction is quickened */
+#define VM_QUICKEN_AFTER 8
+
+/* Failed type guards after which a generic instruction stays generic */
+#define VM_DEOPT_MAX 4
+
+/* Stacks of finished coroutines a VM keeps to start new ones on */
+#define VM_CORO_SPARE 4
+
+/* Fuel of a VM that is never preempted */
+#define VM_FUEL_UNLIMITED INT64_MAX
+
+/* If defined, the VM logs every instruction it executes */
+// #define VM_TRACE 1
+
+#ifdef VM_TRACE
+#define vm_trace(fmt, ...) log_info(fmt, ##__VA_ARGS__)
+#else
+#define vm_trace(fmt, ...)
+#endif
 
 enum VMOpcode {
     NOP,
@@ -29,6 +58,8 @@ enum VMOpcode {
     JNE,
     JLT,
     JGR,
+    JLE,
+    JGE,
     ADD_I,
     SUB_I,
     MUL_I,
@@ -38,7 +69,54 @@ enum VMOpcode {
     MUL_F,
     DIV_F,
     CALL,
-    RET
+    RET,
+    HALT,
+    TAILCALL,
+    GETG,
+    SETG,
+    NEWS,
+    GETF,
+    SETF,
+    INITF,
+    CALLB,
+    NEWA,
+    GETA,
+    SETA,
+    PUSHA,
+    POPA,
+    LENA,
+    GETAU,
+    SETAU,
+    CHKA,
+    CONCAT,
+    CMP_S,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    CMP,
+    CORO,
+    RESUME,
+    YIELD,
+
+    // Superinstructions, only made by the VM in place of a GETL that starts one
+    // of these sequences. They read the rest from the instructions that follow,
+    // which are left as they were, and never appear in an image.
+    GETL2,  // getl a, getl b
+    INCL,   // getl x, push.i k, add.i, setl x
+    JCMP_L, // getl a, getl b, cmp.i, j<cc> target
+    JCMP_K  // getl a, push.i k, cmp.i, j<cc> target
+};
+
+/* Whether an instruction starts by pushing a local, as GETL and superinstructions do */
+#define is_getl(_op) ((_op) == GETL || (_op) >= GETL2)
+
+enum VMStatus {
+    VM_RUNNING,
+    VM_HALTED,
+    VM_ERROR,
+    VM_YIELDED, // out of fuel, runs on from where it stopped once given more
+    VM_WAITING, // waiting for a read or write, see `aio` below
 };
 
 typedef struct VMOperand {
@@ -58,27 +136,139 @@ typedef struct VMInstruction {
     VMOperand operands[3];
 } VMInstruction;
 
+/**
+ * Function table entry. Locals include the parameters, which are passed in the
+ * first `nparams` slots.
+ */
+typedef struct VMFunction {
+    int entry;   // address of the first instruction
+    int nparams; // number of parameters
+    int nlocals; // number of local slots, parameters included
+    int name;    // constant pool index of the function name
+} VMFunction;
+
+/**
+ * Inline cache of a global or field lookup instruction. Globals only use the
+ * slot of entry 0. Field lookups remember up to VM_IC_ENTRIES shapes, with the
+ * slot the field has in each; for stores that add a field, `next` is the shape
+ * the structure moves to.
+ */
+typedef struct VMCacheEntry {
+    Shape *shape;
+    Shape *next;
+    int slot;
+} VMCacheEntry;
+
+typedef struct VMCache {
+    VMCacheEntry entries[VM_IC_ENTRIES];
+    int count;
+    int victim; // next entry to replace once full
+} VMCache;
+
+/**
+ * Type feedback of a generic arithmetic or compare instruction. Once it has seen
+ * the same operand types VM_QUICKEN_AFTER times in a row it is rewritten in place
+ * to the _I or _F form, which checks the types and turns it back into `generic`
+ * when they don't match.
+ */
+typedef struct VMFeedback {
+    enum VMOpcode generic;
+    enum RuntimeValueType seen; // TY_UNKNOWN after mixed or non-numeric operands
+    int hits;
+    int deopts;
+} VMFeedback;
+
+/**
+ * Operand of a lookup instruction that holds its cache index, or of a generic
+ * instruction that holds its feedback index, set at load time. It is -1 in the
+ * _I and _F instructions the compiler emitted, which don't check types.
+ */
+#define VM_IC_OPERAND 2
+
+struct Bytecode;
+
 typedef struct VM {
     size_t ip;
     int eq, dif;
+    enum VMStatus status;
 
     VMInstruction *code;
     size_t code_size;
 
+    // Constant pool and function table of the loaded image, `constants` holds
+    // the pool as string values for `loads`
+    char **strings;
+    Value *constants;
+    int string_count;
+    VMFunction *funcs;
+    int func_count;
+
+    // Inline caches of the lookup instructions in `code`
+    VMCache *caches;
+    size_t cache_count;
+
+    // Type feedback of the generic instructions in `code`
+    VMFeedback *feedback;
+    size_t feedback_count;
+
+    // Arrivals at each function entry and loop header, -1 once moved up a tier
+    int *hotness;
+
+    // Native code for hot regions, NULL when the JIT is off
+    bool use_jit;
+    Jit *jit;
+
+    // Fuel left and what each opcode costs, which has to be set before loading.
+    // Fuel is charged a block at a time at the jump, call or return that ends
+    // it, and the VM yields at a backward jump or call once it goes negative
+    int64_t fuel;
+    int costs[OPCODE_COUNT];
+    int *charges; // per instruction, the cost of the block it ends
+
+    // Ring the I/O builtins submit to, NULL to do blocking reads and writes. With
+    // a ring the VM stops as VM_WAITING until the host sees `io` finish on it and
+    // calls builtin_io_complete, `io.data` is left to the host
+    Aio *aio;
+    AioRequest io;
+
+    // Descriptors the I/O builtins opened, indexed by the handles scripts see and
+    // -1 where one was closed. A script can't name any descriptor it didn't open
+    int *handles;
+    int handle_count, handle_capacity;
+
+    // Coroutine running on the stack in `mem`, NULL for the main program
+    CoroObj *coro;
+    CoroContext spare[VM_CORO_SPARE];
+    int spare_count;
+
     // Memory
     VMMem mem;
     Hashtable *string_tbl;
-
-    // GC related
-    pthread_mutex_t gc_mutex;
-    pthread_t gc_thread;
-    bool stop_gc;
+    Globals globals;
+    ShapeTree shapes;
 } VM;
 
 void vm_init(VM *vm, int gc_threshold);
-void vm_load(Arena *arena, VM *vm, uint8_t *code, size_t len);
+void vm_load(Arena *arena, VM *vm, struct Bytecode *bc);
 void vm_cleanup(Arena *arena, VM *vm);
+enum VMStatus vm_run(Arena *arena, VM *vm);
+
+/* Add fuel, resuming a VM that yielded once it has enough to go on */
+void vm_add_fuel(VM *vm, int64_t fuel);
+
+/**
+ * Run at most `budget` instructions, returning VM_RUNNING if the program isn't
+ * done and can be continued with another slice. Native code is charged the
+ * fuel it spends, and leaves at a back edge once that uses up the slice.
+ */
+enum VMStatus vm_run_slice(Arena *arena, VM *vm, size_t budget);
 void vm_cycle(Arena *arena, VM *vm);
 void vm_decode(Arena *arena, VM *vm, VMInstruction *ins);
 
+/* Log a runtime error at the current instruction and stop the VM */
+void vm_error(VM *vm, const char *message);
+
+/* Value left on the stack by a halted program, or NULL */
+Value *vm_result(VM *vm);
+
 #endif
@@ -1,16 +1,89 @@
 #include "vm_mem.h"
+#include "object.h"
 
 #include "../util/logger.h"
 
-void stack_push(VMMem *mem, Value *value) {
-    // Check for stack overflow
-    if (mem->sp >= VM_STACK_MAX_SIZE) {
-        log_error("VM: stack overflow\n");
-        return;
+#include <sys/mman.h>
+#include <unistd.h>
+
+static size_t page_round(size_t bytes) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+/* Reserve `bytes` of address space and a guard page after it, all inaccessible */
+static void *region_reserve(size_t bytes) {
+    void *base = mmap(NULL, page_round(bytes) + page_round(1), PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return base == MAP_FAILED ? NULL : base;
+}
+
+static void region_release(void *base, size_t bytes) {
+    if (base != NULL) {
+        munmap(base, page_round(bytes) + page_round(1));
+    }
+}
+
+/**
+ * Commit the start of a region of `max` items of `size` bytes so at least `count`
+ * are usable, at least doubling what is committed to keep growth rare.
+ */
+static bool region_commit(void *base, size_t size, size_t max, size_t *committed,
+                          size_t count) {
+    if (count > max) {
+        return false;
     }
 
-    // Return a pointer to the stack frame
-    mem->stack_top[mem->sp++] = *value;
+    size_t want  = count > *committed * 2 ? count : *committed * 2;
+    size_t bytes = page_round((want < max ? want : max) * size);
+
+    // The part committed already is left as it is
+    if (mprotect(base, bytes, PROT_READ | PROT_WRITE) != 0) {
+        log_error("VM: failed to commit stack memory\n");
+        return false;
+    }
+
+    *committed = bytes / size < max ? bytes / size : max;
+    return true;
+}
+
+bool mem_reserve(VMMem *mem) {
+    if (mem->stack != NULL) {
+        return true;
+    }
+
+    mem->stack  = (Value *)region_reserve(mem->stack_max * sizeof(Value));
+    mem->frames = (Frame *)region_reserve(mem->frames_max * sizeof(Frame));
+    if (mem->stack == NULL || mem->frames == NULL) {
+        log_error("VM: failed to reserve the stack\n");
+        mem_release(mem);
+        return false;
+    }
+
+    mem->stack_committed  = 0;
+    mem->frames_committed = 0;
+    return stack_grow(mem, 1) && frames_grow(mem, 1);
+}
+
+void mem_release(VMMem *mem) {
+    region_release(mem->stack, mem->stack_max * sizeof(Value));
+    region_release(mem->frames, mem->frames_max * sizeof(Frame));
+    mem->stack            = NULL;
+    mem->frames           = NULL;
+    mem->stack_committed  = 0;
+    mem->frames_committed = 0;
+}
+
+bool stack_grow(VMMem *mem, size_t count) {
+    return mem->stack != NULL &&
+           region_commit(mem->stack, sizeof(Value), mem->stack_max, &mem->stack_committed,
+                         count);
+}
+
+bool frames_grow(VMMem *mem, size_t count) {
+    return mem->frames != NULL &&
+           region_commit(mem->frames, sizeof(Frame), mem->frames_max,
+                         &mem->frames_committed, count);
 }
 
 Value *stack_pop(VMMem *mem) {
@@ -19,9 +92,8 @@ Value *stack_pop(VMMem *mem) {
         return NULL;
     }
 
-    mem->stack_top = &mem->stack[mem->sp - 1];
-    mem->sp--;
-    return mem->stack_top;
+    // The slot stays valid until the next push
+    return &mem->stack[--mem->sp];
 }
 
 void stack_dump(VMMem *mem) {
@@ -31,64 +103,40 @@ void stack_dump(VMMem *mem) {
             log_info("  %d: %d\n", i, mem->stack[i].data.int_value);
         } else if (mem->stack[i].type == TY_FLOAT) {
             log_info("  %d: %f\n", i, mem->stack[i].data.float_value);
-        } else if (mem->stack[i].type == TY_STRING) {
-            log_info("  %d: %s\n", i, mem->stack[i].data.string_value);
+        } else if (is_string(mem->stack[i])) {
+            const char *chars = string_chars(&mem->stack[i]);
+            log_info("  %d: %s\n", i, chars != NULL ? chars : "<string>");
         }
     }
 }
 
-Value *heap_alloc(VMMem *mem, size_t size) {
-    HeapObj *entry = mem->heap;
-
-    // Try to find a free space
-    while (entry != NULL) {
-        if (entry->free) {
-            entry->free = false;
-            return (void *)entry;
-        }
-
-        entry = entry->next;
-    }
-
-    // Allocate a new entry, if no free block is found
-    entry = (HeapObj *)malloc(sizeof(HeapObj) + size);
-    if (entry == NULL) {
+HeapObj *heap_alloc(VMMem *mem, size_t size, enum RuntimeValueType type) {
+    // `size` is the whole object, header included
+    HeapObj *obj = (HeapObj *)calloc(1, size);
+    if (obj == NULL) {
         log_error("VM: failed to allocate memory for block\n");
         return NULL;
     }
 
-    // Add the entry to the list of allocated blocks
-    entry->next  = mem->heap;
-    mem->heap    = entry;
-    entry->value = value_create(TY_UNKNOWN);
-    entry->free  = false;
+    // Add the object to the list of allocated blocks
+    obj->next  = mem->heap;
+    obj->type  = type;
+    mem->heap  = obj;
 
     mem->gc_counter++;
-    return entry->value;
+    return obj;
 }
 
-void heap_free(VMMem *mem, void *pblock) {
-    if (pblock == NULL) {
+void heap_free(VMMem *mem, HeapObj *obj) {
+    if (obj == NULL) {
         log_error("VM: failed to free, cannot free NULL block\n");
         return;
     }
 
 #ifdef GC_DEBUG
-    log_info("VM: freeing entry at %p\n", pblock);
+    log_info("VM: freeing object at %p\n", (void *)obj);
 #endif
 
-    HeapObj *entry = (HeapObj *)pblock;
-
-    // Prevent double-free, only free if we haven't already
-    if (!entry->free) {
-        if (entry->value) {
-            if (entry->value->s_children) {
-                free(entry->value->s_children);
-            }
-            free(entry->value);
-        }
-
-        entry->free = true;
-        // vm->gc_counter--;
-    }
+    // The caller has already unlinked it from the heap list
+    object_free(obj);
 }
@@ -1,38 +1,81 @@
 #ifndef TARO_VM_MEMORY_H
 #define TARO_VM_MEMORY_H
 
+#include "stackframe.h"
 #include "value.h"
 
-#define VM_STACK_MAX_SIZE 16384 // 16KB
+/* Default limits of a VM's stack, in values, and of its call nesting */
+#define VM_STACK_MAX_SIZE 16384
+#define VM_FRAMES_MAX 4096
 
 /**
- * An object on the heap with a pointer to the next object
+ * Header shared by every object on the heap. Objects embed it as their first
+ * member and are kept in a list for the GC to sweep.
  */
 typedef struct HeapObj {
-    Value *value;
     struct HeapObj *next;
-
-    bool free;
+    enum RuntimeValueType type;
+    bool marked;
 } HeapObj;
 
+/**
+ * The stack and the call frames are each reserved as address space for their
+ * maximum size when a program is loaded, followed by a guard page that is never
+ * committed, and committed as they grow. An idle VM holds a page of each, and
+ * nothing on them moves when they grow.
+ */
 typedef struct VMMem {
     size_t sp;
 
-    Value stack[VM_STACK_MAX_SIZE];
-    Value *stack_top;
+    Value *stack;
+    size_t stack_max;       // limit, can be set before loading
+    size_t stack_committed; // values usable without committing more
     HeapObj *heap;
 
-    // GC related
+    // Call frames, frames[frame_count - 1] is the running function
+    Frame *frames;
+    size_t frame_count;
+    size_t frames_max;
+    size_t frames_committed;
+
+    // GC related, gc_counter counts allocations since the last collection
     int gc_counter;
     int gc_threshold;
+    int gc_live; // objects that survived the last collection
+
+    // Objects marked but whose children haven't been marked yet
+    HeapObj **gray;
+    size_t gray_count, gray_capacity;
 } VMMem;
 
-void stack_push(VMMem *mem, Value *value);
+/* Reserve the stack and frames, false if the address space isn't there */
+bool mem_reserve(VMMem *mem);
+void mem_release(VMMem *mem);
+
+/* Commit room for `count` values or frames, false if it is over the limit */
+bool stack_grow(VMMem *mem, size_t count);
+bool frames_grow(VMMem *mem, size_t count);
+
+/* Make sure there is room for the first `count` values of the stack */
+static inline bool stack_reserve(VMMem *mem, size_t count) {
+    return count <= mem->stack_committed || stack_grow(mem, count);
+}
+
+/* Push a value, false if the stack is full */
+static inline bool stack_push(VMMem *mem, Value *value) {
+    if (!stack_reserve(mem, mem->sp + 1)) {
+        return false;
+    }
+
+    mem->stack[mem->sp++] = *value;
+    return true;
+}
+
 Value *stack_pop(VMMem *mem);
 
 void stack_dump(VMMem *mem);
 
-Value *heap_alloc(VMMem *mem, size_t size);
-void heap_free(VMMem *mem, void *pentry);
+HeapObj *heap_alloc(VMMem *mem, size_t size, enum RuntimeValueType type);
+void heap_free(VMMem *mem, HeapObj *obj);
 
 #endif
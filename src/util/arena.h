@@ -6,15 +6,21 @@
 #define ARENA_FREE free
 #endif
 
+/* Allocations are rounded up to this alignment */
+#define ARENA_ALIGN sizeof(void *)
+
 #include <stddef.h>
 #include <stdlib.h>
 
 // Based on this tutorial:
 // https://dev.to/ccgargantua/working-smarter-instead-of-harder-in-c-43o3
 
-typedef struct {
+typedef struct Arena {
     void *region;
     size_t index, size;
+
+    // Overflow region, chained on once this one is exhausted
+    struct Arena *next;
 } Arena;
 
 static Arena *arena_create(size_t size) __attribute__((unused));
@@ -30,11 +36,13 @@ static Arena *arena_create(size_t size) {
 
     arena->region = ARENA_MALLOC(size);
     if (arena->region == NULL) {
+        ARENA_FREE(arena);
         return NULL;
     }
 
     arena->index = 0;
     arena->size  = size;
+    arena->next  = NULL;
     return arena;
 }
 
@@ -43,9 +51,24 @@ static void *arena_alloc(Arena *arena, size_t size) {
         return NULL;
     }
 
-    if ((arena->size - arena->index) < size) {
-        // Check if we have enough room for the allocation
-        return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    // Walk the chain looking for a region with enough room for the allocation
+    while ((arena->size - arena->index) < size) {
+        if (arena->next == NULL) {
+            // Grow geometrically so the chain stays short
+            size_t next_size = arena->size * 2;
+            if (next_size < size) {
+                next_size = size;
+            }
+
+            arena->next = arena_create(next_size);
+            if (arena->next == NULL) {
+                return NULL;
+            }
+        }
+
+        arena = arena->next;
     }
 
     arena->index += size;
@@ -55,25 +78,25 @@ static void *arena_alloc(Arena *arena, size_t size) {
 }
 
 static void arena_clear(Arena *arena) {
-    if (arena == NULL) {
-        return;
-    }
-
     // Reset the index to 0, so we can reuse memory without free'ing
-    arena->index = 0;
+    while (arena != NULL) {
+        arena->index = 0;
+        arena        = arena->next;
+    }
 }
 
 static void arena_destroy(Arena *arena) {
-    if (arena == NULL) {
-        return;
-    }
+    while (arena != NULL) {
+        Arena *next = arena->next;
 
-    // Free all allocations in the region before free'ing the arena itself
-    if (arena->region != NULL) {
-        ARENA_FREE(arena->region);
-    }
+        // Free all allocations in the region before free'ing the arena itself
+        if (arena->region != NULL) {
+            ARENA_FREE(arena->region);
+        }
 
-    ARENA_FREE(arena);
+        ARENA_FREE(arena);
+        arena = next;
+    }
 }
 
 #endif
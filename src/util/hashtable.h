@@ -33,6 +33,17 @@ static inline unsigned long fnv_hash(char *key) {
     return hash;
 }
 
+static inline unsigned long fnv_hash_n(const char *key, size_t length) {
+    // FNV-1a over a sized slice, for keys that aren't NUL-terminated
+    unsigned long hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
 Ht_Entry *st_entry(char *key, char *value);
 
 Hashtable *hashtable_create();
@@ -0,0 +1,57 @@
+#include "parallel.h"
+#include "logger.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+struct ParallelJob {
+    ParallelTask fn;
+    void *ctx;
+
+    size_t ntasks;
+    atomic_size_t next;
+};
+
+static void *parallel_worker(void *arg) {
+    struct ParallelJob *job = (struct ParallelJob *)arg;
+
+    size_t task;
+    while ((task = atomic_fetch_add(&job->next, 1)) < job->ntasks) {
+        job->fn(job->ctx, task);
+    }
+
+    return NULL;
+}
+
+int parallel_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+void parallel_for(int nthreads, size_t ntasks, ParallelTask fn, void *ctx) {
+    struct ParallelJob job = {.fn = fn, .ctx = ctx, .ntasks = ntasks};
+    atomic_init(&job.next, 0);
+
+    if (nthreads > PARALLEL_MAX_THREADS)
+        nthreads = PARALLEL_MAX_THREADS;
+    if ((size_t)nthreads > ntasks)
+        nthreads = (int)ntasks;
+
+    // The calling thread is a worker too, so we only spawn nthreads - 1
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    int spawned = 0;
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[spawned], NULL, parallel_worker, &job) != 0) {
+            log_warn("failed to create worker thread, continuing with %d\n", spawned + 1);
+            break;
+        }
+        spawned++;
+    }
+
+    parallel_worker(&job);
+
+    for (int i = 0; i < spawned; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
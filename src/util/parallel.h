@@ -0,0 +1,21 @@
+#ifndef TARO_PARALLEL_H
+#define TARO_PARALLEL_H
+
+#include <stddef.h>
+
+/** Upper bound on the number of worker threads a parallel_for will spawn */
+#define PARALLEL_MAX_THREADS 64
+
+typedef void (*ParallelTask)(void *ctx, size_t task);
+
+/* Number of online CPUs, at least 1 */
+int parallel_default_threads(void);
+
+/**
+ * Run `fn(ctx, i)` for every i in [0, ntasks) on a pool of `nthreads` workers,
+ * returning once every task has finished. Tasks are handed out dynamically, so
+ * uneven tasks still balance across the pool.
+ */
+void parallel_for(int nthreads, size_t ntasks, ParallelTask fn, void *ctx);
+
+#endif
@@ -0,0 +1,288 @@
+#include "scan.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static inline bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline bool is_ident(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_';
+}
+
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+/* Scalar tails shared by every implementation */
+
+static size_t blanks_tail(const char *p, size_t i, size_t n, int *newlines) {
+    for (; i < n && is_blank(p[i]); i++) {
+        *newlines += p[i] == '\n';
+    }
+    return i;
+}
+
+static size_t ident_tail(const char *p, size_t i, size_t n) {
+    while (i < n && is_ident(p[i]))
+        i++;
+    return i;
+}
+
+static size_t digits_tail(const char *p, size_t i, size_t n) {
+    while (i < n && is_digit(p[i]))
+        i++;
+    return i;
+}
+
+static size_t line_tail(const char *p, size_t i, size_t n) {
+    while (i < n && p[i] != '\n')
+        i++;
+    return i;
+}
+
+#ifdef SCAN_X86
+
+/*
+ * SSE2: 16 bytes per step. Each class test produces a byte mask of matching
+ * lanes, the first non-matching lane ends the run.
+ */
+
+static inline __m128i sse2_in_range(__m128i v, char lo, char hi) {
+    // Signed compares are fine, every byte we accept is 7-bit ASCII
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), v));
+}
+
+static size_t sse2_blanks(const char *p, size_t n, int *newlines) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v  = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i nl = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                               _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), nl));
+
+        unsigned miss  = ~(unsigned)_mm_movemask_epi8(ws) & 0xFFFF;
+        unsigned lines = (unsigned)_mm_movemask_epi8(nl);
+        if (miss) {
+            unsigned stop = __builtin_ctz(miss);
+            *newlines += __builtin_popcount(lines & ((1u << stop) - 1));
+            return i + stop;
+        }
+        *newlines += __builtin_popcount(lines);
+    }
+    return blanks_tail(p, i, n, newlines);
+}
+
+static size_t sse2_ident(const char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v     = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i ok    = _mm_or_si128(
+            _mm_or_si128(sse2_in_range(lower, 'a', 'z'), sse2_in_range(v, '0', '9')),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+
+        unsigned miss = ~(unsigned)_mm_movemask_epi8(ok) & 0xFFFF;
+        if (miss)
+            return i + __builtin_ctz(miss);
+    }
+    return ident_tail(p, i, n);
+}
+
+static size_t sse2_digits(const char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v     = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned miss = ~(unsigned)_mm_movemask_epi8(sse2_in_range(v, '0', '9')) & 0xFFFF;
+        if (miss)
+            return i + __builtin_ctz(miss);
+    }
+    return digits_tail(p, i, n);
+}
+
+static size_t sse2_line(const char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v    = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned hit = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        if (hit)
+            return i + __builtin_ctz(hit);
+    }
+    return line_tail(p, i, n);
+}
+
+/* AVX2: the same tests 32 bytes at a time, only called when cpuid allows it */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i avx2_in_range(__m256i v, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+AVX2 static size_t avx2_blanks(const char *p, size_t n, int *newlines) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v  = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i nl = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+        __m256i ws =
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), nl));
+
+        uint32_t miss  = ~(uint32_t)_mm256_movemask_epi8(ws);
+        uint32_t lines = (uint32_t)_mm256_movemask_epi8(nl);
+        if (miss) {
+            unsigned stop = __builtin_ctz(miss);
+            *newlines += __builtin_popcount(lines & ((1u << stop) - 1));
+            return i + stop;
+        }
+        *newlines += __builtin_popcount(lines);
+    }
+    return i + sse2_blanks(p + i, n - i, newlines);
+}
+
+AVX2 static size_t avx2_ident(const char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v     = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i ok    = _mm256_or_si256(
+            _mm256_or_si256(avx2_in_range(lower, 'a', 'z'), avx2_in_range(v, '0', '9')),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+
+        uint32_t miss = ~(uint32_t)_mm256_movemask_epi8(ok);
+        if (miss)
+            return i + __builtin_ctz(miss);
+    }
+    return i + sse2_ident(p + i, n - i);
+}
+
+AVX2 static size_t avx2_digits(const char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v     = _mm256_loadu_si256((const __m256i *)(p + i));
+        uint32_t miss = ~(uint32_t)_mm256_movemask_epi8(avx2_in_range(v, '0', '9'));
+        if (miss)
+            return i + __builtin_ctz(miss);
+    }
+    return i + sse2_digits(p + i, n - i);
+}
+
+AVX2 static size_t avx2_line(const char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v    = _mm256_loadu_si256((const __m256i *)(p + i));
+        uint32_t hit = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        if (hit)
+            return i + __builtin_ctz(hit);
+    }
+    return i + sse2_line(p + i, n - i);
+}
+
+#else
+
+/*
+ * SWAR: 8 bytes per step using the classic "has zero byte" trick. Runs are only
+ * taken a word at a time while the whole word matches, the scalar tail finds
+ * the exact stopping point.
+ */
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGH 0x8080808080808080ULL
+
+static inline uint64_t swar_load(const char *p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static inline bool swar_has_byte(uint64_t w, unsigned char c) {
+    uint64_t x = w ^ (SWAR_ONES * c);
+    return ((x - SWAR_ONES) & ~x & SWAR_HIGH) != 0;
+}
+
+static inline bool swar_all_digits(uint64_t w) {
+    // Every byte must be 0x30..0x39: high nibble 3, and adding 6 must not carry
+    return (w & (SWAR_ONES * 0xF0)) == SWAR_ONES * 0x30 &&
+           ((w + SWAR_ONES * 0x06) & (SWAR_ONES * 0xF0)) == SWAR_ONES * 0x30;
+}
+
+static size_t swar_blanks(const char *p, size_t n, int *newlines) {
+    size_t i = 0;
+    for (; i + 8 <= n && swar_load(p + i) == SWAR_ONES * ' '; i += 8)
+        ;
+    return blanks_tail(p, i, n, newlines);
+}
+
+static size_t swar_ident(const char *p, size_t n) { return ident_tail(p, 0, n); }
+
+static size_t swar_digits(const char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n && swar_all_digits(swar_load(p + i)); i += 8)
+        ;
+    return digits_tail(p, i, n);
+}
+
+static size_t swar_line(const char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n && !swar_has_byte(swar_load(p + i), '\n'); i += 8)
+        ;
+    return line_tail(p, i, n);
+}
+
+#endif
+
+/* Runtime dispatch, resolved once by scan_init() */
+
+static struct {
+    size_t (*blanks)(const char *, size_t, int *);
+    size_t (*ident)(const char *, size_t);
+    size_t (*digits)(const char *, size_t);
+    size_t (*line)(const char *, size_t);
+} g_scan;
+
+static pthread_once_t g_scan_once = PTHREAD_ONCE_INIT;
+
+static void scan_select(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan.ident  = avx2_ident;
+        g_scan.digits = avx2_digits;
+        g_scan.line   = avx2_line;
+        g_scan.blanks = avx2_blanks;
+    } else {
+        g_scan.ident  = sse2_ident;
+        g_scan.digits = sse2_digits;
+        g_scan.line   = sse2_line;
+        g_scan.blanks = sse2_blanks;
+    }
+#else
+    g_scan.ident  = swar_ident;
+    g_scan.digits = swar_digits;
+    g_scan.line   = swar_line;
+    g_scan.blanks = swar_blanks;
+#endif
+}
+
+void scan_init(void) { pthread_once(&g_scan_once, scan_select); }
+
+size_t scan_blanks(const char *p, size_t n, int *newlines) {
+    return g_scan.blanks(p, n, newlines);
+}
+
+size_t scan_ident(const char *p, size_t n) { return g_scan.ident(p, n); }
+
+size_t scan_digits(const char *p, size_t n) { return g_scan.digits(p, n); }
+
+size_t scan_line(const char *p, size_t n) { return g_scan.line(p, n); }
@@ -0,0 +1,29 @@
+/**
+ * Vectorized character-class scanners used by the lexer.
+ *
+ * Each scanner returns how many bytes at the start of `p` belong to its class,
+ * never reading past `p + n`. SSE2 is used on every x86-64 CPU and AVX2 when
+ * cpuid reports it, other targets fall back to SWAR over 64-bit words.
+ */
+
+#ifndef TARO_SCAN_H
+#define TARO_SCAN_H
+
+#include <stddef.h>
+
+/* Pick the widest implementation the CPU supports, must run before any scan */
+void scan_init(void);
+
+/* Skip ' ', '\t', '\r' and '\n', counting the newlines passed over */
+size_t scan_blanks(const char *p, size_t n, int *newlines);
+
+/* Identifier body characters: [A-Za-z0-9_] */
+size_t scan_ident(const char *p, size_t n);
+
+/* Decimal digits: [0-9] */
+size_t scan_digits(const char *p, size_t n);
+
+/* Everything up to (not including) the next '\n' */
+size_t scan_line(const char *p, size_t n);
+
+#endif
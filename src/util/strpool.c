@@ -0,0 +1,98 @@
+#include "strpool.h"
+#include "hashtable.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+StrPool *strpool_create(void) {
+    StrPool *pool = (StrPool *)malloc(sizeof(StrPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->arena    = arena_create(STRPOOL_ARENA_SIZE);
+    pool->entries  = NULL;
+    pool->count    = 0;
+    pool->capacity = 0;
+
+    return pool;
+}
+
+void strpool_free(StrPool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    arena_destroy(pool->arena);
+    free(pool->entries);
+    free(pool);
+}
+
+static struct StrPoolEntry *strpool_find(struct StrPoolEntry *entries, size_t capacity,
+                                         const char *str, size_t length,
+                                         unsigned long hash) {
+    // Linear probing, capacity is always a power of two
+    size_t slot = hash & (capacity - 1);
+    while (entries[slot].str != NULL) {
+        struct StrPoolEntry *e = &entries[slot];
+        if (e->hash == hash && e->length == length && memcmp(e->str, str, length) == 0) {
+            return e;
+        }
+
+        slot = (slot + 1) & (capacity - 1);
+    }
+
+    return &entries[slot];
+}
+
+static bool strpool_grow(StrPool *pool) {
+    size_t capacity = pool->capacity ? pool->capacity * 2 : 64;
+
+    struct StrPoolEntry *entries =
+        (struct StrPoolEntry *)calloc(capacity, sizeof(struct StrPoolEntry));
+    if (entries == NULL) {
+        return false;
+    }
+
+    // Rehash the existing entries into the new table
+    for (size_t i = 0; i < pool->capacity; i++) {
+        struct StrPoolEntry *e = &pool->entries[i];
+        if (e->str != NULL) {
+            *strpool_find(entries, capacity, e->str, e->length, e->hash) = *e;
+        }
+    }
+
+    free(pool->entries);
+    pool->entries  = entries;
+    pool->capacity = capacity;
+    return true;
+}
+
+const char *strpool_intern(StrPool *pool, const char *str, size_t length) {
+    // Keep the load factor under 3/4
+    if ((pool->count + 1) * 4 > pool->capacity * 3 && !strpool_grow(pool)) {
+        return NULL;
+    }
+
+    unsigned long hash = fnv_hash_n(str, length);
+    struct StrPoolEntry *e =
+        strpool_find(pool->entries, pool->capacity, str, length, hash);
+    if (e->str != NULL) {
+        return e->str;
+    }
+
+    char *copy = (char *)arena_alloc(pool->arena, length + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+
+    e->str    = copy;
+    e->length = length;
+    e->hash   = hash;
+    pool->count++;
+
+    return copy;
+}
@@ -0,0 +1,33 @@
+#ifndef TARO_STRPOOL_H
+#define TARO_STRPOOL_H
+
+#include "arena.h"
+
+#include <stddef.h>
+
+/** Size of the first arena region backing a string pool */
+#define STRPOOL_ARENA_SIZE 4096
+
+struct StrPoolEntry {
+    const char *str;
+    size_t length;
+    unsigned long hash;
+};
+
+/**
+ * Interned string pool. Every distinct string is copied into the arena exactly
+ * once and NUL-terminated, so interned strings can be compared by pointer.
+ */
+typedef struct StrPool {
+    Arena *arena;
+
+    struct StrPoolEntry *entries;
+    size_t count, capacity;
+} StrPool;
+
+StrPool *strpool_create(void);
+void strpool_free(StrPool *pool);
+
+const char *strpool_intern(StrPool *pool, const char *str, size_t length);
+
+#endif